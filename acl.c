@@ -32,6 +32,32 @@
 #define get_perm acl_get_perm_np
 #endif
 
+/* Besides libacl, the tree-level functions use Linux kernel interfaces
+   (xattrs, inotify, fanotify, /proc) and threads, so HAVE_LINUX_KERNEL
+   is not set on other libacl systems such as GNU/kFreeBSD */
+#ifdef HAVE_LINUX_KERNEL
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/xattr.h>
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
 #if PY_MAJOR_VERSION >= 3
 #define IS_PY3K
 #define PyInt_Check(op) PyLong_Check(op)
@@ -49,6 +75,7 @@
 #define MyString_FromFormat PyUnicode_FromFormat
 #define MyString_FromString PyUnicode_FromString
 #define MyString_FromStringAndSize PyUnicode_FromStringAndSize
+#define MySlice_GetIndicesEx PySlice_GetIndicesEx
 #else
 #define PyBytes_Check PyString_Check
 #define PyBytes_AS_STRING PyString_AS_STRING
@@ -60,6 +87,8 @@
 #define MyString_FromFormat PyBytes_FromFormat
 #define MyString_FromString PyBytes_FromString
 #define MyString_FromStringAndSize PyBytes_FromStringAndSize
+#define MySlice_GetIndicesEx(s, n, start, stop, step, len) \
+    PySlice_GetIndicesEx((PySliceObject*)(s), n, start, stop, step, len)
 
 /* Python 2.6 already defines Py_TYPE */
 #ifndef Py_TYPE
@@ -92,6 +121,16 @@ static PyTypeObject ACL_Type
   CPYCHECKER_TYPE_OBJECT_FOR_TYPEDEF("ACL_Object");
 static PyObject* ACL_applyto(PyObject* obj, PyObject* args);
 static PyObject* ACL_valid(PyObject* obj, PyObject* args);
+#ifdef HAVE_LINUX_KERNEL
+static PyObject* ACL_redundant(PyObject *obj, PyObject *args);
+static PyObject* ACL_minimize(PyObject *obj, PyObject *args);
+static PyObject* ACL_modify(PyObject *obj, PyObject *args, PyObject *keywds);
+static PyObject* ACL_load(PyObject *obj, PyObject *args, PyObject *keywds);
+static PyObject* ACL_load_from_bytes(PyObject *obj, PyObject *args);
+static PyObject* ACL_load_from_text(PyObject *obj, PyObject *args);
+static PyObject* ACL_get_load_buffers(PyObject *obj, void* arg);
+static PyNumberMethods ACL_as_number;
+#endif
 
 #ifdef HAVE_ACL_COPY_EXT
 static PyObject* ACL_get_state(PyObject *obj, PyObject* args);
@@ -111,15 +150,151 @@ static acl_perm_t holder_ACL_EXECUTE = ACL_EXECUTE;
 static acl_perm_t holder_ACL_READ = ACL_READ;
 static acl_perm_t holder_ACL_WRITE = ACL_WRITE;
 
+#ifdef HAVE_LEVEL2
+/* An entry of the index of an ACL */
+typedef struct {
+    acl_tag_t tag;
+    id_t id;              /* ACL_UNDEFINED_ID for unnamed entries */
+    acl_entry_t entry;
+} acl_key;
+#endif
+
+/* Results derived from an ACL, kept until it changes: the flags tell
+   which ones are there, for the given generation of the ACL */
+#define MEMO_VALID 1
+#define MEMO_CHECK 2
+#define MEMO_MODE 4
+
+typedef struct {
+    unsigned long generation;
+    int flags;
+    PyObject *text;       /* str() */
+    char *blob;           /* the sorted xattr blob (malloc'ed) */
+    size_t blob_len;
+    int valid;
+    int check_result;
+    int check_index;
+    int mode_errno;       /* 0 if mode is set */
+    mode_t mode;
+} acl_memo;
+
 typedef struct {
     PyObject_HEAD
     acl_t acl;
+    int *cow_refs;        /* if acl is shared, the number of sharers */
+    int exposed;          /* entries were handed out: don't share acl */
+    unsigned long generation; /* bumped by every change */
+    acl_memo memo;
+#ifdef HAVE_LINUX_KERNEL
+    char *load_buf;       /* kept by load() for the next one */
+    size_t load_size;
+    acl_entry_t *load_entries;
+    int load_alloc;
+    char *lazy_name;      /* for a lazy ACL not read yet, the file */
+    int lazy_dir_fd;
+    acl_type_t lazy_type;
+#endif
 #ifdef HAVE_LEVEL2
-    int entry_id;
+    int entry_id;         /* the next entry of an iteration, in order */
+    acl_key *keys;        /* sorted by tag and id; NULL until needed */
+    int nkeys;
+    acl_entry_t *order;   /* the entries in ACL order; NULL until needed */
+    int norder;
+    int auto_mask;
+    int mask_counts[3];   /* group class entries granting r, w, x */
+    int mask_named;       /* named entries */
+    acl_entry_t mask_entry;
+    acl_t *retired;       /* replaced while exposed (see ACL_retire) */
+    int nretired;
 #endif
 } ACL_Object;
 
+/* A lazy ACL only records where it is read from (see lazy_acl),
+   and reads it when first needed: every method using the acl_t calls
+   ACL_ready first. */
+
+#ifdef HAVE_LINUX_KERNEL
+static int ACL_load_lazy(ACL_Object *self);
+#endif
+
+/* Reads the ACL if lazy; returns -1 with an exception set */
+static int ACL_ready(ACL_Object *self) {
+#ifdef HAVE_LINUX_KERNEL
+    if(self->lazy_name != NULL)
+        return ACL_load_lazy(self);
+#endif
+    return 0;
+}
+
+/* Forgets the file of a lazy ACL, whose contents are being replaced */
+static void ACL_drop_lazy(ACL_Object *self) {
+#ifdef HAVE_LINUX_KERNEL
+    free(self->lazy_name);
+    self->lazy_name = NULL;
+#endif
+}
+
+/* Copies of an ACL share its acl_t until one of them is changed (see
+   ACL_unshare): copying is then constant time, and so are read-only
+   copies. An ACL whose entries were handed out as Entry objects isn't
+   shared any more, as these can change it behind our back. */
+
+/* Releases the acl_t of the ACL, freeing it unless still shared */
+static void ACL_release(ACL_Object *self) {
+    if(self->cow_refs != NULL && --*self->cow_refs > 0) {
+        self->cow_refs = NULL;
+        self->acl = NULL;
+        return;
+    }
+    free(self->cow_refs);
+    self->cow_refs = NULL;
+    if(self->acl != NULL)
+        acl_free(self->acl);
+    self->acl = NULL;
+}
+
+/* Makes dst (without an acl_t) a copy of src; returns -1 with an
+   exception set on failure */
+static int ACL_share(ACL_Object *dst, ACL_Object *src) {
+    acl_memo *m = &dst->memo;
+
+    if(ACL_ready(src) == -1)
+        return -1;
+    if(src->exposed) {
+        if((dst->acl = acl_dup(src->acl)) == NULL) {
+            PyErr_SetFromErrno(PyExc_IOError);
+            return -1;
+        }
+        return 0;
+    }
+    if(src->cow_refs == NULL) {
+        if((src->cow_refs = malloc(sizeof(int))) == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        *src->cow_refs = 1;
+    }
+    ++*src->cow_refs;
+    dst->acl = src->acl;
+    dst->cow_refs = src->cow_refs;
+    /* the derived results are shared too, as far as it's cheap */
+    if(src->memo.generation == src->generation) {
+        Py_CLEAR(m->text);
+        m->text = src->memo.text;
+        Py_XINCREF(m->text);
+        m->flags = src->memo.flags;
+        m->valid = src->memo.valid;
+        m->check_result = src->memo.check_result;
+        m->check_index = src->memo.check_index;
+        m->mode_errno = src->memo.mode_errno;
+        m->mode = src->memo.mode;
+        m->generation = dst->generation;
+    }
+    return 0;
+}
+
 #ifdef HAVE_LEVEL2
+static int ACL_unshare(ACL_Object *self);
 
 typedef struct {
     PyObject_HEAD
@@ -133,6 +308,233 @@ typedef struct {
     acl_permset_t permset;
 } Permset_Object;
 
+/* Drops the list of the entries in order, after entries were added
+   or removed */
+static void ACL_drop_order(ACL_Object *self) {
+    free(self->order);
+    self->order = NULL;
+    self->norder = 0;
+}
+
+/* Drops the index of the entries, after a change to them */
+static void ACL_drop_index(ACL_Object *self) {
+    self->generation++;
+    free(self->keys);
+    self->keys = NULL;
+    self->nkeys = 0;
+    ACL_drop_order(self);
+}
+
+/* Returns the rights in a permission set as a combination of
+   ACL_READ, ACL_WRITE and ACL_EXECUTE, or -1 with errno set */
+static int permset_get_bits(acl_permset_t permset) {
+    int r, w, x;
+
+    if((r = get_perm(permset, ACL_READ)) == -1 ||
+       (w = get_perm(permset, ACL_WRITE)) == -1 ||
+       (x = get_perm(permset, ACL_EXECUTE)) == -1)
+        return -1;
+    return (r ? ACL_READ : 0) | (w ? ACL_WRITE : 0) | (x ? ACL_EXECUTE : 0);
+}
+
+/* Sets the rights in a permission set to such a combination */
+static int permset_set_bits(acl_permset_t permset, unsigned int perm) {
+    if(acl_clear_perms(permset) == -1 ||
+       ((perm & ACL_READ) && acl_add_perm(permset, ACL_READ) == -1) ||
+       ((perm & ACL_WRITE) && acl_add_perm(permset, ACL_WRITE) == -1) ||
+       ((perm & ACL_EXECUTE) && acl_add_perm(permset, ACL_EXECUTE) == -1))
+        return -1;
+    return 0;
+}
+
+/* Sets the permissions of an entry to a combination of ACL_READ,
+   ACL_WRITE and ACL_EXECUTE */
+static int entry_set_perms(acl_entry_t entry, unsigned int perm) {
+    acl_permset_t permset;
+
+    if(acl_get_permset(entry, &permset) == -1 ||
+       permset_set_bits(permset, perm) == -1)
+        return -1;
+    return acl_set_permset(entry, permset);
+}
+
+/* In auto-mask mode, the mask follows the union of the permissions
+   of the group class entries. The number of such entries granting
+   each permission is kept up to date on every edit made through the
+   ACL and its entries, so that the mask is adjusted without a scan
+   (nor the reordering done by acl_calc_mask). The edits call
+   ACL_mask_forget before and ACL_mask_note after the change. */
+static const acl_perm_t mask_rights[3] = { ACL_READ, ACL_WRITE,
+                                           ACL_EXECUTE };
+
+/* Adds (sign 1) or removes (sign -1) the share of an entry */
+static void ACL_mask_count(ACL_Object *self, acl_entry_t entry, int sign) {
+    acl_tag_t tag;
+    acl_permset_t permset;
+    int k;
+
+    if(acl_get_tag_type(entry, &tag) == -1)
+        return;
+    if(tag == ACL_MASK) {
+        if(sign < 0 && entry == self->mask_entry)
+            self->mask_entry = NULL;
+        else if(sign > 0 && self->mask_entry == NULL)
+            self->mask_entry = entry;
+        return;
+    }
+    if(tag != ACL_USER && tag != ACL_GROUP && tag != ACL_GROUP_OBJ)
+        return;
+    if(tag != ACL_GROUP_OBJ)
+        self->mask_named += sign;
+    if(acl_get_permset(entry, &permset) == -1)
+        return;
+    for(k = 0; k < 3; k++)
+        if(get_perm(permset, mask_rights[k]) == 1)
+            self->mask_counts[k] += sign;
+}
+
+/* Updates the mask from the counts, adding it if needed */
+static int ACL_mask_sync(ACL_Object *self) {
+    unsigned int perm = 0;
+    int k;
+
+    if(self->mask_entry == NULL) {
+        if(self->mask_named == 0)
+            return 0;
+        if(acl_create_entry(&self->acl, &self->mask_entry) == -1)
+            goto err;
+        ACL_drop_index(self);
+        if(acl_set_tag_type(self->mask_entry, ACL_MASK) == -1)
+            goto err;
+    }
+    for(k = 0; k < 3; k++)
+        if(self->mask_counts[k] > 0)
+            perm |= mask_rights[k];
+    if(entry_set_perms(self->mask_entry, perm) == -1)
+        goto err;
+    return 0;
+
+ err:
+    PyErr_SetFromErrno(PyExc_IOError);
+    return -1;
+}
+
+static void ACL_mask_forget(ACL_Object *self, acl_entry_t entry) {
+    if(self->auto_mask)
+        ACL_mask_count(self, entry, -1);
+}
+
+/* Returns -1 with an exception set if the mask can't be updated */
+static int ACL_mask_note(ACL_Object *self, acl_entry_t entry) {
+    /* every edit ends here, so it's also where the ACL changes */
+    self->generation++;
+    if(!self->auto_mask)
+        return 0;
+    if(entry != NULL)
+        ACL_mask_count(self, entry, 1);
+    return ACL_mask_sync(self);
+}
+
+/* Recounts all the entries, after a change to the whole ACL */
+static int ACL_mask_rescan(ACL_Object *self) {
+    acl_entry_t entry;
+    int nerr, eid = ACL_FIRST_ENTRY;
+
+    if(!self->auto_mask)
+        return 0;
+    /* the mask may have to be added */
+    if(ACL_unshare(self) == -1)
+        return -1;
+    memset(self->mask_counts, 0, sizeof(self->mask_counts));
+    self->mask_named = 0;
+    self->mask_entry = NULL;
+    while((nerr = acl_get_entry(self->acl, eid, &entry)) == 1) {
+        eid = ACL_NEXT_ENTRY;
+        ACL_mask_count(self, entry, 1);
+    }
+    if(nerr == -1) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return -1;
+    }
+    return ACL_mask_sync(self);
+}
+
+/* Gives the ACL its own acl_t before a change, or before handing out
+   its entries; returns -1 with an exception set on failure */
+static int ACL_unshare(ACL_Object *self) {
+    acl_t acl;
+
+    if(ACL_ready(self) == -1)
+        return -1;
+    if(self->cow_refs == NULL)
+        return 0;
+    if(*self->cow_refs == 1) {
+        free(self->cow_refs);
+        self->cow_refs = NULL;
+        return 0;
+    }
+    if((acl = acl_dup(self->acl)) == NULL) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return -1;
+    }
+    ACL_release(self);
+    self->acl = acl;
+    /* the entries are new, but the contents (and memo) are the same */
+    free(self->keys);
+    self->keys = NULL;
+    self->nkeys = 0;
+    ACL_drop_order(self);
+    self->mask_entry = NULL;
+    return ACL_mask_rescan(self);
+}
+
+/* Sets the acl_t aside for the Entry objects pointing into it, until
+   the ACL is freed; returns -1 with errno set */
+static int ACL_retire(ACL_Object *self) {
+    acl_t *p;
+
+    if((p = realloc(self->retired,
+                    (self->nretired + 1) * sizeof(*p))) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    self->retired = p;
+    self->retired[self->nretired++] = self->acl;
+    self->acl = NULL;
+    self->exposed = 0;
+    return 0;
+}
+
+/* Before entries are deleted: if some were handed out, moves them
+   along with the acl_t to a retired copy, so that no Entry object is
+   left pointing at a deleted entry; the ACL goes on with a duplicate.
+   Returns -1 with an exception set on failure. */
+static int ACL_detach_entries(ACL_Object *self) {
+    acl_t acl;
+
+    if(!self->exposed)
+        return 0;
+    if(ACL_unshare(self) == -1)
+        return -1;
+    if((acl = acl_dup(self->acl)) == NULL) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return -1;
+    }
+    if(ACL_retire(self) == -1) {
+        acl_free(acl);
+        PyErr_NoMemory();
+        return -1;
+    }
+    self->acl = acl;
+    /* as in ACL_unshare, only the entries are new */
+    free(self->keys);
+    self->keys = NULL;
+    self->nkeys = 0;
+    ACL_drop_order(self);
+    self->mask_entry = NULL;
+    return ACL_mask_rescan(self);
+}
+
 #endif
 
 /* Creation of a new ACL instance */
@@ -145,7 +547,7 @@ static PyObject* ACL_new(PyTypeObject* type, PyObject* args,
     if(newacl != NULL) {
         ((ACL_Object*)newacl)->acl = NULL;
 #ifdef HAVEL_LEVEL2
-        ((ACL_Object*)newacl)->entry_id = ACL_FIRST_ENTRY;
+        ((ACL_Object*)newacl)->entry_id = 0;
 #endif
     }
 
@@ -187,8 +589,12 @@ static int ACL_init(PyObject* obj, PyObject* args, PyObject *keywds) {
 
     /* Free the old acl_t without checking for error, we don't
      * care right now */
-    if(self->acl != NULL)
-        acl_free(self->acl);
+    ACL_release(self);
+    ACL_drop_lazy(self);
+    self->generation++;
+#ifdef HAVE_LEVEL2
+    ACL_drop_index(self);
+#endif
 
     if(file != NULL)
         self->acl = acl_get_file(file, ACL_TYPE_ACCESS);
@@ -196,8 +602,10 @@ static int ACL_init(PyObject* obj, PyObject* args, PyObject *keywds) {
         self->acl = acl_from_text(text);
     else if(fd != -1)
         self->acl = acl_get_fd(fd);
-    else if(thesrc != NULL)
-        self->acl = acl_dup(thesrc->acl);
+    else if(thesrc != NULL) {
+        if(ACL_share(self, thesrc) == -1)
+            return -1;
+    }
     else if(filedef != NULL)
         self->acl = acl_get_file(filedef, ACL_TYPE_DEFAULT);
 #ifdef HAVE_LINUX
@@ -211,8 +619,11 @@ static int ACL_init(PyObject* obj, PyObject* args, PyObject *keywds) {
         PyErr_SetFromErrno(PyExc_IOError);
         return -1;
     }
-
+#ifdef HAVE_LEVEL2
+    return ACL_mask_rescan(self);
+#else
     return 0;
+#endif
 }
 
 /* Standard type functions */
@@ -223,29 +634,69 @@ static void ACL_dealloc(PyObject* obj) {
 
     if (have_error)
         PyErr_Fetch(&err_type, &err_value, &err_traceback);
-    if(self->acl != NULL && acl_free(self->acl) != 0)
+    if(self->cow_refs != NULL)
+        ACL_release(self);
+    else if(self->acl != NULL && acl_free(self->acl) != 0)
         PyErr_WriteUnraisable(obj);
+#ifdef HAVE_LEVEL2
+    ACL_drop_index(self);
+    while(self->nretired > 0)
+        acl_free(self->retired[--self->nretired]);
+    free(self->retired);
+#endif
+    Py_CLEAR(self->memo.text);
+    free(self->memo.blob);
+#ifdef HAVE_LINUX_KERNEL
+    free(self->load_buf);
+    free(self->load_entries);
+#endif
+    ACL_drop_lazy(self);
     if (have_error)
         PyErr_Restore(err_type, err_value, err_traceback);
     PyObject_DEL(self);
 }
 
+/* Returns the memo of the ACL, emptied if the ACL changed since */
+static acl_memo* ACL_memo(ACL_Object *self) {
+    acl_memo *m = &self->memo;
+
+    if(m->generation != self->generation) {
+        Py_CLEAR(m->text);
+        free(m->blob);
+        m->blob = NULL;
+        m->flags = 0;
+        m->generation = self->generation;
+    }
+    return m;
+}
+
 /* Converts the acl to a text format */
 static PyObject* ACL_str(PyObject *obj) {
     char *text;
     ACL_Object *self = (ACL_Object*) obj;
+    acl_memo *m;
     PyObject *ret;
 
-    text = acl_to_text(self->acl, NULL);
-    if(text == NULL) {
-        return PyErr_SetFromErrno(PyExc_IOError);
-    }
-    ret = MyString_FromString(text);
-    if(acl_free(text) != 0) {
-        Py_XDECREF(ret);
-        return PyErr_SetFromErrno(PyExc_IOError);
+    if(ACL_ready(self) == -1)
+        return NULL;
+    m = ACL_memo(self);
+
+    if(m->text == NULL) {
+        text = acl_to_text(self->acl, NULL);
+        if(text == NULL) {
+            return PyErr_SetFromErrno(PyExc_IOError);
+        }
+        ret = MyString_FromString(text);
+        if(acl_free(text) != 0) {
+            Py_XDECREF(ret);
+            return PyErr_SetFromErrno(PyExc_IOError);
+        }
+        if(ret == NULL)
+            return NULL;
+        m->text = ret;
     }
-    return ret;
+    Py_INCREF(m->text);
+    return m->text;
 }
 
 #ifdef HAVE_LINUX
@@ -290,6 +741,8 @@ static PyObject* ACL_to_any_text(PyObject *obj, PyObject *args,
     if (!PyArg_ParseTupleAndKeywords(args, kwds, "|sci", kwlist, &arg_prefix,
                                      &arg_separator, &arg_options))
       return NULL;
+    if(ACL_ready(self) == -1)
+      return NULL;
 
     text = acl_to_any_text(self->acl, arg_prefix, arg_separator, arg_options);
     if(text == NULL) {
@@ -329,11 +782,24 @@ static char __check_doc__[] =
 /* The acl_check method */
 static PyObject* ACL_check(PyObject* obj, PyObject* args) {
     ACL_Object *self = (ACL_Object*) obj;
+    acl_memo *m;
     int result;
     int eindex;
 
-    if((result = acl_check(self->acl, &eindex)) == -1)
-        return PyErr_SetFromErrno(PyExc_IOError);
+    if(ACL_ready(self) == -1)
+        return NULL;
+    m = ACL_memo(self);
+
+    if(m->flags & MEMO_CHECK) {
+        result = m->check_result;
+        eindex = m->check_index;
+    } else {
+        if((result = acl_check(self->acl, &eindex)) == -1)
+            return PyErr_SetFromErrno(PyExc_IOError);
+        m->check_result = result;
+        m->check_index = eindex;
+        m->flags |= MEMO_CHECK;
+    }
     if(result == 0) {
         Py_RETURN_FALSE;
     }
@@ -357,6 +823,8 @@ static PyObject* ACL_richcompare(PyObject* o1, PyObject* o2, int op) {
 
     acl1 = (ACL_Object*)o1;
     acl2 = (ACL_Object*)o2;
+    if(ACL_ready(acl1) == -1 || ACL_ready(acl2) == -1)
+        return NULL;
     if((n=acl_cmp(acl1->acl, acl2->acl))==-1)
         return PyErr_SetFromErrno(PyExc_IOError);
     switch(op) {
@@ -387,11 +855,21 @@ static char __equiv_mode_doc__[] =
 /* The acl_equiv_mode method */
 static PyObject* ACL_equiv_mode(PyObject* obj, PyObject* args) {
     ACL_Object *self = (ACL_Object*) obj;
-    mode_t mode;
+    acl_memo *m;
 
-    if(acl_equiv_mode(self->acl, &mode) == -1)
+    if(ACL_ready(self) == -1)
+        return NULL;
+    m = ACL_memo(self);
+
+    if(!(m->flags & MEMO_MODE)) {
+        m->mode_errno = acl_equiv_mode(self->acl, &m->mode) == -1 ? errno : 0;
+        m->flags |= MEMO_MODE;
+    }
+    if(m->mode_errno) {
+        errno = m->mode_errno;
         return PyErr_SetFromErrno(PyExc_IOError);
-    return PyInt_FromLong(mode);
+    }
+    return PyInt_FromLong(m->mode);
 }
 #endif
 
@@ -421,7 +899,8 @@ static PyObject* ACL_applyto(PyObject* obj, PyObject* args) {
     int nret;
     int fd;
 
-    if (!PyArg_ParseTuple(args, "O|I", &myarg, &type))
+    if (!PyArg_ParseTuple(args, "O|I", &myarg, &type) ||
+        ACL_ready(self) == -1)
         return NULL;
 
     if(PyBytes_Check(myarg)) {
@@ -487,14 +966,54 @@ static char __valid_doc__[] =
 /* Checks the ACL for validity */
 static PyObject* ACL_valid(PyObject* obj, PyObject* args) {
     ACL_Object *self = (ACL_Object*) obj;
+    acl_memo *m;
 
-    if(acl_valid(self->acl) == -1) {
+    if(ACL_ready(self) == -1)
+        return NULL;
+    m = ACL_memo(self);
+
+    if(!(m->flags & MEMO_VALID)) {
+        m->valid = acl_valid(self->acl) != -1;
+        m->flags |= MEMO_VALID;
+    }
+    if(!m->valid) {
         Py_RETURN_FALSE;
     } else {
         Py_RETURN_TRUE;
     }
 }
 
+static char __ACL_copy_doc__[] =
+    "Return a copy of the ACL.\n"
+    "\n"
+    "The copy shares the entries of the ACL until either of them is\n"
+    "changed, so that copies that are only read cost next to nothing.\n"
+    "This is also what ``ACL(acl=...)`` does.\n"
+    "\n"
+    ":rtype: ACL\n"
+    ;
+
+static PyObject* ACL_copy(PyObject *obj, PyObject *args) {
+    PyObject *newacl;
+
+    if((newacl = ACL_new(Py_TYPE(obj), NULL, NULL)) == NULL)
+        return NULL;
+    if(ACL_share((ACL_Object*)newacl, (ACL_Object*)obj) == -1) {
+        Py_DECREF(newacl);
+        return NULL;
+    }
+    return newacl;
+}
+
+/* ACLs hold no other objects, so a deep copy is just a copy */
+static PyObject* ACL_deepcopy(PyObject *obj, PyObject *args) {
+    PyObject *memo;
+
+    if(!PyArg_ParseTuple(args, "O", &memo))
+        return NULL;
+    return ACL_copy(obj, NULL);
+}
+
 #ifdef HAVE_ACL_COPY_EXT
 static PyObject* ACL_get_state(PyObject *obj, PyObject* args) {
     ACL_Object *self = (ACL_Object*) obj;
@@ -502,6 +1021,8 @@ static PyObject* ACL_get_state(PyObject *obj, PyObject* args) {
     ssize_t size, nsize;
     char *buf;
 
+    if(ACL_ready(self) == -1)
+        return NULL;
     size = acl_size(self->acl);
     if(size == -1)
         return PyErr_SetFromErrno(PyExc_IOError);
@@ -533,12 +1054,21 @@ static PyObject* ACL_set_state(PyObject *obj, PyObject* args) {
         return PyErr_SetFromErrno(PyExc_IOError);
 
     /* Free the old acl. Should we ignore errors here? */
-    if(self->acl != NULL) {
+    ACL_drop_lazy(self);
+    if(self->cow_refs != NULL)
+        ACL_release(self);
+    else if(self->acl != NULL) {
         if(acl_free(self->acl) == -1)
             return PyErr_SetFromErrno(PyExc_IOError);
     }
 
     self->acl = ptr;
+    self->generation++;
+#ifdef HAVE_LEVEL2
+    ACL_drop_index(self);
+    if(ACL_mask_rescan(self) == -1)
+        return NULL;
+#endif
 
     /* Return the result */
     Py_INCREF(Py_None);
@@ -548,12 +1078,21 @@ static PyObject* ACL_set_state(PyObject *obj, PyObject* args) {
 
 #ifdef HAVE_LEVEL2
 
+static int ACL_build_order_unshared(ACL_Object *self);
+
 /* tp_iter for the ACL type; since it can be iterated only
  * destructively, the type is its iterator
+ *
+ * The iteration steps through the order array rather than using
+ * acl_get_entry's cursor, which every other scan of the entries
+ * (len(), find(), ...) resets.
  */
 static PyObject* ACL_iter(PyObject *obj) {
     ACL_Object *self = (ACL_Object*)obj;
-    self->entry_id = ACL_FIRST_ENTRY;
+    if(ACL_build_order_unshared(self) == -1)
+        return NULL;
+    self->exposed = 1;
+    self->entry_id = 0;
     Py_INCREF(obj);
     return obj;
 }
@@ -563,17 +1102,16 @@ static PyObject* ACL_iternext(PyObject *obj) {
     ACL_Object *self = (ACL_Object*)obj;
     acl_entry_t the_entry_t;
     Entry_Object *the_entry_obj;
-    int nerr;
 
-    nerr = acl_get_entry(self->acl, self->entry_id, &the_entry_t);
-    self->entry_id = ACL_NEXT_ENTRY;
-    if(nerr == -1)
-        return PyErr_SetFromErrno(PyExc_IOError);
-    else if(nerr == 0) {
+    /* the array is rebuilt if the entries changed meanwhile */
+    if(ACL_build_order_unshared(self) == -1)
+        return NULL;
+    if(self->entry_id >= self->norder) {
         /* Docs says this is not needed */
         /*PyErr_SetObject(PyExc_StopIteration, Py_None);*/
         return NULL;
     }
+    the_entry_t = self->order[self->entry_id++];
 
     the_entry_obj = (Entry_Object*) PyType_GenericNew(&Entry_Type, NULL, NULL);
     if(the_entry_obj == NULL)
@@ -603,11 +1141,19 @@ static PyObject* ACL_delete_entry(PyObject *obj, PyObject *args) {
     ACL_Object *self = (ACL_Object*)obj;
     Entry_Object *e;
 
-    if (!PyArg_ParseTuple(args, "O!", &Entry_Type, &e))
+    if (!PyArg_ParseTuple(args, "O!", &Entry_Type, &e) ||
+        ACL_unshare(self) == -1)
         return NULL;
 
-    if(acl_delete_entry(self->acl, e->entry) == -1)
-        return PyErr_SetFromErrno(PyExc_IOError);
+    ACL_mask_forget(self, e->entry);
+    if(acl_delete_entry(self->acl, e->entry) == -1) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        ACL_mask_note(self, e->entry);
+        return NULL;
+    }
+    ACL_drop_index(self);
+    if(ACL_mask_note(self, NULL) == -1)
+        return NULL;
 
     /* Return the result */
     Py_INCREF(Py_None);
@@ -635,8 +1181,13 @@ static char __ACL_calc_mask_doc__[] =
 static PyObject* ACL_calc_mask(PyObject *obj, PyObject *args) {
     ACL_Object *self = (ACL_Object*)obj;
 
+    if(ACL_unshare(self) == -1)
+        return NULL;
     if(acl_calc_mask(&self->acl) == -1)
         return PyErr_SetFromErrno(PyExc_IOError);
+    ACL_drop_index(self);
+    if(ACL_mask_rescan(self) == -1)
+        return NULL;
 
     /* Return the result */
     Py_INCREF(Py_None);
@@ -669,16 +1220,19 @@ static PyObject* ACL_append(PyObject *obj, PyObject *args) {
         return NULL;
     }
 
-    if (!PyArg_ParseTuple(args, "|O!", &Entry_Type, &oldentry)) {
+    if (!PyArg_ParseTuple(args, "|O!", &Entry_Type, &oldentry) ||
+        ACL_unshare(self) == -1) {
         Py_DECREF(newentry);
         return NULL;
     }
+    self->exposed = 1;
 
     nret = acl_create_entry(&self->acl, &newentry->entry);
     if(nret == -1) {
         Py_DECREF(newentry);
         return PyErr_SetFromErrno(PyExc_IOError);
     }
+    ACL_drop_index(self);
 
     if(oldentry != NULL) {
         nret = acl_copy_entry(newentry->entry, oldentry->entry);
@@ -686,6 +1240,10 @@ static PyObject* ACL_append(PyObject *obj, PyObject *args) {
             Py_DECREF(newentry);
             return PyErr_SetFromErrno(PyExc_IOError);
         }
+        if(ACL_mask_note(self, newentry->entry) == -1) {
+            Py_DECREF(newentry);
+            return NULL;
+        }
     }
 
     newentry->parent_acl = obj;
@@ -694,84 +1252,556 @@ static PyObject* ACL_append(PyObject *obj, PyObject *args) {
     return (PyObject*)newentry;
 }
 
-/***** Entry type *****/
-
-typedef struct {
-    acl_tag_t tag;
-    union {
-        uid_t uid;
-        gid_t gid;
-    };
-} tag_qual;
+/* Returns the position of the first key not below (tag, id) */
+static int acl_key_find(const ACL_Object *self, acl_tag_t tag, id_t id) {
+    int lo = 0, hi = self->nkeys, mid;
+    const acl_key *k;
+
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        k = self->keys + mid;
+        if(k->tag < tag || (k->tag == tag && k->id < id))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
 
-/* Pre-declaring the function is more friendly to cpychecker, sigh. */
-static int get_tag_qualifier(acl_entry_t entry, tag_qual *tq)
-  CPYCHECKER_NEGATIVE_RESULT_SETS_EXCEPTION;
+static int acl_key_cmp(const void *a, const void *b) {
+    const acl_key *x = a, *y = b;
 
-/* Helper function to get the tag and qualifier of an Entry at the
-   same time. This is "needed" because the acl_get_qualifier function
-   returns a pointer to different types, based on the tag value, and
-   thus it's not straightforward to get the right type.
+    if(x->tag != y->tag)
+        return x->tag < y->tag ? -1 : 1;
+    return x->id < y->id ? -1 : x->id > y->id;
+}
 
-   It sets a Python exception if an error occurs, and returns -1 in
-   this case. If successful, the tag is set to the tag type, the
-   qualifier (if any) to either the uid or the gid entry in the
-   tag_qual structure, and the return value is 0.
-*/
-static int get_tag_qualifier(acl_entry_t entry, tag_qual *tq) {
-    void *p;
+/* Builds the index of the entries by tag and qualifier, unless it's
+   already there; sets a Python exception on failure */
+static int ACL_build_index(ACL_Object *self) {
+    acl_entry_t entry;
+    acl_key *keys = NULL, *p;
+    int count = 0, alloc = 0, nerr, eid = ACL_FIRST_ENTRY;
+    void *q;
 
-    if(acl_get_tag_type(entry, &tq->tag) == -1) {
-        PyErr_SetFromErrno(PyExc_IOError);
+    if(self->keys != NULL)
+        return 0;
+    if(ACL_ready(self) == -1)
         return -1;
-    }
-    if (tq->tag == ACL_USER || tq->tag == ACL_GROUP) {
-        if((p = acl_get_qualifier(entry)) == NULL) {
-            PyErr_SetFromErrno(PyExc_IOError);
-            return -1;
+    while((nerr = acl_get_entry(self->acl, eid, &entry)) == 1) {
+        eid = ACL_NEXT_ENTRY;
+        if(count == alloc) {
+            alloc = alloc ? alloc * 2 : 8;
+            if((p = realloc(keys, alloc * sizeof(*p))) == NULL) {
+                free(keys);
+                PyErr_NoMemory();
+                return -1;
+            }
+            keys = p;
         }
-        if (tq->tag == ACL_USER) {
-            tq->uid = *(uid_t*)p;
-        } else {
-            tq->gid = *(gid_t*)p;
+        if(acl_get_tag_type(entry, &keys[count].tag) == -1)
+            goto err;
+        keys[count].id = ACL_UNDEFINED_ID;
+        if(keys[count].tag == ACL_USER || keys[count].tag == ACL_GROUP) {
+            if((q = acl_get_qualifier(entry)) == NULL)
+                goto err;
+            keys[count].id = *(id_t*)q;
+            acl_free(q);
         }
-        acl_free(p);
+        keys[count++].entry = entry;
     }
-    return 0;
-}
-
-/* Creation of a new Entry instance */
-static PyObject* Entry_new(PyTypeObject* type, PyObject* args,
-                           PyObject *keywds) {
-    PyObject* newentry;
-
-    newentry = PyType_GenericNew(type, args, keywds);
-
-    if(newentry != NULL) {
-        ((Entry_Object*)newentry)->entry = NULL;
-        ((Entry_Object*)newentry)->parent_acl = NULL;
+    if(nerr == -1)
+        goto err;
+    /* an empty index still needs a non-NULL array */
+    if(keys == NULL && (keys = malloc(sizeof(*keys))) == NULL) {
+        PyErr_NoMemory();
+        return -1;
     }
+    qsort(keys, count, sizeof(*keys), acl_key_cmp);
+    self->keys = keys;
+    self->nkeys = count;
+    return 0;
 
-    return newentry;
+ err:
+    free(keys);
+    PyErr_SetFromErrno(PyExc_IOError);
+    return -1;
+}
+
+/* Parses a (tag, qualifier) key: the qualifier is needed exactly
+   for the named entries */
+static int acl_parse_key(int tag, PyObject *qualifier, id_t *id) {
+    unsigned long value;
+
+    switch(tag) {
+    case ACL_USER_OBJ: case ACL_GROUP_OBJ: case ACL_MASK: case ACL_OTHER:
+        if(qualifier != Py_None) {
+            PyErr_SetString(PyExc_ValueError,
+                            "only named entries have a qualifier");
+            return -1;
+        }
+        *id = ACL_UNDEFINED_ID;
+        return 0;
+    case ACL_USER: case ACL_GROUP:
+        if(qualifier == Py_None) {
+            PyErr_SetString(PyExc_ValueError,
+                            "named entries need a qualifier");
+            return -1;
+        }
+        value = PyLong_AsUnsignedLong(qualifier);
+        if(PyErr_Occurred())
+            return -1;
+        if(value >= UINT32_MAX) {
+            PyErr_SetString(PyExc_OverflowError, "invalid qualifier");
+            return -1;
+        }
+        *id = value;
+        return 0;
+    default:
+        PyErr_SetString(PyExc_ValueError, "invalid tag type");
+        return -1;
+    }
+}
+
+/* Wraps an entry of the ACL in a new Entry object */
+static PyObject* ACL_wrap_entry(PyObject *obj, acl_entry_t entry) {
+    Entry_Object *e;
+
+    e = (Entry_Object*)PyType_GenericNew(&Entry_Type, NULL, NULL);
+    if(e == NULL)
+        return NULL;
+    e->entry = entry;
+    e->parent_acl = obj;
+    ((ACL_Object*)obj)->exposed = 1;
+    Py_INCREF(obj);
+    return (PyObject*)e;
+}
+
+static char __ACL_find_doc__[] =
+    "find(tag[, qualifier=None])\n"
+    "Return the entry with the given tag and qualifier.\n"
+    "\n"
+    "The lookup goes through an index of the entries, built on the\n"
+    "first use and kept until the entries are changed other than by\n"
+    ":py:meth:`set_perms` (which keeps it up to date).\n"
+    "\n"
+    ".. note:: Only available with level 2.\n"
+    "\n"
+    ":param int tag: the tag type, e.g. :py:data:`ACL_USER`\n"
+    ":param int qualifier: the uid or gid, for named entries only\n"
+    ":return: the entry, or None if there is none\n"
+    ":rtype: :py:class:`Entry`\n"
+    ;
+
+static PyObject* ACL_find(PyObject *obj, PyObject *args) {
+    ACL_Object *self = (ACL_Object*)obj;
+    PyObject *qualifier = Py_None;
+    int tag, pos;
+    id_t id;
+
+    if(!PyArg_ParseTuple(args, "i|O", &tag, &qualifier) ||
+       acl_parse_key(tag, qualifier, &id) == -1 ||
+       ACL_build_index(self) == -1)
+        return NULL;
+    pos = acl_key_find(self, tag, id);
+    if(pos == self->nkeys || self->keys[pos].tag != (acl_tag_t)tag ||
+       self->keys[pos].id != id)
+        Py_RETURN_NONE;
+    if(self->cow_refs != NULL) {
+        if(ACL_unshare(self) == -1 || ACL_build_index(self) == -1)
+            return NULL;
+        pos = acl_key_find(self, tag, id);
+    }
+    return ACL_wrap_entry(obj, self->keys[pos].entry);
+}
+
+static char __ACL_set_perms_doc__[] =
+    "set_perms(tag, qualifier, perms)\n"
+    "Set the permissions of an entry, creating or deleting it.\n"
+    "\n"
+    "The entry with the given tag and qualifier is created if needed;\n"
+    "with perms None, it's deleted if present. The mask is left alone\n"
+    "(see :py:meth:`calc_mask`).\n"
+    "\n"
+    "Deleting an entry detaches the :py:class:`Entry` objects obtained\n"
+    "from the ACL before, as :py:meth:`load` does.\n"
+    "\n"
+    ".. note:: Only available with level 2.\n"
+    "\n"
+    ":param int tag: the tag type, e.g. :py:data:`ACL_USER`\n"
+    ":param int qualifier: the uid or gid, for named entries only\n"
+    "    (None otherwise)\n"
+    ":param int perms: a combination of :py:data:`ACL_READ`,\n"
+    "    :py:data:`ACL_WRITE` and :py:data:`ACL_EXECUTE`, or None\n"
+    ;
+
+static PyObject* ACL_set_perms(PyObject *obj, PyObject *args) {
+    ACL_Object *self = (ACL_Object*)obj;
+    PyObject *qualifier, *perms;
+    acl_entry_t entry;
+    acl_key *p;
+    long bits = 0;
+    int tag, pos, found;
+    id_t id;
+
+    if(!PyArg_ParseTuple(args, "iOO", &tag, &qualifier, &perms) ||
+       acl_parse_key(tag, qualifier, &id) == -1)
+        return NULL;
+    if(perms != Py_None) {
+        bits = PyInt_AsLong(perms);
+        if(bits == -1 && PyErr_Occurred())
+            return NULL;
+        if(bits & ~(long)(ACL_READ | ACL_WRITE | ACL_EXECUTE)) {
+            PyErr_SetString(PyExc_ValueError, "invalid permissions");
+            return NULL;
+        }
+    }
+    if(ACL_unshare(self) == -1 || ACL_build_index(self) == -1)
+        return NULL;
+    pos = acl_key_find(self, tag, id);
+    found = pos < self->nkeys && self->keys[pos].tag == (acl_tag_t)tag &&
+        self->keys[pos].id == id;
+    if(perms == Py_None) {
+        if(found) {
+            if(self->exposed) {
+                if(ACL_detach_entries(self) == -1 ||
+                   ACL_build_index(self) == -1)
+                    return NULL;
+                pos = acl_key_find(self, tag, id);
+            }
+            entry = self->keys[pos].entry;
+            ACL_mask_forget(self, entry);
+            if(acl_delete_entry(self->acl, entry) == -1) {
+                PyErr_SetFromErrno(PyExc_IOError);
+                ACL_mask_note(self, entry);
+                return NULL;
+            }
+            memmove(self->keys + pos, self->keys + pos + 1,
+                    (self->nkeys - pos - 1) * sizeof(acl_key));
+            self->nkeys--;
+            ACL_drop_order(self);
+            if(ACL_mask_note(self, NULL) == -1)
+                return NULL;
+        }
+        Py_RETURN_NONE;
+    }
+    if(found) {
+        entry = self->keys[pos].entry;
+        ACL_mask_forget(self, entry);
+    } else {
+        if((p = realloc(self->keys,
+                        (self->nkeys + 1) * sizeof(acl_key))) == NULL)
+            return PyErr_NoMemory();
+        self->keys = p;
+        if(acl_create_entry(&self->acl, &entry) == -1)
+            return PyErr_SetFromErrno(PyExc_IOError);
+        if(acl_set_tag_type(entry, tag) == -1 ||
+           ((tag == ACL_USER || tag == ACL_GROUP) &&
+            acl_set_qualifier(entry, &id) == -1)) {
+            acl_delete_entry(self->acl, entry);
+            return PyErr_SetFromErrno(PyExc_IOError);
+        }
+        memmove(self->keys + pos + 1, self->keys + pos,
+                (self->nkeys - pos) * sizeof(acl_key));
+        self->keys[pos].tag = tag;
+        self->keys[pos].id = id;
+        self->keys[pos].entry = entry;
+        self->nkeys++;
+        ACL_drop_order(self);
+    }
+    if(entry_set_perms(entry, bits) == -1) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        ACL_mask_note(self, entry);
+        return NULL;
+    }
+    if(ACL_mask_note(self, entry) == -1)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject* ACL_get_auto_mask(PyObject *obj, void* arg) {
+    return PyBool_FromLong(((ACL_Object*)obj)->auto_mask);
+}
+
+static int ACL_set_auto_mask(PyObject *obj, PyObject *value, void* arg) {
+    ACL_Object *self = (ACL_Object*)obj;
+    int on;
+
+    if(value == NULL) {
+        PyErr_SetString(PyExc_TypeError,
+                        "auto_mask deletion is not supported");
+        return -1;
+    }
+    if((on = PyObject_IsTrue(value)) == -1)
+        return -1;
+    if(on == self->auto_mask)
+        return 0;
+    self->auto_mask = on;
+    self->mask_entry = NULL;
+    self->generation++;
+    return ACL_mask_rescan(self);
+}
+
+/* Sequence protocol */
+
+/* Lists the entries in ACL order, unless already done; sets a
+   Python exception on failure */
+static int ACL_build_order(ACL_Object *self) {
+    acl_entry_t entry, *p, *order = NULL;
+    int count = 0, alloc = 0, nerr, eid = ACL_FIRST_ENTRY;
+
+    if(self->order != NULL)
+        return 0;
+    if(ACL_ready(self) == -1)
+        return -1;
+    while((nerr = acl_get_entry(self->acl, eid, &entry)) == 1) {
+        eid = ACL_NEXT_ENTRY;
+        if(count == alloc) {
+            alloc = alloc ? alloc * 2 : 8;
+            if((p = realloc(order, alloc * sizeof(*p))) == NULL) {
+                free(order);
+                PyErr_NoMemory();
+                return -1;
+            }
+            order = p;
+        }
+        order[count++] = entry;
+    }
+    if(nerr == -1) {
+        free(order);
+        PyErr_SetFromErrno(PyExc_IOError);
+        return -1;
+    }
+    /* an empty list still needs a non-NULL array */
+    if(order == NULL && (order = malloc(sizeof(*order))) == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    self->order = order;
+    self->norder = count;
+    return 0;
+}
+
+/* Like ACL_build_order, but for handing out entries */
+static int ACL_build_order_unshared(ACL_Object *self) {
+    if(ACL_build_order(self) == -1)
+        return -1;
+    if(self->cow_refs != NULL &&
+       (ACL_unshare(self) == -1 || ACL_build_order(self) == -1))
+        return -1;
+    return 0;
+}
+
+static Py_ssize_t ACL_length(PyObject *obj) {
+    ACL_Object *self = (ACL_Object*)obj;
+
+    if(ACL_build_order(self) == -1)
+        return -1;
+    return self->norder;
+}
+
+static PyObject* ACL_item(PyObject *obj, Py_ssize_t i) {
+    ACL_Object *self = (ACL_Object*)obj;
+
+    if(ACL_build_order_unshared(self) == -1)
+        return NULL;
+    if(i < 0 || i >= self->norder) {
+        PyErr_SetString(PyExc_IndexError, "ACL index out of range");
+        return NULL;
+    }
+    return ACL_wrap_entry(obj, self->order[i]);
+}
+
+static PyObject* ACL_subscript(PyObject *obj, PyObject *key) {
+    ACL_Object *self = (ACL_Object*)obj;
+    Py_ssize_t i, start, stop, step, len;
+    PyObject *list, *entry;
+
+    if(PyIndex_Check(key)) {
+        if((i = PyNumber_AsSsize_t(key, PyExc_IndexError)) == -1 &&
+           PyErr_Occurred())
+            return NULL;
+        if(i < 0) {
+            if(ACL_build_order(self) == -1)
+                return NULL;
+            i += self->norder;
+        }
+        return ACL_item(obj, i);
+    }
+    if(!PySlice_Check(key)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "ACL indices must be integers or slices");
+        return NULL;
+    }
+    if(ACL_build_order_unshared(self) == -1 ||
+       MySlice_GetIndicesEx(key, self->norder, &start, &stop, &step,
+                            &len) == -1 ||
+       (list = PyList_New(len)) == NULL)
+        return NULL;
+    for(i = 0; i < len; i++, start += step) {
+        if((entry = ACL_wrap_entry(obj, self->order[start])) == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, entry);
+    }
+    return list;
+}
+
+/* Membership is by (tag, qualifier), through the index */
+static int ACL_contains(PyObject *obj, PyObject *key) {
+    ACL_Object *self = (ACL_Object*)obj;
+    PyObject *qualifier = Py_None;
+    int tag, pos;
+    id_t id;
+
+    if(!PyTuple_Check(key)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "ACL membership needs a (tag, qualifier) tuple");
+        return -1;
+    }
+    if(!PyArg_ParseTuple(key, "i|O", &tag, &qualifier) ||
+       acl_parse_key(tag, qualifier, &id) == -1 ||
+       ACL_build_index(self) == -1)
+        return -1;
+    pos = acl_key_find(self, tag, id);
+    return pos < self->nkeys && self->keys[pos].tag == (acl_tag_t)tag &&
+        self->keys[pos].id == id;
+}
+
+static PySequenceMethods ACL_as_sequence = {
+    ACL_length,         /* sq_length */
+    0,                  /* sq_concat */
+    0,                  /* sq_repeat */
+    ACL_item,           /* sq_item */
+    0,                  /* sq_slice */
+    0,                  /* sq_ass_item */
+    0,                  /* sq_ass_slice */
+    ACL_contains,       /* sq_contains */
+};
+
+static PyMappingMethods ACL_as_mapping = {
+    ACL_length,         /* mp_length */
+    ACL_subscript,      /* mp_subscript */
+    0,                  /* mp_ass_subscript */
+};
+
+/***** Entry type *****/
+
+typedef struct {
+    acl_tag_t tag;
+    union {
+        uid_t uid;
+        gid_t gid;
+    };
+} tag_qual;
+
+/* Pre-declaring the function is more friendly to cpychecker, sigh. */
+static int get_tag_qualifier(acl_entry_t entry, tag_qual *tq)
+  CPYCHECKER_NEGATIVE_RESULT_SETS_EXCEPTION;
+
+/* Helper function to get the tag and qualifier of an Entry at the
+   same time. This is "needed" because the acl_get_qualifier function
+   returns a pointer to different types, based on the tag value, and
+   thus it's not straightforward to get the right type.
+
+   It sets a Python exception if an error occurs, and returns -1 in
+   this case. If successful, the tag is set to the tag type, the
+   qualifier (if any) to either the uid or the gid entry in the
+   tag_qual structure, and the return value is 0.
+*/
+static int get_tag_qualifier(acl_entry_t entry, tag_qual *tq) {
+    void *p;
+
+    if(acl_get_tag_type(entry, &tq->tag) == -1) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return -1;
+    }
+    if (tq->tag == ACL_USER || tq->tag == ACL_GROUP) {
+        if((p = acl_get_qualifier(entry)) == NULL) {
+            PyErr_SetFromErrno(PyExc_IOError);
+            return -1;
+        }
+        if (tq->tag == ACL_USER) {
+            tq->uid = *(uid_t*)p;
+        } else {
+            tq->gid = *(gid_t*)p;
+        }
+        acl_free(p);
+    }
+    return 0;
+}
+
+/* Creation of a new Entry instance */
+static PyObject* Entry_new(PyTypeObject* type, PyObject* args,
+                           PyObject *keywds) {
+    PyObject* newentry;
+
+    newentry = PyType_GenericNew(type, args, keywds);
+
+    if(newentry != NULL) {
+        ((Entry_Object*)newentry)->entry = NULL;
+        ((Entry_Object*)newentry)->parent_acl = NULL;
+    }
+
+    return newentry;
 }
 
 /* Initialization of a new Entry instance */
 static int Entry_init(PyObject* obj, PyObject* args, PyObject *keywds) {
     Entry_Object* self = (Entry_Object*) obj;
+    static char *kwlist[] = { "acl", "tag_type", "qualifier", "perms",
+                              NULL };
     ACL_Object* parent = NULL;
-
-    if (!PyArg_ParseTuple(args, "O!", &ACL_Type, &parent))
+    PyObject *qualifier = Py_None, *perms = Py_None;
+    int tag = ACL_UNDEFINED_TAG;
+    long bits = 0;
+    id_t id = ACL_UNDEFINED_ID;
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "O!|iOO", kwlist,
+                                     &ACL_Type, &parent, &tag, &qualifier,
+                                     &perms))
+        return -1;
+    if(tag != ACL_UNDEFINED_TAG) {
+        if(acl_parse_key(tag, qualifier, &id) == -1)
+            return -1;
+    } else if(qualifier != Py_None) {
+        PyErr_SetString(PyExc_ValueError, "a qualifier needs a tag type");
         return -1;
+    }
+    if(perms != Py_None) {
+        bits = PyInt_AsLong(perms);
+        if(bits == -1 && PyErr_Occurred())
+            return -1;
+        if(bits & ~(long)(ACL_READ | ACL_WRITE | ACL_EXECUTE)) {
+            PyErr_SetString(PyExc_ValueError, "invalid permissions");
+            return -1;
+        }
+    }
+    if(ACL_unshare(parent) == -1)
+        return -1;
+    parent->exposed = 1;
 
     if(acl_create_entry(&parent->acl, &self->entry) == -1) {
         PyErr_SetFromErrno(PyExc_IOError);
         return -1;
     }
+    ACL_drop_index(parent);
+    if((tag != ACL_UNDEFINED_TAG &&
+        acl_set_tag_type(self->entry, tag) == -1) ||
+       ((tag == ACL_USER || tag == ACL_GROUP) &&
+        acl_set_qualifier(self->entry, &id) == -1) ||
+       entry_set_perms(self->entry, bits) == -1) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        acl_delete_entry(parent->acl, self->entry);
+        self->entry = NULL;
+        return -1;
+    }
 
     self->parent_acl = (PyObject*)parent;
     Py_INCREF(parent);
 
-    return 0;
+    return ACL_mask_note(parent, self->entry);
 }
 
 /* Free the Entry instance */
@@ -845,6 +1875,7 @@ static PyObject* Entry_str(PyObject *obj) {
 /* Sets the tag type of the entry */
 static int Entry_set_tag_type(PyObject* obj, PyObject* value, void* arg) {
     Entry_Object *self = (Entry_Object*) obj;
+    ACL_Object *parent = (ACL_Object*)self->parent_acl;
 
     if(value == NULL) {
         PyErr_SetString(PyExc_TypeError,
@@ -857,10 +1888,15 @@ static int Entry_set_tag_type(PyObject* obj, PyObject* value, void* arg) {
                         "tag type must be integer");
         return -1;
     }
+    ACL_mask_forget(parent, self->entry);
     if(acl_set_tag_type(self->entry, (acl_tag_t)PyInt_AsLong(value)) == -1) {
         PyErr_SetFromErrno(PyExc_IOError);
+        ACL_mask_note(parent, self->entry);
         return -1;
     }
+    ACL_drop_index(parent);
+    if(ACL_mask_note(parent, self->entry) == -1)
+        return -1;
 
     return 0;
 }
@@ -944,6 +1980,7 @@ static int Entry_set_qualifier(PyObject* obj, PyObject* value, void* arg) {
         PyErr_SetFromErrno(PyExc_IOError);
         return -1;
     }
+    ACL_drop_index((ACL_Object*)self->parent_acl);
 
     return 0;
 }
@@ -1009,6 +2046,7 @@ static PyObject* Entry_get_permset(PyObject *obj, void* arg) {
 /* Sets the permset of the entry to the passed Permset */
 static int Entry_set_permset(PyObject* obj, PyObject* value, void* arg) {
     Entry_Object *self = (Entry_Object*)obj;
+    ACL_Object *parent = (ACL_Object*)self->parent_acl;
     Permset_Object *p;
 
     if(!PyObject_IsInstance(value, (PyObject*)&Permset_Type)) {
@@ -1016,11 +2054,13 @@ static int Entry_set_permset(PyObject* obj, PyObject* value, void* arg) {
         return -1;
     }
     p = (Permset_Object*)value;
+    ACL_mask_forget(parent, self->entry);
     if(acl_set_permset(self->entry, p->permset) == -1) {
         PyErr_SetFromErrno(PyExc_IOError);
+        ACL_mask_note(parent, self->entry);
         return -1;
     }
-    return 0;
+    return ACL_mask_note(parent, self->entry);
 }
 
 static char __Entry_copy_doc__[] =
@@ -1036,13 +2076,21 @@ static char __Entry_copy_doc__[] =
 /* Sets all the entry parameters to another entry */
 static PyObject* Entry_copy(PyObject *obj, PyObject *args) {
     Entry_Object *self = (Entry_Object*)obj;
+    ACL_Object *parent = (ACL_Object*)self->parent_acl;
     Entry_Object *other;
 
     if(!PyArg_ParseTuple(args, "O!", &Entry_Type, &other))
         return NULL;
 
-    if(acl_copy_entry(self->entry, other->entry) == -1)
-        return PyErr_SetFromErrno(PyExc_IOError);
+    ACL_mask_forget(parent, self->entry);
+    if(acl_copy_entry(self->entry, other->entry) == -1) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        ACL_mask_note(parent, self->entry);
+        return NULL;
+    }
+    ACL_drop_index(parent);
+    if(ACL_mask_note(parent, self->entry) == -1)
+        return NULL;
 
     Py_INCREF(Py_None);
     return Py_None;
@@ -1101,15 +2149,41 @@ static void Permset_dealloc(PyObject* obj) {
     PyObject_DEL(self);
 }
 
+/* Permsets always belong to an entry; see the ACL auto-mask mode */
+static void Permset_mask_forget(Permset_Object *self) {
+    Entry_Object *e = (Entry_Object*)self->parent_entry;
+
+    if(e != NULL)
+        ACL_mask_forget((ACL_Object*)e->parent_acl, e->entry);
+}
+
+static int Permset_mask_note(Permset_Object *self) {
+    Entry_Object *e = (Entry_Object*)self->parent_entry;
+
+    return e == NULL ? 0 :
+        ACL_mask_note((ACL_Object*)e->parent_acl, e->entry);
+}
+
+/* The eight "rwx" strings, made on first use */
+static PyObject *perm_strings[8];
+
 /* Permset string representation */
 static PyObject* Permset_str(PyObject *obj) {
     Permset_Object *self = (Permset_Object*) obj;
     char pstr[3];
+    int bits;
 
-    pstr[0] = get_perm(self->permset, ACL_READ) ? 'r' : '-';
-    pstr[1] = get_perm(self->permset, ACL_WRITE) ? 'w' : '-';
-    pstr[2] = get_perm(self->permset, ACL_EXECUTE) ? 'x' : '-';
-    return MyString_FromStringAndSize(pstr, 3);
+    if((bits = permset_get_bits(self->permset)) == -1)
+        return PyErr_SetFromErrno(PyExc_IOError);
+    if(perm_strings[bits] == NULL) {
+        pstr[0] = bits & ACL_READ ? 'r' : '-';
+        pstr[1] = bits & ACL_WRITE ? 'w' : '-';
+        pstr[2] = bits & ACL_EXECUTE ? 'x' : '-';
+        if((perm_strings[bits] = MyString_FromStringAndSize(pstr, 3)) == NULL)
+            return NULL;
+    }
+    Py_INCREF(perm_strings[bits]);
+    return perm_strings[bits];
 }
 
 static char __Permset_clear_doc__[] =
@@ -1120,8 +2194,14 @@ static char __Permset_clear_doc__[] =
 static PyObject* Permset_clear(PyObject* obj, PyObject* args) {
     Permset_Object *self = (Permset_Object*) obj;
 
-    if(acl_clear_perms(self->permset) == -1)
-        return PyErr_SetFromErrno(PyExc_IOError);
+    Permset_mask_forget(self);
+    if(acl_clear_perms(self->permset) == -1) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        Permset_mask_note(self);
+        return NULL;
+    }
+    if(Permset_mask_note(self) == -1)
+        return NULL;
 
     /* Return the result */
     Py_INCREF(Py_None);
@@ -1149,15 +2229,17 @@ static int Permset_set_right(PyObject* obj, PyObject* value, void* arg) {
         return -1;
     }
     on = PyInt_AsLong(value);
+    Permset_mask_forget(self);
     if(on)
         nerr = acl_add_perm(self->permset, *(acl_perm_t*)arg);
     else
         nerr = acl_delete_perm(self->permset, *(acl_perm_t*)arg);
     if(nerr == -1) {
         PyErr_SetFromErrno(PyExc_IOError);
+        Permset_mask_note(self);
         return -1;
     }
-    return 0;
+    return Permset_mask_note(self);
 }
 
 static char __Permset_add_doc__[] =
@@ -1181,8 +2263,14 @@ static PyObject* Permset_add(PyObject* obj, PyObject* args) {
     if (!PyArg_ParseTuple(args, "i", &right))
         return NULL;
 
-    if(acl_add_perm(self->permset, (acl_perm_t) right) == -1)
-        return PyErr_SetFromErrno(PyExc_IOError);
+    Permset_mask_forget(self);
+    if(acl_add_perm(self->permset, (acl_perm_t) right) == -1) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        Permset_mask_note(self);
+        return NULL;
+    }
+    if(Permset_mask_note(self) == -1)
+        return NULL;
 
     /* Return the result */
     Py_INCREF(Py_None);
@@ -1210,8 +2298,14 @@ static PyObject* Permset_delete(PyObject* obj, PyObject* args) {
     if (!PyArg_ParseTuple(args, "i", &right))
         return NULL;
 
-    if(acl_delete_perm(self->permset, (acl_perm_t) right) == -1)
-        return PyErr_SetFromErrno(PyExc_IOError);
+    Permset_mask_forget(self);
+    if(acl_delete_perm(self->permset, (acl_perm_t) right) == -1) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        Permset_mask_note(self);
+        return NULL;
+    }
+    if(Permset_mask_note(self) == -1)
+        return NULL;
 
     /* Return the result */
     Py_INCREF(Py_None);
@@ -1250,19 +2344,156 @@ static PyObject* Permset_test(PyObject* obj, PyObject* args) {
     }
 }
 
-#endif
+/* The integer view of the permset: all the rights at once, as a
+   combination of ACL_READ, ACL_WRITE and ACL_EXECUTE */
+static PyObject* Permset_int(PyObject *obj) {
+    Permset_Object *self = (Permset_Object*) obj;
+    int bits;
 
-static char __ACL_Type_doc__[] =
-    "Type which represents a POSIX ACL\n"
-    "\n"
-    ".. note:: only one keyword parameter should be provided\n"
-    "\n"
-    ":param string file: creates an ACL representing\n"
-    "    the access ACL of the specified file\n"
-    ":param string filedef: creates an ACL representing\n"
-    "    the default ACL of the given directory\n"
-    ":param int fd: creates an ACL representing\n"
-    "    the access ACL of the given file descriptor\n"
+    if((bits = permset_get_bits(self->permset)) == -1)
+        return PyErr_SetFromErrno(PyExc_IOError);
+    return PyInt_FromLong(bits);
+}
+
+static PyObject* Permset_get_perms(PyObject *obj, void* arg) {
+    return Permset_int(obj);
+}
+
+static int Permset_set_perms(PyObject* obj, PyObject* value, void* arg) {
+    Permset_Object *self = (Permset_Object*) obj;
+    long bits;
+
+    if(value == NULL) {
+        PyErr_SetString(PyExc_TypeError,
+                        "perms deletion is not supported");
+        return -1;
+    }
+    bits = PyInt_AsLong(value);
+    if(bits == -1 && PyErr_Occurred())
+        return -1;
+    if(bits & ~(long)(ACL_READ | ACL_WRITE | ACL_EXECUTE)) {
+        PyErr_SetString(PyExc_ValueError, "invalid permissions");
+        return -1;
+    }
+    Permset_mask_forget(self);
+    if(permset_set_bits(self->permset, bits) == -1) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        Permset_mask_note(self);
+        return -1;
+    }
+    return Permset_mask_note(self);
+}
+
+/* Gets new references to the integer values of two operands, each a
+   Permset or an integer; returns 1, 0 if an operand is of another
+   type, or -1 with an exception set */
+static int Permset_operands(PyObject *o1, PyObject *o2,
+                            PyObject **a, PyObject **b) {
+    PyObject *o[2] = { o1, o2 }, *v[2] = { NULL, NULL };
+    int i;
+
+    for(i = 0; i < 2; i++) {
+        if(PyObject_IsInstance(o[i], (PyObject*)&Permset_Type)) {
+            if((v[i] = Permset_int(o[i])) == NULL)
+                break;
+        } else if(PyInt_Check(o[i]) || PyLong_Check(o[i])) {
+            Py_INCREF(o[i]);
+            v[i] = o[i];
+        } else {
+            break;
+        }
+    }
+    if(i < 2) {
+        Py_XDECREF(v[0]);
+        return PyErr_Occurred() ? -1 : 0;
+    }
+    *a = v[0];
+    *b = v[1];
+    return 1;
+}
+
+/* Applies a binary operation to the integer values of the operands */
+static PyObject* Permset_binop(PyObject *o1, PyObject *o2,
+                               PyObject* (*op)(PyObject*, PyObject*)) {
+    PyObject *a, *b, *ret;
+    int nret;
+
+    if((nret = Permset_operands(o1, o2, &a, &b)) <= 0) {
+        if(nret == -1)
+            return NULL;
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
+    }
+    ret = op(a, b);
+    Py_DECREF(a);
+    Py_DECREF(b);
+    return ret;
+}
+
+static PyObject* Permset_or(PyObject *o1, PyObject *o2) {
+    return Permset_binop(o1, o2, PyNumber_Or);
+}
+
+static PyObject* Permset_and(PyObject *o1, PyObject *o2) {
+    return Permset_binop(o1, o2, PyNumber_And);
+}
+
+/* Permsets compare as their integer values */
+static PyObject* Permset_richcompare(PyObject *o1, PyObject *o2, int op) {
+    PyObject *a, *b, *ret;
+    int nret;
+
+    if((nret = Permset_operands(o1, o2, &a, &b)) <= 0) {
+        if(nret == -1)
+            return NULL;
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
+    }
+    ret = PyObject_RichCompare(a, b, op);
+    Py_DECREF(a);
+    Py_DECREF(b);
+    return ret;
+}
+
+static PyNumberMethods Permset_as_number = {
+    0,                  /* nb_add */
+    0,                  /* nb_subtract */
+    0,                  /* nb_multiply */
+#ifndef IS_PY3K
+    0,                  /* nb_divide */
+#endif
+    0,                  /* nb_remainder */
+    0,                  /* nb_divmod */
+    0,                  /* nb_power */
+    0,                  /* nb_negative */
+    0,                  /* nb_positive */
+    0,                  /* nb_absolute */
+    0,                  /* nb_bool */
+    0,                  /* nb_invert */
+    0,                  /* nb_lshift */
+    0,                  /* nb_rshift */
+    Permset_and,        /* nb_and */
+    0,                  /* nb_xor */
+    Permset_or,         /* nb_or */
+#ifndef IS_PY3K
+    0,                  /* nb_coerce */
+#endif
+    Permset_int,        /* nb_int */
+};
+
+#endif
+
+static char __ACL_Type_doc__[] =
+    "Type which represents a POSIX ACL\n"
+    "\n"
+    ".. note:: only one keyword parameter should be provided\n"
+    "\n"
+    ":param string file: creates an ACL representing\n"
+    "    the access ACL of the specified file\n"
+    ":param string filedef: creates an ACL representing\n"
+    "    the default ACL of the given directory\n"
+    ":param int fd: creates an ACL representing\n"
+    "    the access ACL of the given file descriptor\n"
     ":param string text: creates an ACL from a \n"
     "    textual description\n"
     ":param ACL acl: creates a copy of an existing ACL instance\n"
@@ -1274,18 +2505,155 @@ static char __ACL_Type_doc__[] =
     "makes sense only when your OS supports ACL modification\n"
     "(i.e. it implements full POSIX.1e support), otherwise the ACL won't\n"
     "be useful.\n"
+    "\n"
+    "On Linux, ACLs can be combined per principal with the ``|``\n"
+    "(union), ``&`` (intersection) and ``-`` (difference) operators,\n"
+    "which work on the effective permissions and compute the mask of\n"
+    "the result:\n"
+    "\n"
+    "  >>> base = posix1e.ACL(text=\"u::rw,g::r,o::-\")\n"
+    "  >>> print(base | posix1e.ACL(text=\"u::r,g::-,o::-,u:1000:rw\"))\n"
+    "\n"
+    "With level 2 support, an ACL is also a sequence of its entries:\n"
+    "``len(acl)``, ``acl[i]`` and ``acl[i:j]`` work without iterating,\n"
+    "and ``(tag, qualifier) in acl`` (e.g. ``(ACL_USER, 1000) in acl``)\n"
+    "looks the entry up in the index used by :py:meth:`find`.\n"
+    ;
+
+#ifdef HAVE_LINUX_KERNEL
+static char __ACL_redundant_doc__[] =
+    "Return the entries of the ACL that have no effect.\n"
+    "\n"
+    "An entry has no effect when removing it changes the access of no\n"
+    "process, whatever its user and groups. The reasons are:\n"
+    "\n"
+    "- ``'duplicate'``: an earlier entry has the same qualifier\n"
+    "- ``'masked'``: a named entry granting nothing once masked, where\n"
+    "  the entries applying in its absence grant nothing either\n"
+    "- ``'shadowed'``: a named entry granting what the entries\n"
+    "  applying in its absence grant\n"
+    "- ``'unneeded'``: the mask, when no named entry is left\n"
+    "\n"
+    "All of them can be removed together; see :py:meth:`minimize`.\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":return: a list of (tag, qualifier, permissions, reason) tuples,\n"
+    "    the qualifier being None for the entries without one\n"
+    ":rtype: list\n"
+    ;
+
+static char __ACL_minimize_doc__[] =
+    "Return an equivalent ACL without the entries that have no effect.\n"
+    "\n"
+    "The entries listed by :py:meth:`redundant` are removed; if the\n"
+    "mask goes, the owning group entry gets the permissions it was\n"
+    "effectively granting. The ACL is left unchanged.\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":rtype: ACL\n"
+    ;
+
+static char __ACL_modify_doc__[] =
+    "modify(ops[, calc_mask=True])\n"
+    "Apply a batch of modifications to the ACL, as :command:`setfacl`\n"
+    "does with its ``-m`` and ``-x`` options.\n"
+    "\n"
+    "The operations are either a string of entries separated by commas\n"
+    "or white space, ``tag:qualifier:perms`` to set the permissions of\n"
+    "an entry (creating it if needed) and ``tag:qualifier`` to remove\n"
+    "it, or a sequence of (tag, qualifier, perms) tuples, with perms\n"
+    "None to remove the entry. Later operations on an entry override\n"
+    "earlier ones. Unless disabled or an operation is on the mask, the\n"
+    "mask is then recomputed once, and added if needed.\n"
+    "\n"
+    "Either all the operations are applied or, if the resulting ACL\n"
+    "would not be valid, none; the entries kept are updated in place.\n"
+    "If entries are deleted, though, the :py:class:`Entry` objects\n"
+    "obtained from the ACL before are detached, as by :py:meth:`load`.\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param ops: the operations, e.g. ``\"u:1001:rwx,g:42,o::r\"``\n"
+    ":param bool calc_mask: whether to recompute the mask\n"
+    ":raises ValueError: for invalid entries, or an invalid result\n"
+    ;
+
+static char __ACL_load_doc__[] =
+    "load(source[, type=ACL_TYPE_ACCESS])\n"
+    "Replace the entries of the ACL with the ACL of a file.\n"
+    "\n"
+    "This is the same as creating a new ACL with ``file=`` (or\n"
+    "``filedef=``), but reuses the object and its storage, so that\n"
+    "a loop over many files doesn't allocate anything once warmed up.\n"
+    "Symbolic links are followed. A missing access ACL is made from\n"
+    "the file mode, and a missing default ACL gives an empty one.\n"
+    "\n"
+    "The :py:class:`Entry` objects obtained from the ACL before (e.g.\n"
+    "by iterating over it) are not changed: they keep the previous\n"
+    "entries, detached from the ACL, and the new entries get storage\n"
+    "of their own.\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param source: a path or an open file descriptor\n"
+    ":param int type: :py:data:`ACL_TYPE_ACCESS` or\n"
+    "    :py:data:`ACL_TYPE_DEFAULT`\n"
+    ;
+
+static char __ACL_load_from_bytes_doc__[] =
+    "load_from_bytes(data)\n"
+    "Replace the entries of the ACL with those of an xattr blob.\n"
+    "\n"
+    "The blob is in the format of the ``system.posix_acl_access``\n"
+    "extended attribute, as used by :py:func:`pax_decode` with\n"
+    "``raw=True``. The object and its storage are reused, as for\n"
+    ":py:meth:`load`.\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param bytes data: the blob\n"
+    ;
+
+static char __ACL_load_from_text_doc__[] =
+    "load_from_text(text)\n"
+    "Replace the entries of the ACL with those of a text form.\n"
+    "\n"
+    "The text is parsed as with ``ACL(text=...)``; the object is\n"
+    "reused, and so are its entries where possible.\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param string text: the ACL, in any form accepted by\n"
+    "    :manpage:`acl_from_text(3)`\n"
     ;
+#endif
 
 /* ACL type methods */
 static PyMethodDef ACL_methods[] = {
     {"applyto", ACL_applyto, METH_VARARGS, __applyto_doc__},
     {"valid", ACL_valid, METH_NOARGS, __valid_doc__},
+    {"__copy__", ACL_copy, METH_NOARGS, __ACL_copy_doc__},
+    {"__deepcopy__", ACL_deepcopy, METH_VARARGS, __ACL_copy_doc__},
 #ifdef HAVE_LINUX
     {"to_any_text", (PyCFunction)ACL_to_any_text, METH_VARARGS | METH_KEYWORDS,
      __to_any_text_doc__},
     {"check", ACL_check, METH_NOARGS, __check_doc__},
     {"equiv_mode", ACL_equiv_mode, METH_NOARGS, __equiv_mode_doc__},
 #endif
+#ifdef HAVE_LINUX_KERNEL
+    {"redundant", ACL_redundant, METH_NOARGS, __ACL_redundant_doc__},
+    {"minimize", ACL_minimize, METH_NOARGS, __ACL_minimize_doc__},
+    {"modify", (PyCFunction)ACL_modify, METH_VARARGS | METH_KEYWORDS,
+     __ACL_modify_doc__},
+    {"load", (PyCFunction)ACL_load, METH_VARARGS | METH_KEYWORDS,
+     __ACL_load_doc__},
+    {"load_from_bytes", ACL_load_from_bytes, METH_VARARGS,
+     __ACL_load_from_bytes_doc__},
+    {"load_from_text", ACL_load_from_text, METH_VARARGS,
+     __ACL_load_from_text_doc__},
+#endif
 #ifdef HAVE_ACL_COPYEXT
     {"__getstate__", ACL_get_state, METH_NOARGS,
      "Dumps the ACL to an external format."},
@@ -1296,10 +2664,36 @@ static PyMethodDef ACL_methods[] = {
     {"delete_entry", ACL_delete_entry, METH_VARARGS, __ACL_delete_entry_doc__},
     {"calc_mask", ACL_calc_mask, METH_NOARGS, __ACL_calc_mask_doc__},
     {"append", ACL_append, METH_VARARGS, __ACL_append_doc__},
+    {"find", ACL_find, METH_VARARGS, __ACL_find_doc__},
+    {"set_perms", ACL_set_perms, METH_VARARGS, __ACL_set_perms_doc__},
 #endif
     {NULL, NULL, 0, NULL}
 };
 
+#ifdef HAVE_LEVEL2
+static char __ACL_auto_mask_doc__[] =
+    "Whether the mask is kept up to date automatically.\n"
+    "\n"
+    "While set, the permissions of the :py:data:`ACL_MASK` entry are\n"
+    "kept equal to the union of those of the :py:data:`ACL_GROUP_OBJ`,\n"
+    ":py:data:`ACL_USER` and :py:data:`ACL_GROUP` entries, and the mask\n"
+    "is added (at the end) once there are named entries. Unlike with\n"
+    ":py:meth:`calc_mask`, each change to an entry (made through this\n"
+    "ACL, its entries or their permission sets) adjusts the mask in\n"
+    "constant time, and the other entries keep their order.\n"
+    "\n"
+    "Setting it computes the mask at once. It is not set by default.\n"
+    ;
+
+static PyGetSetDef ACL_getsets[] = {
+    {"auto_mask", ACL_get_auto_mask, ACL_set_auto_mask,
+     __ACL_auto_mask_doc__},
+#ifdef HAVE_LINUX_KERNEL
+    {"_load_buffers", ACL_get_load_buffers, NULL, NULL},
+#endif
+    {NULL}
+};
+#endif
 
 /* The definition of the ACL Type */
 static PyTypeObject ACL_Type = {
@@ -1318,9 +2712,18 @@ static PyTypeObject ACL_Type = {
     0,                  /* tp_setattr */
     ACL_nocmp,          /* tp_compare */
     0,                  /* tp_repr */
+#ifdef HAVE_LINUX_KERNEL
+    &ACL_as_number,     /* tp_as_number */
+#else
     0,                  /* tp_as_number */
+#endif
+#ifdef HAVE_LEVEL2
+    &ACL_as_sequence,   /* tp_as_sequence */
+    &ACL_as_mapping,    /* tp_as_mapping */
+#else
     0,                  /* tp_as_sequence */
     0,                  /* tp_as_mapping */
+#endif
     0,                  /* tp_hash */
     0,                  /* tp_call */
     ACL_str,            /* tp_str */
@@ -1346,7 +2749,11 @@ static PyTypeObject ACL_Type = {
 #endif
     ACL_methods,        /* tp_methods */
     0,                  /* tp_members */
+#ifdef HAVE_LEVEL2
+    ACL_getsets,        /* tp_getset */
+#else
     0,                  /* tp_getset */
+#endif
     0,                  /* tp_base */
     0,                  /* tp_dict */
     0,                  /* tp_descr_get */
@@ -1413,6 +2820,8 @@ static char __Entry_Type_doc__[] =
     "\n"
     "  >>> e = posix1e.Entry(myACL) # this creates a new entry in the ACL\n"
     "  >>> e = myACL.append() # another way for doing the same thing\n"
+    "  >>> e = posix1e.Entry(myACL, posix1e.ACL_USER, 1000,\n"
+    "  ...                   posix1e.ACL_READ | posix1e.ACL_WRITE)\n"
     "\n"
     "or by:\n"
     "\n"
@@ -1499,6 +2908,16 @@ static char __Permset_read_doc__[] =
     "permission defined by your platform.\n"
     ;
 
+static char __Permset_perms_doc__[] =
+    "All the permissions, as an integer\n"
+    "\n"
+    "The combination of :py:data:`ACL_READ`, :py:data:`ACL_WRITE` and\n"
+    ":py:data:`ACL_EXECUTE` in the permission set, read or written at\n"
+    "once. This is also what ``int(permset)`` returns, and what the\n"
+    "``|`` and ``&`` operators and the comparisons work on, so that\n"
+    "e.g. ``permset == ACL_READ | ACL_WRITE`` holds for ``rw-``.\n"
+    ;
+
 static char __Permset_write_doc__[] =
     "Write permission property\n"
     "\n"
@@ -1517,6 +2936,8 @@ static PyGetSetDef Permset_getsets[] = {
      __Permset_read_doc__, &holder_ACL_READ},
     {"write", Permset_get_right, Permset_set_right,
      __Permset_write_doc__, &holder_ACL_WRITE},
+    {"perms", Permset_get_perms, Permset_set_perms,
+     __Permset_perms_doc__, NULL},
     {NULL}
 };
 
@@ -1533,6 +2954,13 @@ static char __Permset_Type_doc__[] =
     "Note that the Permset keeps a reference to its Entry, so even if \n"
     "you delete the entry, it won't be cleaned up and will continue to \n"
     "exist until its Permset will be deleted.\n"
+    "\n"
+    "A Permset also behaves as the integer of its :py:attr:`perms`:\n"
+    "\n"
+    ">>> perms == posix1e.ACL_READ | posix1e.ACL_EXECUTE\n"
+    "\n"
+    "As equality is by value, and the value can change, Permsets are\n"
+    "not hashable; use their :py:attr:`perms` as keys instead.\n"
     ;
 
 /* The definition of the Permset Type */
@@ -1552,20 +2980,24 @@ static PyTypeObject Permset_Type = {
     0,                  /* tp_setattr */
     0,                  /* tp_compare */
     0,                  /* tp_repr */
-    0,                  /* tp_as_number */
+    &Permset_as_number, /* tp_as_number */
     0,                  /* tp_as_sequence */
     0,                  /* tp_as_mapping */
-    0,                  /* tp_hash */
+    PyObject_HashNotImplemented, /* tp_hash */
     0,                  /* tp_call */
     Permset_str,        /* tp_str */
     0,                  /* tp_getattro */
     0,                  /* tp_setattro */
     0,                  /* tp_as_buffer */
+#ifdef IS_PY3K
     Py_TPFLAGS_DEFAULT, /* tp_flags */
+#else
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_CHECKTYPES, /* tp_flags */
+#endif
     __Permset_Type_doc__,/* tp_doc */
     0,                  /* tp_traverse */
     0,                  /* tp_clear */
-    0,                  /* tp_richcompare */
+    Permset_richcompare,/* tp_richcompare */
     0,                  /* tp_weaklistoffset */
     0,                  /* tp_iter */
     0,                  /* tp_iternext */
@@ -1584,124 +3016,10509 @@ static PyTypeObject Permset_Type = {
 
 #endif
 
-/* Module methods */
+#ifdef HAVE_LINUX_KERNEL
 
-static char __deletedef_doc__[] =
-    "delete_default(path)\n"
-    "Delete the default ACL from a directory.\n"
-    "\n"
-    "This function deletes the default ACL associated with\n"
-    "a directory (the ACL which will be ANDed with the mode\n"
-    "parameter to the open, creat functions).\n"
-    "\n"
-    ":param string path: the directory whose default ACL should be deleted\n"
-    ;
+/***** Raw ACL records *****/
 
-/* Deletes the default ACL from a directory */
-static PyObject* aclmodule_delete_default(PyObject* obj, PyObject* args) {
-    char *filename;
+/* The kernel stores POSIX ACLs in the system.posix_acl_access and
+   system.posix_acl_default extended attributes, as a version header
+   followed by (tag, perm, id) triples, little endian and sorted by
+   tag and then by id. The tree-level functions work directly on this
+   layout: it is what getxattr returns, it is canonical (equal ACLs
+   have equal bytes) and it doesn't need any libacl allocation. On
+   Linux, the tag and permission values are the same as the libacl
+   ones.
+*/
+#define ACL_EA_ACCESS "system.posix_acl_access"
+#define ACL_EA_DEFAULT "system.posix_acl_default"
+#define ACL_EA_VERSION 0x0002
+#define ACL_EA_HEADER 4
+#define ACL_EA_ENTRY 8
+#define ACL_EA_NOID ((uint32_t)-1)
 
-    /* Parse the arguments */
-    if (!PyArg_ParseTuple(args, "et", NULL, &filename))
-        return NULL;
+#ifdef IS_PY3K
+#define MyPath_FromStringAndSize PyUnicode_DecodeFSDefaultAndSize
+#else
+#define MyPath_FromStringAndSize PyBytes_FromStringAndSize
+#endif
 
-    if(acl_delete_def_file(filename) == -1) {
-        return PyErr_SetFromErrno(PyExc_IOError);
+typedef struct {
+    int tag;
+    unsigned int perm;
+    uint32_t id;
+} entry_rec;
+
+/* A growable byte buffer; allocated with malloc so that it can be
+   used with the GIL released. */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t size;
+} membuf;
+
+static int membuf_reserve(membuf *b, size_t extra) {
+    size_t nsize;
+    char *p;
+
+    if(b->len + extra <= b->size)
+        return 0;
+    nsize = b->size ? b->size : 4096;
+    while(nsize < b->len + extra)
+        nsize *= 2;
+    if((p = realloc(b->data, nsize)) == NULL) {
+        errno = ENOMEM;
+        return -1;
     }
+    b->data = p;
+    b->size = nsize;
+    return 0;
+}
 
-    /* Return the result */
-    Py_INCREF(Py_None);
-    return Py_None;
+static int membuf_append(membuf *b, const void *data, size_t len) {
+    if(membuf_reserve(b, len) == -1)
+        return -1;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
 }
 
-#ifdef HAVE_LINUX
-static char __has_extended_doc__[] =
-    "has_extended(item)\n"
-    "Check if a file or file handle has an extended ACL.\n"
-    "\n"
-    ":param item: either a file name or a file-like object or an integer;\n"
-    "  it represents the file-system object on which to act\n"
-    ;
+static void membuf_free(membuf *b) {
+    free(b->data);
+    b->data = NULL;
+    b->len = b->size = 0;
+}
 
-/* Check for extended ACL a file or fd */
-static PyObject* aclmodule_has_extended(PyObject* obj, PyObject* args) {
-    PyObject *myarg;
-    int nret;
-    int fd;
+/* 64-bit FNV-1a, used for hashing ACL blobs */
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
 
-    if (!PyArg_ParseTuple(args, "O", &myarg))
-        return NULL;
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
 
-    if(PyBytes_Check(myarg)) {
-        const char *filename = PyBytes_AS_STRING(myarg);
-        nret = acl_extended_file(filename);
-    } else if (PyUnicode_Check(myarg)) {
-        PyObject *o =
-            PyUnicode_AsEncodedString(myarg,
-                                      Py_FileSystemDefaultEncoding, "strict");
-        if (o == NULL)
-            return NULL;
-        const char *filename = PyBytes_AS_STRING(o);
-        nret = acl_extended_file(filename);
-        Py_DECREF(o);
-    } else if((fd = PyObject_AsFileDescriptor(myarg)) != -1) {
-        nret = acl_extended_fd(fd);
-    } else {
-        PyErr_SetString(PyExc_TypeError, "argument 1 must be string, int,"
-                        " or file-like object");
-        return 0;
+    while(len--) {
+        h ^= *p++;
+        h *= FNV_PRIME;
     }
-    if(nret == -1) {
-        return PyErr_SetFromErrno(PyExc_IOError);
+    return h;
+}
+
+static int entry_rec_cmp(const void *a, const void *b) {
+    const entry_rec *ra = a, *rb = b;
+
+    if(ra->tag != rb->tag)
+        return ra->tag < rb->tag ? -1 : 1;
+    if(ra->id != rb->id)
+        return ra->id < rb->id ? -1 : 1;
+    return 0;
+}
+
+/* Returns the number of entries in an ACL blob, or -1 (with errno
+   set to EINVAL) if the blob is malformed */
+static int blob_count(const char *blob, size_t len) {
+    uint32_t version;
+
+    if(len < ACL_EA_HEADER || (len - ACL_EA_HEADER) % ACL_EA_ENTRY != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(&version, blob, sizeof(version));
+    if(le32toh(version) != ACL_EA_VERSION) {
+        errno = EINVAL;
+        return -1;
     }
+    return (len - ACL_EA_HEADER) / ACL_EA_ENTRY;
+}
 
-    /* Return the result */
-    return PyBool_FromLong(nret);
+static void blob_get(const char *blob, int idx, entry_rec *rec) {
+    const char *p = blob + ACL_EA_HEADER + idx * ACL_EA_ENTRY;
+    uint16_t tag, perm;
+    uint32_t id;
+
+    memcpy(&tag, p, 2);
+    memcpy(&perm, p + 2, 2);
+    memcpy(&id, p + 4, 4);
+    rec->tag = le16toh(tag);
+    rec->perm = le16toh(perm);
+    rec->id = le32toh(id);
 }
-#endif
 
-/* The module methods */
-static PyMethodDef aclmodule_methods[] = {
-    {"delete_default", aclmodule_delete_default, METH_VARARGS,
-     __deletedef_doc__},
-#ifdef HAVE_LINUX
-    {"has_extended", aclmodule_has_extended, METH_VARARGS,
-     __has_extended_doc__},
-#endif
-    {NULL, NULL, 0, NULL}
-};
+/* Sorts the records in place and appends them as a blob to out */
+static int recs_to_blob(entry_rec *recs, int count, membuf *out) {
+    char *p;
+    uint32_t version = htole32(ACL_EA_VERSION);
+    uint16_t tag, perm;
+    uint32_t id;
+    int i;
 
-static char __posix1e_doc__[] =
-    "POSIX.1e ACLs manipulation\n"
-    "==========================\n"
-    "\n"
-    "This module provides support for manipulating POSIX.1e ACLS\n"
-    "\n"
-    "Depending on the operating system support for POSIX.1e, \n"
-    "the ACL type will have more or less capabilities:\n\n"
-    "  - level 1, only basic support, you can create\n"
-    "    ACLs from files and text descriptions;\n"
-    "    once created, the type is immutable\n"
-    "  - level 2, complete support, you can alter\n"
-    "    the ACL once it is created\n"
-    "\n"
-    "Also, in level 2, more types are available, corresponding\n"
-    "to acl_entry_t (the Entry type), acl_permset_t (the Permset type).\n"
-    "\n"
-    "The existence of level 2 support and other extensions can be\n"
-    "checked by the constants:\n\n"
-    "  - :py:data:`HAS_ACL_ENTRY` for level 2 and the Entry/Permset classes\n"
-    "  - :py:data:`HAS_ACL_FROM_MODE` for ``ACL(mode=...)`` usage\n"
-    "  - :py:data:`HAS_ACL_CHECK` for the :py:func:`ACL.check` function\n"
-    "  - :py:data:`HAS_EXTENDED_CHECK` for the module-level\n"
-    "    :py:func:`has_extended` function\n"
-    "  - :py:data:`HAS_EQUIV_MODE` for the :py:func:`ACL.equiv_mode` method\n"
-    "\n"
-    "Example:\n"
-    "\n"
-    ">>> import posix1e\n"
-    ">>> acl1 = posix1e.ACL(file=\"file.txt\") \n"
-    ">>> print acl1\n"
+    qsort(recs, count, sizeof(entry_rec), entry_rec_cmp);
+    if(membuf_reserve(out, ACL_EA_HEADER + count * ACL_EA_ENTRY) == -1)
+        return -1;
+    p = out->data + out->len;
+    memcpy(p, &version, 4);
+    p += ACL_EA_HEADER;
+    for(i = 0; i < count; i++, p += ACL_EA_ENTRY) {
+        tag = htole16(recs[i].tag);
+        perm = htole16(recs[i].perm);
+        id = htole32(recs[i].tag == ACL_USER || recs[i].tag == ACL_GROUP ?
+                     recs[i].id : ACL_EA_NOID);
+        memcpy(p, &tag, 2);
+        memcpy(p + 2, &perm, 2);
+        memcpy(p + 4, &id, 4);
+    }
+    out->len += ACL_EA_HEADER + count * ACL_EA_ENTRY;
+    return 0;
+}
+
+/* Fills recs with the three entries of the minimal ACL for mode */
+static int recs_from_mode(mode_t mode, entry_rec *recs) {
+    recs[0].tag = ACL_USER_OBJ;
+    recs[0].perm = (mode >> 6) & 7;
+    recs[1].tag = ACL_GROUP_OBJ;
+    recs[1].perm = (mode >> 3) & 7;
+    recs[2].tag = ACL_OTHER;
+    recs[2].perm = mode & 7;
+    recs[0].id = recs[1].id = recs[2].id = ACL_EA_NOID;
+    return 3;
+}
+
+/* Converts a libacl ACL to an array of records (malloc'ed, in the
+   ACL's order). Returns the number of records, or -1 with errno
+   set. */
+static int acl_get_recs(acl_t acl, entry_rec **recs) {
+    acl_entry_t entry;
+    acl_permset_t permset;
+    entry_rec *r = NULL, *nr;
+    int count = 0, alloc = 0, bits;
+    int nerr, eid = ACL_FIRST_ENTRY;
+    void *q;
+
+    while((nerr = acl_get_entry(acl, eid, &entry)) == 1) {
+        eid = ACL_NEXT_ENTRY;
+        if(count == alloc) {
+            alloc = alloc ? alloc * 2 : 8;
+            if((nr = realloc(r, alloc * sizeof(entry_rec))) == NULL) {
+                errno = ENOMEM;
+                goto err;
+            }
+            r = nr;
+        }
+        if(acl_get_tag_type(entry, &r[count].tag) == -1 ||
+           acl_get_permset(entry, &permset) == -1 ||
+           (bits = permset_get_bits(permset)) == -1)
+            goto err;
+        r[count].perm = bits;
+        r[count].id = ACL_EA_NOID;
+        if(r[count].tag == ACL_USER || r[count].tag == ACL_GROUP) {
+            if((q = acl_get_qualifier(entry)) == NULL)
+                goto err;
+            r[count].id = *(id_t*)q;
+            acl_free(q);
+        }
+        count++;
+    }
+    if(nerr == -1)
+        goto err;
+    *recs = r;
+    return count;
+
+ err:
+    free(r);
+    return -1;
+}
+
+/* Builds a libacl ACL out of an array of records */
+static acl_t acl_from_recs(const entry_rec *recs, int count) {
+    acl_t acl;
+    acl_entry_t entry;
+    acl_permset_t permset;
+    id_t id;
+    int i;
+
+    if((acl = acl_init(count)) == NULL)
+        return NULL;
+    for(i = 0; i < count; i++) {
+        if(acl_create_entry(&acl, &entry) == -1 ||
+           acl_set_tag_type(entry, recs[i].tag) == -1 ||
+           acl_get_permset(entry, &permset) == -1 ||
+           acl_clear_perms(permset) == -1)
+            goto err;
+        if(((recs[i].perm & ACL_READ) &&
+            acl_add_perm(permset, ACL_READ) == -1) ||
+           ((recs[i].perm & ACL_WRITE) &&
+            acl_add_perm(permset, ACL_WRITE) == -1) ||
+           ((recs[i].perm & ACL_EXECUTE) &&
+            acl_add_perm(permset, ACL_EXECUTE) == -1) ||
+           acl_set_permset(entry, permset) == -1)
+            goto err;
+        if(recs[i].tag == ACL_USER || recs[i].tag == ACL_GROUP) {
+            id = recs[i].id;
+            if(acl_set_qualifier(entry, &id) == -1)
+                goto err;
+        }
+    }
+    return acl;
+
+ err:
+    acl_free(acl);
+    return NULL;
+}
+
+static acl_t acl_from_blob(const char *blob, size_t len) {
+    entry_rec *recs;
+    acl_t acl;
+    int count, i;
+
+    if((count = blob_count(blob, len)) == -1)
+        return NULL;
+    if((recs = malloc((count + 1) * sizeof(entry_rec))) == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    for(i = 0; i < count; i++)
+        blob_get(blob, i, recs + i);
+    acl = acl_from_recs(recs, count);
+    free(recs);
+    return acl;
+}
+
+/* Reads the ACL of the given type of path, as a blob, into out
+   (replacing its contents). Returns 1 if an ACL was read, 0 if there
+   is none (only for default ACLs, as a missing access ACL is
+   synthesised from the mode) and -1 on error, with errno set. */
+static int read_acl_blob(const char *path, acl_type_t type, mode_t mode,
+                         membuf *out) {
+    const char *name = type == ACL_TYPE_DEFAULT ?
+        ACL_EA_DEFAULT : ACL_EA_ACCESS;
+    entry_rec recs[3];
+    ssize_t n;
+
+    out->len = 0;
+    if(membuf_reserve(out, 256) == -1)
+        return -1;
+    while((n = lgetxattr(path, name, out->data, out->size)) == -1) {
+        if(errno == ERANGE) {
+            if((n = lgetxattr(path, name, NULL, 0)) == -1)
+                return -1;
+            if(membuf_reserve(out, n) == -1)
+                return -1;
+            continue;
+        }
+        if(errno != ENODATA && errno != ENOTSUP)
+            return -1;
+        if(type == ACL_TYPE_DEFAULT)
+            return 0;
+        return recs_to_blob(recs, recs_from_mode(mode, recs), out) == -1 ?
+            -1 : 1;
+    }
+    if(n == 0 && type == ACL_TYPE_DEFAULT)
+        return 0;
+    if(blob_count(out->data, n) == -1)
+        return -1;
+    out->len = n;
+    return 1;
+}
+
+/* Appends the ACL as a sorted xattr blob to out, through the memo;
+   returns 0, or -1 with errno set */
+static int ACL_get_blob(ACL_Object *self, membuf *out) {
+    acl_memo *m = ACL_memo(self);
+    membuf blob = { NULL, 0, 0 };
+    entry_rec *recs = NULL;
+    int count, nret;
+
+    if(m->blob == NULL) {
+        if((count = acl_get_recs(self->acl, &recs)) == -1)
+            return -1;
+        nret = recs_to_blob(recs, count, &blob);
+        free(recs);
+        if(nret == -1)
+            return -1;
+        m->blob = blob.data;
+        m->blob_len = blob.len;
+    }
+    return membuf_append(out, m->blob, m->blob_len);
+}
+
+/* Wraps a libacl ACL in a new ACL object, taking ownership of it */
+static PyObject* ACL_wrap(acl_t acl) {
+    PyObject *obj = ACL_new(&ACL_Type, NULL, NULL);
+
+    if(obj == NULL) {
+        acl_free(acl);
+        return NULL;
+    }
+    ((ACL_Object*)obj)->acl = acl;
+    return obj;
+}
+
+static PyObject* ACL_from_blob(const char *blob, size_t len) {
+    acl_t acl;
+
+    if((acl = acl_from_blob(blob, len)) == NULL)
+        return PyErr_SetFromErrno(PyExc_IOError);
+    return ACL_wrap(acl);
+}
+
+/* A set of unique ACL blobs, used to deduplicate the ACLs of a
+   tree. Ids are assigned in insertion order. */
+typedef struct {
+    membuf blobs;
+    uint64_t *offs;
+    uint32_t *lens;
+    uint64_t *hashes;
+    size_t count;
+    size_t alloc;
+    uint32_t *slots;  /* 0 is empty, otherwise id + 1 */
+    size_t nslots;
+} blob_table;
+
+static int blob_table_grow(blob_table *t) {
+    size_t alloc = t->alloc ? t->alloc * 2 : 64;
+    size_t nslots = alloc * 2, i, j;
+    uint64_t *offs, *hashes;
+    uint32_t *lens, *slots;
+
+    if((offs = realloc(t->offs, alloc * sizeof(*offs))) == NULL)
+        goto nomem;
+    t->offs = offs;
+    if((lens = realloc(t->lens, alloc * sizeof(*lens))) == NULL)
+        goto nomem;
+    t->lens = lens;
+    if((hashes = realloc(t->hashes, alloc * sizeof(*hashes))) == NULL)
+        goto nomem;
+    t->hashes = hashes;
+    if((slots = calloc(nslots, sizeof(*slots))) == NULL)
+        goto nomem;
+    for(i = 0; i < t->count; i++) {
+        for(j = t->hashes[i] % nslots; slots[j] != 0; j = (j + 1) % nslots)
+            ;
+        slots[j] = i + 1;
+    }
+    free(t->slots);
+    t->slots = slots;
+    t->nslots = nslots;
+    t->alloc = alloc;
+    return 0;
+
+ nomem:
+    errno = ENOMEM;
+    return -1;
+}
+
+/* Returns the id of the blob, adding it if not yet present, or -1 on
+   error */
+static int64_t blob_table_add(blob_table *t, const char *blob, size_t len) {
+    uint64_t h = fnv1a(FNV_OFFSET, blob, len);
+    size_t j = 0;
+    uint32_t id;
+
+    if(t->nslots != 0) {
+        for(j = h % t->nslots; t->slots[j] != 0; j = (j + 1) % t->nslots) {
+            id = t->slots[j] - 1;
+            if(t->hashes[id] == h && t->lens[id] == len &&
+               memcmp(t->blobs.data + t->offs[id], blob, len) == 0)
+                return id;
+        }
+    }
+    if(t->count == t->alloc) {
+        if(blob_table_grow(t) == -1)
+            return -1;
+        for(j = h % t->nslots; t->slots[j] != 0; j = (j + 1) % t->nslots)
+            ;
+    }
+    if(membuf_append(&t->blobs, blob, len) == -1)
+        return -1;
+    id = t->count++;
+    t->offs[id] = t->blobs.len - len;
+    t->lens[id] = len;
+    t->hashes[id] = h;
+    t->slots[j] = id + 1;
+    return id;
+}
+
+static void blob_table_free(blob_table *t) {
+    membuf_free(&t->blobs);
+    free(t->offs);
+    free(t->lens);
+    free(t->hashes);
+    free(t->slots);
+    memset(t, 0, sizeof(*t));
+}
+
+/* Per-path errors collected during tree operations */
+typedef struct {
+    membuf paths;   /* NUL-terminated paths */
+    size_t *offs;
+    int *errnos;
+    size_t count;
+    size_t alloc;
+} err_list;
+
+static int err_list_add(err_list *l, const char *path, int err) {
+    size_t alloc, *offs;
+    int *errnos;
+
+    if(l->count == l->alloc) {
+        alloc = l->alloc ? l->alloc * 2 : 16;
+        if((offs = realloc(l->offs, alloc * sizeof(*offs))) == NULL)
+            goto nomem;
+        l->offs = offs;
+        if((errnos = realloc(l->errnos, alloc * sizeof(*errnos))) == NULL)
+            goto nomem;
+        l->errnos = errnos;
+        l->alloc = alloc;
+    }
+    l->offs[l->count] = l->paths.len;
+    if(membuf_append(&l->paths, path, strlen(path) + 1) == -1)
+        return -1;
+    l->errnos[l->count++] = err;
+    return 0;
+
+ nomem:
+    errno = ENOMEM;
+    return -1;
+}
+
+static void err_list_free(err_list *l) {
+    membuf_free(&l->paths);
+    free(l->offs);
+    free(l->errnos);
+    memset(l, 0, sizeof(*l));
+}
+
+/* Converts the error list to a list of (path, errno, message) tuples */
+static PyObject* err_list_to_list(err_list *l) {
+    PyObject *ret, *item, *path;
+    size_t i;
+
+    if((ret = PyList_New(l->count)) == NULL)
+        return NULL;
+    for(i = 0; i < l->count; i++) {
+        const char *p = l->paths.data + l->offs[i];
+        if((path = MyPath_FromStringAndSize(p, strlen(p))) == NULL)
+            goto err;
+        item = Py_BuildValue("(Nis)", path, l->errnos[i],
+                             strerror(l->errnos[i]));
+        if(item == NULL)
+            goto err;
+        PyList_SET_ITEM(ret, i, item);
+    }
+    return ret;
+
+ err:
+    Py_DECREF(ret);
+    return NULL;
+}
+
+/***** Tree walker *****/
+
+/* The walker visits a tree in depth-first order, with the entries of
+   each directory sorted by name, without following symbolic links
+   and keeping only one directory open at a time. The callback gets
+   each object before its children are visited (post = 0) and, for
+   directories, once more afterwards (post = 1). Objects that can't
+   be examined are recorded in the error list and skipped; a callback
+   returning -1 (with errno set) aborts the walk.
+*/
+typedef struct {
+    const char *path;  /* usable with the file system calls */
+    const char *rel;   /* relative to the root, "." for the root */
+    const char *name;  /* last component of rel */
+    const struct stat *st;
+    int depth;
+} walk_item;
+
+typedef int (*walk_fn)(void *data, const walk_item *item, int post);
+
+typedef struct {
+    walk_fn fn;
+    void *data;
+    err_list *errors;
+    membuf path;
+    size_t rel_off;
+} walker;
+
+static int name_cmp(const void *a, const void *b) {
+    return strcmp(*(const char**)a, *(const char**)b);
+}
+
+static int walk_call(walker *w, size_t name_off, const struct stat *st,
+                     int depth, int post) {
+    walk_item item;
+
+    item.path = w->path.data;
+    item.rel = depth == 0 ? "." : w->path.data + w->rel_off;
+    item.name = depth == 0 ? "." : w->path.data + name_off;
+    item.st = st;
+    item.depth = depth;
+    return w->fn(w->data, &item, post);
+}
+
+static int walk_entry(walker *w, size_t name_off, int depth) {
+    struct stat st;
+    DIR *dir;
+    struct dirent *de;
+    membuf names = { NULL, 0, 0 };
+    char **sorted = NULL;
+    size_t count = 0, i, base, nlen, off;
+    int ret = -1;
+
+    if(lstat(w->path.data, &st) == -1)
+        return err_list_add(w->errors, depth == 0 ? "." :
+                            w->path.data + w->rel_off, errno);
+    if(walk_call(w, name_off, &st, depth, 0) == -1)
+        return -1;
+    if(!S_ISDIR(st.st_mode))
+        return 0;
+
+    if((dir = opendir(w->path.data)) == NULL) {
+        if(err_list_add(w->errors, depth == 0 ? "." :
+                        w->path.data + w->rel_off, errno) == -1)
+            return -1;
+    } else {
+        while((de = readdir(dir)) != NULL) {
+            if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+                continue;
+            if(membuf_append(&names, de->d_name, strlen(de->d_name) + 1)
+               == -1) {
+                closedir(dir);
+                goto out;
+            }
+            count++;
+        }
+        closedir(dir);
+        if(count > 0 && (sorted = malloc(count * sizeof(char*))) == NULL) {
+            errno = ENOMEM;
+            goto out;
+        }
+        for(i = 0, off = 0; i < count; i++) {
+            sorted[i] = names.data + off;
+            off += strlen(sorted[i]) + 1;
+        }
+        qsort(sorted, count, sizeof(char*), name_cmp);
+        base = w->path.len;
+        for(i = 0; i < count; i++) {
+            nlen = strlen(sorted[i]);
+            w->path.len = base - 1;
+            if(w->path.data[w->path.len - 1] != '/' &&
+               membuf_append(&w->path, "/", 1) == -1)
+                goto out;
+            off = w->path.len;
+            if(membuf_append(&w->path, sorted[i], nlen + 1) == -1)
+                goto out;
+            if(walk_entry(w, off, depth + 1) == -1)
+                goto out;
+        }
+        w->path.len = base;
+        w->path.data[base - 1] = '\0';
+    }
+    ret = walk_call(w, name_off, &st, depth, 1);
+
+ out:
+    free(sorted);
+    membuf_free(&names);
+    return ret;
+}
+
+/* Walks the tree at root; returns 0 on success (errors on individual
+   paths are only recorded) or -1 if the walk was aborted */
+static int walk_tree(const char *root, walk_fn fn, void *data,
+                     err_list *errors) {
+    walker w;
+    size_t len = strlen(root);
+    int ret;
+
+    while(len > 1 && root[len - 1] == '/')
+        len--;
+    memset(&w, 0, sizeof(w));
+    w.fn = fn;
+    w.data = data;
+    w.errors = errors;
+    if(membuf_append(&w.path, root, len) == -1 ||
+       membuf_append(&w.path, "", 1) == -1) {
+        membuf_free(&w.path);
+        return -1;
+    }
+    w.rel_off = root[len - 1] == '/' ? len : len + 1;
+    ret = walk_entry(&w, 0, 0);
+    membuf_free(&w.path);
+    return ret;
+}
+
+/***** Tree digests *****/
+
+/* Every object of a tree (except symbolic links, which have no ACLs)
+   gets a digest of its type and ACLs; the digest of a directory also
+   covers the names and digests of its entries, in the walker's
+   order. Two trees with the same digest thus hold the same ACLs,
+   and the differences between two trees can be found by descending
+   only into the directories whose digests differ.
+
+   ACLs enter the digest via their fingerprint, the FNV-1a hash of
+   their blob (0 for a missing default ACL). The digests detect
+   changes; they are not meant to resist deliberate collisions.
+*/
+
+static uint64_t digest_start(mode_t mode, uint64_t acc_fp, uint64_t def_fp) {
+    uint64_t v[3];
+
+    v[0] = htole64(mode & S_IFMT);
+    v[1] = htole64(acc_fp);
+    v[2] = htole64(def_fp);
+    return fnv1a(FNV_OFFSET, v, sizeof(v));
+}
+
+/* Adds an entry of a directory to the directory's digest */
+static uint64_t digest_add(uint64_t state, const char *name,
+                           uint64_t digest) {
+    digest = htole64(digest);
+    state = fnv1a(state, name, strlen(name) + 1);
+    return fnv1a(state, &digest, sizeof(digest));
+}
+
+/* The digests of the directories being walked, one per depth */
+typedef struct {
+    uint64_t *states;
+    int alloc;
+} digest_stack;
+
+static int digest_stack_set(digest_stack *d, int depth, uint64_t state) {
+    uint64_t *states;
+    int alloc;
+
+    if(depth >= d->alloc) {
+        alloc = d->alloc ? d->alloc * 2 : 16;
+        while(alloc <= depth)
+            alloc *= 2;
+        if((states = realloc(d->states, alloc * sizeof(*states))) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        d->states = states;
+        d->alloc = alloc;
+    }
+    d->states[depth] = state;
+    return 0;
+}
+
+/* Adds a finished object to the digest of its directory */
+static void digest_stack_feed(digest_stack *d, const walk_item *item,
+                              uint64_t digest) {
+    if(item->depth > 0)
+        d->states[item->depth - 1] =
+            digest_add(d->states[item->depth - 1], item->name, digest);
+}
+
+typedef struct {
+    digest_stack stack;
+    membuf scratch;
+    err_list *errors;
+    uint64_t digest;
+} tree_digester;
+
+static int tree_digest_visit(void *data, const walk_item *item, int post) {
+    tree_digester *td = data;
+    uint64_t acc_fp = 0, def_fp = 0, digest;
+    int r;
+
+    if(S_ISLNK(item->st->st_mode))
+        return 0;
+    if(post) {
+        digest = td->stack.states[item->depth];
+    } else {
+        if(read_acl_blob(item->path, ACL_TYPE_ACCESS, item->st->st_mode,
+                         &td->scratch) == -1) {
+            if(err_list_add(td->errors, item->rel, errno) == -1)
+                return -1;
+        } else {
+            acc_fp = fnv1a(FNV_OFFSET, td->scratch.data, td->scratch.len);
+        }
+        if(S_ISDIR(item->st->st_mode)) {
+            r = read_acl_blob(item->path, ACL_TYPE_DEFAULT, 0, &td->scratch);
+            if(r == -1 && err_list_add(td->errors, item->rel, errno) == -1)
+                return -1;
+            if(r == 1)
+                def_fp = fnv1a(FNV_OFFSET, td->scratch.data, td->scratch.len);
+            return digest_stack_set(&td->stack, item->depth,
+                                    digest_start(item->st->st_mode,
+                                                 acc_fp, def_fp));
+        }
+        digest = digest_start(item->st->st_mode, acc_fp, def_fp);
+    }
+    digest_stack_feed(&td->stack, item, digest);
+    if(item->depth == 0)
+        td->digest = digest;
+    return 0;
+}
+
+static char __tree_digest_doc__[] =
+    "tree_digest(root)\n"
+    "Compute the digest of the ACLs of a directory tree.\n"
+    "\n"
+    "The digest covers the names, types, access ACLs and default ACLs\n"
+    "of all the objects in the tree (symbolic links are ignored), so\n"
+    "two replicas of a tree can be compared by comparing their\n"
+    "digests. The digest of each path is also saved by\n"
+    ":py:func:`snapshot`; see :py:meth:`Snapshot.digest` and\n"
+    ":py:func:`diff_snapshots`.\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param string root: the directory tree\n"
+    ":return: the digest, a 64-bit integer\n"
+    ":rtype: integer\n"
+    ":raises IOError: if some object of the tree couldn't be read\n"
+    ;
+
+static PyObject* aclmodule_tree_digest(PyObject* obj, PyObject* args) {
+    char *root = NULL;
+    tree_digester td;
+    err_list errors;
+    PyObject *ret = NULL;
+    int nret;
+
+    if (!PyArg_ParseTuple(args, "et", Py_FileSystemDefaultEncoding, &root))
+        return NULL;
+    memset(&td, 0, sizeof(td));
+    memset(&errors, 0, sizeof(errors));
+    td.errors = &errors;
+    Py_BEGIN_ALLOW_THREADS
+    nret = walk_tree(root, tree_digest_visit, &td, &errors);
+    Py_END_ALLOW_THREADS
+    if(nret == -1) {
+        PyErr_SetFromErrno(PyExc_IOError);
+    } else if(errors.count > 0) {
+        errno = errors.errnos[0];
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError,
+                                       errors.paths.data + errors.offs[0]);
+    } else {
+        ret = PyLong_FromUnsignedLongLong(td.digest);
+    }
+    free(td.stack.states);
+    membuf_free(&td.scratch);
+    err_list_free(&errors);
+    PyMem_Free(root);
+    return ret;
+}
+
+/***** ACL snapshots *****/
+
+/* Snapshot file layout; all integers are little endian and all the
+   tables are 8-byte aligned, so that the file can be used in place
+   via mmap:
+
+   - the header (snap_header)
+   - the ACL table: one snap_acl per unique ACL
+   - the path table: one snap_path per path, sorted by path
+   - the inode index: one snap_ino per path, sorted by inode number
+   - the path names (NUL terminated, relative to the tree root)
+   - the ACL blobs, in the xattr format described above
+
+   Each path also records its tree digest (see above), and each ACL
+   its fingerprint.
+
+   A delta snapshot (SNAP_DELTA) only holds the paths that changed
+   since the snapshot identified by base_id, plus SNAP_DELETED records
+   for the paths that went away; it is the last link of a chain that
+   starts with a full snapshot. Directories whose digest changed count
+   as changed, so that the digests of a chain are always current.
+*/
+#define SNAP_MAGIC "PYACLSNP"
+#define SNAP_VERSION 4
+#define SNAP_NOACL ((uint32_t)-1)
+#define SNAP_DELTA 1            /* header flag */
+#define SNAP_DELETED 1          /* path flag */
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t n_acls;
+    uint64_t n_paths;
+    uint64_t acl_off;
+    uint64_t path_off;
+    uint64_t ino_off;
+    uint64_t str_off;
+    uint64_t snap_id;
+    uint64_t base_id;           /* 0 for full snapshots */
+    uint64_t n_live;            /* paths other than deletion records */
+} snap_header;
+
+typedef struct {
+    uint64_t off;
+    uint32_t len;
+    uint32_t reserved;
+    uint64_t hash;        /* the fingerprint */
+} snap_acl;
+
+typedef struct {
+    uint64_t name_off;
+    uint64_t ino;
+    int64_t ctime_sec;
+    uint32_t name_len;
+    uint32_t ctime_nsec;
+    uint32_t access_id;
+    uint32_t default_id;  /* SNAP_NOACL if none */
+    uint32_t mode;
+    uint32_t flags;
+    uint64_t digest;
+} snap_path;
+
+typedef struct {
+    uint64_t ino;
+    uint64_t path_idx;
+} snap_ino;
+
+/***** Snapshot type *****/
+
+typedef struct {
+    PyObject_HEAD
+    char *map;
+    size_t size;
+    uint64_t n_acls;
+    uint64_t n_paths;
+    uint64_t n_live;    /* paths other than deletion records */
+    const snap_acl *acls;
+    const snap_path *paths;
+    const snap_ino *inos;
+    uint32_t flags;
+    uint64_t snap_id;
+    uint64_t base_id;
+    int busy;           /* in use with the GIL released */
+} Snapshot_Object;
+
+static PyTypeObject Snapshot_Type
+  CPYCHECKER_TYPE_OBJECT_FOR_TYPEDEF("Snapshot_Object");
+
+/* Checks that [off, off + count * size) is inside the mapping */
+static int snap_range_ok(size_t map_size, uint64_t off, uint64_t count,
+                         size_t size) {
+    if(off > map_size || off % 8 != 0)
+        return 0;
+    return count <= (map_size - off) / size;
+}
+
+/* Maps a snapshot file and validates its header; returns 0 or -1
+   with errno set */
+static int snap_open(Snapshot_Object *self, const char *fname) {
+    snap_header hdr;
+    struct stat st;
+    char *map;
+    int fd;
+
+    if((fd = open(fname, O_RDONLY | O_CLOEXEC)) == -1)
+        return -1;
+    if(fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if(st.st_size < (off_t)sizeof(hdr)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return -1;
+    memcpy(&hdr, map, sizeof(hdr));
+    hdr.n_acls = le64toh(hdr.n_acls);
+    hdr.n_paths = le64toh(hdr.n_paths);
+    hdr.acl_off = le64toh(hdr.acl_off);
+    hdr.path_off = le64toh(hdr.path_off);
+    hdr.ino_off = le64toh(hdr.ino_off);
+    hdr.n_live = le64toh(hdr.n_live);
+    if(memcmp(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic)) != 0 ||
+       le32toh(hdr.version) != SNAP_VERSION ||
+       hdr.n_live > hdr.n_paths ||
+       !snap_range_ok(st.st_size, hdr.acl_off, hdr.n_acls, sizeof(snap_acl)) ||
+       !snap_range_ok(st.st_size, hdr.path_off, hdr.n_paths,
+                      sizeof(snap_path)) ||
+       !snap_range_ok(st.st_size, hdr.ino_off, hdr.n_paths,
+                      sizeof(snap_ino))) {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    self->map = map;
+    self->size = st.st_size;
+    self->n_acls = hdr.n_acls;
+    self->n_paths = hdr.n_paths;
+    self->flags = le32toh(hdr.flags);
+    self->snap_id = le64toh(hdr.snap_id);
+    self->base_id = le64toh(hdr.base_id);
+    self->acls = (const snap_acl*)(map + hdr.acl_off);
+    self->paths = (const snap_path*)(map + hdr.path_off);
+    self->inos = (const snap_ino*)(map + hdr.ino_off);
+    self->n_live = hdr.n_live;
+    return 0;
+}
+
+static void snap_close(Snapshot_Object *self) {
+    if(self->map != NULL)
+        munmap(self->map, self->size);
+    self->map = NULL;
+    self->size = 0;
+    self->n_acls = self->n_paths = self->n_live = 0;
+}
+
+/* Returns the name of the idx-th path, or NULL if it is corrupt */
+static const char* snap_path_name(const Snapshot_Object *self, uint64_t idx,
+                                  uint32_t *len) {
+    uint64_t off = le64toh(self->paths[idx].name_off);
+    uint32_t nlen = le32toh(self->paths[idx].name_len);
+
+    if(off >= self->size || nlen >= self->size - off ||
+       self->map[off + nlen] != '\0')
+        return NULL;
+    if(len != NULL)
+        *len = nlen;
+    return self->map + off;
+}
+
+/* Returns the blob of ACL id, or NULL if it is corrupt */
+static const char* snap_acl_blob(const Snapshot_Object *self, uint32_t id,
+                                 uint32_t *len) {
+    uint64_t off;
+
+    if(id >= self->n_acls)
+        return NULL;
+    off = le64toh(self->acls[id].off);
+    *len = le32toh(self->acls[id].len);
+    if(off > self->size || *len > self->size - off)
+        return NULL;
+    return self->map + off;
+}
+
+/* Returns the fingerprint of ACL id, or 0 for SNAP_NOACL */
+static uint64_t snap_acl_hash(const Snapshot_Object *self, uint32_t id) {
+    return id >= self->n_acls ? 0 : le64toh(self->acls[id].hash);
+}
+
+/* Binary search for a path; returns its index or -1. Note that the
+   record found might be a deletion one. */
+static int64_t snap_find_record(const Snapshot_Object *self,
+                                const char *path) {
+    uint64_t lo = 0, hi = self->n_paths, mid;
+    const char *name;
+    int c;
+
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if((name = snap_path_name(self, mid, NULL)) == NULL)
+            return -1;
+        c = strcmp(name, path);
+        if(c == 0)
+            return mid;
+        if(c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -1;
+}
+
+/* Normalises a path given by the user to the snapshot form */
+static const char* snap_norm_path(char *path) {
+    size_t len;
+
+    while(path[0] == '.' && path[1] == '/')
+        path += 2;
+    while(path[0] == '/')
+        path++;
+    len = strlen(path);
+    while(len > 0 && path[len - 1] == '/')
+        path[--len] = '\0';
+    return len == 0 ? "." : path;
+}
+
+static int snap_is_deleted(const Snapshot_Object *self, uint64_t idx) {
+    return (le32toh(self->paths[idx].flags) & SNAP_DELETED) != 0;
+}
+
+/* Like snap_find_record, but ignores deletion records */
+static int64_t snap_find(const Snapshot_Object *self, const char *path) {
+    int64_t idx = snap_find_record(self, path);
+
+    return idx != -1 && snap_is_deleted(self, idx) ? -1 : idx;
+}
+
+static PyObject* snap_corrupt(void) {
+    PyErr_SetString(PyExc_ValueError, "corrupt snapshot file");
+    return NULL;
+}
+
+static PyObject* snap_acl_object(const Snapshot_Object *self, uint32_t id) {
+    const char *blob;
+    uint32_t len;
+
+    if(id == SNAP_NOACL)
+        Py_RETURN_NONE;
+    if((blob = snap_acl_blob(self, id, &len)) == NULL)
+        return snap_corrupt();
+    return ACL_from_blob(blob, len);
+}
+
+static PyObject* Snapshot_new(PyTypeObject* type, PyObject* args,
+                              PyObject *keywds) {
+    PyObject* newsnap;
+
+    newsnap = type->tp_alloc(type, 0);
+    if(newsnap != NULL) {
+        ((Snapshot_Object*)newsnap)->map = NULL;
+        ((Snapshot_Object*)newsnap)->busy = 0;
+    }
+    return newsnap;
+}
+
+static int Snapshot_init(PyObject* obj, PyObject* args, PyObject *keywds) {
+    Snapshot_Object *self = (Snapshot_Object*)obj;
+    static char *kwlist[] = { "filename", NULL };
+    char *fname = NULL;
+    int nret;
+
+    if(!PyArg_ParseTupleAndKeywords(args, keywds, "et", kwlist,
+                                    Py_FileSystemDefaultEncoding, &fname))
+        return -1;
+    if(self->busy) {
+        PyErr_SetString(PyExc_ValueError, "snapshot is in use");
+        PyMem_Free(fname);
+        return -1;
+    }
+    snap_close(self);
+    nret = snap_open(self, fname);
+    if(nret == -1)
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, fname);
+    PyMem_Free(fname);
+    return nret;
+}
+
+static void Snapshot_dealloc(PyObject* obj) {
+    snap_close((Snapshot_Object*)obj);
+    PyObject_DEL(obj);
+}
+
+static Py_ssize_t Snapshot_length(PyObject *obj) {
+    return ((Snapshot_Object*)obj)->n_live;
+}
+
+static int Snapshot_contains(PyObject *obj, PyObject *key) {
+    Snapshot_Object *self = (Snapshot_Object*)obj;
+    PyObject *bytes;
+    int64_t idx;
+
+    if(PyUnicode_Check(key)) {
+        bytes = PyUnicode_AsEncodedString(key, Py_FileSystemDefaultEncoding,
+                                          "strict");
+        if(bytes == NULL)
+            return -1;
+    } else if(PyBytes_Check(key)) {
+        /* a copy, as normalizing the path writes to it */
+        bytes = PyBytes_FromStringAndSize(PyBytes_AS_STRING(key),
+                                          PyBytes_GET_SIZE(key));
+        if(bytes == NULL)
+            return -1;
+    } else {
+        return 0;
+    }
+    idx = snap_find(self, snap_norm_path(PyBytes_AS_STRING(bytes)));
+    Py_DECREF(bytes);
+    return idx != -1;
+}
+
+static char __Snapshot_lookup_doc__[] =
+    "lookup(path)\n"
+    "Return the ACLs saved for a path.\n"
+    "\n"
+    "Only the parts of the file needed to answer the query are read.\n"
+    "\n"
+    ":param string path: the path, relative to the snapshot's root\n"
+    ":return: a tuple (access ACL, default ACL); the default ACL is\n"
+    "    None if the object had no default ACL\n"
+    ":raises KeyError: if the path is not in the snapshot\n"
+    ;
+
+static PyObject* Snapshot_lookup(PyObject *obj, PyObject *args) {
+    Snapshot_Object *self = (Snapshot_Object*)obj;
+    char *path = NULL;
+    const snap_path *p;
+    PyObject *acc, *def;
+    int64_t idx;
+
+    if(!PyArg_ParseTuple(args, "et", Py_FileSystemDefaultEncoding, &path))
+        return NULL;
+    idx = snap_find(self, snap_norm_path(path));
+    PyMem_Free(path);
+    if(idx == -1) {
+        PyErr_SetObject(PyExc_KeyError, PyTuple_GET_ITEM(args, 0));
+        return NULL;
+    }
+    p = self->paths + idx;
+    if((acc = snap_acl_object(self, le32toh(p->access_id))) == NULL)
+        return NULL;
+    if((def = snap_acl_object(self, le32toh(p->default_id))) == NULL) {
+        Py_DECREF(acc);
+        return NULL;
+    }
+    return Py_BuildValue("(NN)", acc, def);
+}
+
+static char __Snapshot_lookup_inode_doc__[] =
+    "lookup_inode(ino)\n"
+    "Return the paths saved for an inode number.\n"
+    "\n"
+    ":param int ino: the inode number\n"
+    ":return: the list of paths (more than one for hard links); the\n"
+    "    list is empty if the inode is not in the snapshot\n"
+    ":rtype: list\n"
+    ;
+
+static PyObject* Snapshot_lookup_inode(PyObject *obj, PyObject *args) {
+    Snapshot_Object *self = (Snapshot_Object*)obj;
+    unsigned long long ino;
+    uint64_t lo = 0, hi = self->n_paths, mid, idx;
+    const char *name;
+    uint32_t len;
+    PyObject *ret, *path;
+
+    if(!PyArg_ParseTuple(args, "K", &ino))
+        return NULL;
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if(le64toh(self->inos[mid].ino) < ino)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if((ret = PyList_New(0)) == NULL)
+        return NULL;
+    for(; lo < self->n_paths && le64toh(self->inos[lo].ino) == ino; lo++) {
+        idx = le64toh(self->inos[lo].path_idx);
+        if(idx >= self->n_paths ||
+           (name = snap_path_name(self, idx, &len)) == NULL) {
+            Py_DECREF(ret);
+            return snap_corrupt();
+        }
+        if(snap_is_deleted(self, idx))
+            continue;
+        if((path = MyPath_FromStringAndSize(name, len)) == NULL ||
+           PyList_Append(ret, path) == -1) {
+            Py_XDECREF(path);
+            Py_DECREF(ret);
+            return NULL;
+        }
+        Py_DECREF(path);
+    }
+    return ret;
+}
+
+static char __Snapshot_digest_doc__[] =
+    "digest(path)\n"
+    "Return the digest saved for a path.\n"
+    "\n"
+    "For a directory, this is the digest of the whole subtree, as\n"
+    "computed by :py:func:`tree_digest`, so ``snap.digest('.')`` can be\n"
+    "compared with the digest of a live tree, or of another snapshot.\n"
+    "\n"
+    ":param string path: the path, relative to the snapshot's root\n"
+    ":return: the digest, a 64-bit integer\n"
+    ":rtype: integer\n"
+    ":raises KeyError: if the path is not in the snapshot\n"
+    ;
+
+static PyObject* Snapshot_digest(PyObject *obj, PyObject *args) {
+    Snapshot_Object *self = (Snapshot_Object*)obj;
+    char *path = NULL;
+    int64_t idx;
+
+    if(!PyArg_ParseTuple(args, "et", Py_FileSystemDefaultEncoding, &path))
+        return NULL;
+    idx = snap_find(self, snap_norm_path(path));
+    PyMem_Free(path);
+    if(idx == -1) {
+        PyErr_SetObject(PyExc_KeyError, PyTuple_GET_ITEM(args, 0));
+        return NULL;
+    }
+    return PyLong_FromUnsignedLongLong(le64toh(self->paths[idx].digest));
+}
+
+static char __Snapshot_close_doc__[] =
+    "Unmap the snapshot file.\n"
+    "\n"
+    "After this, the snapshot behaves as if it were empty.\n"
+    ;
+
+static PyObject* Snapshot_close(PyObject *obj, PyObject *args) {
+    if(((Snapshot_Object*)obj)->busy) {
+        PyErr_SetString(PyExc_ValueError, "snapshot is in use");
+        return NULL;
+    }
+    snap_close((Snapshot_Object*)obj);
+    Py_RETURN_NONE;
+}
+
+static char __Snapshot_delta_doc__[] =
+    "Whether this is a delta snapshot\n"
+    "\n"
+    "A delta snapshot only contains the paths which changed since its\n"
+    "base snapshot; see :py:func:`snapshot` and\n"
+    ":py:func:`merge_snapshots`.\n"
+    ;
+
+static PyObject* Snapshot_get_delta(PyObject *obj, void* arg) {
+    return PyBool_FromLong(((Snapshot_Object*)obj)->flags & SNAP_DELTA);
+}
+
+static PyGetSetDef Snapshot_getsets[] = {
+    {"delta", Snapshot_get_delta, NULL, __Snapshot_delta_doc__},
+    {NULL}
+};
+
+static PyMethodDef Snapshot_methods[] = {
+    {"lookup", Snapshot_lookup, METH_VARARGS, __Snapshot_lookup_doc__},
+    {"lookup_inode", Snapshot_lookup_inode, METH_VARARGS,
+     __Snapshot_lookup_inode_doc__},
+    {"digest", Snapshot_digest, METH_VARARGS, __Snapshot_digest_doc__},
+    {"close", Snapshot_close, METH_NOARGS, __Snapshot_close_doc__},
+    {NULL, NULL, 0, NULL}
+};
+
+static PySequenceMethods Snapshot_as_sequence = {
+    Snapshot_length,    /* sq_length */
+    0,                  /* sq_concat */
+    0,                  /* sq_repeat */
+    0,                  /* sq_item */
+    0,                  /* sq_slice */
+    0,                  /* sq_ass_item */
+    0,                  /* sq_ass_slice */
+    Snapshot_contains,  /* sq_contains */
+};
+
+static char __Snapshot_Type_doc__[] =
+    "Type which represents an ACL snapshot file\n"
+    "\n"
+    "The file, written by :py:func:`snapshot`, is memory-mapped and\n"
+    "only the pages needed by each lookup are actually read, so\n"
+    "opening even a very large snapshot is cheap:\n"
+    "\n"
+    "  >>> snap = posix1e.Snapshot(\"tree.snap\")\n"
+    "  >>> acl, default = snap.lookup(\"some/dir\")\n"
+    "  >>> \"some/file\" in snap\n"
+    "  True\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param string filename: the snapshot file\n"
+    ;
+
+/* The definition of the Snapshot Type */
+static PyTypeObject Snapshot_Type = {
+#ifdef IS_PY3K
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL)
+    0,
+#endif
+    "posix1e.Snapshot",
+    sizeof(Snapshot_Object),
+    0,
+    Snapshot_dealloc,   /* tp_dealloc */
+    0,                  /* tp_print */
+    0,                  /* tp_getattr */
+    0,                  /* tp_setattr */
+    0,                  /* tp_compare */
+    0,                  /* tp_repr */
+    0,                  /* tp_as_number */
+    &Snapshot_as_sequence, /* tp_as_sequence */
+    0,                  /* tp_as_mapping */
+    0,                  /* tp_hash */
+    0,                  /* tp_call */
+    0,                  /* tp_str */
+    0,                  /* tp_getattro */
+    0,                  /* tp_setattro */
+    0,                  /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT, /* tp_flags */
+    __Snapshot_Type_doc__, /* tp_doc */
+    0,                  /* tp_traverse */
+    0,                  /* tp_clear */
+    0,                  /* tp_richcompare */
+    0,                  /* tp_weaklistoffset */
+    0,                  /* tp_iter */
+    0,                  /* tp_iternext */
+    Snapshot_methods,   /* tp_methods */
+    0,                  /* tp_members */
+    Snapshot_getsets,   /* tp_getset */
+    0,                  /* tp_base */
+    0,                  /* tp_dict */
+    0,                  /* tp_descr_get */
+    0,                  /* tp_descr_set */
+    0,                  /* tp_dictoffset */
+    Snapshot_init,      /* tp_init */
+    0,                  /* tp_alloc */
+    Snapshot_new,       /* tp_new */
+};
+
+
+/***** Snapshot writer *****/
+
+/* A sequence of snapshots: a full one followed by zero or more
+   deltas, each based on the previous one */
+typedef struct {
+    Snapshot_Object **snaps;
+    int count;
+    unsigned char **seen;  /* per snapshot, one bit per visited path */
+} snap_chain;
+
+/* Finds the current record of a path in the chain, i.e. the one in
+   the last snapshot that has it. Returns 1 and sets which and idx,
+   or 0 if the path is not in the chain (or was deleted). */
+static int snap_chain_find(const snap_chain *c, const char *path,
+                           int *which, uint64_t *idx) {
+    int64_t i;
+    int k;
+
+    for(k = c->count - 1; k >= 0; k--) {
+        if((i = snap_find_record(c->snaps[k], path)) == -1)
+            continue;
+        if(snap_is_deleted(c->snaps[k], i))
+            return 0;
+        *which = k;
+        *idx = i;
+        return 1;
+    }
+    return 0;
+}
+
+/* A directory being walked; it is added to the writer only once all
+   its entries have been visited, as that's when its digest is known */
+typedef struct {
+    snap_path rec;
+    uint64_t state;       /* the digest computed so far */
+    uint64_t old_digest;
+    membuf acc;
+    membuf def;
+    int has_def;
+    int emit;             /* if 0, only added if the digest changed */
+    int failed;           /* the ACLs couldn't be read */
+} snap_frame;
+
+typedef struct {
+    blob_table acls;
+    membuf names;
+    snap_path *paths;  /* in host byte order until written */
+    size_t count;
+    size_t alloc;
+    membuf scratch;
+    membuf scratch_def;
+    snap_frame *frames;
+    int nframes;
+    err_list *errors;
+    snap_chain *base;  /* the previous state, in incremental mode */
+    int delta;
+    uint32_t flags;
+    uint64_t snap_id;
+    uint64_t base_id;
+    size_t reused;
+    size_t deleted;
+} snap_writer;
+
+/* Adds a path to the writer; rec holds the path's metadata, and its
+   name and ACL ids are filled in here. A NULL access ACL is only
+   valid for deletion records. */
+static int snap_writer_add(snap_writer *sw, const char *rel,
+                           const snap_path *rec,
+                           const char *acc, uint32_t acc_len,
+                           const char *def, uint32_t def_len) {
+    snap_path *p;
+    int64_t id;
+
+    if(sw->count == sw->alloc) {
+        size_t alloc = sw->alloc ? sw->alloc * 2 : 1024;
+        if((p = realloc(sw->paths, alloc * sizeof(*p))) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        sw->paths = p;
+        sw->alloc = alloc;
+    }
+    p = sw->paths + sw->count;
+    *p = *rec;
+    p->access_id = p->default_id = SNAP_NOACL;
+    if(acc != NULL) {
+        if((id = blob_table_add(&sw->acls, acc, acc_len)) == -1)
+            return -1;
+        p->access_id = id;
+    }
+    if(def != NULL) {
+        if((id = blob_table_add(&sw->acls, def, def_len)) == -1)
+            return -1;
+        p->default_id = id;
+    }
+    p->name_off = sw->names.len;
+    p->name_len = strlen(rel);
+    if(membuf_append(&sw->names, rel, p->name_len + 1) == -1)
+        return -1;
+    sw->count++;
+    return 0;
+}
+
+/* Adds the idx-th path of a snapshot to the writer */
+static int snap_writer_copy(snap_writer *sw, const Snapshot_Object *snap,
+                            uint64_t idx) {
+    const snap_path *sp = snap->paths + idx;
+    const char *name, *acc, *def = NULL;
+    uint32_t acc_len = 0, def_len = 0, def_id = le32toh(sp->default_id);
+    snap_path rec;
+
+    name = snap_path_name(snap, idx, NULL);
+    acc = snap_acl_blob(snap, le32toh(sp->access_id), &acc_len);
+    if(def_id != SNAP_NOACL &&
+       (def = snap_acl_blob(snap, def_id, &def_len)) == NULL)
+        name = NULL;
+    if(name == NULL || acc == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(&rec, 0, sizeof(rec));
+    rec.ino = le64toh(sp->ino);
+    rec.ctime_sec = le64toh(sp->ctime_sec);
+    rec.ctime_nsec = le32toh(sp->ctime_nsec);
+    rec.mode = le32toh(sp->mode);
+    rec.digest = le64toh(sp->digest);
+    return snap_writer_add(sw, name, &rec, acc, acc_len, def, def_len);
+}
+
+/* Returns the frame for the given depth, growing the stack if
+   needed */
+static snap_frame* snap_writer_frame(snap_writer *sw, int depth) {
+    snap_frame *frames;
+    int n;
+
+    if(depth >= sw->nframes) {
+        n = sw->nframes ? sw->nframes * 2 : 16;
+        while(n <= depth)
+            n *= 2;
+        if((frames = realloc(sw->frames, n * sizeof(*frames))) == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        memset(frames + sw->nframes, 0,
+               (n - sw->nframes) * sizeof(*frames));
+        sw->frames = frames;
+        sw->nframes = n;
+    }
+    return sw->frames + depth;
+}
+
+/* Adds a finished object to the digest of its directory */
+static void snap_writer_feed(snap_writer *sw, const walk_item *item,
+                             uint64_t digest) {
+    snap_frame *f;
+
+    if(item->depth > 0) {
+        f = sw->frames + item->depth - 1;
+        f->state = digest_add(f->state, item->name, digest);
+    }
+}
+
+static int snap_writer_leave(snap_writer *sw, const walk_item *item) {
+    snap_frame *f = sw->frames + item->depth;
+
+    f->rec.digest = f->state;
+    snap_writer_feed(sw, item, f->state);
+    if(f->failed || (!f->emit && f->state == f->old_digest))
+        return 0;
+    return snap_writer_add(sw, item->rel, &f->rec, f->acc.data, f->acc.len,
+                           f->has_def ? f->def.data : NULL, f->def.len);
+}
+
+/* Records an object whose ACLs couldn't be read; directories still
+   get a frame, as their entries are walked anyway */
+static int snap_writer_failed(snap_writer *sw, const walk_item *item) {
+    snap_frame *f;
+
+    if(err_list_add(sw->errors, item->rel, errno) == -1)
+        return -1;
+    if(!S_ISDIR(item->st->st_mode)) {
+        snap_writer_feed(sw, item, digest_start(item->st->st_mode, 0, 0));
+        return 0;
+    }
+    if((f = snap_writer_frame(sw, item->depth)) == NULL)
+        return -1;
+    f->state = digest_start(item->st->st_mode, 0, 0);
+    f->failed = 1;
+    return 0;
+}
+
+static int snap_writer_visit(void *data, const walk_item *item, int post) {
+    snap_writer *sw = data;
+    const Snapshot_Object *snap = NULL;
+    const snap_path *old = NULL;
+    snap_frame *f;
+    snap_path rec;
+    const char *acc, *def = NULL;
+    uint32_t acc_len = 0, def_len = 0, def_id;
+    uint64_t idx, acc_fp, def_fp = 0;
+    int which, r;
+
+    if(S_ISLNK(item->st->st_mode))
+        return 0;
+    if(post)
+        return snap_writer_leave(sw, item);
+    memset(&rec, 0, sizeof(rec));
+    rec.ino = item->st->st_ino;
+    rec.ctime_sec = item->st->st_ctim.tv_sec;
+    rec.ctime_nsec = item->st->st_ctim.tv_nsec;
+    rec.mode = item->st->st_mode;
+
+    /* any change of the ACLs changes the ctime, so unchanged inodes
+       can reuse the previous ACLs */
+    if(sw->base != NULL &&
+       snap_chain_find(sw->base, item->rel, &which, &idx)) {
+        sw->base->seen[which][idx / 8] |= 1 << (idx % 8);
+        snap = sw->base->snaps[which];
+        old = snap->paths + idx;
+        if(le64toh(old->ino) != rec.ino ||
+           (int64_t)le64toh(old->ctime_sec) != rec.ctime_sec ||
+           le32toh(old->ctime_nsec) != rec.ctime_nsec)
+            old = NULL;
+    }
+
+    if(old != NULL) {
+        def_id = le32toh(old->default_id);
+        acc = snap_acl_blob(snap, le32toh(old->access_id), &acc_len);
+        if(def_id != SNAP_NOACL &&
+           (def = snap_acl_blob(snap, def_id, &def_len)) == NULL)
+            acc = NULL;
+        if(acc == NULL) {
+            errno = EINVAL;
+            return -1;
+        }
+        acc_fp = snap_acl_hash(snap, le32toh(old->access_id));
+        def_fp = snap_acl_hash(snap, def_id);
+        sw->reused++;
+    } else {
+        r = 0;
+        if(read_acl_blob(item->path, ACL_TYPE_ACCESS, item->st->st_mode,
+                         &sw->scratch) == -1 ||
+           (S_ISDIR(item->st->st_mode) &&
+            (r = read_acl_blob(item->path, ACL_TYPE_DEFAULT, 0,
+                               &sw->scratch_def)) == -1))
+            return snap_writer_failed(sw, item);
+        acc = sw->scratch.data;
+        acc_len = sw->scratch.len;
+        acc_fp = fnv1a(FNV_OFFSET, acc, acc_len);
+        if(r == 1) {
+            def = sw->scratch_def.data;
+            def_len = sw->scratch_def.len;
+            def_fp = fnv1a(FNV_OFFSET, def, def_len);
+        }
+    }
+
+    if(S_ISDIR(item->st->st_mode)) {
+        if((f = snap_writer_frame(sw, item->depth)) == NULL)
+            return -1;
+        f->rec = rec;
+        f->state = digest_start(rec.mode, acc_fp, def_fp);
+        f->old_digest = old != NULL ? le64toh(old->digest) : 0;
+        f->emit = old == NULL || !sw->delta;
+        f->has_def = def != NULL;
+        f->failed = 0;
+        f->acc.len = f->def.len = 0;
+        if(membuf_append(&f->acc, acc, acc_len) == -1 ||
+           (def != NULL && membuf_append(&f->def, def, def_len) == -1))
+            return -1;
+        return 0;
+    }
+    rec.digest = digest_start(rec.mode, acc_fp, def_fp);
+    snap_writer_feed(sw, item, rec.digest);
+    if(old != NULL && sw->delta)
+        return 0;
+    return snap_writer_add(sw, item->rel, &rec, acc, acc_len, def, def_len);
+}
+
+/* Adds deletion records for the paths of the base chain that were
+   not seen during the walk */
+static int snap_writer_deleted(snap_writer *sw) {
+    snap_chain *c = sw->base;
+    const char *name;
+    snap_path rec;
+    uint64_t i, idx;
+    int k, which;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.flags = SNAP_DELETED;
+    for(k = 0; k < c->count; k++) {
+        for(i = 0; i < c->snaps[k]->n_paths; i++) {
+            if(c->seen[k][i / 8] & (1 << (i % 8)))
+                continue;
+            if((name = snap_path_name(c->snaps[k], i, NULL)) == NULL) {
+                errno = EINVAL;
+                return -1;
+            }
+            /* skip records shadowed by a later snapshot */
+            if(!snap_chain_find(c, name, &which, &idx) || which != k)
+                continue;
+            if(snap_writer_add(sw, name, &rec, NULL, 0, NULL, 0) == -1)
+                return -1;
+            sw->deleted++;
+        }
+    }
+    return 0;
+}
+
+/* Adds the current records of all the paths in the chain */
+static int snap_writer_merge(snap_writer *sw, const snap_chain *c) {
+    const char *name;
+    uint64_t i, idx;
+    int k, which;
+
+    for(k = 0; k < c->count; k++) {
+        for(i = 0; i < c->snaps[k]->n_paths; i++) {
+            if(snap_is_deleted(c->snaps[k], i))
+                continue;
+            if((name = snap_path_name(c->snaps[k], i, NULL)) == NULL) {
+                errno = EINVAL;
+                return -1;
+            }
+            if(!snap_chain_find(c, name, &which, &idx) || which != k)
+                continue;
+            if(snap_writer_copy(sw, c->snaps[k], i) == -1)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/* Returns a new, non-zero, snapshot id */
+static uint64_t snap_new_id(const snap_writer *sw) {
+    struct timespec ts;
+    pid_t pid = getpid();
+    uint64_t h;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    h = fnv1a(FNV_OFFSET, &ts, sizeof(ts));
+    h = fnv1a(h, &pid, sizeof(pid));
+    h = fnv1a(h, sw->names.data, sw->names.len);
+    return h ? h : 1;
+}
+
+/* qsort has no context argument, so the name table used by the
+   comparison functions is passed via a thread-local */
+static __thread const char *sort_names;
+
+static int snap_path_cmp(const void *a, const void *b) {
+    return strcmp(sort_names + ((const snap_path*)a)->name_off,
+                  sort_names + ((const snap_path*)b)->name_off);
+}
+
+static int snap_ino_cmp(const void *a, const void *b) {
+    const snap_ino *ia = a, *ib = b;
+
+    if(ia->ino != ib->ino)
+        return ia->ino < ib->ino ? -1 : 1;
+    return ia->path_idx < ib->path_idx ? -1 : ia->path_idx > ib->path_idx;
+}
+
+#define SNAP_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    ssize_t n;
+
+    while(len > 0) {
+        if((n = write(fd, p, len)) == -1) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+#define SNAP_OUT_BUFSIZE 65536
+
+/* Adds to the output of snap_writer_save, writing it to fd whenever
+   the buffer fills up */
+static int snap_out_put(int fd, membuf *out, const void *data, size_t len) {
+    if(membuf_append(out, data, len) == -1)
+        return -1;
+    if(out->len < SNAP_OUT_BUFSIZE)
+        return 0;
+    if(write_all(fd, out->data, out->len) == -1)
+        return -1;
+    out->len = 0;
+    return 0;
+}
+
+/* Writes the collected paths and ACLs as a snapshot file; the file is
+   replaced atomically, so existing mappings of it stay valid. The
+   tables are streamed through a small buffer, and the file is synced
+   before it replaces the old one. */
+static int snap_writer_save(snap_writer *sw, const char *fname) {
+    snap_header hdr;
+    snap_ino *inos = NULL;
+    membuf out = { NULL, 0, 0 }, tmpname = { NULL, 0, 0 };
+    uint64_t blob_off, str_off, n_live = 0;
+    size_t i;
+    int fd = -1, ret = -1, saved;
+    static const char zeros[8] = { 0 };
+
+    sort_names = sw->names.data;
+    qsort(sw->paths, sw->count, sizeof(snap_path), snap_path_cmp);
+    if(sw->count > 0 &&
+       (inos = malloc(sw->count * sizeof(snap_ino))) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for(i = 0; i < sw->count; i++) {
+        inos[i].ino = sw->paths[i].ino;
+        inos[i].path_idx = i;
+        if(!(sw->paths[i].flags & SNAP_DELETED))
+            n_live++;
+    }
+    qsort(inos, sw->count, sizeof(snap_ino), snap_ino_cmp);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+    hdr.version = htole32(SNAP_VERSION);
+    hdr.flags = htole32(sw->flags);
+    hdr.snap_id = htole64(sw->snap_id ? sw->snap_id : snap_new_id(sw));
+    hdr.base_id = htole64(sw->base_id);
+    hdr.n_acls = htole64(sw->acls.count);
+    hdr.n_paths = htole64(sw->count);
+    hdr.n_live = htole64(n_live);
+    hdr.acl_off = sizeof(hdr);
+    hdr.path_off = hdr.acl_off + sw->acls.count * sizeof(snap_acl);
+    hdr.ino_off = hdr.path_off + sw->count * sizeof(snap_path);
+    str_off = hdr.ino_off + sw->count * sizeof(snap_ino);
+    blob_off = SNAP_ALIGN(str_off + sw->names.len);
+    hdr.acl_off = htole64(hdr.acl_off);
+    hdr.path_off = htole64(hdr.path_off);
+    hdr.ino_off = htole64(hdr.ino_off);
+    hdr.str_off = htole64(str_off);
+
+    if(membuf_append(&tmpname, fname, strlen(fname)) == -1 ||
+       membuf_append(&tmpname, ".XXXXXX", 8) == -1)
+        goto out;
+    if((fd = mkostemp(tmpname.data, O_CLOEXEC)) == -1)
+        goto out;
+    if(snap_out_put(fd, &out, &hdr, sizeof(hdr)) == -1)
+        goto out;
+    for(i = 0; i < sw->acls.count; i++) {
+        snap_acl a;
+        a.off = htole64(blob_off + sw->acls.offs[i]);
+        a.len = htole32(sw->acls.lens[i]);
+        a.reserved = 0;
+        a.hash = htole64(sw->acls.hashes[i]);
+        if(snap_out_put(fd, &out, &a, sizeof(a)) == -1)
+            goto out;
+    }
+    for(i = 0; i < sw->count; i++) {
+        snap_path p = sw->paths[i];
+        p.name_off = htole64(str_off + p.name_off);
+        p.ino = htole64(p.ino);
+        p.ctime_sec = htole64(p.ctime_sec);
+        p.name_len = htole32(p.name_len);
+        p.ctime_nsec = htole32(p.ctime_nsec);
+        p.access_id = htole32(p.access_id);
+        p.default_id = htole32(p.default_id);
+        p.mode = htole32(p.mode);
+        p.flags = htole32(p.flags);
+        p.digest = htole64(p.digest);
+        if(snap_out_put(fd, &out, &p, sizeof(p)) == -1)
+            goto out;
+    }
+    for(i = 0; i < sw->count; i++) {
+        snap_ino n;
+        n.ino = htole64(inos[i].ino);
+        n.path_idx = htole64(inos[i].path_idx);
+        if(snap_out_put(fd, &out, &n, sizeof(n)) == -1)
+            goto out;
+    }
+
+    if(write_all(fd, out.data, out.len) == -1 ||
+       write_all(fd, sw->names.data, sw->names.len) == -1 ||
+       write_all(fd, zeros, blob_off - str_off - sw->names.len) == -1 ||
+       write_all(fd, sw->acls.blobs.data, sw->acls.blobs.len) == -1 ||
+       fsync(fd) == -1)
+        goto out;
+    ret = close(fd);
+    fd = -1;
+    if(ret == 0)
+        ret = rename(tmpname.data, fname);
+
+ out:
+    saved = errno;
+    if(fd != -1)
+        close(fd);
+    if(ret == -1 && tmpname.len > 0)
+        unlink(tmpname.data);
+    free(inos);
+    membuf_free(&out);
+    membuf_free(&tmpname);
+    errno = saved;
+    return ret;
+}
+
+static void snap_writer_free(snap_writer *sw) {
+    int i;
+
+    blob_table_free(&sw->acls);
+    membuf_free(&sw->names);
+    membuf_free(&sw->scratch);
+    membuf_free(&sw->scratch_def);
+    for(i = 0; i < sw->nframes; i++) {
+        membuf_free(&sw->frames[i].acc);
+        membuf_free(&sw->frames[i].def);
+    }
+    free(sw->frames);
+    free(sw->paths);
+}
+
+static int dict_set_size(PyObject *dict, const char *key, size_t value) {
+    PyObject *v;
+    int ret;
+
+    if((v = PyInt_FromSize_t(value)) == NULL)
+        return -1;
+    ret = PyDict_SetItemString(dict, key, v);
+    Py_DECREF(v);
+    return ret;
+}
+
+/* Builds a Python dict with the statistics of a tree operation */
+static PyObject* tree_stats(err_list *errors, const char *k1, size_t v1,
+                            const char *k2, size_t v2) {
+    PyObject *errs;
+
+    if((errs = err_list_to_list(errors)) == NULL)
+        return NULL;
+    return Py_BuildValue("{snsnsN}", k1, (Py_ssize_t)v1,
+                         k2, (Py_ssize_t)v2, "errors", errs);
+}
+
+static void snap_chain_free(snap_chain *c) {
+    int k;
+
+    if(c->seen != NULL)
+        for(k = 0; k < c->count; k++)
+            free(c->seen[k]);
+    free(c->seen);
+    free(c->snaps);
+    memset(c, 0, sizeof(*c));
+}
+
+/* Builds a chain out of a Snapshot, a file name, or a sequence of
+   these (the full snapshot first, then its deltas in order). The
+   snapshots are kept alive, and marked as busy, by *holder. */
+static int snap_chain_init(snap_chain *c, PyObject *arg, PyObject **holder) {
+    PyObject *seq, *item;
+    Py_ssize_t i, n;
+    Snapshot_Object *snap;
+
+    memset(c, 0, sizeof(*c));
+    if(PyObject_IsInstance(arg, (PyObject*)&Snapshot_Type) ||
+       PyBytes_Check(arg) || PyUnicode_Check(arg))
+        seq = Py_BuildValue("[O]", arg);
+    else
+        seq = PySequence_List(arg);
+    if(seq == NULL)
+        return -1;
+    n = PyList_GET_SIZE(seq);
+    for(i = 0; i < n; i++) {
+        item = PyList_GET_ITEM(seq, i);
+        if(PyObject_IsInstance(item, (PyObject*)&Snapshot_Type))
+            continue;
+        item = PyObject_CallFunctionObjArgs((PyObject*)&Snapshot_Type,
+                                            item, NULL);
+        if(item == NULL)
+            goto err;
+        PyList_SetItem(seq, i, item);
+    }
+    if(n <= 0) {
+        PyErr_SetString(PyExc_ValueError, "no snapshots given");
+        goto err;
+    }
+    c->count = n;
+    c->snaps = calloc((size_t)n, sizeof(*c->snaps));
+    c->seen = calloc((size_t)n, sizeof(*c->seen));
+    if(c->snaps == NULL || c->seen == NULL) {
+        PyErr_NoMemory();
+        goto err;
+    }
+    for(i = 0; i < n; i++) {
+        snap = (Snapshot_Object*)PyList_GET_ITEM(seq, i);
+        if(((snap->flags & SNAP_DELTA) != 0) != (i > 0) ||
+           (i > 0 && snap->base_id != c->snaps[i - 1]->snap_id)) {
+            PyErr_SetString(PyExc_ValueError, "the snapshots must be a full"
+                            " snapshot followed by its deltas, in order");
+            goto err;
+        }
+        if((c->seen[i] = calloc(snap->n_paths / 8 + 1, 1)) == NULL) {
+            PyErr_NoMemory();
+            goto err;
+        }
+        c->snaps[i] = snap;
+    }
+    for(i = 0; i < n; i++)
+        c->snaps[i]->busy++;
+    *holder = seq;
+    return 0;
+
+ err:
+    Py_DECREF(seq);
+    snap_chain_free(c);
+    return -1;
+}
+
+static void snap_chain_release(snap_chain *c, PyObject *holder) {
+    int k;
+
+    for(k = 0; k < c->count; k++)
+        c->snaps[k]->busy--;
+    snap_chain_free(c);
+    Py_DECREF(holder);
+}
+
+static char __snapshot_doc__[] =
+    "snapshot(root, filename[, base=None, delta=True])\n"
+    "Save the ACLs of a directory tree to a snapshot file.\n"
+    "\n"
+    "The tree is walked without following symbolic links, and the\n"
+    "access ACL of each object (plus the default ACL of directories)\n"
+    "is stored in a compact binary file: each distinct ACL is stored\n"
+    "only once, and the file is laid out so that it can be used\n"
+    "in place via :py:class:`Snapshot`, without being loaded.\n"
+    "\n"
+    "Paths are stored relative to root, with the root itself being\n"
+    "``'.'``.\n"
+    "\n"
+    "If a base is given, the snapshot is incremental: objects whose\n"
+    "inode number and ctime are the same as in the base are assumed\n"
+    "to be unchanged, and their ACLs are not read again. By default, an\n"
+    "incremental snapshot is a delta, which only records the changed,\n"
+    "new and deleted paths; deltas can be chained (by passing the\n"
+    "whole chain as base) and combined via :py:func:`merge_snapshots`.\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param string root: the directory tree to save\n"
+    ":param string filename: the snapshot file to write\n"
+    ":param base: the previous state of the tree: a :py:class:`Snapshot`\n"
+    "    or file name, or a list of them, consisting of a full snapshot\n"
+    "    followed by its deltas\n"
+    ":param bool delta: if false, a full snapshot is written even when\n"
+    "    a base is given\n"
+    ":return: a dictionary with the number of ``paths`` and distinct\n"
+    "    ``acls`` saved, and the list of ``errors``, as (path, errno,\n"
+    "    message) tuples, for the objects that couldn't be read; with a\n"
+    "    base, also the number of paths ``reused`` from the base and,\n"
+    "    for deltas, of ``deleted`` ones\n"
+    ":rtype: dict\n"
+    ;
+
+static PyObject* aclmodule_snapshot(PyObject* obj, PyObject* args,
+                                    PyObject *keywds) {
+    static char *kwlist[] = { "root", "filename", "base", "delta", NULL };
+    char *root = NULL, *fname = NULL;
+    PyObject *base = Py_None, *holder = NULL, *ret = NULL;
+    snap_writer sw;
+    snap_chain chain;
+    err_list errors;
+    int delta = 1, nret;
+
+    memset(&sw, 0, sizeof(sw));
+    memset(&errors, 0, sizeof(errors));
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "etet|Oi", kwlist,
+                                     Py_FileSystemDefaultEncoding, &root,
+                                     Py_FileSystemDefaultEncoding, &fname,
+                                     &base, &delta))
+        goto out;
+    if(base != Py_None) {
+        if(snap_chain_init(&chain, base, &holder) == -1)
+            goto out;
+        sw.base = &chain;
+        sw.delta = delta;
+        if(delta) {
+            sw.flags = SNAP_DELTA;
+            sw.base_id = chain.snaps[chain.count - 1]->snap_id;
+        }
+    }
+
+    sw.errors = &errors;
+    Py_BEGIN_ALLOW_THREADS
+    nret = walk_tree(root, snap_writer_visit, &sw, &errors);
+    if(nret == 0 && sw.delta)
+        nret = snap_writer_deleted(&sw);
+    if(nret == 0)
+        nret = snap_writer_save(&sw, fname);
+    Py_END_ALLOW_THREADS
+    if(sw.base != NULL)
+        snap_chain_release(&chain, holder);
+    if(nret == -1) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        goto out;
+    }
+    ret = tree_stats(&errors, "paths", sw.count, "acls", sw.acls.count);
+    if(ret != NULL && sw.base != NULL &&
+       (dict_set_size(ret, "reused", sw.reused) == -1 ||
+        (delta && dict_set_size(ret, "deleted", sw.deleted) == -1))) {
+        Py_DECREF(ret);
+        ret = NULL;
+    }
+
+ out:
+    snap_writer_free(&sw);
+    err_list_free(&errors);
+    PyMem_Free(root);
+    PyMem_Free(fname);
+    return ret;
+}
+
+static char __merge_snapshots_doc__[] =
+    "merge_snapshots(filename, snapshots)\n"
+    "Combine a chain of snapshots into a full snapshot.\n"
+    "\n"
+    "The result describes the same state as the last delta of the\n"
+    "chain, so later deltas based on that one can be applied on top\n"
+    "of the merged snapshot too.\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param string filename: the snapshot file to write\n"
+    ":param snapshots: a list of :py:class:`Snapshot` objects or file\n"
+    "    names, consisting of a full snapshot followed by its deltas\n"
+    ":return: the number of paths in the merged snapshot\n"
+    ":rtype: integer\n"
+    ;
+
+static PyObject* aclmodule_merge_snapshots(PyObject* obj, PyObject* args) {
+    char *fname = NULL;
+    PyObject *snaps, *holder, *ret = NULL;
+    snap_writer sw;
+    snap_chain chain;
+    int nret;
+
+    memset(&sw, 0, sizeof(sw));
+    if (!PyArg_ParseTuple(args, "etO", Py_FileSystemDefaultEncoding, &fname,
+                          &snaps))
+        goto out;
+    if(snap_chain_init(&chain, snaps, &holder) == -1)
+        goto out;
+    sw.snap_id = chain.snaps[chain.count - 1]->snap_id;
+    Py_BEGIN_ALLOW_THREADS
+    nret = snap_writer_merge(&sw, &chain);
+    if(nret == 0)
+        nret = snap_writer_save(&sw, fname);
+    Py_END_ALLOW_THREADS
+    snap_chain_release(&chain, holder);
+    if(nret == -1)
+        PyErr_SetFromErrno(PyExc_IOError);
+    else
+        ret = PyInt_FromSize_t(sw.count);
+
+ out:
+    snap_writer_free(&sw);
+    PyMem_Free(fname);
+    return ret;
+}
+
+/***** Snapshot comparison *****/
+
+/* Returns the index of the first path not less than key */
+static uint64_t snap_lower_bound(const Snapshot_Object *self,
+                                 const char *key) {
+    uint64_t lo = 0, hi = self->n_paths, mid;
+    const char *name;
+
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if((name = snap_path_name(self, mid, NULL)) == NULL)
+            return self->n_paths;
+        if(strcmp(name, key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Returns the next entry, at or after *pos, of the directory whose
+   paths start with prefix ("" for the root, "dir/" otherwise), or -1
+   if there are no more. The subtrees of the entries are skipped via
+   binary searches, as "x/..." sorts before "x0". */
+static int64_t snap_next_child(const Snapshot_Object *self,
+                               const char *prefix, size_t plen,
+                               uint64_t *pos, membuf *key) {
+    const char *name, *slash;
+
+    while(*pos < self->n_paths) {
+        if((name = snap_path_name(self, *pos, NULL)) == NULL)
+            return -1;
+        if(strncmp(name, prefix, plen) != 0)
+            return -1;
+        if(plen == 0 && strcmp(name, ".") == 0) {
+            (*pos)++;
+            continue;
+        }
+        if((slash = strchr(name + plen, '/')) == NULL)
+            return (*pos)++;
+        key->len = 0;
+        if(membuf_append(key, name, slash - name) == -1 ||
+           membuf_append(key, "0", 2) == -1)
+            return -1;
+        *pos = snap_lower_bound(self, key->data);
+    }
+    return -1;
+}
+
+static int snap_same_acl(const Snapshot_Object *a, uint32_t ida,
+                         const Snapshot_Object *b, uint32_t idb) {
+    const char *ba, *bb;
+    uint32_t la, lb;
+
+    if(ida == SNAP_NOACL || idb == SNAP_NOACL)
+        return ida == idb;
+    if((ba = snap_acl_blob(a, ida, &la)) == NULL ||
+       (bb = snap_acl_blob(b, idb, &lb)) == NULL)
+        return 0;
+    return la == lb && memcmp(ba, bb, la) == 0;
+}
+
+static int diff_report(PyObject *list, const Snapshot_Object *snap,
+                       uint64_t idx, const char *status) {
+    const char *name;
+    uint32_t len;
+    PyObject *item;
+    int ret;
+
+    if((name = snap_path_name(snap, idx, &len)) == NULL) {
+        snap_corrupt();
+        return -1;
+    }
+    if((item = Py_BuildValue("(Ns)", MyPath_FromStringAndSize(name, len),
+                             status)) == NULL)
+        return -1;
+    ret = PyList_Append(list, item);
+    Py_DECREF(item);
+    return ret;
+}
+
+/* Compares the directories ia of a and ib of b, whose digests differ */
+static int diff_dir(const Snapshot_Object *a, uint64_t ia,
+                    const Snapshot_Object *b, uint64_t ib,
+                    PyObject *list, membuf *key) {
+    const snap_path *pa = a->paths + ia, *pb = b->paths + ib;
+    membuf prefix = { NULL, 0, 0 };
+    const char *name, *na = NULL, *nb = NULL;
+    uint64_t posa, posb;
+    int64_t ca, cb;
+    uint32_t len;
+    int c, ret = -1;
+
+    if(!snap_same_acl(a, le32toh(pa->access_id), b, le32toh(pb->access_id)) ||
+       !snap_same_acl(a, le32toh(pa->default_id),
+                      b, le32toh(pb->default_id))) {
+        if(diff_report(list, b, ib, "changed") == -1)
+            return -1;
+    }
+    if((name = snap_path_name(a, ia, &len)) == NULL) {
+        snap_corrupt();
+        return -1;
+    }
+    if(strcmp(name, ".") != 0 &&
+       (membuf_append(&prefix, name, len) == -1 ||
+        membuf_append(&prefix, "/", 1) == -1)) {
+        PyErr_NoMemory();
+        goto out;
+    }
+    if(membuf_append(&prefix, "", 1) == -1) {
+        PyErr_NoMemory();
+        goto out;
+    }
+    posa = snap_lower_bound(a, prefix.data);
+    posb = snap_lower_bound(b, prefix.data);
+    ca = snap_next_child(a, prefix.data, prefix.len - 1, &posa, key);
+    cb = snap_next_child(b, prefix.data, prefix.len - 1, &posb, key);
+    while(ca != -1 || cb != -1) {
+        if(ca != -1)
+            na = snap_path_name(a, ca, NULL);
+        if(cb != -1)
+            nb = snap_path_name(b, cb, NULL);
+        c = ca == -1 ? 1 : cb == -1 ? -1 : strcmp(na, nb);
+        if(c < 0) {
+            if(diff_report(list, a, ca, "removed") == -1)
+                goto out;
+        } else if(c > 0) {
+            if(diff_report(list, b, cb, "added") == -1)
+                goto out;
+        } else if(a->paths[ca].digest != b->paths[cb].digest) {
+            if(S_ISDIR(le32toh(a->paths[ca].mode)) &&
+               S_ISDIR(le32toh(b->paths[cb].mode))) {
+                if(diff_dir(a, ca, b, cb, list, key) == -1)
+                    goto out;
+            } else if(diff_report(list, b, cb, "changed") == -1) {
+                goto out;
+            }
+        }
+        if(c <= 0)
+            ca = snap_next_child(a, prefix.data, prefix.len - 1, &posa, key);
+        if(c >= 0)
+            cb = snap_next_child(b, prefix.data, prefix.len - 1, &posb, key);
+    }
+    ret = 0;
+
+ out:
+    membuf_free(&prefix);
+    return ret;
+}
+
+static char __diff_snapshots_doc__[] =
+    "diff_snapshots(a, b)\n"
+    "Compare the ACLs saved in two snapshots.\n"
+    "\n"
+    "Thanks to the digests saved in the snapshots, only the\n"
+    "directories whose contents differ are examined, so comparing two\n"
+    "replicas of a large tree with few differences is fast.\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param a: the old state, a full :py:class:`Snapshot` or file name\n"
+    ":param b: the new state, a full :py:class:`Snapshot` or file name\n"
+    ":return: a list of (path, status) tuples, in depth-first order, where\n"
+    "    status is ``'changed'`` if the path's ACLs differ,\n"
+    "    ``'added'`` if it is only in b and ``'removed'`` if it is only\n"
+    "    in a; the entries of added and removed directories are not\n"
+    "    listed\n"
+    ":rtype: list\n"
+    ;
+
+static PyObject* aclmodule_diff_snapshots(PyObject* obj, PyObject* args) {
+    PyObject *snaps[2], *list = NULL;
+    Snapshot_Object *a, *b;
+    membuf key = { NULL, 0, 0 };
+    int64_t ia, ib;
+    int i;
+
+    if (!PyArg_ParseTuple(args, "OO", &snaps[0], &snaps[1]))
+        return NULL;
+    for(i = 0; i < 2; i++) {
+        if(PyObject_IsInstance(snaps[i], (PyObject*)&Snapshot_Type))
+            Py_INCREF(snaps[i]);
+        else
+            snaps[i] = PyObject_CallFunctionObjArgs((PyObject*)&Snapshot_Type,
+                                                    snaps[i], NULL);
+        if(snaps[i] == NULL) {
+            if(i == 1)
+                Py_DECREF(snaps[0]);
+            return NULL;
+        }
+    }
+    a = (Snapshot_Object*)snaps[0];
+    b = (Snapshot_Object*)snaps[1];
+    if((a->flags | b->flags) & SNAP_DELTA) {
+        PyErr_SetString(PyExc_ValueError, "delta snapshots must be merged"
+                        " before being compared");
+        goto out;
+    }
+    if((list = PyList_New(0)) == NULL)
+        goto out;
+    ia = snap_find(a, ".");
+    ib = snap_find(b, ".");
+    if(ia == -1 || ib == -1) {
+        if((ia != -1 && diff_report(list, a, ia, "removed") == -1) ||
+           (ib != -1 && diff_report(list, b, ib, "added") == -1))
+            Py_CLEAR(list);
+    } else if(a->paths[ia].digest != b->paths[ib].digest) {
+        if(S_ISDIR(le32toh(a->paths[ia].mode)) &&
+           S_ISDIR(le32toh(b->paths[ib].mode))) {
+            if(diff_dir(a, ia, b, ib, list, &key) == -1)
+                Py_CLEAR(list);
+        } else if(diff_report(list, b, ib, "changed") == -1) {
+            Py_CLEAR(list);
+        }
+    }
+
+ out:
+    membuf_free(&key);
+    Py_DECREF(snaps[0]);
+    Py_DECREF(snaps[1]);
+    return list;
+}
+
+/***** getfacl dumps *****/
+
+/* A small map from byte strings to integers, used to cache user and
+   group name lookups */
+typedef struct {
+    membuf keys;
+    uint64_t *koffs;   /* offset of the key, its length in the top bits */
+    uint64_t *values;
+    uint64_t *hashes;
+    size_t count;
+    size_t alloc;
+    uint32_t *slots;   /* 0 is empty, otherwise index + 1 */
+    size_t nslots;
+} kv_map;
+
+#define KV_KEYLEN(o) ((o) >> 48)
+#define KV_KEYOFF(o) ((o) & ((1ULL << 48) - 1))
+
+/* Returns a pointer to the value of key, or NULL if it's not set */
+static uint64_t* kv_map_ref(const kv_map *m, const char *key, size_t len) {
+    uint64_t h;
+    size_t j;
+    uint32_t i;
+
+    if(m->nslots == 0)
+        return NULL;
+    h = fnv1a(FNV_OFFSET, key, len);
+    for(j = h % m->nslots; m->slots[j] != 0; j = (j + 1) % m->nslots) {
+        i = m->slots[j] - 1;
+        if(m->hashes[i] == h && KV_KEYLEN(m->koffs[i]) == len &&
+           memcmp(m->keys.data + KV_KEYOFF(m->koffs[i]), key, len) == 0)
+            return m->values + i;
+    }
+    return NULL;
+}
+
+static int kv_map_get(const kv_map *m, const char *key, size_t len,
+                      uint64_t *value) {
+    uint64_t *ref = kv_map_ref(m, key, len);
+
+    if(ref == NULL)
+        return 0;
+    *value = *ref;
+    return 1;
+}
+
+static int kv_map_put(kv_map *m, const char *key, size_t len,
+                      uint64_t value) {
+    uint64_t h = fnv1a(FNV_OFFSET, key, len), *p;
+    uint32_t *slots;
+    size_t alloc, nslots, i, j;
+
+    if(len >= (1 << 16)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if(m->count == m->alloc) {
+        alloc = m->alloc ? m->alloc * 2 : 32;
+        nslots = alloc * 2;
+        if((p = realloc(m->koffs, alloc * sizeof(*p))) == NULL)
+            goto nomem;
+        m->koffs = p;
+        if((p = realloc(m->values, alloc * sizeof(*p))) == NULL)
+            goto nomem;
+        m->values = p;
+        if((p = realloc(m->hashes, alloc * sizeof(*p))) == NULL)
+            goto nomem;
+        m->hashes = p;
+        if((slots = calloc(nslots, sizeof(*slots))) == NULL)
+            goto nomem;
+        for(i = 0; i < m->count; i++) {
+            for(j = m->hashes[i] % nslots; slots[j] != 0;
+                j = (j + 1) % nslots)
+                ;
+            slots[j] = i + 1;
+        }
+        free(m->slots);
+        m->slots = slots;
+        m->nslots = nslots;
+        m->alloc = alloc;
+    }
+    for(j = h % m->nslots; m->slots[j] != 0; j = (j + 1) % m->nslots)
+        ;
+    i = m->count;
+    m->koffs[i] = ((uint64_t)len << 48) | m->keys.len;
+    if(membuf_append(&m->keys, key, len) == -1)
+        return -1;
+    m->values[i] = value;
+    m->hashes[i] = h;
+    m->slots[j] = i + 1;
+    m->count++;
+    return 0;
+
+ nomem:
+    errno = ENOMEM;
+    return -1;
+}
+
+/* Like kv_map_put, but replaces the value if key is already set */
+static int kv_map_set(kv_map *m, const char *key, size_t len,
+                      uint64_t value) {
+    uint64_t *ref = kv_map_ref(m, key, len);
+
+    if(ref == NULL)
+        return kv_map_put(m, key, len, value);
+    *ref = value;
+    return 0;
+}
+
+static void kv_map_free(kv_map *m) {
+    membuf_free(&m->keys);
+    free(m->koffs);
+    free(m->values);
+    free(m->hashes);
+    free(m->slots);
+    memset(m, 0, sizeof(*m));
+}
+
+/* Resolves a user (tag ACL_USER) or group name to its id, accepting
+   numeric ids too. Returns 0, or -1 with errno set (EINVAL for
+   unknown names). */
+static int resolve_name(kv_map *cache, int tag, const char *name,
+                        uint32_t *id) {
+    char key[256 + 1], *end, *buf;
+    size_t len = strlen(name);
+    unsigned long num;
+    uint64_t value;
+    long bufsize;
+    struct passwd pw, *pwp = NULL;
+    struct group gr, *grp = NULL;
+    int nerr;
+
+    if(len == 0 || len >= sizeof(key)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if(name[0] >= '0' && name[0] <= '9') {
+        errno = 0;
+        num = strtoul(name, &end, 10);
+        if(*end == '\0' && errno == 0 && num < ACL_EA_NOID) {
+            *id = num;
+            return 0;
+        }
+    }
+    key[0] = tag == ACL_USER ? 'u' : 'g';
+    memcpy(key + 1, name, len);
+    if(kv_map_get(cache, key, len + 1, &value)) {
+        *id = value;
+        return 0;
+    }
+    bufsize = sysconf(tag == ACL_USER ? _SC_GETPW_R_SIZE_MAX :
+                      _SC_GETGR_R_SIZE_MAX);
+    if(bufsize < 1024)
+        bufsize = 16384;
+    for(;;) {
+        if((buf = malloc(bufsize)) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        if(tag == ACL_USER)
+            nerr = getpwnam_r(name, &pw, buf, bufsize, &pwp);
+        else
+            nerr = getgrnam_r(name, &gr, buf, bufsize, &grp);
+        free(buf);
+        if(nerr != ERANGE)
+            break;
+        bufsize *= 2;
+    }
+    if(pwp == NULL && grp == NULL) {
+        errno = nerr ? nerr : EINVAL;
+        return -1;
+    }
+    *id = tag == ACL_USER ? pw.pw_uid : gr.gr_gid;
+    return kv_map_put(cache, key, len + 1, *id);
+}
+
+/* getfacl escapes special characters in file names as \ooo octal
+   sequences (and backslashes as \\); this undoes it in place */
+static void unquote_path(char *s) {
+    char *d = s;
+
+    while(*s) {
+        if(s[0] == '\\' && s[1] == '\\') {
+            *d++ = '\\';
+            s += 2;
+        } else if(s[0] == '\\' && s[1] >= '0' && s[1] <= '3' &&
+                  s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+            *d++ = ((s[1] - '0') << 6) | ((s[2] - '0') << 3) | (s[3] - '0');
+            s += 4;
+        } else {
+            *d++ = *s++;
+        }
+    }
+    *d = '\0';
+}
+
+/* Parser for the getfacl text format; it is fed one line at a time,
+   and calls emit for each complete record (a "# file:" header and
+   its ACL entries). */
+typedef struct dump_parser dump_parser;
+
+struct dump_parser {
+    int (*emit)(void *data, dump_parser *p);
+    void *data;
+    kv_map names;
+    membuf path;
+    membuf owner;
+    membuf group;
+    entry_rec *recs[2];  /* access and default entries */
+    int count[2];
+    int alloc[2];
+    int in_record;
+    int lax_names;       /* leave unknown names to emit, via name_err */
+    int name_err;        /* set if a name of the record can't be resolved */
+    unsigned long lineno;
+};
+
+static int dump_parser_emit(dump_parser *p) {
+    int ret = 0;
+
+    if(p->in_record)
+        ret = p->emit(p->data, p);
+    p->in_record = 0;
+    p->name_err = 0;
+    p->count[0] = p->count[1] = 0;
+    p->owner.len = p->group.len = 0;
+    return ret;
+}
+
+static int dump_parse_entry(dump_parser *p, char *line) {
+    char *tag, *qual, *perms, *end;
+    entry_rec *r;
+    int which = 0, i;
+
+    if(strncmp(line, "default:", 8) == 0) {
+        which = 1;
+        line += 8;
+    } else if(strncmp(line, "d:", 2) == 0) {
+        which = 1;
+        line += 2;
+    }
+    tag = line;
+    if((qual = strchr(tag, ':')) == NULL)
+        goto inval;
+    *qual++ = '\0';
+    if((perms = strchr(qual, ':')) == NULL)
+        goto inval;
+    *perms++ = '\0';
+    /* strip the "#effective:" comment and trailing blanks */
+    for(end = perms; *end && *end != ' ' && *end != '\t' && *end != '#';
+        end++)
+        ;
+    *end = '\0';
+
+    if(p->count[which] == p->alloc[which]) {
+        int alloc = p->alloc[which] ? p->alloc[which] * 2 : 16;
+        if((r = realloc(p->recs[which], alloc * sizeof(*r))) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        p->recs[which] = r;
+        p->alloc[which] = alloc;
+    }
+    r = p->recs[which] + p->count[which];
+    if(strcmp(tag, "user") == 0 || strcmp(tag, "u") == 0)
+        r->tag = *qual ? ACL_USER : ACL_USER_OBJ;
+    else if(strcmp(tag, "group") == 0 || strcmp(tag, "g") == 0)
+        r->tag = *qual ? ACL_GROUP : ACL_GROUP_OBJ;
+    else if(strcmp(tag, "mask") == 0 || strcmp(tag, "m") == 0)
+        r->tag = ACL_MASK;
+    else if(strcmp(tag, "other") == 0 || strcmp(tag, "o") == 0)
+        r->tag = ACL_OTHER;
+    else
+        goto inval;
+    r->id = ACL_EA_NOID;
+    if(r->tag == ACL_USER || r->tag == ACL_GROUP) {
+        if(resolve_name(&p->names, r->tag, qual, &r->id) == -1) {
+            if(!p->lax_names ||
+               (errno != EINVAL && errno != ENOENT && errno != ESRCH))
+                return -1;
+            if(!p->name_err)
+                p->name_err = errno;
+        }
+    } else if(*qual) {
+        goto inval;
+    }
+    r->perm = 0;
+    for(i = 0; perms[i]; i++) {
+        switch(perms[i]) {
+        case 'r': r->perm |= ACL_READ; break;
+        case 'w': r->perm |= ACL_WRITE; break;
+        case 'x': r->perm |= ACL_EXECUTE; break;
+        case '-': break;
+        default: goto inval;
+        }
+    }
+    p->count[which]++;
+    return 0;
+
+ inval:
+    errno = EINVAL;
+    return -1;
+}
+
+/* Feeds a line (without the newline, NUL terminated) to the parser;
+   returns 0, or -1 with errno set */
+static int dump_parse_line(dump_parser *p, char *line) {
+    membuf *hdr = NULL;
+    size_t len;
+
+    p->lineno++;
+    len = strlen(line);
+    while(len > 0 && (line[len - 1] == '\r' || line[len - 1] == ' ' ||
+                      line[len - 1] == '\t'))
+        line[--len] = '\0';
+    if(len == 0)
+        return dump_parser_emit(p);
+    if(line[0] == '#') {
+        if(strncmp(line, "# file: ", 8) == 0) {
+            if(dump_parser_emit(p) == -1)
+                return -1;
+            unquote_path(line + 8);
+            p->path.len = 0;
+            if(membuf_append(&p->path, line + 8, strlen(line + 8) + 1) == -1)
+                return -1;
+            p->in_record = 1;
+            return 0;
+        }
+        if(strncmp(line, "# owner: ", 9) == 0)
+            hdr = &p->owner;
+        else if(strncmp(line, "# group: ", 9) == 0)
+            hdr = &p->group;
+        if(hdr != NULL && p->in_record) {
+            unquote_path(line + 9);
+            hdr->len = 0;
+            return membuf_append(hdr, line + 9, strlen(line + 9) + 1);
+        }
+        return 0;
+    }
+    if(!p->in_record) {
+        errno = EINVAL;
+        return -1;
+    }
+    return dump_parse_entry(p, line);
+}
+
+static void dump_parser_free(dump_parser *p) {
+    kv_map_free(&p->names);
+    membuf_free(&p->path);
+    membuf_free(&p->owner);
+    membuf_free(&p->group);
+    free(p->recs[0]);
+    free(p->recs[1]);
+}
+
+/* Buffered line reader over a file descriptor or, if file is set,
+   a Python file object (which needs the GIL to be held) */
+typedef struct {
+    int fd;
+    PyObject *file;
+    membuf buf;
+    size_t pos;
+    int eof;
+    int nogil;    /* release the GIL around reads from fd */
+} line_reader;
+
+/* Reads from the Python file of the reader into its buffer; returns
+   the number of bytes read, or -1 with a Python exception set */
+static ssize_t line_reader_pyread(line_reader *r) {
+    PyObject *data, *bytes;
+    ssize_t n;
+
+    if((data = PyObject_CallMethod(r->file, "read", "(i)", 65536)) == NULL)
+        return -1;
+    if(PyUnicode_Check(data)) {
+        bytes = PyUnicode_AsEncodedString(data, Py_FileSystemDefaultEncoding,
+                                          "strict");
+        Py_DECREF(data);
+        if(bytes == NULL)
+            return -1;
+        data = bytes;
+    }
+    if(!PyBytes_Check(data)) {
+        PyErr_SetString(PyExc_TypeError, "read() didn't return a string");
+        Py_DECREF(data);
+        return -1;
+    }
+    n = PyBytes_GET_SIZE(data);
+    if(membuf_append(&r->buf, PyBytes_AS_STRING(data), n) == -1) {
+        Py_DECREF(data);
+        PyErr_NoMemory();
+        return -1;
+    }
+    r->buf.len -= n;
+    Py_DECREF(data);
+    return n;
+}
+
+/* Returns 1 and the next line (NUL terminated, in the reader's
+   buffer), 0 at end of file or -1 on error */
+static int line_reader_next(line_reader *r, char **line) {
+    char *nl;
+    ssize_t n;
+
+    for(;;) {
+        nl = memchr(r->buf.data + r->pos, '\n', r->buf.len - r->pos);
+        if(nl != NULL || (r->eof && r->pos < r->buf.len)) {
+            if(nl == NULL) {
+                if(membuf_reserve(&r->buf, 1) == -1)
+                    return -1;
+                nl = r->buf.data + r->buf.len++;
+            }
+            *nl = '\0';
+            *line = r->buf.data + r->pos;
+            r->pos = nl - r->buf.data + 1;
+            return 1;
+        }
+        if(r->eof)
+            return 0;
+        if(r->pos > 0) {
+            memmove(r->buf.data, r->buf.data + r->pos, r->buf.len - r->pos);
+            r->buf.len -= r->pos;
+            r->pos = 0;
+        }
+        if(membuf_reserve(&r->buf, 65536) == -1)
+            return -1;
+        if(r->file != NULL)
+            n = line_reader_pyread(r);
+        else if(r->nogil) {
+            Py_BEGIN_ALLOW_THREADS
+            n = read(r->fd, r->buf.data + r->buf.len,
+                     r->buf.size - r->buf.len);
+            Py_END_ALLOW_THREADS
+        } else
+            n = read(r->fd, r->buf.data + r->buf.len,
+                     r->buf.size - r->buf.len);
+        if(n == -1) {
+            if(errno == EINTR && r->file == NULL)
+                continue;
+            return -1;
+        }
+        if(n == 0)
+            r->eof = 1;
+        r->buf.len += n;
+    }
+}
+
+/***** Parallel restore *****/
+
+typedef struct {
+    uint64_t rel;      /* offsets into the restore_job name/blob buffers, */
+    uint64_t acc;      /* or pointers when the ACLs come from a snapshot */
+    uint64_t def;
+    uint32_t acc_len;
+    uint32_t def_len;  /* 0 means no default ACL */
+    uint32_t depth;
+    uint32_t seq;
+    int err;
+} restore_item;
+
+typedef struct {
+    restore_item *items;
+    size_t count;
+    size_t alloc;
+    membuf names;
+    membuf blobs;
+    const char *root;
+    size_t *level_end;
+    size_t *level_next;
+    size_t nlevels;
+    int skip_identical;
+    pthread_mutex_t gate_lock;
+    pthread_cond_t gate_cond;
+    int gate;
+    pthread_barrier_t barrier;
+    size_t applied;
+    size_t skipped;
+    err_list *errors;
+} restore_job;
+
+static int restore_add(restore_job *job, const char *rel, uint64_t acc,
+                       uint32_t acc_len, uint64_t def, uint32_t def_len) {
+    restore_item *it;
+    const char *p;
+    uint32_t depth = 0;
+
+    if(job->count == job->alloc) {
+        size_t alloc = job->alloc ? job->alloc * 2 : 1024;
+        if((it = realloc(job->items, alloc * sizeof(*it))) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        job->items = it;
+        job->alloc = alloc;
+    }
+    it = job->items + job->count;
+    it->rel = job->names.len;
+    if(membuf_append(&job->names, rel, strlen(rel) + 1) == -1)
+        return -1;
+    if(strcmp(rel, ".") != 0)
+        for(p = rel, depth = 1; *p; p++)
+            if(*p == '/' && p[1] != '\0' && p[1] != '/')
+                depth++;
+    it->acc = acc;
+    it->acc_len = acc_len;
+    it->def = def;
+    it->def_len = def_len;
+    it->depth = depth;
+    it->seq = job->count;
+    it->err = 0;
+    job->count++;
+    return 0;
+}
+
+static int restore_item_cmp(const void *a, const void *b) {
+    const restore_item *ia = a, *ib = b;
+
+    if(ia->depth != ib->depth)
+        return ia->depth < ib->depth ? -1 : 1;
+    return ia->seq < ib->seq ? -1 : ia->seq > ib->seq;
+}
+
+/* Sets (or removes, if blob is NULL) one ACL of path, unless it is
+   already identical; returns 1 if changed, 0 if not, -1 on error */
+static int restore_one(const char *path, const struct stat *st,
+                       acl_type_t type, const char *blob, uint32_t len,
+                       int skip_identical, membuf *scratch) {
+    const char *name = type == ACL_TYPE_DEFAULT ?
+        ACL_EA_DEFAULT : ACL_EA_ACCESS;
+    int r;
+
+    if(skip_identical) {
+        if((r = read_acl_blob(path, type, st->st_mode, scratch)) == -1)
+            return -1;
+        if(blob == NULL ? r == 0 :
+           (r == 1 && scratch->len == len &&
+            memcmp(scratch->data, blob, len) == 0))
+            return 0;
+    }
+    if(blob == NULL) {
+        if(lremovexattr(path, name) == -1 && errno != ENODATA)
+            return -1;
+    } else if(lsetxattr(path, name, blob, len, 0) == -1) {
+        return -1;
+    }
+    return 1;
+}
+
+static void restore_item_run(restore_job *job, restore_item *it,
+                             membuf *path, membuf *scratch) {
+    const char *rel = job->names.data + it->rel;
+    struct stat st;
+    int a, d = 0;
+
+    path->len = 0;
+    if(strcmp(rel, ".") == 0) {
+        if(membuf_append(path, job->root, strlen(job->root) + 1) == -1)
+            goto err;
+    } else if(membuf_append(path, job->root, strlen(job->root)) == -1 ||
+              membuf_append(path, "/", 1) == -1 ||
+              membuf_append(path, rel, strlen(rel) + 1) == -1) {
+        goto err;
+    }
+    if(lstat(path->data, &st) == -1)
+        goto err;
+    if((a = restore_one(path->data, &st, ACL_TYPE_ACCESS,
+                        (const char*)(uintptr_t)it->acc, it->acc_len,
+                        job->skip_identical, scratch)) == -1)
+        goto err;
+    if(S_ISDIR(st.st_mode) &&
+       (d = restore_one(path->data, &st, ACL_TYPE_DEFAULT,
+                        it->def_len ? (const char*)(uintptr_t)it->def : NULL,
+                        it->def_len, job->skip_identical, scratch)) == -1)
+        goto err;
+    if(a || d)
+        __sync_fetch_and_add(&job->applied, 1);
+    else
+        __sync_fetch_and_add(&job->skipped, 1);
+    return;
+
+ err:
+    it->err = errno;
+}
+
+static void restore_levels(restore_job *job) {
+    membuf path = { NULL, 0, 0 }, scratch = { NULL, 0, 0 };
+    size_t level, idx;
+
+    for(level = 0; level < job->nlevels; level++) {
+        while((idx = __sync_fetch_and_add(job->level_next + level, 1)) <
+              job->level_end[level])
+            restore_item_run(job, job->items + idx, &path, &scratch);
+        /* a directory's ACLs are in place before its children's */
+        pthread_barrier_wait(&job->barrier);
+    }
+    membuf_free(&path);
+    membuf_free(&scratch);
+}
+
+static void* restore_worker(void *arg) {
+    restore_job *job = arg;
+    int gate;
+
+    pthread_mutex_lock(&job->gate_lock);
+    while((gate = job->gate) == 0)
+        pthread_cond_wait(&job->gate_cond, &job->gate_lock);
+    pthread_mutex_unlock(&job->gate_lock);
+    if(gate == 1)
+        restore_levels(job);
+    return NULL;
+}
+
+/* Applies all the items of the job, using nthreads threads, one
+   depth level at a time */
+static int restore_run(restore_job *job, int nthreads) {
+    pthread_t *tids;
+    size_t i;
+    int started, nerr;
+
+    if(job->count == 0)
+        return 0;
+    if((size_t)nthreads > job->count)
+        nthreads = job->count;
+    qsort(job->items, job->count, sizeof(restore_item), restore_item_cmp);
+    job->nlevels = job->items[job->count - 1].depth + 1;
+    job->level_end = calloc(job->nlevels, sizeof(size_t));
+    job->level_next = calloc(job->nlevels, sizeof(size_t));
+    tids = malloc(nthreads * sizeof(pthread_t));
+    if(job->level_end == NULL || job->level_next == NULL || tids == NULL) {
+        free(tids);
+        errno = ENOMEM;
+        return -1;
+    }
+    for(i = 0; i < job->count; i++)
+        job->level_end[job->items[i].depth] = i + 1;
+    for(i = 1; i < job->nlevels; i++) {
+        if(job->level_end[i] == 0)
+            job->level_end[i] = job->level_end[i - 1];
+        job->level_next[i] = job->level_end[i - 1];
+    }
+    /* the workers wait at the gate until we know how many of them
+       could be started, which is the size of the barrier */
+    pthread_mutex_lock(&job->gate_lock);
+    for(started = 0; started < nthreads - 1; started++)
+        if(pthread_create(tids + started, NULL, restore_worker, job) != 0)
+            break;
+    nerr = pthread_barrier_init(&job->barrier, NULL, started + 1);
+    job->gate = nerr == 0 ? 1 : -1;
+    pthread_cond_broadcast(&job->gate_cond);
+    pthread_mutex_unlock(&job->gate_lock);
+    if(nerr == 0)
+        restore_levels(job);
+    for(i = 0; i < (size_t)started; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+    if(nerr != 0) {
+        errno = nerr;
+        return -1;
+    }
+    pthread_barrier_destroy(&job->barrier);
+    for(i = 0; i < job->count; i++)
+        if(job->items[i].err != 0 &&
+           err_list_add(job->errors, job->names.data + job->items[i].rel,
+                        job->items[i].err) == -1)
+            return -1;
+    return 0;
+}
+
+static void restore_job_free(restore_job *job) {
+    pthread_mutex_destroy(&job->gate_lock);
+    pthread_cond_destroy(&job->gate_cond);
+    free(job->items);
+    membuf_free(&job->names);
+    membuf_free(&job->blobs);
+    free(job->level_end);
+    free(job->level_next);
+}
+
+/* Collects the records of a getfacl dump as restore items; the blob
+   offsets are turned into pointers once the whole dump is read */
+static int restore_emit_dump(void *data, dump_parser *p) {
+    restore_job *job = data;
+    uint64_t acc, def;
+    uint32_t acc_len, def_len = 0;
+
+    if(p->count[0] == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if(p->name_err)
+        return err_list_add(job->errors, snap_norm_path(p->path.data),
+                            p->name_err);
+    acc = job->blobs.len;
+    if(recs_to_blob(p->recs[0], p->count[0], &job->blobs) == -1)
+        return -1;
+    acc_len = job->blobs.len - acc;
+    def = job->blobs.len;
+    if(p->count[1] > 0) {
+        if(recs_to_blob(p->recs[1], p->count[1], &job->blobs) == -1)
+            return -1;
+        def_len = job->blobs.len - def;
+    }
+    return restore_add(job, snap_norm_path(p->path.data), acc, acc_len,
+                       def, def_len);
+}
+
+/* Reads a getfacl dump from fd into the job; on parse errors, the
+   line number is stored in lineno */
+static int restore_load_dump(restore_job *job, int fd,
+                             unsigned long *lineno) {
+    dump_parser p;
+    line_reader r;
+    char *line;
+    size_t i;
+    int nret;
+
+    memset(&p, 0, sizeof(p));
+    memset(&r, 0, sizeof(r));
+    p.emit = restore_emit_dump;
+    p.data = job;
+    p.lax_names = 1;
+    r.fd = fd;
+    while((nret = line_reader_next(&r, &line)) == 1)
+        if((nret = dump_parse_line(&p, line)) == -1)
+            break;
+    if(nret == 0)
+        nret = dump_parser_emit(&p);
+    *lineno = p.lineno;
+    dump_parser_free(&p);
+    membuf_free(&r.buf);
+    if(nret == -1)
+        return -1;
+    for(i = 0; i < job->count; i++) {
+        job->items[i].acc += (uintptr_t)job->blobs.data;
+        job->items[i].def += (uintptr_t)job->blobs.data;
+    }
+    return 0;
+}
+
+static int restore_load_snapshot(restore_job *job, Snapshot_Object *snap) {
+    const char *name, *acc, *def = NULL;
+    uint32_t acc_len = 0, def_len = 0, def_id;
+    uint64_t i;
+
+    for(i = 0; i < snap->n_paths; i++) {
+        if(snap_is_deleted(snap, i))
+            continue;
+        name = snap_path_name(snap, i, NULL);
+        def = NULL;
+        acc = snap_acl_blob(snap, le32toh(snap->paths[i].access_id),
+                            &acc_len);
+        def_id = le32toh(snap->paths[i].default_id);
+        def_len = 0;
+        if(def_id != SNAP_NOACL &&
+           (def = snap_acl_blob(snap, def_id, &def_len)) == NULL)
+            name = NULL;
+        if(name == NULL || acc == NULL) {
+            errno = EINVAL;
+            return -1;
+        }
+        if(restore_add(job, name, (uintptr_t)acc, acc_len,
+                       (uintptr_t)def, def_len) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+static char __restore_doc__[] =
+    "restore(source[, root='.', threads=0, skip_identical=True])\n"
+    "Restore the ACLs of a directory tree.\n"
+    "\n"
+    "The ACLs are read either from a snapshot (as written by\n"
+    ":py:func:`snapshot`) or from a dump in the ``getfacl -R`` text\n"
+    "format, and applied with several threads in parallel. Objects\n"
+    "are processed in order of their depth, so that the ACLs (and in\n"
+    "particular the default ACL) of a directory are set before its\n"
+    "children are processed. Directories without a saved default ACL\n"
+    "have their current one removed. The ``# owner:`` and ``# group:``\n"
+    "lines of a dump are ignored. Restoring a delta snapshot only\n"
+    "applies the ACLs of the paths it contains.\n"
+    "\n"
+    "A failure on one object doesn't stop the restore; instead, all\n"
+    "the errors are returned. This includes the objects whose entries\n"
+    "in a dump name unknown users or groups, which are not restored.\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param source: a :py:class:`Snapshot` instance, or the name of a\n"
+    "    snapshot or dump file\n"
+    ":param string root: the directory the saved paths are relative to\n"
+    ":param int threads: the number of threads to use; 0 means one per\n"
+    "    online CPU\n"
+    ":param bool skip_identical: if true, ACLs which are already as saved\n"
+    "    are not written again\n"
+    ":return: a dictionary with the number of objects ``applied`` (changed)\n"
+    "    and ``skipped`` (already identical), and the list of ``errors``,\n"
+    "    as (path, errno, message) tuples\n"
+    ":rtype: dict\n"
+    ":raises ValueError: if the dump file can't be parsed\n"
+    ;
+
+static PyObject* aclmodule_restore(PyObject* obj, PyObject* args,
+                                   PyObject *keywds) {
+    static char *kwlist[] = { "source", "root", "threads", "skip_identical",
+                              NULL };
+    PyObject *source, *fname = NULL, *ret = NULL;
+    Snapshot_Object *snap = NULL;
+    char *root = NULL;
+    int threads = 0, skip_identical = 1, fd = -1, nret;
+    char magic[sizeof(SNAP_MAGIC) - 1];
+    unsigned long lineno = 0;
+    restore_job job;
+    err_list errors;
+
+    memset(&job, 0, sizeof(job));
+    memset(&errors, 0, sizeof(errors));
+    pthread_mutex_init(&job.gate_lock, NULL);
+    pthread_cond_init(&job.gate_cond, NULL);
+    if(!PyArg_ParseTupleAndKeywords(args, keywds, "O|etii", kwlist,
+                                    &source, Py_FileSystemDefaultEncoding,
+                                    &root, &threads, &skip_identical))
+        goto out;
+    if(threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads <= 0)
+        threads = 1;
+    job.root = root != NULL ? root : ".";
+    job.skip_identical = skip_identical;
+    job.errors = &errors;
+
+    if(PyObject_IsInstance(source, (PyObject*)&Snapshot_Type)) {
+        snap = (Snapshot_Object*)source;
+        Py_INCREF(snap);
+    } else {
+#ifdef IS_PY3K
+        if(!PyUnicode_FSConverter(source, &fname))
+            goto out;
+#else
+        if(!PyBytes_Check(source)) {
+            PyErr_SetString(PyExc_TypeError, "argument 1 must be a string"
+                            " or a Snapshot");
+            goto out;
+        }
+        fname = source;
+        Py_INCREF(fname);
+#endif
+        if((fd = open(PyBytes_AS_STRING(fname), O_RDONLY | O_CLOEXEC)) ==
+           -1) {
+            PyErr_SetFromErrnoWithFilename(PyExc_IOError,
+                                           PyBytes_AS_STRING(fname));
+            goto out;
+        }
+        if(read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+           memcmp(magic, SNAP_MAGIC, sizeof(magic)) == 0) {
+            snap = (Snapshot_Object*)Snapshot_new(&Snapshot_Type, NULL, NULL);
+            if(snap == NULL)
+                goto out;
+            if(snap_open(snap, PyBytes_AS_STRING(fname)) == -1) {
+                PyErr_SetFromErrnoWithFilename(PyExc_IOError,
+                                               PyBytes_AS_STRING(fname));
+                goto out;
+            }
+        } else if(lseek(fd, 0, SEEK_SET) == -1) {
+            PyErr_SetFromErrno(PyExc_IOError);
+            goto out;
+        }
+    }
+
+    if(snap != NULL)
+        snap->busy++;
+    Py_BEGIN_ALLOW_THREADS
+    if(snap != NULL)
+        nret = restore_load_snapshot(&job, snap);
+    else
+        nret = restore_load_dump(&job, fd, &lineno);
+    if(nret == 0)
+        nret = restore_run(&job, threads);
+    Py_END_ALLOW_THREADS
+    if(snap != NULL)
+        snap->busy--;
+    if(nret == -1) {
+        if(errno == EINVAL && snap == NULL)
+            PyErr_Format(PyExc_ValueError, "invalid dump file, line %lu",
+                         lineno);
+        else
+            PyErr_SetFromErrno(PyExc_IOError);
+        goto out;
+    }
+    ret = tree_stats(&errors, "applied", job.applied, "skipped", job.skipped);
+
+ out:
+    if(fd != -1)
+        close(fd);
+    Py_XDECREF(fname);
+    Py_XDECREF(snap);
+    PyMem_Free(root);
+    restore_job_free(&job);
+    err_list_free(&errors);
+    return ret;
+}
+
+/***** getfacl text codec *****/
+
+#define SINK_BUFSIZE (1 << 20)
+
+/* Buffered output to a file descriptor or, if file is set, to a
+   Python file object. The latter may be used with the GIL released:
+   tstate then points to the saved thread state, and the GIL is
+   reacquired for each flush. */
+typedef struct {
+    int fd;
+    PyObject *file;
+    PyThreadState **tstate;
+    membuf buf;
+    int pyerr;          /* a Python exception is pending */
+} out_sink;
+
+static int sink_flush(out_sink *s) {
+    PyObject *data, *ret;
+    int nret = 0;
+
+    if(s->buf.len == 0)
+        return 0;
+    if(s->file == NULL) {
+        nret = write_all(s->fd, s->buf.data, s->buf.len);
+    } else {
+        if(s->tstate != NULL)
+            PyEval_RestoreThread(*s->tstate);
+        data = PyBytes_FromStringAndSize(s->buf.data, s->buf.len);
+        ret = data == NULL ? NULL :
+            PyObject_CallMethod(s->file, "write", "(O)", data);
+        Py_XDECREF(data);
+        Py_XDECREF(ret);
+        if(ret == NULL) {
+            s->pyerr = 1;
+            nret = -1;
+        }
+        if(s->tstate != NULL)
+            *s->tstate = PyEval_SaveThread();
+        if(nret == -1)
+            errno = EIO;
+    }
+    s->buf.len = 0;
+    return nret;
+}
+
+static int sink_write(out_sink *s, const char *data, size_t len) {
+    if(membuf_append(&s->buf, data, len) == -1)
+        return -1;
+    return s->buf.len >= SINK_BUFSIZE ? sink_flush(s) : 0;
+}
+
+static int sink_puts(out_sink *s, const char *str) {
+    return sink_write(s, str, strlen(str));
+}
+
+/* Writes str quoted the way getfacl does: backslashes, control
+   characters and the characters in special become \ooo sequences */
+static int sink_quoted(out_sink *s, const char *str, const char *special) {
+    const unsigned char *p;
+    char esc[5];
+
+    for(p = (const unsigned char*)str; *p; p++) {
+        if(*p == '\\') {
+            if(sink_write(s, "\\\\", 2) == -1)
+                return -1;
+        } else if(*p < 0x20 || *p == 0x7f || strchr(special, *p) != NULL) {
+            snprintf(esc, sizeof(esc), "\\%03o", *p);
+            if(sink_write(s, esc, 4) == -1)
+                return -1;
+        } else if(sink_write(s, (const char*)p, 1) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Checks that obj can be used as a sink, and sets it up */
+static int sink_init(out_sink *s, PyObject *obj) {
+    memset(s, 0, sizeof(*s));
+#ifdef IS_PY3K
+    if(PyLong_Check(obj)) {
+#else
+    if(PyInt_Check(obj) || PyLong_Check(obj)) {
+#endif
+        if((s->fd = PyObject_AsFileDescriptor(obj)) == -1)
+            return -1;
+        return 0;
+    }
+    if(!PyObject_HasAttrString(obj, "write")) {
+        PyErr_SetString(PyExc_TypeError, "the output must be a file"
+                        " descriptor or have a write() method");
+        return -1;
+    }
+    s->file = obj;
+    return 0;
+}
+
+/* A cache of user and group names, by id */
+typedef struct {
+    kv_map ids;         /* ('u' or 'g', id) -> offset in names + 1 */
+    membuf names;
+} id_names;
+
+/* Formats the records of a tree or snapshot; record is called for
+   each object, st being NULL when the owner isn't known */
+typedef struct dump_writer dump_writer;
+
+typedef int (*dump_record_fn)(dump_writer *dw, const char *rel, mode_t mode,
+                              const struct stat *st,
+                              const char *acc, size_t acc_len,
+                              const char *def, size_t def_len);
+
+struct dump_writer {
+    out_sink *out;
+    dump_record_fn record;
+    int numeric;
+    int format;         /* for exports */
+    const char *header;
+    id_names names;
+    membuf scratch;
+    membuf scratch_def;
+    err_list *errors;
+    size_t count;
+};
+
+/* Returns the user (tag ACL_USER) or group name for an id, or NULL if
+   there is none */
+static const char* id_name(id_names *c, int tag, uint32_t id) {
+    char key[1 + sizeof(id)], *buf;
+    const char *name = NULL;
+    uint64_t value;
+    long bufsize;
+    struct passwd pw, *pwp = NULL;
+    struct group gr, *grp = NULL;
+    int nerr;
+
+    key[0] = tag == ACL_USER ? 'u' : 'g';
+    memcpy(key + 1, &id, sizeof(id));
+    if(kv_map_get(&c->ids, key, sizeof(key), &value))
+        return value == 0 ? NULL : c->names.data + value - 1;
+    bufsize = sysconf(tag == ACL_USER ? _SC_GETPW_R_SIZE_MAX :
+                      _SC_GETGR_R_SIZE_MAX);
+    if(bufsize < 1024)
+        bufsize = 16384;
+    for(;;) {
+        if((buf = malloc(bufsize)) == NULL)
+            return NULL;
+        if(tag == ACL_USER) {
+            nerr = getpwuid_r(id, &pw, buf, bufsize, &pwp);
+            if(pwp != NULL)
+                name = pw.pw_name;
+        } else {
+            nerr = getgrgid_r(id, &gr, buf, bufsize, &grp);
+            if(grp != NULL)
+                name = gr.gr_name;
+        }
+        if(nerr != ERANGE)
+            break;
+        free(buf);
+        bufsize *= 2;
+    }
+    value = 0;
+    if(name != NULL) {
+        value = c->names.len + 1;
+        if(membuf_append(&c->names, name, strlen(name) + 1) == -1)
+            value = 0;
+    }
+    free(buf);
+    kv_map_put(&c->ids, key, sizeof(key), value);
+    return value == 0 ? NULL : c->names.data + value - 1;
+}
+
+static void id_names_free(id_names *c) {
+    kv_map_free(&c->ids);
+    membuf_free(&c->names);
+}
+
+/* Writes a user or group name, or the id if numeric output was
+   requested or the id has no name */
+static int dump_write_id(dump_writer *dw, int tag, uint32_t id) {
+    const char *name = dw->numeric ? NULL : id_name(&dw->names, tag, id);
+    char num[16];
+
+    if(name != NULL)
+        return sink_quoted(dw->out, name, " \t\n\r");
+    snprintf(num, sizeof(num), "%u", id);
+    return sink_puts(dw->out, num);
+}
+
+static int dump_write_acl(dump_writer *dw, const char *blob, size_t len,
+                          const char *prefix) {
+    entry_rec rec;
+    const char *tag;
+    char perms[5];
+    int count, i;
+
+    if((count = blob_count(blob, len)) == -1)
+        return -1;
+    for(i = 0; i < count; i++) {
+        blob_get(blob, i, &rec);
+        switch(rec.tag) {
+        case ACL_USER_OBJ: case ACL_USER: tag = "user:"; break;
+        case ACL_GROUP_OBJ: case ACL_GROUP: tag = "group:"; break;
+        case ACL_MASK: tag = "mask:"; break;
+        case ACL_OTHER: tag = "other:"; break;
+        default:
+            errno = EINVAL;
+            return -1;
+        }
+        if(sink_puts(dw->out, prefix) == -1 ||
+           sink_puts(dw->out, tag) == -1)
+            return -1;
+        if((rec.tag == ACL_USER || rec.tag == ACL_GROUP) &&
+           dump_write_id(dw, rec.tag, rec.id) == -1)
+            return -1;
+        perms[0] = ':';
+        perms[1] = rec.perm & ACL_READ ? 'r' : '-';
+        perms[2] = rec.perm & ACL_WRITE ? 'w' : '-';
+        perms[3] = rec.perm & ACL_EXECUTE ? 'x' : '-';
+        perms[4] = '\n';
+        if(sink_write(dw->out, perms, sizeof(perms)) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+/* Writes one record in the getfacl format */
+static int dump_write_record(dump_writer *dw, const char *rel, mode_t mode,
+                             const struct stat *st,
+                             const char *acc, size_t acc_len,
+                             const char *def, size_t def_len) {
+    char flags[16];
+
+    if(sink_puts(dw->out, "# file: ") == -1 ||
+       sink_quoted(dw->out, rel, "\n\r") == -1 ||
+       sink_puts(dw->out, "\n") == -1)
+        return -1;
+    if(st != NULL &&
+       (sink_puts(dw->out, "# owner: ") == -1 ||
+        dump_write_id(dw, ACL_USER, st->st_uid) == -1 ||
+        sink_puts(dw->out, "\n# group: ") == -1 ||
+        dump_write_id(dw, ACL_GROUP, st->st_gid) == -1 ||
+        sink_puts(dw->out, "\n") == -1))
+        return -1;
+    if(mode & (S_ISUID | S_ISGID | S_ISVTX)) {
+        snprintf(flags, sizeof(flags), "# flags: %c%c%c\n",
+                 mode & S_ISUID ? 's' : '-', mode & S_ISGID ? 's' : '-',
+                 mode & S_ISVTX ? 't' : '-');
+        if(sink_puts(dw->out, flags) == -1)
+            return -1;
+    }
+    if(dump_write_acl(dw, acc, acc_len, "") == -1 ||
+       (def != NULL && dump_write_acl(dw, def, def_len, "default:") == -1) ||
+       sink_puts(dw->out, "\n") == -1)
+        return -1;
+    dw->count++;
+    return 0;
+}
+
+static int dump_visit(void *data, const walk_item *item, int post) {
+    dump_writer *dw = data;
+    int r = 0;
+
+    if(post || S_ISLNK(item->st->st_mode))
+        return 0;
+    if(read_acl_blob(item->path, ACL_TYPE_ACCESS, item->st->st_mode,
+                     &dw->scratch) == -1 ||
+       (S_ISDIR(item->st->st_mode) &&
+        (r = read_acl_blob(item->path, ACL_TYPE_DEFAULT, 0,
+                           &dw->scratch_def)) == -1))
+        return err_list_add(dw->errors, item->rel, errno);
+    return dw->record(dw, item->rel, item->st->st_mode, item->st,
+                      dw->scratch.data, dw->scratch.len,
+                      r == 1 ? dw->scratch_def.data : NULL,
+                      dw->scratch_def.len);
+}
+
+static int dump_snapshot(dump_writer *dw, const Snapshot_Object *snap) {
+    const char *name, *acc, *def;
+    uint32_t acc_len = 0, def_len = 0, def_id;
+    uint64_t i;
+
+    for(i = 0; i < snap->n_paths; i++) {
+        if(snap_is_deleted(snap, i))
+            continue;
+        name = snap_path_name(snap, i, NULL);
+        acc = snap_acl_blob(snap, le32toh(snap->paths[i].access_id),
+                            &acc_len);
+        def = NULL;
+        def_id = le32toh(snap->paths[i].default_id);
+        if(def_id != SNAP_NOACL &&
+           (def = snap_acl_blob(snap, def_id, &def_len)) == NULL)
+            name = NULL;
+        if(name == NULL || acc == NULL) {
+            errno = EINVAL;
+            return -1;
+        }
+        if(dw->record(dw, name, le32toh(snap->paths[i].mode), NULL,
+                      acc, acc_len, def, def_len) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+static char __dump_doc__[] =
+    "dump(source, file[, numeric=False])\n"
+    "Write ACLs in the ``getfacl -R`` text format.\n"
+    "\n"
+    "The text is generated natively and written in large blocks, so\n"
+    "even dumps of very large trees are cheap. For each object, a\n"
+    "``# file:`` header (followed, for trees, by the ``# owner:`` and\n"
+    "``# group:`` lines, and by ``# flags:`` if the object has the\n"
+    "setuid, setgid or sticky bits) is written, then the access ACL,\n"
+    "then the default ACL entries with a ``default:`` prefix, and an\n"
+    "empty line. Symbolic links are skipped. The output can be read\n"
+    "back via :py:class:`DumpReader`, :py:func:`restore` or\n"
+    "``setfacl --restore``.\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param source: a directory tree, or a :py:class:`Snapshot`; paths\n"
+    "    are written relative to the tree root, which is ``'.'``\n"
+    ":param file: a file descriptor, or an object with a ``write()``\n"
+    "    method accepting bytes (e.g. a file opened in binary mode)\n"
+    ":param bool numeric: if true, user and group ids are written\n"
+    "    instead of names\n"
+    ":return: a dictionary with the number of ``paths`` written and the\n"
+    "    list of ``errors``, as (path, errno, message) tuples, for the\n"
+    "    objects that couldn't be read\n"
+    ":rtype: dict\n"
+    ;
+
+/* Runs the writer over a tree or a snapshot, writing to file (a
+   file descriptor or file object) */
+static PyObject* dump_run(dump_writer *dw, PyObject *source, PyObject *file) {
+    PyObject *root = NULL, *errs, *ret = NULL;
+    Snapshot_Object *snap = NULL;
+    out_sink sink;
+    err_list errors;
+    int nret;
+
+    memset(&errors, 0, sizeof(errors));
+    if(sink_init(&sink, file) == -1)
+        return NULL;
+    if(PyObject_IsInstance(source, (PyObject*)&Snapshot_Type)) {
+        snap = (Snapshot_Object*)source;
+    } else {
+#ifdef IS_PY3K
+        if(!PyUnicode_FSConverter(source, &root))
+            return NULL;
+#else
+        if(!PyBytes_Check(source)) {
+            PyErr_SetString(PyExc_TypeError, "argument 1 must be a string"
+                            " or a Snapshot");
+            return NULL;
+        }
+        root = source;
+        Py_INCREF(root);
+#endif
+    }
+    dw->out = &sink;
+    dw->errors = &errors;
+
+    if(dw->header != NULL && sink_puts(&sink, dw->header) == -1) {
+        if(!sink.pyerr)
+            PyErr_SetFromErrno(PyExc_IOError);
+        goto out;
+    }
+    if(snap != NULL)
+        snap->busy++;
+    Py_BEGIN_ALLOW_THREADS
+    sink.tstate = &_save;
+    if(snap != NULL)
+        nret = dump_snapshot(dw, snap);
+    else
+        nret = walk_tree(PyBytes_AS_STRING(root), dump_visit, dw, &errors);
+    if(nret == 0)
+        nret = sink_flush(&sink);
+    sink.tstate = NULL;
+    Py_END_ALLOW_THREADS
+    if(snap != NULL)
+        snap->busy--;
+    if(nret == -1) {
+        if(!sink.pyerr)
+            PyErr_SetFromErrno(PyExc_IOError);
+        goto out;
+    }
+    if((errs = err_list_to_list(&errors)) != NULL)
+        ret = Py_BuildValue("{snsN}", "paths", (Py_ssize_t)dw->count,
+                            "errors", errs);
+
+ out:
+    Py_XDECREF(root);
+    membuf_free(&sink.buf);
+    err_list_free(&errors);
+    return ret;
+}
+
+static void dump_writer_free(dump_writer *dw) {
+    id_names_free(&dw->names);
+    membuf_free(&dw->scratch);
+    membuf_free(&dw->scratch_def);
+}
+
+static PyObject* aclmodule_dump(PyObject* obj, PyObject* args,
+                                PyObject *keywds) {
+    static char *kwlist[] = { "source", "file", "numeric", NULL };
+    PyObject *source, *file, *ret;
+    dump_writer dw;
+
+    memset(&dw, 0, sizeof(dw));
+    if(!PyArg_ParseTupleAndKeywords(args, keywds, "OO|i", kwlist,
+                                    &source, &file, &dw.numeric))
+        return NULL;
+    dw.record = dump_write_record;
+    ret = dump_run(&dw, source, file);
+    dump_writer_free(&dw);
+    return ret;
+}
+
+/***** NDJSON and CSV export *****/
+
+#define EXPORT_NDJSON 0
+#define EXPORT_CSV 1
+
+static const char* export_tag_name(int tag) {
+    switch(tag) {
+    case ACL_USER_OBJ: return "user_obj";
+    case ACL_USER: return "user";
+    case ACL_GROUP_OBJ: return "group_obj";
+    case ACL_GROUP: return "group";
+    case ACL_MASK: return "mask";
+    case ACL_OTHER: return "other";
+    }
+    return NULL;
+}
+
+/* Writes a JSON string. Invalid UTF-8 bytes are written as lone
+   surrogates (\udcXX), as Python's surrogateescape handler does. */
+static int sink_json_string(out_sink *s, const char *str) {
+    const unsigned char *p = (const unsigned char*)str, *start;
+    char esc[8];
+    int n, i;
+
+    if(sink_write(s, "\"", 1) == -1)
+        return -1;
+    while(*p) {
+        for(start = p; *p >= 0x20 && *p < 0x80 && *p != '"' && *p != '\\';
+            p++)
+            ;
+        if(p > start && sink_write(s, (const char*)start, p - start) == -1)
+            return -1;
+        if(*p == '\0')
+            break;
+        if(*p < 0x80) {
+            if(*p == '"' || *p == '\\')
+                snprintf(esc, sizeof(esc), "\\%c", *p);
+            else
+                snprintf(esc, sizeof(esc), "\\u%04x", *p);
+            n = strlen(esc);
+        } else {
+            /* the length of the UTF-8 sequence, if valid */
+            n = *p >= 0xc2 && *p <= 0xdf ? 2 : *p >= 0xe0 && *p <= 0xef ? 3 :
+                *p >= 0xf0 && *p <= 0xf4 ? 4 : 0;
+            for(i = 1; i < n; i++)
+                if((p[i] & 0xc0) != 0x80)
+                    n = 0;
+            if(n == 3 && ((*p == 0xe0 && p[1] < 0xa0) ||
+                          (*p == 0xed && p[1] >= 0xa0)))
+                n = 0;
+            if(n == 4 && ((*p == 0xf0 && p[1] < 0x90) ||
+                          (*p == 0xf4 && p[1] >= 0x90)))
+                n = 0;
+            if(n > 0) {
+                if(sink_write(s, (const char*)p, n) == -1)
+                    return -1;
+                p += n;
+                continue;
+            }
+            snprintf(esc, sizeof(esc), "\\udc%02x", *p);
+            if(sink_write(s, esc, 6) == -1)
+                return -1;
+            p++;
+            continue;
+        }
+        if(sink_write(s, esc, n) == -1)
+            return -1;
+        p++;
+    }
+    return sink_write(s, "\"", 1);
+}
+
+/* Writes a CSV field, quoted if needed */
+static int sink_csv_field(out_sink *s, const char *str) {
+    const char *p;
+
+    if(strpbrk(str, ",\"\r\n") == NULL)
+        return sink_puts(s, str);
+    if(sink_write(s, "\"", 1) == -1)
+        return -1;
+    for(p = str; *p; p++)
+        if((*p == '"' && sink_write(s, "\"", 1) == -1) ||
+           sink_write(s, p, 1) == -1)
+            return -1;
+    return sink_write(s, "\"", 1);
+}
+
+static int export_write_acl(dump_writer *dw, const char *rel,
+                            const char *type, const char *blob, size_t len) {
+    out_sink *s = dw->out;
+    entry_rec rec;
+    const char *name;
+    char perms[4], eff[4], num[16];
+    unsigned mask = 7;
+    int count, i, csv = dw->format == EXPORT_CSV;
+
+    if((count = blob_count(blob, len)) == -1)
+        return -1;
+    for(i = 0; i < count; i++) {
+        blob_get(blob, i, &rec);
+        if(rec.tag == ACL_MASK)
+            mask = rec.perm;
+    }
+    if(!csv &&
+       (sink_puts(s, "{\"path\": ") == -1 ||
+        sink_json_string(s, rel) == -1 ||
+        sink_puts(s, ", \"type\": \"") == -1 ||
+        sink_puts(s, type) == -1 ||
+        sink_puts(s, "\", \"entries\": [") == -1))
+        return -1;
+    for(i = 0; i < count; i++) {
+        blob_get(blob, i, &rec);
+        if(export_tag_name(rec.tag) == NULL) {
+            errno = EINVAL;
+            return -1;
+        }
+        snprintf(perms, sizeof(perms), "%c%c%c",
+                 rec.perm & ACL_READ ? 'r' : '-',
+                 rec.perm & ACL_WRITE ? 'w' : '-',
+                 rec.perm & ACL_EXECUTE ? 'x' : '-');
+        if(rec.tag == ACL_USER || rec.tag == ACL_GROUP_OBJ ||
+           rec.tag == ACL_GROUP)
+            rec.perm &= mask;
+        snprintf(eff, sizeof(eff), "%c%c%c",
+                 rec.perm & ACL_READ ? 'r' : '-',
+                 rec.perm & ACL_WRITE ? 'w' : '-',
+                 rec.perm & ACL_EXECUTE ? 'x' : '-');
+        num[0] = '\0';
+        name = NULL;
+        if(rec.tag == ACL_USER || rec.tag == ACL_GROUP) {
+            snprintf(num, sizeof(num), "%u", rec.id);
+            if(dw->numeric == 0)
+                name = id_name(&dw->names, rec.tag, rec.id);
+        }
+        if(csv) {
+            if(sink_csv_field(s, rel) == -1 ||
+               sink_puts(s, ",") == -1 ||
+               sink_puts(s, type) == -1 ||
+               sink_puts(s, ",") == -1 ||
+               sink_puts(s, export_tag_name(rec.tag)) == -1 ||
+               sink_puts(s, ",") == -1 ||
+               sink_puts(s, num) == -1 ||
+               (!dw->numeric &&
+                (sink_puts(s, ",") == -1 ||
+                 (name != NULL && sink_csv_field(s, name) == -1))) ||
+               sink_puts(s, ",") == -1 ||
+               sink_puts(s, perms) == -1 ||
+               sink_puts(s, ",") == -1 ||
+               sink_puts(s, eff) == -1 ||
+               sink_puts(s, "\n") == -1)
+                return -1;
+            continue;
+        }
+        if((i > 0 && sink_puts(s, ", ") == -1) ||
+           sink_puts(s, "{\"tag\": \"") == -1 ||
+           sink_puts(s, export_tag_name(rec.tag)) == -1 ||
+           sink_puts(s, "\", \"qualifier\": ") == -1 ||
+           sink_puts(s, num[0] ? num : "null") == -1)
+            return -1;
+        if(!dw->numeric &&
+           (sink_puts(s, ", \"name\": ") == -1 ||
+            (name != NULL ? sink_json_string(s, name) :
+             sink_puts(s, "null")) == -1))
+            return -1;
+        if(sink_puts(s, ", \"perms\": \"") == -1 ||
+           sink_puts(s, perms) == -1 ||
+           sink_puts(s, "\", \"effective\": \"") == -1 ||
+           sink_puts(s, eff) == -1 ||
+           sink_puts(s, "\"}") == -1)
+            return -1;
+    }
+    return csv ? 0 : sink_puts(s, "]}\n");
+}
+
+static int export_write_record(dump_writer *dw, const char *rel, mode_t mode,
+                               const struct stat *st,
+                               const char *acc, size_t acc_len,
+                               const char *def, size_t def_len) {
+    if(export_write_acl(dw, rel, "access", acc, acc_len) == -1 ||
+       (def != NULL &&
+        export_write_acl(dw, rel, "default", def, def_len) == -1))
+        return -1;
+    dw->count++;
+    return 0;
+}
+
+static char __export_doc__[] =
+    "export(source, file[, format='ndjson', names=False])\n"
+    "Export ACLs as NDJSON or CSV records.\n"
+    "\n"
+    "The records are formatted natively and written in large blocks.\n"
+    "With the ``'ndjson'`` format, one JSON object is written per line\n"
+    "for each access ACL and each default ACL, for example::\n"
+    "\n"
+    "  {\"path\": \"a\", \"type\": \"access\", \"entries\": [{\"tag\":\n"
+    "   \"user_obj\", \"qualifier\": null, \"perms\": \"rw-\",\n"
+    "   \"effective\": \"rw-\"}, ...]}\n"
+    "\n"
+    "With the ``'csv'`` format, a header line is written, followed by one\n"
+    "line per ACL entry with the path, type (``access`` or ``default``),\n"
+    "tag, qualifier, name (only with names), permissions and effective\n"
+    "permissions (the permissions masked by the mask entry, for the\n"
+    "entries it applies to). File names which are not valid UTF-8 are\n"
+    "written, in JSON, with the bytes escaped as lone surrogates, as\n"
+    "``os.fsdecode()`` would. Symbolic links are skipped.\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param source: a directory tree, or a :py:class:`Snapshot`\n"
+    ":param file: a file descriptor, or an object with a ``write()``\n"
+    "    method accepting bytes\n"
+    ":param string format: ``'ndjson'`` or ``'csv'``\n"
+    ":param bool names: if true, the user and group names of named\n"
+    "    entries are included (as null/empty if they can't be resolved)\n"
+    ":return: a dictionary with the number of ``paths`` exported and the\n"
+    "    list of ``errors``, as (path, errno, message) tuples\n"
+    ":rtype: dict\n"
+    ;
+
+static PyObject* aclmodule_export(PyObject* obj, PyObject* args,
+                                  PyObject *keywds) {
+    static char *kwlist[] = { "source", "file", "format", "names", NULL };
+    PyObject *source, *file, *ret;
+    const char *format = "ndjson";
+    dump_writer dw;
+    int names = 0;
+
+    memset(&dw, 0, sizeof(dw));
+    if(!PyArg_ParseTupleAndKeywords(args, keywds, "OO|si", kwlist,
+                                    &source, &file, &format, &names))
+        return NULL;
+    if(strcmp(format, "ndjson") == 0) {
+        dw.format = EXPORT_NDJSON;
+    } else if(strcmp(format, "csv") == 0) {
+        dw.format = EXPORT_CSV;
+    } else {
+        PyErr_SetString(PyExc_ValueError, "format must be 'ndjson' or 'csv'");
+        return NULL;
+    }
+    dw.numeric = !names;
+    dw.record = export_write_record;
+    if(dw.format == EXPORT_CSV)
+        dw.header = names ? "path,type,tag,qualifier,name,perms,effective\n" :
+            "path,type,tag,qualifier,perms,effective\n";
+    ret = dump_run(&dw, source, file);
+    dump_writer_free(&dw);
+    return ret;
+}
+
+/***** DumpReader type *****/
+
+typedef struct {
+    PyObject_HEAD
+    dump_parser parser;
+    line_reader reader;
+    int owned_fd;       /* the fd was opened by us */
+    int done;
+    int busy;           /* a read is running without the GIL */
+    PyObject *pending;  /* the last record parsed */
+} DumpReader_Object;
+
+static PyTypeObject DumpReader_Type
+  CPYCHECKER_TYPE_OBJECT_FOR_TYPEDEF("DumpReader_Object");
+
+static int dump_reader_emit(void *data, dump_parser *p) {
+    DumpReader_Object *self = data;
+    PyObject *path, *acc, *def;
+    acl_t acl;
+
+    if(p->count[0] == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if((acl = acl_from_recs(p->recs[0], p->count[0])) == NULL) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return -1;
+    }
+    if((acc = ACL_wrap(acl)) == NULL)
+        return -1;
+    if(p->count[1] == 0) {
+        def = Py_None;
+        Py_INCREF(def);
+    } else if((acl = acl_from_recs(p->recs[1], p->count[1])) == NULL ||
+              (def = ACL_wrap(acl)) == NULL) {
+        if(acl == NULL)
+            PyErr_SetFromErrno(PyExc_IOError);
+        Py_DECREF(acc);
+        return -1;
+    }
+    path = MyPath_FromStringAndSize(p->path.data, strlen(p->path.data));
+    if(path == NULL) {
+        Py_DECREF(acc);
+        Py_DECREF(def);
+        return -1;
+    }
+    if((self->pending = Py_BuildValue("(NNN)", path, acc, def)) == NULL)
+        return -1;
+    return 0;
+}
+
+static void dump_reader_clear(DumpReader_Object *self) {
+    dump_parser_free(&self->parser);
+    memset(&self->parser, 0, sizeof(self->parser));
+    membuf_free(&self->reader.buf);
+    if(self->owned_fd)
+        close(self->reader.fd);
+    Py_CLEAR(self->reader.file);
+    Py_CLEAR(self->pending);
+    memset(&self->reader, 0, sizeof(self->reader));
+    self->reader.fd = -1;
+    self->owned_fd = 0;
+}
+
+static PyObject* DumpReader_new(PyTypeObject* type, PyObject* args,
+                                PyObject *keywds) {
+    PyObject* newreader;
+
+    newreader = type->tp_alloc(type, 0);
+    if(newreader != NULL) {
+        DumpReader_Object *self = (DumpReader_Object*)newreader;
+        memset(&self->parser, 0, sizeof(self->parser));
+        memset(&self->reader, 0, sizeof(self->reader));
+        self->reader.fd = -1;
+        self->owned_fd = 0;
+        self->done = 1;
+        self->busy = 0;
+        self->pending = NULL;
+    }
+    return newreader;
+}
+
+static int DumpReader_init(PyObject* obj, PyObject* args, PyObject *keywds) {
+    DumpReader_Object *self = (DumpReader_Object*)obj;
+    static char *kwlist[] = { "source", NULL };
+    PyObject *source, *fname = NULL;
+
+    if(!PyArg_ParseTupleAndKeywords(args, keywds, "O", kwlist, &source))
+        return -1;
+    if(self->busy) {
+        PyErr_SetString(PyExc_ValueError, "reader is in use");
+        return -1;
+    }
+    dump_reader_clear(self);
+    self->parser.emit = dump_reader_emit;
+    self->parser.data = self;
+#ifdef IS_PY3K
+    if(PyLong_Check(source)) {
+#else
+    if(PyInt_Check(source) || PyLong_Check(source)) {
+#endif
+        if((self->reader.fd = PyObject_AsFileDescriptor(source)) == -1)
+            return -1;
+    } else if(PyBytes_Check(source) || PyUnicode_Check(source)) {
+#ifdef IS_PY3K
+        if(!PyUnicode_FSConverter(source, &fname))
+            return -1;
+#else
+        if(PyUnicode_Check(source))
+            fname = PyUnicode_AsEncodedString(source,
+                                              Py_FileSystemDefaultEncoding,
+                                              "strict");
+        else {
+            fname = source;
+            Py_INCREF(fname);
+        }
+        if(fname == NULL)
+            return -1;
+#endif
+        self->reader.fd = open(PyBytes_AS_STRING(fname), O_RDONLY | O_CLOEXEC);
+        if(self->reader.fd == -1) {
+            PyErr_SetFromErrnoWithFilename(PyExc_IOError,
+                                           PyBytes_AS_STRING(fname));
+            Py_DECREF(fname);
+            return -1;
+        }
+        Py_DECREF(fname);
+        self->owned_fd = 1;
+    } else if(PyObject_HasAttrString(source, "read")) {
+        Py_INCREF(source);
+        self->reader.file = source;
+    } else {
+        PyErr_SetString(PyExc_TypeError, "argument 1 must be a file name,"
+                        " a file descriptor or have a read() method");
+        return -1;
+    }
+    self->reader.nogil = self->reader.file == NULL;
+    self->done = 0;
+    return 0;
+}
+
+static void DumpReader_dealloc(PyObject* obj) {
+    dump_reader_clear((DumpReader_Object*)obj);
+    PyObject_DEL(obj);
+}
+
+static PyObject* DumpReader_iternext(PyObject *obj) {
+    DumpReader_Object *self = (DumpReader_Object*)obj;
+    PyObject *ret;
+    char *line;
+    int nret;
+
+    if(self->busy) {
+        PyErr_SetString(PyExc_ValueError, "reader is in use");
+        return NULL;
+    }
+    while(self->pending == NULL) {
+        if(self->done)
+            return NULL;
+        self->busy++;
+        nret = line_reader_next(&self->reader, &line);
+        self->busy--;
+        if(nret == 1) {
+            nret = dump_parse_line(&self->parser, line);
+        } else if(nret == 0) {
+            self->done = 1;
+            nret = dump_parser_emit(&self->parser);
+        }
+        if(nret == -1) {
+            self->done = 1;
+            if(PyErr_Occurred())
+                return NULL;
+            if(errno == EINVAL)
+                return PyErr_Format(PyExc_ValueError,
+                                    "invalid dump, line %lu",
+                                    self->parser.lineno);
+            return PyErr_SetFromErrno(PyExc_IOError);
+        }
+    }
+    ret = self->pending;
+    self->pending = NULL;
+    return ret;
+}
+
+static char __DumpReader_Type_doc__[] =
+    "Iterator over the records of a getfacl dump\n"
+    "\n"
+    "The text, in the ``getfacl -R`` format (as also written by\n"
+    ":py:func:`dump`), is read in large blocks and parsed natively;\n"
+    "for each ``# file:`` record, a tuple (path, access ACL, default\n"
+    "ACL) is returned, the default ACL being None if the record has\n"
+    "none. User and group names are resolved (once per name), and\n"
+    "numeric ids are accepted too; ``#effective:`` comments are\n"
+    "ignored.\n"
+    "\n"
+    "  >>> for path, acl, default in posix1e.DumpReader(\"acls.txt\"):\n"
+    "  ...     print(path)\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param source: a file name, a file descriptor, or an object with a\n"
+    "    ``read()`` method\n"
+    ":raises ValueError: while iterating, if the text can't be parsed\n"
+    ;
+
+/* The definition of the DumpReader Type */
+static PyTypeObject DumpReader_Type = {
+#ifdef IS_PY3K
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL)
+    0,
+#endif
+    "posix1e.DumpReader",
+    sizeof(DumpReader_Object),
+    0,
+    DumpReader_dealloc, /* tp_dealloc */
+    0,                  /* tp_print */
+    0,                  /* tp_getattr */
+    0,                  /* tp_setattr */
+    0,                  /* tp_compare */
+    0,                  /* tp_repr */
+    0,                  /* tp_as_number */
+    0,                  /* tp_as_sequence */
+    0,                  /* tp_as_mapping */
+    0,                  /* tp_hash */
+    0,                  /* tp_call */
+    0,                  /* tp_str */
+    0,                  /* tp_getattro */
+    0,                  /* tp_setattro */
+    0,                  /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT, /* tp_flags */
+    __DumpReader_Type_doc__, /* tp_doc */
+    0,                  /* tp_traverse */
+    0,                  /* tp_clear */
+    0,                  /* tp_richcompare */
+    0,                  /* tp_weaklistoffset */
+    PyObject_SelfIter,  /* tp_iter */
+    DumpReader_iternext, /* tp_iternext */
+    0,                  /* tp_methods */
+    0,                  /* tp_members */
+    0,                  /* tp_getset */
+    0,                  /* tp_base */
+    0,                  /* tp_dict */
+    0,                  /* tp_descr_get */
+    0,                  /* tp_descr_set */
+    0,                  /* tp_dictoffset */
+    DumpReader_init,    /* tp_init */
+    0,                  /* tp_alloc */
+    DumpReader_new,     /* tp_new */
+};
+
+/***** PAX records *****/
+
+/* The pax extended header records used by star and GNU tar for ACLs.
+   Their value is the ACL in the short text form, with the entries
+   separated by commas and, for named entries, the numeric id as an
+   extra field, e.g. "user::rw-,user:joe:r--:1001,group::r--,...". */
+#define PAX_ACCESS "SCHILY.acl.access"
+#define PAX_DEFAULT "SCHILY.acl.default"
+
+/* State shared by the records of a batch, so that name lookups are
+   cached and buffers reused */
+typedef struct {
+    id_names ids;       /* for encoding */
+    kv_map names;       /* for decoding */
+    int numeric;
+    membuf blob;
+    membuf def;
+    membuf text;
+    membuf out;
+} pax_ctx;
+
+static void pax_ctx_free(pax_ctx *c) {
+    id_names_free(&c->ids);
+    kv_map_free(&c->names);
+    membuf_free(&c->blob);
+    membuf_free(&c->def);
+    membuf_free(&c->text);
+    membuf_free(&c->out);
+}
+
+/* Converts an ACL object, or a raw xattr blob, to a blob in out
+   (replacing its contents); returns 0, or -1 with an exception set */
+static int pax_get_blob(PyObject *obj, membuf *out) {
+    int nret;
+
+    out->len = 0;
+    if(PyObject_IsInstance(obj, (PyObject*)&ACL_Type)) {
+        if(ACL_ready((ACL_Object*)obj) == -1)
+            return -1;
+        if(ACL_get_blob((ACL_Object*)obj, out) == -1) {
+            PyErr_SetFromErrno(PyExc_IOError);
+            return -1;
+        }
+        return 0;
+    } else if(PyBytes_Check(obj)) {
+        if(blob_count(PyBytes_AS_STRING(obj), PyBytes_GET_SIZE(obj)) == -1) {
+            PyErr_SetString(PyExc_ValueError, "invalid ACL blob");
+            return -1;
+        }
+        nret = membuf_append(out, PyBytes_AS_STRING(obj),
+                             PyBytes_GET_SIZE(obj));
+    } else {
+        PyErr_SetString(PyExc_TypeError, "expected an ACL or a bytes"
+                        " object");
+        return -1;
+    }
+    if(nret == -1)
+        PyErr_NoMemory();
+    return nret;
+}
+
+/* Appends a record with the text of the blob to c->out; returns 0
+   or -1 with errno set */
+static int pax_put_record(pax_ctx *c, const char *key,
+                          const char *blob, size_t len) {
+    entry_rec rec;
+    const char *tag, *name;
+    char buf[32];
+    size_t body, total, digits;
+    int count, i;
+
+    if((count = blob_count(blob, len)) == -1)
+        return -1;
+    c->text.len = 0;
+    for(i = 0; i < count; i++) {
+        blob_get(blob, i, &rec);
+        switch(rec.tag) {
+        case ACL_USER_OBJ: case ACL_USER: tag = "user:"; break;
+        case ACL_GROUP_OBJ: case ACL_GROUP: tag = "group:"; break;
+        case ACL_MASK: tag = "mask:"; break;
+        case ACL_OTHER: tag = "other:"; break;
+        default:
+            errno = EINVAL;
+            return -1;
+        }
+        if((i > 0 && membuf_append(&c->text, ",", 1) == -1) ||
+           membuf_append(&c->text, tag, strlen(tag)) == -1)
+            return -1;
+        if(rec.tag == ACL_USER || rec.tag == ACL_GROUP) {
+            name = c->numeric ? NULL : id_name(&c->ids, rec.tag, rec.id);
+            if(name == NULL) {
+                snprintf(buf, sizeof(buf), "%u", rec.id);
+                name = buf;
+            }
+            if(membuf_append(&c->text, name, strlen(name)) == -1)
+                return -1;
+        }
+        snprintf(buf, sizeof(buf), ":%c%c%c",
+                 rec.perm & ACL_READ ? 'r' : '-',
+                 rec.perm & ACL_WRITE ? 'w' : '-',
+                 rec.perm & ACL_EXECUTE ? 'x' : '-');
+        if(membuf_append(&c->text, buf, 4) == -1)
+            return -1;
+        if(rec.tag == ACL_USER || rec.tag == ACL_GROUP) {
+            snprintf(buf, sizeof(buf), ":%u", rec.id);
+            if(membuf_append(&c->text, buf, strlen(buf)) == -1)
+                return -1;
+        }
+    }
+    /* "<length> <key>=<value>\n", where the length counts itself */
+    body = 1 + strlen(key) + 1 + c->text.len + 1;
+    for(digits = 1; ; digits++) {
+        total = body + digits;
+        snprintf(buf, sizeof(buf), "%zu", total);
+        if(strlen(buf) == digits)
+            break;
+    }
+    if(membuf_append(&c->out, buf, digits) == -1 ||
+       membuf_append(&c->out, " ", 1) == -1 ||
+       membuf_append(&c->out, key, strlen(key)) == -1 ||
+       membuf_append(&c->out, "=", 1) == -1 ||
+       membuf_append(&c->out, c->text.data, c->text.len) == -1 ||
+       membuf_append(&c->out, "\n", 1) == -1)
+        return -1;
+    return 0;
+}
+
+/* Parses the text of an ACL record into a blob in out; returns 0, or
+   -1 with errno set (EINVAL for syntax errors) */
+static int pax_parse_acl(pax_ctx *c, const char *value, size_t len,
+                         membuf *out) {
+    entry_rec *recs = NULL, *r;
+    char *text, *tok, *save = NULL, *fields[4], *end;
+    int count = 0, alloc = 0, nf, i, ret = -1;
+    unsigned long num;
+
+    if((text = malloc(len + 1)) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(text, value, len);
+    text[len] = '\0';
+    for(tok = strtok_r(text, ",\n", &save); tok != NULL;
+        tok = strtok_r(NULL, ",\n", &save)) {
+        while(*tok == ' ' || *tok == '\t')
+            tok++;
+        if(*tok == '\0' || *tok == '#')
+            continue;
+        if(count == alloc) {
+            alloc = alloc ? alloc * 2 : 16;
+            if((r = realloc(recs, alloc * sizeof(*r))) == NULL) {
+                errno = ENOMEM;
+                goto out;
+            }
+            recs = r;
+        }
+        r = recs + count;
+        for(nf = 1, fields[0] = tok; nf < 4; nf++) {
+            if((fields[nf] = strchr(fields[nf - 1], ':')) == NULL)
+                break;
+            *fields[nf]++ = '\0';
+        }
+        if(nf < 3)
+            goto inval;
+        if(strcmp(fields[0], "user") == 0 || strcmp(fields[0], "u") == 0)
+            r->tag = *fields[1] ? ACL_USER : ACL_USER_OBJ;
+        else if(strcmp(fields[0], "group") == 0 ||
+                strcmp(fields[0], "g") == 0)
+            r->tag = *fields[1] ? ACL_GROUP : ACL_GROUP_OBJ;
+        else if(strcmp(fields[0], "mask") == 0 ||
+                strcmp(fields[0], "m") == 0)
+            r->tag = ACL_MASK;
+        else if(strcmp(fields[0], "other") == 0 ||
+                strcmp(fields[0], "o") == 0)
+            r->tag = ACL_OTHER;
+        else
+            goto inval;
+        r->id = ACL_EA_NOID;
+        if(r->tag == ACL_USER || r->tag == ACL_GROUP) {
+            /* the numeric id, if present, takes precedence */
+            if(nf == 4) {
+                errno = 0;
+                num = strtoul(fields[3], &end, 10);
+                if(*end != '\0' || end == fields[3] || errno != 0 ||
+                   num >= ACL_EA_NOID)
+                    goto inval;
+                r->id = num;
+            } else if(resolve_name(&c->names, r->tag, fields[1],
+                                   &r->id) == -1) {
+                goto out;
+            }
+        } else if(*fields[1] || nf == 4) {
+            goto inval;
+        }
+        r->perm = 0;
+        for(i = 0; fields[2][i]; i++) {
+            switch(fields[2][i]) {
+            case 'r': r->perm |= ACL_READ; break;
+            case 'w': r->perm |= ACL_WRITE; break;
+            case 'x': r->perm |= ACL_EXECUTE; break;
+            case '-': break;
+            default: goto inval;
+            }
+        }
+        count++;
+    }
+    out->len = 0;
+    ret = recs_to_blob(recs, count, out);
+    goto out;
+
+ inval:
+    errno = EINVAL;
+ out:
+    free(text);
+    free(recs);
+    return ret;
+}
+
+/* Finds the ACL records of a pax extended header; *has_acc and
+   *has_def tell whether they were present. Other records are
+   ignored. Returns 0, or -1 with errno set. */
+static int pax_parse(pax_ctx *c, const char *data, size_t len,
+                     int *has_acc, int *has_def) {
+    const char *rec, *key, *eq;
+    size_t pos = 0, reclen;
+    membuf *dst;
+
+    *has_acc = *has_def = 0;
+    while(pos < len) {
+        rec = data + pos;
+        for(reclen = 0, key = rec; key < data + len && *key >= '0' &&
+                *key <= '9'; key++) {
+            reclen = reclen * 10 + (*key - '0');
+            if(reclen > len)
+                goto inval;
+        }
+        if(key == rec || key >= data + len || *key != ' ' ||
+           reclen > len - pos || rec + reclen <= key + 1 ||
+           rec[reclen - 1] != '\n')
+            goto inval;
+        key++;
+        if((eq = memchr(key, '=', rec + reclen - key)) == NULL)
+            goto inval;
+        dst = NULL;
+        if((size_t)(eq - key) == strlen(PAX_ACCESS) &&
+           memcmp(key, PAX_ACCESS, eq - key) == 0) {
+            dst = &c->blob;
+            *has_acc = 1;
+        } else if((size_t)(eq - key) == strlen(PAX_DEFAULT) &&
+                  memcmp(key, PAX_DEFAULT, eq - key) == 0) {
+            dst = &c->def;
+            *has_def = 1;
+        }
+        if(dst != NULL &&
+           pax_parse_acl(c, eq + 1, rec + reclen - 1 - (eq + 1), dst) == -1)
+            return -1;
+        pos += reclen;
+    }
+    return 0;
+
+ inval:
+    errno = EINVAL;
+    return -1;
+}
+
+/* Encodes a pair of ACLs (either may be None) as bytes */
+static PyObject* pax_encode_pair(pax_ctx *c, PyObject *acc, PyObject *def) {
+    c->out.len = 0;
+    if(acc != Py_None) {
+        if(pax_get_blob(acc, &c->blob) == -1)
+            return NULL;
+        if(pax_put_record(c, PAX_ACCESS, c->blob.data, c->blob.len) == -1)
+            return PyErr_SetFromErrno(PyExc_IOError);
+    }
+    if(def != Py_None) {
+        if(pax_get_blob(def, &c->blob) == -1)
+            return NULL;
+        if(pax_put_record(c, PAX_DEFAULT, c->blob.data, c->blob.len) == -1)
+            return PyErr_SetFromErrno(PyExc_IOError);
+    }
+    return PyBytes_FromStringAndSize(c->out.data, c->out.len);
+}
+
+static PyObject* pax_blob_object(const membuf *blob, int present, int raw) {
+    if(!present)
+        Py_RETURN_NONE;
+    if(raw)
+        return PyBytes_FromStringAndSize(blob->data, blob->len);
+    return ACL_from_blob(blob->data, blob->len);
+}
+
+/* Decodes the ACLs of a pax header into an (access, default) tuple */
+static PyObject* pax_decode_header(pax_ctx *c, PyObject *data, int raw) {
+    Py_buffer view;
+    PyObject *acc, *def;
+    int has_acc, has_def, nret;
+
+    if(PyObject_GetBuffer(data, &view, PyBUF_SIMPLE) == -1)
+        return NULL;
+    nret = pax_parse(c, view.buf, view.len, &has_acc, &has_def);
+    PyBuffer_Release(&view);
+    if(nret == -1) {
+        if(errno == EINVAL)
+            PyErr_SetString(PyExc_ValueError, "invalid pax header");
+        else
+            PyErr_SetFromErrno(PyExc_IOError);
+        return NULL;
+    }
+    if((acc = pax_blob_object(&c->blob, has_acc, raw)) == NULL)
+        return NULL;
+    if((def = pax_blob_object(&c->def, has_def, raw)) == NULL) {
+        Py_DECREF(acc);
+        return NULL;
+    }
+    return Py_BuildValue("(NN)", acc, def);
+}
+
+static char __pax_encode_doc__[] =
+    "pax_encode([acl=None, default=None, numeric=False])\n"
+    "Encode ACLs as pax extended header records.\n"
+    "\n"
+    "The ``SCHILY.acl.access`` and ``SCHILY.acl.default`` records, as\n"
+    "written by star and GNU tar, are generated for the ACLs which are\n"
+    "not None; named entries include both the name and the numeric id.\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param acl: the access ACL, as an :py:class:`ACL` or a raw\n"
+    "    ``system.posix_acl_access`` extended attribute value\n"
+    ":param default: the default ACL, in the same forms\n"
+    ":param bool numeric: if true, ids are written instead of names\n"
+    ":return: the records\n"
+    ":rtype: bytes\n"
+    ;
+
+static PyObject* aclmodule_pax_encode(PyObject* obj, PyObject* args,
+                                      PyObject *keywds) {
+    static char *kwlist[] = { "acl", "default", "numeric", NULL };
+    PyObject *acc = Py_None, *def = Py_None, *ret;
+    pax_ctx c;
+
+    memset(&c, 0, sizeof(c));
+    if(!PyArg_ParseTupleAndKeywords(args, keywds, "|OOi", kwlist,
+                                    &acc, &def, &c.numeric))
+        return NULL;
+    ret = pax_encode_pair(&c, acc, def);
+    pax_ctx_free(&c);
+    return ret;
+}
+
+static char __pax_decode_doc__[] =
+    "pax_decode(data[, raw=False])\n"
+    "Decode the ACL records of a pax extended header.\n"
+    "\n"
+    "Records other than ``SCHILY.acl.access`` and ``SCHILY.acl.default``\n"
+    "are ignored. The numeric ids of named entries are used when\n"
+    "present; otherwise, the names are resolved.\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param data: the extended header data (bytes or any object\n"
+    "    supporting the buffer protocol)\n"
+    ":param bool raw: if true, the ACLs are returned as raw extended\n"
+    "    attribute values (bytes) instead of :py:class:`ACL` objects\n"
+    ":return: a tuple (access ACL, default ACL); each is None if the\n"
+    "    corresponding record is missing\n"
+    ":raises ValueError: if the data can't be parsed\n"
+    ;
+
+static PyObject* aclmodule_pax_decode(PyObject* obj, PyObject* args,
+                                      PyObject *keywds) {
+    static char *kwlist[] = { "data", "raw", NULL };
+    PyObject *data, *ret;
+    int raw = 0;
+    pax_ctx c;
+
+    memset(&c, 0, sizeof(c));
+    if(!PyArg_ParseTupleAndKeywords(args, keywds, "O|i", kwlist,
+                                    &data, &raw))
+        return NULL;
+    ret = pax_decode_header(&c, data, raw);
+    pax_ctx_free(&c);
+    return ret;
+}
+
+static char __pax_encode_many_doc__[] =
+    "pax_encode_many(items[, numeric=False])\n"
+    "Encode the ACLs of many files as pax extended header records.\n"
+    "\n"
+    "This is the batched version of :py:func:`pax_encode`; name lookups\n"
+    "are shared by the whole batch.\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param items: an iterable of (access ACL, default ACL) pairs, in\n"
+    "    the forms accepted by :py:func:`pax_encode`\n"
+    ":param bool numeric: if true, ids are written instead of names\n"
+    ":return: the records for each item\n"
+    ":rtype: list of bytes\n"
+    ;
+
+static PyObject* aclmodule_pax_encode_many(PyObject* obj, PyObject* args,
+                                           PyObject *keywds) {
+    static char *kwlist[] = { "items", "numeric", NULL };
+    PyObject *items, *iter, *item, *rec, *ret = NULL;
+    PyObject *acc, *def;
+    pax_ctx c;
+
+    memset(&c, 0, sizeof(c));
+    if(!PyArg_ParseTupleAndKeywords(args, keywds, "O|i", kwlist,
+                                    &items, &c.numeric))
+        return NULL;
+    if((iter = PyObject_GetIter(items)) == NULL)
+        return NULL;
+    if((ret = PyList_New(0)) == NULL)
+        goto out;
+    while((item = PyIter_Next(iter)) != NULL) {
+        if(!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+            PyErr_SetString(PyExc_TypeError, "items must be (acl, default)"
+                            " tuples");
+            rec = NULL;
+        } else {
+            acc = PyTuple_GET_ITEM(item, 0);
+            def = PyTuple_GET_ITEM(item, 1);
+            rec = pax_encode_pair(&c, acc, def);
+        }
+        Py_DECREF(item);
+        if(rec == NULL || PyList_Append(ret, rec) == -1) {
+            Py_XDECREF(rec);
+            Py_CLEAR(ret);
+            goto out;
+        }
+        Py_DECREF(rec);
+    }
+    if(PyErr_Occurred())
+        Py_CLEAR(ret);
+
+ out:
+    Py_DECREF(iter);
+    pax_ctx_free(&c);
+    return ret;
+}
+
+static char __pax_decode_many_doc__[] =
+    "pax_decode_many(headers[, raw=False])\n"
+    "Decode the ACL records of many pax extended headers.\n"
+    "\n"
+    "This is the batched version of :py:func:`pax_decode`; name lookups\n"
+    "are shared by the whole batch.\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param headers: an iterable of extended header data\n"
+    ":param bool raw: if true, the ACLs are returned as raw extended\n"
+    "    attribute values\n"
+    ":return: an (access ACL, default ACL) tuple for each header\n"
+    ":rtype: list\n"
+    ":raises ValueError: if some header can't be parsed\n"
+    ;
+
+static PyObject* aclmodule_pax_decode_many(PyObject* obj, PyObject* args,
+                                           PyObject *keywds) {
+    static char *kwlist[] = { "headers", "raw", NULL };
+    PyObject *headers, *iter, *item, *rec, *ret = NULL;
+    int raw = 0;
+    pax_ctx c;
+
+    memset(&c, 0, sizeof(c));
+    if(!PyArg_ParseTupleAndKeywords(args, keywds, "O|i", kwlist,
+                                    &headers, &raw))
+        return NULL;
+    if((iter = PyObject_GetIter(headers)) == NULL)
+        return NULL;
+    if((ret = PyList_New(0)) == NULL)
+        goto out;
+    while((item = PyIter_Next(iter)) != NULL) {
+        rec = pax_decode_header(&c, item, raw);
+        Py_DECREF(item);
+        if(rec == NULL || PyList_Append(ret, rec) == -1) {
+            Py_XDECREF(rec);
+            Py_CLEAR(ret);
+            goto out;
+        }
+        Py_DECREF(rec);
+    }
+    if(PyErr_Occurred())
+        Py_CLEAR(ret);
+
+ out:
+    Py_DECREF(iter);
+    pax_ctx_free(&c);
+    return ret;
+}
+
+/***** Packed ACL batches *****/
+
+/* A compact format for shipping many ACLs at once:
+
+   - the magic PACK_MAGIC and a version byte
+   - varint: the number of distinct ACLs, then for each of them
+     varint: the number of entries, and for each entry a byte holding
+     the tag code (pack_tags) and the permissions (code << 3 | perms),
+     followed for named entries by the varint qualifier
+   - varint: the number of items, then for each item a varint which is
+     the index of its ACL plus one, or 0 for None
+
+   Varints are unsigned LEB128 (7 bits per byte, low bits first).
+*/
+#define PACK_MAGIC "PYACLPK"
+#define PACK_VERSION 1
+
+static const int pack_tags[] = {
+    ACL_USER_OBJ, ACL_USER, ACL_GROUP_OBJ, ACL_GROUP, ACL_MASK, ACL_OTHER
+};
+
+#define PACK_NTAGS ((int)(sizeof(pack_tags) / sizeof(pack_tags[0])))
+
+static int varint_put(membuf *out, uint64_t v) {
+    char buf[10];
+    int n = 0;
+
+    do {
+        buf[n++] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+        v >>= 7;
+    } while(v != 0);
+    return membuf_append(out, buf, n);
+}
+
+/* Reads a varint at *pos; returns 0, or -1 if it is truncated or too
+   large */
+static int varint_get(const unsigned char *data, size_t len, size_t *pos,
+                      uint64_t *v) {
+    int shift;
+
+    *v = 0;
+    for(shift = 0; shift < 64 && *pos < len; shift += 7) {
+        *v |= (uint64_t)(data[*pos] & 0x7f) << shift;
+        if((data[(*pos)++] & 0x80) == 0)
+            return 0;
+    }
+    return -1;
+}
+
+static int pack_acl_blob(membuf *out, const char *blob, size_t len) {
+    entry_rec rec;
+    unsigned char b;
+    int count, i, code;
+
+    count = blob_count(blob, len);
+    if(varint_put(out, count) == -1)
+        return -1;
+    for(i = 0; i < count; i++) {
+        blob_get(blob, i, &rec);
+        for(code = 0; code < PACK_NTAGS && pack_tags[code] != rec.tag; code++)
+            ;
+        if(code == PACK_NTAGS) {
+            errno = EINVAL;
+            return -1;
+        }
+        b = code << 3 | (rec.perm & 7);
+        if(membuf_append(out, (char*)&b, 1) == -1)
+            return -1;
+        if((rec.tag == ACL_USER || rec.tag == ACL_GROUP) &&
+           varint_put(out, rec.id) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+static char __pack_acls_doc__[] =
+    "pack_acls(acls[, buffer])\n"
+    "Serialize many ACLs into a single buffer.\n"
+    "\n"
+    "The result is a compact, versioned binary format in which each\n"
+    "distinct ACL is stored only once and qualifiers are stored as\n"
+    "variable-length integers; it can be read back, without creating\n"
+    "any ACL objects until they are needed, by :py:class:`PackedACLs`.\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param acls: an iterable of :py:class:`ACL` objects, raw\n"
+    "    ``system.posix_acl_*`` extended attribute values (bytes), or\n"
+    "    None\n"
+    ":param buffer: if given, a writable buffer (e.g. a\n"
+    "    ``bytearray``, or a ``memoryview`` of shared memory) to write\n"
+    "    into, instead of returning a new bytes object\n"
+    ":return: the packed data or, with a buffer, its size\n"
+    ":raises ValueError: if the buffer is too small\n"
+    ;
+
+static PyObject* aclmodule_pack_acls(PyObject* obj, PyObject* args) {
+    PyObject *acls, *target = NULL, *iter, *item, *ret = NULL;
+    blob_table table;
+    membuf blob = { NULL, 0, 0 }, ids = { NULL, 0, 0 };
+    membuf out = { NULL, 0, 0 };
+    Py_buffer view;
+    uint32_t *item_ids, item_id;
+    int64_t id;
+    size_t i, n;
+    char version = PACK_VERSION;
+
+    memset(&table, 0, sizeof(table));
+    if(!PyArg_ParseTuple(args, "O|O", &acls, &target))
+        return NULL;
+    if((iter = PyObject_GetIter(acls)) == NULL)
+        return NULL;
+    while((item = PyIter_Next(iter)) != NULL) {
+        id = 0;
+        if(item != Py_None) {
+            if(pax_get_blob(item, &blob) == -1)
+                id = -1;
+            else if((id = blob_table_add(&table, blob.data, blob.len)) == -1)
+                PyErr_NoMemory();
+            else
+                id++;
+        }
+        Py_DECREF(item);
+        if(id == -1)
+            goto out;
+        item_id = id;
+        if(membuf_append(&ids, &item_id, sizeof(item_id)) == -1) {
+            PyErr_NoMemory();
+            goto out;
+        }
+    }
+    if(PyErr_Occurred())
+        goto out;
+
+    item_ids = (uint32_t*)ids.data;
+    n = ids.len / sizeof(uint32_t);
+    if(membuf_append(&out, PACK_MAGIC, sizeof(PACK_MAGIC) - 1) == -1 ||
+       membuf_append(&out, &version, 1) == -1 ||
+       varint_put(&out, table.count) == -1)
+        goto nomem;
+    for(i = 0; i < table.count; i++)
+        if(pack_acl_blob(&out, table.blobs.data + table.offs[i],
+                         table.lens[i]) == -1)
+            goto nomem;
+    if(varint_put(&out, n) == -1)
+        goto nomem;
+    for(i = 0; i < n; i++)
+        if(varint_put(&out, item_ids[i]) == -1)
+            goto nomem;
+
+    if(target == NULL) {
+        ret = PyBytes_FromStringAndSize(out.data, out.len);
+    } else {
+        if(PyObject_GetBuffer(target, &view, PyBUF_WRITABLE) == -1)
+            goto out;
+        if((size_t)view.len < out.len)
+            PyErr_Format(PyExc_ValueError, "buffer too small, %lu bytes"
+                         " needed", (unsigned long)out.len);
+        else
+            memcpy(view.buf, out.data, out.len);
+        PyBuffer_Release(&view);
+        if(!PyErr_Occurred())
+            ret = PyInt_FromSize_t(out.len);
+    }
+    goto out;
+
+ nomem:
+    PyErr_NoMemory();
+ out:
+    Py_DECREF(iter);
+    blob_table_free(&table);
+    membuf_free(&blob);
+    membuf_free(&ids);
+    membuf_free(&out);
+    return ret;
+}
+
+/***** PackedACLs type *****/
+
+typedef struct {
+    PyObject_HEAD
+    Py_buffer view;
+    int has_view;
+    uint64_t n_acls;
+    uint64_t n_items;
+    size_t *acl_offs;   /* offset of each distinct ACL */
+    uint32_t *items;    /* ACL index + 1, or 0 */
+} PackedACLs_Object;
+
+static PyTypeObject PackedACLs_Type
+  CPYCHECKER_TYPE_OBJECT_FOR_TYPEDEF("PackedACLs_Object");
+
+static void packed_clear(PackedACLs_Object *self) {
+    if(self->has_view)
+        PyBuffer_Release(&self->view);
+    self->has_view = 0;
+    free(self->acl_offs);
+    free(self->items);
+    self->acl_offs = NULL;
+    self->items = NULL;
+    self->n_acls = self->n_items = 0;
+}
+
+/* Builds the index of the packed data; returns 0, or -1 with errno
+   set (EINVAL if the data is malformed) */
+static int packed_index(PackedACLs_Object *self) {
+    const unsigned char *data = self->view.buf;
+    size_t len = self->view.len, pos = sizeof(PACK_MAGIC);
+    uint64_t i, j, count, v;
+
+    if(len < pos || memcmp(data, PACK_MAGIC, pos - 1) != 0 ||
+       data[pos - 1] != PACK_VERSION)
+        goto inval;
+    if(varint_get(data, len, &pos, &self->n_acls) == -1 ||
+       self->n_acls > len)
+        goto inval;
+    if((self->acl_offs = malloc((self->n_acls + 1) * sizeof(size_t))) == NULL)
+        goto nomem;
+    for(i = 0; i < self->n_acls; i++) {
+        self->acl_offs[i] = pos;
+        if(varint_get(data, len, &pos, &count) == -1)
+            goto inval;
+        for(j = 0; j < count; j++) {
+            if(pos >= len || (data[pos] >> 3) >= PACK_NTAGS)
+                goto inval;
+            v = data[pos++] >> 3;
+            if((pack_tags[v] == ACL_USER || pack_tags[v] == ACL_GROUP) &&
+               (varint_get(data, len, &pos, &v) == -1 || v >= ACL_EA_NOID))
+                goto inval;
+        }
+    }
+    if(varint_get(data, len, &pos, &self->n_items) == -1 ||
+       self->n_items > len - pos)
+        goto inval;
+    if((self->items = malloc((self->n_items + 1) * sizeof(uint32_t))) == NULL)
+        goto nomem;
+    for(i = 0; i < self->n_items; i++) {
+        if(varint_get(data, len, &pos, &v) == -1 || v > self->n_acls)
+            goto inval;
+        self->items[i] = v;
+    }
+    if(pos != len)
+        goto inval;
+    return 0;
+
+ nomem:
+    errno = ENOMEM;
+    return -1;
+ inval:
+    errno = EINVAL;
+    return -1;
+}
+
+static PyObject* PackedACLs_new(PyTypeObject* type, PyObject* args,
+                                PyObject *keywds) {
+    PyObject* newobj;
+
+    newobj = type->tp_alloc(type, 0);
+    if(newobj != NULL) {
+        ((PackedACLs_Object*)newobj)->has_view = 0;
+        ((PackedACLs_Object*)newobj)->acl_offs = NULL;
+        ((PackedACLs_Object*)newobj)->items = NULL;
+    }
+    return newobj;
+}
+
+static int PackedACLs_init(PyObject* obj, PyObject* args, PyObject *keywds) {
+    PackedACLs_Object *self = (PackedACLs_Object*)obj;
+    static char *kwlist[] = { "data", NULL };
+    PyObject *data;
+
+    if(!PyArg_ParseTupleAndKeywords(args, keywds, "O", kwlist, &data))
+        return -1;
+    packed_clear(self);
+    if(PyObject_GetBuffer(data, &self->view, PyBUF_SIMPLE) == -1)
+        return -1;
+    self->has_view = 1;
+    if(packed_index(self) == -1) {
+        if(errno == EINVAL)
+            PyErr_SetString(PyExc_ValueError, "invalid packed ACL data");
+        else
+            PyErr_SetFromErrno(PyExc_IOError);
+        packed_clear(self);
+        return -1;
+    }
+    return 0;
+}
+
+static void PackedACLs_dealloc(PyObject* obj) {
+    packed_clear((PackedACLs_Object*)obj);
+    PyObject_DEL(obj);
+}
+
+static Py_ssize_t PackedACLs_length(PyObject *obj) {
+    return ((PackedACLs_Object*)obj)->n_items;
+}
+
+static PyObject* PackedACLs_item(PyObject *obj, Py_ssize_t idx) {
+    PackedACLs_Object *self = (PackedACLs_Object*)obj;
+    const unsigned char *data = self->view.buf;
+    size_t len = self->view.len, pos;
+    uint64_t count, i, v;
+    entry_rec *recs;
+    acl_t acl;
+
+    if(idx < 0 || (uint64_t)idx >= self->n_items) {
+        PyErr_SetString(PyExc_IndexError, "index out of range");
+        return NULL;
+    }
+    if(self->items[idx] == 0)
+        Py_RETURN_NONE;
+    /* the data was validated when indexed, but a writable buffer may
+       have been changed since, so the record is checked again */
+    pos = self->acl_offs[self->items[idx] - 1];
+    if(varint_get(data, len, &pos, &count) == -1 || count > len - pos)
+        goto inval;
+    if((recs = malloc((count + 1) * sizeof(entry_rec))) == NULL)
+        return PyErr_NoMemory();
+    for(i = 0; i < count; i++) {
+        if(pos >= len || (data[pos] >> 3) >= PACK_NTAGS) {
+            free(recs);
+            goto inval;
+        }
+        recs[i].tag = pack_tags[data[pos] >> 3];
+        recs[i].perm = data[pos++] & 7;
+        recs[i].id = ACL_EA_NOID;
+        if(recs[i].tag == ACL_USER || recs[i].tag == ACL_GROUP) {
+            if(varint_get(data, len, &pos, &v) == -1 || v >= ACL_EA_NOID) {
+                free(recs);
+                goto inval;
+            }
+            recs[i].id = v;
+        }
+    }
+    acl = acl_from_recs(recs, count);
+    free(recs);
+    if(acl == NULL)
+        return PyErr_SetFromErrno(PyExc_IOError);
+    return ACL_wrap(acl);
+
+ inval:
+    PyErr_SetString(PyExc_ValueError, "invalid packed ACL data");
+    return NULL;
+}
+
+static char __PackedACLs_unique_doc__[] =
+    "The number of distinct ACLs in the data\n"
+    ;
+
+static PyObject* PackedACLs_get_unique(PyObject *obj, void* arg) {
+    return PyInt_FromSize_t(((PackedACLs_Object*)obj)->n_acls);
+}
+
+static PyGetSetDef PackedACLs_getsets[] = {
+    {"unique", PackedACLs_get_unique, NULL, __PackedACLs_unique_doc__},
+    {NULL}
+};
+
+static PySequenceMethods PackedACLs_as_sequence = {
+    PackedACLs_length,  /* sq_length */
+    0,                  /* sq_concat */
+    0,                  /* sq_repeat */
+    PackedACLs_item,    /* sq_item */
+    0,                  /* sq_slice */
+    0,                  /* sq_ass_item */
+    0,                  /* sq_ass_slice */
+    0,                  /* sq_contains */
+};
+
+static char __PackedACLs_Type_doc__[] =
+    "Read-only sequence over ACLs serialized by :py:func:`pack_acls`\n"
+    "\n"
+    "The data is only indexed when the object is created; each ACL is\n"
+    "decoded when it is accessed, so unpacking is cheap even for large\n"
+    "batches of which only some ACLs are used. The data may be any\n"
+    "object supporting the buffer protocol (e.g. a ``memoryview`` of\n"
+    "shared memory); it is kept referenced, and must not be modified,\n"
+    "while the object is alive.\n"
+    "\n"
+    "  >>> data = posix1e.pack_acls([acl1, acl2, None])\n"
+    "  >>> packed = posix1e.PackedACLs(data)\n"
+    "  >>> len(packed), packed[2]\n"
+    "  (3, None)\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param data: the packed data\n"
+    ":raises ValueError: if the data is invalid\n"
+    ;
+
+/* The definition of the PackedACLs Type */
+static PyTypeObject PackedACLs_Type = {
+#ifdef IS_PY3K
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL)
+    0,
+#endif
+    "posix1e.PackedACLs",
+    sizeof(PackedACLs_Object),
+    0,
+    PackedACLs_dealloc, /* tp_dealloc */
+    0,                  /* tp_print */
+    0,                  /* tp_getattr */
+    0,                  /* tp_setattr */
+    0,                  /* tp_compare */
+    0,                  /* tp_repr */
+    0,                  /* tp_as_number */
+    &PackedACLs_as_sequence, /* tp_as_sequence */
+    0,                  /* tp_as_mapping */
+    0,                  /* tp_hash */
+    0,                  /* tp_call */
+    0,                  /* tp_str */
+    0,                  /* tp_getattro */
+    0,                  /* tp_setattro */
+    0,                  /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT, /* tp_flags */
+    __PackedACLs_Type_doc__, /* tp_doc */
+    0,                  /* tp_traverse */
+    0,                  /* tp_clear */
+    0,                  /* tp_richcompare */
+    0,                  /* tp_weaklistoffset */
+    0,                  /* tp_iter */
+    0,                  /* tp_iternext */
+    0,                  /* tp_methods */
+    0,                  /* tp_members */
+    PackedACLs_getsets, /* tp_getset */
+    0,                  /* tp_base */
+    0,                  /* tp_dict */
+    0,                  /* tp_descr_get */
+    0,                  /* tp_descr_set */
+    0,                  /* tp_dictoffset */
+    PackedACLs_init,    /* tp_init */
+    0,                  /* tp_alloc */
+    PackedACLs_new,     /* tp_new */
+};
+
+/***** ACL change watcher *****/
+
+/* The watcher records the fingerprints of the ACLs of a tree and
+   turns the kernel's change notifications into batches of changed
+   ACLs. With inotify, every directory of the tree is watched (the
+   directories that appear later are added as they are found); with
+   fanotify, the whole file system is marked once and the events are
+   mapped back to paths through their directory handles.
+
+   Events only mark paths as dirty: recursively for the directories
+   that appeared (and for the root, after a queue overflow). Once the
+   coalescing window that starts with the first event is over, each
+   dirty path is examined once and reported if its ACLs differ from
+   the recorded ones, so bursts of changes to the same objects cost
+   one read each. All of this runs without the GIL.
+*/
+
+#define WATCH_INOTIFY 0
+#define WATCH_FANOTIFY 1
+
+#define WATCH_INOTIFY_MASK (IN_ATTRIB | IN_CREATE | IN_DELETE | \
+                            IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | \
+                            IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+#ifdef FAN_REPORT_DFID_NAME
+#define WATCH_FANOTIFY_MASK (FAN_ATTRIB | FAN_CREATE | FAN_DELETE | \
+                             FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR)
+#endif
+
+#define WATCH_BUFSIZE 65536
+
+/* Reported changes; the path and the blobs follow the header */
+#define WITEM_OLD 1             /* the old fingerprint is known */
+#define WITEM_ACL 2             /* the object exists */
+#define WITEM_DEF 4             /* it has a default ACL */
+
+typedef struct {
+    uint64_t old;
+    uint32_t flags;
+    uint32_t path_len;
+    uint32_t acc_len;
+    uint32_t def_len;
+} watch_item;
+
+typedef struct {
+    PyObject_HEAD
+    int fd;
+    int root_fd;
+    int backend;
+    int delay;            /* the coalescing window, in milliseconds */
+    int busy;
+    char *root;           /* canonical */
+    kv_map acc;           /* path -> access ACL fingerprint, 0 if gone */
+    kv_map def;           /* path -> default ACL fingerprint */
+    char **wds;           /* inotify watch descriptor -> path */
+    int nwds;
+    kv_map dirty;         /* path -> 1 if it must be scanned recursively */
+    size_t max_pending;   /* dirty paths that end the window early */
+    int64_t window_start;
+    int64_t window_end;
+    size_t events;
+    size_t overflows;
+    size_t throttled;
+    kv_map handles;       /* directory handle -> offset in dirs + 1 */
+    membuf dirs;
+    membuf items;
+    size_t nitems;
+    membuf evbuf;         /* events read, not all handled if throttled */
+    size_t evpos;         /* the first event not handled */
+    membuf path;
+    membuf scratch;
+    membuf scratch_def;
+} Watcher_Object;
+
+static PyTypeObject Watcher_Type
+  CPYCHECKER_TYPE_OBJECT_FOR_TYPEDEF("Watcher_Object");
+
+static int64_t watch_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Sets out to dir/name, relative to the root */
+static int watch_join(membuf *out, const char *dir, const char *name,
+                      size_t name_len) {
+    out->len = 0;
+    if(strcmp(dir, ".") != 0 &&
+       (membuf_append(out, dir, strlen(dir)) == -1 ||
+        membuf_append(out, "/", 1) == -1))
+        return -1;
+    if(membuf_append(out, name, name_len) == -1 ||
+       membuf_append(out, "", 1) == -1)
+        return -1;
+    return 0;
+}
+
+static int watch_mark(Watcher_Object *w, const char *rel, int recursive) {
+    size_t len = strlen(rel) + 1;
+    uint64_t *ref = kv_map_ref(&w->dirty, rel, len);
+
+    if(ref != NULL) {
+        *ref |= recursive;
+        return 0;
+    }
+    return kv_map_put(&w->dirty, rel, len, recursive);
+}
+
+static int watch_add_dir(Watcher_Object *w, const char *path,
+                         const char *rel) {
+    char **wds, *copy;
+    int wd;
+
+    if((wd = inotify_add_watch(w->fd, path, WATCH_INOTIFY_MASK)) == -1)
+        /* the directory went away or can't be read; only running out
+           of watches is fatal */
+        return errno == ENOSPC || errno == ENOMEM ? -1 : 0;
+    if(wd >= w->nwds) {
+        if((wds = realloc(w->wds, (wd + 64) * sizeof(char*))) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(wds + w->nwds, 0, (wd + 64 - w->nwds) * sizeof(char*));
+        w->wds = wds;
+        w->nwds = wd + 64;
+    }
+    if((copy = strdup(rel)) == NULL)
+        return -1;
+    free(w->wds[wd]);
+    w->wds[wd] = copy;
+    return 0;
+}
+
+/* Stops watching rel and the directories below it */
+static void watch_drop_dirs(Watcher_Object *w, const char *rel) {
+    size_t len = strlen(rel);
+    int wd;
+
+    for(wd = 0; wd < w->nwds; wd++)
+        if(w->wds[wd] != NULL && strncmp(w->wds[wd], rel, len) == 0 &&
+           (w->wds[wd][len] == '\0' || w->wds[wd][len] == '/')) {
+            inotify_rm_watch(w->fd, wd);
+            free(w->wds[wd]);
+            w->wds[wd] = NULL;
+        }
+}
+
+static int watch_report(Watcher_Object *w, const char *rel, uint64_t *old,
+                        int flags, const membuf *acc, const membuf *def) {
+    watch_item it;
+
+    it.old = old != NULL ? *old : 0;
+    it.flags = flags | (old != NULL && *old != 0 ? WITEM_OLD : 0);
+    it.path_len = strlen(rel);
+    it.acc_len = acc != NULL ? acc->len : 0;
+    it.def_len = def != NULL ? def->len : 0;
+    if(membuf_append(&w->items, &it, sizeof(it)) == -1 ||
+       membuf_append(&w->items, rel, it.path_len) == -1 ||
+       (acc != NULL && membuf_append(&w->items, acc->data, acc->len) == -1) ||
+       (def != NULL && membuf_append(&w->items, def->data, def->len) == -1))
+        return -1;
+    w->nitems++;
+    return 0;
+}
+
+/* Re-reads the ACLs of one object (st is NULL if it couldn't be
+   found) and records them, reporting them if they changed */
+static int watch_check(Watcher_Object *w, const char *rel, const char *path,
+                       const struct stat *st, int report) {
+    size_t len = strlen(rel) + 1;
+    uint64_t *old = kv_map_ref(&w->acc, rel, len), acc_fp, def_fp = 0;
+    int r = 0;
+
+    if(st != NULL && S_ISLNK(st->st_mode))
+        return 0;
+    if(st != NULL &&
+       (read_acl_blob(path, ACL_TYPE_ACCESS, st->st_mode, &w->scratch) == -1 ||
+        (S_ISDIR(st->st_mode) &&
+         (r = read_acl_blob(path, ACL_TYPE_DEFAULT, 0,
+                            &w->scratch_def)) == -1))) {
+        if(errno == ENOMEM)
+            return -1;
+        if(errno != ENOENT && errno != ENOTDIR)
+            return 0;
+        st = NULL;
+    }
+    if(st == NULL) {
+        if(old == NULL || *old == 0)
+            return 0;
+        if(report && watch_report(w, rel, old, 0, NULL, NULL) == -1)
+            return -1;
+        *old = 0;
+        return 0;
+    }
+    acc_fp = fnv1a(FNV_OFFSET, w->scratch.data, w->scratch.len);
+    if(r == 1)
+        def_fp = fnv1a(FNV_OFFSET, w->scratch_def.data, w->scratch_def.len);
+    if(old != NULL && *old == acc_fp) {
+        uint64_t prev = 0;
+        kv_map_get(&w->def, rel, len, &prev);
+        if(prev == def_fp)
+            return 0;
+    }
+    if(report &&
+       watch_report(w, rel, old, WITEM_ACL | (r == 1 ? WITEM_DEF : 0),
+                    &w->scratch, r == 1 ? &w->scratch_def : NULL) == -1)
+        return -1;
+    if(old != NULL)
+        *old = acc_fp;
+    else if(kv_map_put(&w->acc, rel, len, acc_fp) == -1)
+        return -1;
+    return kv_map_set(&w->def, rel, len, def_fp);
+}
+
+typedef struct {
+    Watcher_Object *w;
+    const char *prefix;
+    membuf rel;
+    int report;
+} watch_scan;
+
+static int watch_scan_visit(void *data, const walk_item *item, int post) {
+    watch_scan *ws = data;
+    const char *rel = ws->prefix;
+
+    if(post)
+        return 0;
+    if(item->depth > 0) {
+        if(watch_join(&ws->rel, ws->prefix, item->rel,
+                      strlen(item->rel)) == -1)
+            return -1;
+        rel = ws->rel.data;
+    }
+    if(S_ISDIR(item->st->st_mode) && ws->w->backend == WATCH_INOTIFY &&
+       watch_add_dir(ws->w, item->path, rel) == -1)
+        return -1;
+    return watch_check(ws->w, rel, item->path, item->st, ws->report);
+}
+
+/* Records (and maybe reports) everything below rel */
+static int watch_scan_tree(Watcher_Object *w, const char *rel,
+                           const char *path, int report) {
+    watch_scan ws;
+    err_list errors;
+    int ret;
+
+    memset(&ws, 0, sizeof(ws));
+    memset(&errors, 0, sizeof(errors));
+    ws.w = w;
+    ws.prefix = rel;
+    ws.report = report;
+    ret = walk_tree(path, watch_scan_visit, &ws, &errors);
+    membuf_free(&ws.rel);
+    err_list_free(&errors);
+    return ret;
+}
+
+/* Examines the dirty paths */
+static int watch_flush(Watcher_Object *w) {
+    struct stat st;
+    const char *rel;
+    uint64_t known;
+    size_t i;
+    int ret = 0;
+
+    for(i = 0; i < w->dirty.count && ret == 0; i++) {
+        rel = w->dirty.keys.data + KV_KEYOFF(w->dirty.koffs[i]);
+        if(strcmp(rel, ".") == 0)
+            ret = watch_join(&w->path, ".", w->root, strlen(w->root));
+        else
+            ret = watch_join(&w->path, w->root, rel, strlen(rel));
+        if(ret == -1)
+            break;
+        if(lstat(w->path.data, &st) == -1) {
+            ret = watch_check(w, rel, w->path.data, NULL, 1);
+        } else if(S_ISDIR(st.st_mode) &&
+                  (w->dirty.values[i] ||
+                   !kv_map_get(&w->acc, rel, strlen(rel) + 1, &known) ||
+                   known == 0)) {
+            /* directories that appeared are scanned, as their contents
+               may have been created before they were watched */
+            ret = watch_scan_tree(w, rel, w->path.data, 1);
+        } else {
+            ret = watch_check(w, rel, w->path.data, &st, 1);
+        }
+    }
+    kv_map_free(&w->dirty);
+    return ret;
+}
+
+/* Whether max_pending paths are dirty */
+#define WATCH_THROTTLED(w) \
+    ((w)->max_pending > 0 && (w)->dirty.count >= (w)->max_pending)
+
+/* Handles the events in buf, until the watcher is throttled; returns
+   the length of the events handled, or -1 on error */
+static ssize_t watch_read_inotify(Watcher_Object *w, const char *buf,
+                                  size_t len) {
+    const struct inotify_event *ev;
+    const char *dir;
+    size_t off;
+
+    for(off = 0; off + sizeof(*ev) <= len && !WATCH_THROTTLED(w);
+        off += sizeof(*ev) + ev->len) {
+        ev = (const struct inotify_event*)(buf + off);
+        w->events++;
+        if(ev->mask & IN_Q_OVERFLOW) {
+            w->overflows++;
+            if(watch_mark(w, ".", 1) == -1)
+                return -1;
+            continue;
+        }
+        if(ev->wd < 0 || ev->wd >= w->nwds || (dir = w->wds[ev->wd]) == NULL)
+            continue;
+        if(ev->mask & IN_IGNORED) {
+            free(w->wds[ev->wd]);
+            w->wds[ev->wd] = NULL;
+            continue;
+        }
+        if(ev->len == 0 || ev->name[0] == '\0') {
+            if(watch_mark(w, dir, 0) == -1)
+                return -1;
+            continue;
+        }
+        if(watch_join(&w->path, dir, ev->name, strlen(ev->name)) == -1)
+            return -1;
+        if((ev->mask & (IN_MOVED_FROM | IN_DELETE)) && (ev->mask & IN_ISDIR))
+            watch_drop_dirs(w, w->path.data);
+        if(watch_mark(w, w->path.data, (ev->mask & IN_ISDIR) &&
+                      (ev->mask & (IN_CREATE | IN_MOVED_TO))) == -1)
+            return -1;
+    }
+    return off;
+}
+
+#ifdef FAN_REPORT_DFID_NAME
+/* Returns the path of a directory relative to the root, or NULL if
+   it is outside the tree (or gone); the results are cached for the
+   current batch */
+static const char* watch_handle_dir(Watcher_Object *w,
+                                    const struct file_handle *fh) {
+    union {
+        struct file_handle fh;
+        char buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+    } h;
+    size_t hlen = sizeof(*fh) + fh->handle_bytes;
+    size_t rlen = strlen(w->root);
+    char proc[64], target[PATH_MAX];
+    const char *rel = NULL;
+    uint64_t off;
+    ssize_t n;
+    int fd;
+
+    if(fh->handle_bytes > MAX_HANDLE_SZ)
+        return NULL;
+    if(kv_map_get(&w->handles, (const char*)fh, hlen, &off))
+        return off == 0 ? NULL : w->dirs.data + off - 1;
+    memcpy(&h, fh, hlen);
+    if((fd = open_by_handle_at(w->root_fd, &h.fh, O_PATH | O_CLOEXEC)) != -1) {
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+        n = readlink(proc, target, sizeof(target) - 1);
+        close(fd);
+        if(n > 0) {
+            target[n] = '\0';
+            if(strcmp(target, w->root) == 0)
+                rel = ".";
+            else if(rlen == 1 && target[0] == '/')
+                rel = target + 1;
+            else if(strncmp(target, w->root, rlen) == 0 &&
+                    target[rlen] == '/')
+                rel = target + rlen + 1;
+        }
+    }
+    off = 0;
+    if(rel != NULL) {
+        off = w->dirs.len + 1;
+        if(membuf_append(&w->dirs, rel, strlen(rel) + 1) == -1)
+            return NULL;
+    }
+    if(kv_map_put(&w->handles, (const char*)fh, hlen, off) == -1)
+        return NULL;
+    return rel == NULL ? NULL : w->dirs.data + off - 1;
+}
+
+static ssize_t watch_read_fanotify(Watcher_Object *w, const char *buf,
+                                   size_t len) {
+    const struct fanotify_event_metadata *ev;
+    const struct fanotify_event_info_fid *fid;
+    const struct file_handle *fh;
+    const char *dir, *name, *info;
+    int recursive;
+
+    for(ev = (const struct fanotify_event_metadata*)buf;
+        FAN_EVENT_OK(ev, len) && !WATCH_THROTTLED(w);
+        ev = FAN_EVENT_NEXT(ev, len)) {
+        if(ev->fd >= 0)
+            close(ev->fd);
+        w->events++;
+        if(ev->mask & FAN_Q_OVERFLOW) {
+            w->overflows++;
+            if(watch_mark(w, ".", 1) == -1)
+                return -1;
+            continue;
+        }
+        for(info = (const char*)ev + ev->metadata_len;
+            info + sizeof(*fid) <= (const char*)ev + ev->event_len;
+            info += fid->hdr.len) {
+            fid = (const struct fanotify_event_info_fid*)info;
+            if(fid->hdr.len < sizeof(*fid))
+                break;
+            if(fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+                continue;
+            fh = (const struct file_handle*)fid->handle;
+            name = (const char*)fh->f_handle + fh->handle_bytes;
+            errno = 0;
+            if((dir = watch_handle_dir(w, fh)) == NULL) {
+                if(errno == ENOMEM)
+                    return -1;
+                continue;
+            }
+            recursive = (ev->mask & FAN_ONDIR) &&
+                (ev->mask & (FAN_CREATE | FAN_MOVED_TO));
+            if(strcmp(name, ".") == 0) {
+                if(watch_mark(w, dir, recursive) == -1)
+                    return -1;
+            } else if(watch_join(&w->path, dir, name, strlen(name)) == -1 ||
+                      watch_mark(w, w->path.data, recursive) == -1)
+                return -1;
+        }
+    }
+    return (const char*)ev - buf;
+}
+#endif
+
+/* Handles the pending events; once max_pending paths are dirty, the
+   events left are kept for the next call, and the rest of them in the
+   kernel queue */
+static int watch_read(Watcher_Object *w) {
+    ssize_t n = 0;
+
+    for(;;) {
+        if(w->evpos < w->evbuf.len) {
+#ifdef FAN_REPORT_DFID_NAME
+            if(w->backend == WATCH_FANOTIFY)
+                n = watch_read_fanotify(w, w->evbuf.data + w->evpos,
+                                        w->evbuf.len - w->evpos);
+            else
+#endif
+            n = watch_read_inotify(w, w->evbuf.data + w->evpos,
+                                   w->evbuf.len - w->evpos);
+            if(n == -1)
+                return -1;
+            w->evpos += n;
+            if(WATCH_THROTTLED(w))
+                return 0;
+        }
+        w->evbuf.len = w->evpos = 0;
+        if(membuf_reserve(&w->evbuf, WATCH_BUFSIZE) == -1)
+            return -1;
+        if((n = read(w->fd, w->evbuf.data, WATCH_BUFSIZE)) <= 0)
+            break;
+        w->evbuf.len = n;
+    }
+    return n == -1 && errno != EAGAIN ? -1 : 0;
+}
+
+/* Waits for changes until the deadline (-1 for none); returns 1 if
+   some were found, 0 on timeout and -1 on errors (EINTR included,
+   after which it can be called again without losing events) */
+static int watch_collect(Watcher_Object *w, int64_t deadline) {
+    struct pollfd p;
+    int64_t left;
+    int n;
+
+    p.fd = w->fd;
+    p.events = POLLIN;
+    for(;;) {
+        if(w->dirty.count == 0) {
+            left = deadline < 0 ? -1 : deadline - watch_now();
+            if(deadline >= 0 && left < 0)
+                left = 0;
+            /* events kept when throttled are handled first */
+            if(w->evpos < w->evbuf.len)
+                n = 1;
+            else if((n = poll(&p, 1, left > INT_MAX ? INT_MAX : (int)left))
+                    == -1)
+                return -1;
+            if(n == 0 && deadline >= 0 && watch_now() >= deadline)
+                return 0;
+            if(n == 0)
+                continue;
+            if(watch_read(w) == -1)
+                return -1;
+            if(w->dirty.count == 0)
+                continue;
+            w->window_start = watch_now();
+            w->window_end = w->window_start + w->delay;
+        }
+        while((left = w->window_end - watch_now()) > 0) {
+            if(WATCH_THROTTLED(w)) {
+                /* back-pressure: don't let the batch grow further */
+                w->throttled++;
+                break;
+            }
+            if((n = poll(&p, 1, (int)left)) == -1)
+                return -1;
+            if(n > 0 && watch_read(w) == -1)
+                return -1;
+        }
+        if(watch_flush(w) == -1)
+            return -1;
+        if(w->nitems > 0)
+            return 1;
+    }
+}
+
+static void watch_clear_items(Watcher_Object *w) {
+    w->items.len = 0;
+    w->nitems = 0;
+    kv_map_free(&w->handles);
+    w->dirs.len = 0;
+}
+
+/* Converts the reported changes to a list, and clears them */
+static PyObject* watch_take_items(Watcher_Object *w) {
+    PyObject *list, *path, *old, *acc, *def, *tuple;
+    watch_item it;
+    const char *p = w->items.data;
+    size_t i;
+
+    if((list = PyList_New(w->nitems)) == NULL)
+        goto out;
+    for(i = 0; i < w->nitems; i++) {
+        memcpy(&it, p, sizeof(it));
+        p += sizeof(it);
+        path = MyPath_FromStringAndSize(p, it.path_len);
+        p += it.path_len;
+        if(it.flags & WITEM_OLD)
+            old = PyLong_FromUnsignedLongLong(it.old);
+        else {
+            old = Py_None;
+            Py_INCREF(old);
+        }
+        if(it.flags & WITEM_ACL)
+            acc = ACL_from_blob(p, it.acc_len);
+        else {
+            acc = Py_None;
+            Py_INCREF(acc);
+        }
+        p += it.acc_len;
+        if(it.flags & WITEM_DEF)
+            def = ACL_from_blob(p, it.def_len);
+        else {
+            def = Py_None;
+            Py_INCREF(def);
+        }
+        p += it.def_len;
+        if(path == NULL || old == NULL || acc == NULL || def == NULL) {
+            Py_XDECREF(path);
+            Py_XDECREF(old);
+            Py_XDECREF(acc);
+            Py_XDECREF(def);
+            Py_CLEAR(list);
+            goto out;
+        }
+        if((tuple = Py_BuildValue("(NNNN)", path, old, acc, def)) == NULL) {
+            Py_CLEAR(list);
+            goto out;
+        }
+        PyList_SET_ITEM(list, i, tuple);
+    }
+
+ out:
+    watch_clear_items(w);
+    return list;
+}
+
+static void watch_close(Watcher_Object *w) {
+    int wd;
+
+    if(w->fd != -1)
+        close(w->fd);
+    if(w->root_fd != -1)
+        close(w->root_fd);
+    w->fd = w->root_fd = -1;
+    free(w->root);
+    w->root = NULL;
+    for(wd = 0; wd < w->nwds; wd++)
+        free(w->wds[wd]);
+    free(w->wds);
+    w->wds = NULL;
+    w->nwds = 0;
+    w->events = w->overflows = w->throttled = 0;
+    kv_map_free(&w->acc);
+    kv_map_free(&w->def);
+    kv_map_free(&w->dirty);
+    kv_map_free(&w->handles);
+    membuf_free(&w->dirs);
+    membuf_free(&w->items);
+    w->nitems = 0;
+    membuf_free(&w->evbuf);
+    w->evpos = 0;
+    membuf_free(&w->path);
+    membuf_free(&w->scratch);
+    membuf_free(&w->scratch_def);
+}
+
+/* Sets up the notifications and records the initial state */
+static int watch_open(Watcher_Object *w, const char *path, int backend) {
+    if((w->root = realpath(path, NULL)) == NULL ||
+       (w->root_fd = open(w->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+        return -1;
+#ifdef FAN_REPORT_DFID_NAME
+    if(backend != WATCH_INOTIFY) {
+        if((w->fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME |
+                                  FAN_CLOEXEC | FAN_NONBLOCK,
+                                  O_RDONLY | O_CLOEXEC)) != -1 &&
+           fanotify_mark(w->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                         WATCH_FANOTIFY_MASK, w->root_fd, NULL) == 0) {
+            w->backend = WATCH_FANOTIFY;
+            return watch_scan_tree(w, ".", w->root, 0);
+        }
+        if(w->fd != -1) {
+            close(w->fd);
+            w->fd = -1;
+        }
+        if(backend == WATCH_FANOTIFY)
+            return -1;
+    }
+#else
+    if(backend == WATCH_FANOTIFY) {
+        errno = ENOSYS;
+        return -1;
+    }
+#endif
+    if((w->fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) == -1)
+        return -1;
+    w->backend = WATCH_INOTIFY;
+    return watch_scan_tree(w, ".", w->root, 0);
+}
+
+static PyObject* Watcher_new(PyTypeObject* type, PyObject* args,
+                             PyObject *keywds) {
+    PyObject* newwatcher;
+
+    newwatcher = type->tp_alloc(type, 0);
+    if(newwatcher != NULL) {
+        Watcher_Object *self = (Watcher_Object*)newwatcher;
+        self->fd = -1;
+        self->root_fd = -1;
+    }
+    return newwatcher;
+}
+
+static int Watcher_init(PyObject* obj, PyObject* args, PyObject *keywds) {
+    Watcher_Object *self = (Watcher_Object*)obj;
+    static char *kwlist[] = { "path", "backend", "delay", NULL };
+    char *path = NULL;
+    const char *backend = "inotify";
+    double delay = 0.05;
+    int mode, nret;
+
+    if(!PyArg_ParseTupleAndKeywords(args, keywds, "et|sd", kwlist,
+                                    Py_FileSystemDefaultEncoding, &path,
+                                    &backend, &delay))
+        return -1;
+    if(strcmp(backend, "inotify") == 0)
+        mode = WATCH_INOTIFY;
+    else if(strcmp(backend, "fanotify") == 0)
+        mode = WATCH_FANOTIFY;
+    else if(strcmp(backend, "auto") == 0)
+        mode = -1;
+    else {
+        PyErr_SetString(PyExc_ValueError,
+                        "backend must be 'inotify', 'fanotify' or 'auto'");
+        PyMem_Free(path);
+        return -1;
+    }
+    if(delay < 0 || delay > 3600) {
+        PyErr_SetString(PyExc_ValueError, "invalid delay");
+        PyMem_Free(path);
+        return -1;
+    }
+    if(self->busy) {
+        PyErr_SetString(PyExc_ValueError, "watcher is in use");
+        PyMem_Free(path);
+        return -1;
+    }
+    watch_close(self);
+    self->delay = (int)(delay * 1000);
+    self->busy++;
+    Py_BEGIN_ALLOW_THREADS
+    nret = watch_open(self, path, mode);
+    Py_END_ALLOW_THREADS
+    self->busy--;
+    if(nret == -1) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+        watch_close(self);
+    }
+    PyMem_Free(path);
+    return nret;
+}
+
+static void Watcher_dealloc(PyObject* obj) {
+    watch_close((Watcher_Object*)obj);
+    PyObject_DEL(obj);
+}
+
+/* Waits for a batch; timeout is in milliseconds, -1 for none */
+static PyObject* watch_wait(Watcher_Object *self, int64_t timeout) {
+    int64_t deadline = timeout < 0 ? -1 : watch_now() + timeout;
+    int nret;
+
+    if(self->fd == -1) {
+        PyErr_SetString(PyExc_ValueError, "watcher is closed");
+        return NULL;
+    }
+    if(self->busy) {
+        PyErr_SetString(PyExc_ValueError, "watcher is in use");
+        return NULL;
+    }
+    for(;;) {
+        self->busy++;
+        Py_BEGIN_ALLOW_THREADS
+        nret = watch_collect(self, deadline);
+        Py_END_ALLOW_THREADS
+        self->busy--;
+        if(nret != -1)
+            break;
+        if(errno != EINTR)
+            return PyErr_SetFromErrno(PyExc_IOError);
+        if(PyErr_CheckSignals() == -1)
+            return NULL;
+    }
+    return watch_take_items(self);
+}
+
+static char __Watcher_read_doc__[] =
+    "read([timeout])\n"
+    "Wait for ACL changes and return them.\n"
+    "\n"
+    "The first change starts the coalescing window; when it is over,\n"
+    "the changed objects are examined and a batch is returned, as a\n"
+    "list of tuples (path, old fingerprint, ACL, default ACL). The\n"
+    "fingerprint is the hash of the previous access ACL (None if the\n"
+    "object wasn't known, e.g. because it was just created); the ACL\n"
+    "is None if the object was removed, and the default ACL is None if\n"
+    "the object has none. Changes that don't affect the ACLs (e.g. a\n"
+    "change of owner) are not reported.\n"
+    "\n"
+    ":param float timeout: the maximum time to wait, in seconds; by\n"
+    "    default, wait until some ACL changes\n"
+    ":return: the changes, or an empty list on timeout\n"
+    ":rtype: list\n"
+    ;
+
+static PyObject* Watcher_read(PyObject *obj, PyObject *args) {
+    double timeout = -1;
+
+    if(!PyArg_ParseTuple(args, "|d", &timeout))
+        return NULL;
+    return watch_wait((Watcher_Object*)obj,
+                      timeout < 0 ? -1 : (int64_t)(timeout * 1000));
+}
+
+static PyObject* Watcher_iternext(PyObject *obj) {
+    if(((Watcher_Object*)obj)->fd == -1)
+        return NULL;
+    return watch_wait((Watcher_Object*)obj, -1);
+}
+
+static char __Watcher_fileno_doc__[] =
+    "Return the notification file descriptor.\n"
+    "\n"
+    "It becomes readable when events are pending, and can thus be used\n"
+    "with :py:mod:`select` before calling :py:meth:`read`.\n"
+    ;
+
+static PyObject* Watcher_fileno(PyObject *obj, PyObject *args) {
+    if(((Watcher_Object*)obj)->fd == -1) {
+        PyErr_SetString(PyExc_ValueError, "watcher is closed");
+        return NULL;
+    }
+    return PyInt_FromLong(((Watcher_Object*)obj)->fd);
+}
+
+static char __Watcher_close_doc__[] =
+    "Stop watching and release the recorded state.\n"
+    ;
+
+static PyObject* Watcher_close(PyObject *obj, PyObject *args) {
+    if(((Watcher_Object*)obj)->busy) {
+        PyErr_SetString(PyExc_ValueError, "watcher is in use");
+        return NULL;
+    }
+    watch_close((Watcher_Object*)obj);
+    Py_RETURN_NONE;
+}
+
+static char __Watcher_backend_doc__[] =
+    "The notification backend in use, ``'inotify'`` or ``'fanotify'``\n"
+    ;
+
+static PyObject* Watcher_get_backend(PyObject *obj, void* arg) {
+    return MyString_FromString(((Watcher_Object*)obj)->backend ==
+                               WATCH_FANOTIFY ? "fanotify" : "inotify");
+}
+
+static PyGetSetDef Watcher_getsets[] = {
+    {"backend", Watcher_get_backend, NULL, __Watcher_backend_doc__},
+    {NULL}
+};
+
+static PyMethodDef Watcher_methods[] = {
+    {"read", Watcher_read, METH_VARARGS, __Watcher_read_doc__},
+    {"fileno", Watcher_fileno, METH_NOARGS, __Watcher_fileno_doc__},
+    {"close", Watcher_close, METH_NOARGS, __Watcher_close_doc__},
+    {NULL, NULL, 0, NULL}
+};
+
+static char __Watcher_Type_doc__[] =
+    "Watcher for ACL changes in a tree\n"
+    "\n"
+    "The watcher records the ACLs of the tree when created, and then\n"
+    "reports the objects whose ACLs change, as batches (see\n"
+    ":py:meth:`read`); iterating over a watcher returns the batches as\n"
+    "they come. Bursts of changes are coalesced: the changes made\n"
+    "within ``delay`` seconds of the first one are returned together,\n"
+    "with each object examined once.\n"
+    "\n"
+    "With the ``'inotify'`` backend, all the directories of the tree\n"
+    "are watched, which needs one inotify watch each. The\n"
+    "``'fanotify'`` backend marks the whole file system instead, and\n"
+    "needs the ``CAP_SYS_ADMIN`` capability; ``'auto'`` uses it where\n"
+    "permitted, falling back to inotify. Only the file system of the\n"
+    "root is watched, and events lost to a queue overflow trigger a\n"
+    "rescan of the tree.\n"
+    "\n"
+    "  >>> w = posix1e.Watcher(\"/srv/share\")\n"
+    "  >>> for batch in w:\n"
+    "  ...     for path, old, acl, default in batch:\n"
+    "  ...         print(path, acl)\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param string path: the root of the tree\n"
+    ":param string backend: ``'inotify'``, ``'fanotify'`` or ``'auto'``\n"
+    ":param float delay: the coalescing window, in seconds\n"
+    ;
+
+/* The definition of the Watcher Type */
+static PyTypeObject Watcher_Type = {
+#ifdef IS_PY3K
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL)
+    0,
+#endif
+    "posix1e.Watcher",
+    sizeof(Watcher_Object),
+    0,
+    Watcher_dealloc,    /* tp_dealloc */
+    0,                  /* tp_print */
+    0,                  /* tp_getattr */
+    0,                  /* tp_setattr */
+    0,                  /* tp_compare */
+    0,                  /* tp_repr */
+    0,                  /* tp_as_number */
+    0,                  /* tp_as_sequence */
+    0,                  /* tp_as_mapping */
+    0,                  /* tp_hash */
+    0,                  /* tp_call */
+    0,                  /* tp_str */
+    0,                  /* tp_getattro */
+    0,                  /* tp_setattro */
+    0,                  /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT, /* tp_flags */
+    __Watcher_Type_doc__, /* tp_doc */
+    0,                  /* tp_traverse */
+    0,                  /* tp_clear */
+    0,                  /* tp_richcompare */
+    0,                  /* tp_weaklistoffset */
+    PyObject_SelfIter,  /* tp_iter */
+    Watcher_iternext,   /* tp_iternext */
+    Watcher_methods,    /* tp_methods */
+    0,                  /* tp_members */
+    Watcher_getsets,    /* tp_getset */
+    0,                  /* tp_base */
+    0,                  /* tp_dict */
+    0,                  /* tp_descr_get */
+    0,                  /* tp_descr_set */
+    0,                  /* tp_dictoffset */
+    Watcher_init,       /* tp_init */
+    0,                  /* tp_alloc */
+    Watcher_new,        /* tp_new */
+};
+
+/***** ACL mirror *****/
+
+/* A mirror applies the changes found by a watcher to a second tree
+   with the same layout, by writing the raw ACL xattrs; the coalescing
+   of the watcher means that only the final state of a path in each
+   window is written. The watcher's max_pending provides the
+   back-pressure: a batch is applied as soon as that many paths are
+   waiting, instead of growing until the window ends. */
+
+#define MIRROR_TICK 250         /* how often run() checks for stop() */
+#define MIRROR_MAX_ERRORS 100   /* the errors kept for inspection */
+
+typedef struct {
+    PyObject_HEAD
+    Watcher_Object *watcher;
+    char *target;
+    volatile int stop;
+    int busy;
+    size_t batches;
+    size_t applied;
+    size_t skipped;       /* paths whose target ACLs were already right */
+    size_t failed;
+    int64_t lag;          /* of the last batch, in milliseconds */
+    int64_t max_lag;
+    err_list errors;
+    membuf path;
+    membuf scratch;
+} Mirror_Object;
+
+static PyTypeObject Mirror_Type
+  CPYCHECKER_TYPE_OBJECT_FOR_TYPEDEF("Mirror_Object");
+
+/* Counts a path that couldn't be mirrored, and keeps the first
+   errors */
+static int mirror_fail(Mirror_Object *m, const char *rel, int err) {
+    m->failed++;
+    if(m->errors.count < MIRROR_MAX_ERRORS)
+        return err_list_add(&m->errors, rel, err);
+    return 0;
+}
+
+/* Writes the ACLs of one path to the target; errors are recorded */
+static int mirror_apply_one(Mirror_Object *m, const char *rel,
+                            const char *acc, size_t acc_len,
+                            const char *def, size_t def_len) {
+    struct stat st;
+    int a, d = 0;
+
+    if(strcmp(rel, ".") == 0) {
+        if(watch_join(&m->path, ".", m->target, strlen(m->target)) == -1)
+            return -1;
+    } else if(watch_join(&m->path, m->target, rel, strlen(rel)) == -1)
+        return -1;
+    if(lstat(m->path.data, &st) == -1 ||
+       (a = restore_one(m->path.data, &st, ACL_TYPE_ACCESS, acc, acc_len,
+                        1, &m->scratch)) == -1 ||
+       (S_ISDIR(st.st_mode) &&
+        (d = restore_one(m->path.data, &st, ACL_TYPE_DEFAULT, def, def_len,
+                         1, &m->scratch)) == -1)) {
+        if(errno == ENOMEM)
+            return -1;
+        return mirror_fail(m, rel, errno);
+    }
+    if(a || d)
+        m->applied++;
+    else
+        m->skipped++;
+    return 0;
+}
+
+/* Applies the watcher's batch */
+static int mirror_apply(Mirror_Object *m) {
+    Watcher_Object *w = m->watcher;
+    const char *p = w->items.data, *rel, *acc;
+    char *name = NULL;
+    watch_item it;
+    size_t i;
+    int ret = 0;
+
+    for(i = 0; i < w->nitems && ret == 0; i++) {
+        memcpy(&it, p, sizeof(it));
+        rel = p + sizeof(it);
+        acc = rel + it.path_len;
+        p = acc + it.acc_len + it.def_len;
+        /* removed objects are left alone */
+        if(!(it.flags & WITEM_ACL))
+            continue;
+        if((name = strndup(rel, it.path_len)) == NULL)
+            return -1;
+        ret = mirror_apply_one(m, name, acc, it.acc_len,
+                               it.flags & WITEM_DEF ? acc + it.acc_len : NULL,
+                               it.def_len);
+        free(name);
+    }
+    watch_clear_items(w);
+    m->batches++;
+    m->lag = watch_now() - w->window_start;
+    if(m->lag > m->max_lag)
+        m->max_lag = m->lag;
+    return ret;
+}
+
+static int mirror_sync_visit(void *data, const walk_item *item, int post) {
+    Mirror_Object *m = data;
+    Watcher_Object *w = m->watcher;
+    int r = 0;
+
+    if(post || S_ISLNK(item->st->st_mode))
+        return 0;
+    if(read_acl_blob(item->path, ACL_TYPE_ACCESS, item->st->st_mode,
+                     &w->scratch) == -1 ||
+       (S_ISDIR(item->st->st_mode) &&
+        (r = read_acl_blob(item->path, ACL_TYPE_DEFAULT, 0,
+                           &w->scratch_def)) == -1))
+        return errno == ENOMEM ? -1 : mirror_fail(m, item->rel, errno);
+    return mirror_apply_one(m, item->rel, w->scratch.data, w->scratch.len,
+                            r == 1 ? w->scratch_def.data : NULL,
+                            w->scratch_def.len);
+}
+
+static int mirror_check(Mirror_Object *self) {
+    if(self->watcher == NULL || self->watcher->fd == -1) {
+        PyErr_SetString(PyExc_ValueError, "mirror is closed");
+        return -1;
+    }
+    if(self->busy || self->watcher->busy) {
+        PyErr_SetString(PyExc_ValueError, "mirror is in use");
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject* Mirror_new(PyTypeObject* type, PyObject* args,
+                            PyObject *keywds) {
+    return type->tp_alloc(type, 0);
+}
+
+static void mirror_close(Mirror_Object *self) {
+    Py_CLEAR(self->watcher);
+    free(self->target);
+    self->target = NULL;
+    err_list_free(&self->errors);
+    membuf_free(&self->path);
+    membuf_free(&self->scratch);
+}
+
+static int Mirror_init(PyObject* obj, PyObject* args, PyObject *keywds) {
+    Mirror_Object *self = (Mirror_Object*)obj;
+    static char *kwlist[] = { "source", "target", "backend", "delay",
+                              "max_pending", NULL };
+    PyObject *source, *watcher;
+    char *target = NULL, *real;
+    const char *backend = "inotify";
+    double delay = 0.05;
+    Py_ssize_t max_pending = 10000;
+    int fd;
+
+    if(!PyArg_ParseTupleAndKeywords(args, keywds, "Oet|sdn", kwlist,
+                                    &source, Py_FileSystemDefaultEncoding,
+                                    &target, &backend, &delay, &max_pending))
+        return -1;
+    if(self->busy) {
+        PyErr_SetString(PyExc_ValueError, "mirror is in use");
+        PyMem_Free(target);
+        return -1;
+    }
+    if(max_pending < 0) {
+        PyErr_SetString(PyExc_ValueError, "invalid max_pending");
+        PyMem_Free(target);
+        return -1;
+    }
+    if((real = realpath(target, NULL)) == NULL ||
+       (fd = open(real, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, target);
+        free(real);
+        PyMem_Free(target);
+        return -1;
+    }
+    close(fd);
+    PyMem_Free(target);
+    watcher = PyObject_CallFunction((PyObject*)&Watcher_Type, "Osd",
+                                    source, backend, delay);
+    if(watcher == NULL) {
+        free(real);
+        return -1;
+    }
+    mirror_close(self);
+    self->watcher = (Watcher_Object*)watcher;
+    self->watcher->max_pending = max_pending;
+    self->target = real;
+    self->batches = self->applied = self->skipped = self->failed = 0;
+    self->lag = self->max_lag = 0;
+    return 0;
+}
+
+static void Mirror_dealloc(PyObject* obj) {
+    mirror_close((Mirror_Object*)obj);
+    PyObject_DEL(obj);
+}
+
+static char __Mirror_sync_doc__[] =
+    "Copy all the ACLs of the source tree to the target.\n"
+    "\n"
+    "This brings the target up to date initially; changes made while\n"
+    "it runs are caught by the watcher and applied afterwards. The\n"
+    "paths that can't be read, walked or written are counted as\n"
+    "failures, see :py:attr:`stats` and :py:attr:`errors`.\n"
+    "\n"
+    ":return: the number of paths whose ACLs were written\n"
+    ":rtype: int\n"
+    ;
+
+static PyObject* Mirror_sync(PyObject *obj, PyObject *args) {
+    Mirror_Object *self = (Mirror_Object*)obj;
+    size_t applied, i;
+    err_list errors;
+    int nret;
+
+    if(mirror_check(self) == -1)
+        return NULL;
+    memset(&errors, 0, sizeof(errors));
+    applied = self->applied;
+    self->busy++;
+    Py_BEGIN_ALLOW_THREADS
+    nret = walk_tree(self->watcher->root, mirror_sync_visit, self, &errors);
+    /* the paths that couldn't be walked are failures too */
+    for(i = 0; i < errors.count && nret == 0; i++)
+        nret = mirror_fail(self, errors.paths.data + errors.offs[i],
+                           errors.errnos[i]);
+    Py_END_ALLOW_THREADS
+    self->busy--;
+    err_list_free(&errors);
+    if(nret == -1)
+        return PyErr_SetFromErrno(PyExc_IOError);
+    return PyInt_FromSsize_t(self->applied - applied);
+}
+
+static char __Mirror_step_doc__[] =
+    "step([timeout])\n"
+    "Wait for one batch of changes and apply it.\n"
+    "\n"
+    ":param float timeout: the maximum time to wait, in seconds; by\n"
+    "    default, wait until some ACL changes\n"
+    ":return: the number of changed paths in the batch, 0 on timeout\n"
+    ":rtype: int\n"
+    ;
+
+static PyObject* Mirror_step(PyObject *obj, PyObject *args) {
+    Mirror_Object *self = (Mirror_Object*)obj;
+    double timeout = -1;
+    int64_t deadline;
+    size_t count;
+    int nret;
+
+    if(!PyArg_ParseTuple(args, "|d", &timeout))
+        return NULL;
+    if(mirror_check(self) == -1)
+        return NULL;
+    deadline = timeout < 0 ? -1 : watch_now() + (int64_t)(timeout * 1000);
+    for(;;) {
+        self->busy++;
+        Py_BEGIN_ALLOW_THREADS
+        nret = watch_collect(self->watcher, deadline);
+        count = self->watcher->nitems;
+        if(nret == 1)
+            nret = mirror_apply(self) == -1 ? -1 : 1;
+        Py_END_ALLOW_THREADS
+        self->busy--;
+        if(nret != -1)
+            break;
+        if(errno != EINTR)
+            return PyErr_SetFromErrno(PyExc_IOError);
+        if(PyErr_CheckSignals() == -1)
+            return NULL;
+    }
+    return PyInt_FromSsize_t(nret == 1 ? count : 0);
+}
+
+static char __Mirror_run_doc__[] =
+    "Apply the changes as they come, until :py:meth:`stop` is called.\n"
+    "\n"
+    "The GIL is released while waiting and applying, so this can run\n"
+    "in a thread of its own; signals interrupt it as usual.\n"
+    ;
+
+static PyObject* Mirror_run(PyObject *obj, PyObject *args) {
+    Mirror_Object *self = (Mirror_Object*)obj;
+    int nret;
+
+    if(mirror_check(self) == -1)
+        return NULL;
+    self->stop = 0;
+    while(!self->stop) {
+        self->busy++;
+        Py_BEGIN_ALLOW_THREADS
+        nret = watch_collect(self->watcher, watch_now() + MIRROR_TICK);
+        if(nret == 1)
+            nret = mirror_apply(self);
+        Py_END_ALLOW_THREADS
+        self->busy--;
+        if(nret == -1 && errno != EINTR)
+            return PyErr_SetFromErrno(PyExc_IOError);
+        if(PyErr_CheckSignals() == -1)
+            return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static char __Mirror_stop_doc__[] =
+    "Make :py:meth:`run` return (within a fraction of a second).\n"
+    ;
+
+static PyObject* Mirror_stop(PyObject *obj, PyObject *args) {
+    ((Mirror_Object*)obj)->stop = 1;
+    Py_RETURN_NONE;
+}
+
+static char __Mirror_close_doc__[] =
+    "Stop watching the source tree.\n"
+    ;
+
+static PyObject* Mirror_close(PyObject *obj, PyObject *args) {
+    Mirror_Object *self = (Mirror_Object*)obj;
+
+    if(self->busy) {
+        PyErr_SetString(PyExc_ValueError, "mirror is in use");
+        return NULL;
+    }
+    mirror_close(self);
+    Py_RETURN_NONE;
+}
+
+static char __Mirror_stats_doc__[] =
+    "The mirror's metrics, as a dictionary\n"
+    "\n"
+    "- ``events``: the notifications received\n"
+    "- ``pending``: the changed paths waiting to be applied, i.e. the\n"
+    "  current backlog\n"
+    "- ``batches``: the batches applied\n"
+    "- ``applied``: the paths whose ACLs were written to the target\n"
+    "- ``skipped``: the paths whose target ACLs were already right\n"
+    "- ``failed``: the paths that couldn't be written (see\n"
+    "  :py:attr:`errors`)\n"
+    "- ``throttled``: the batches applied early because ``max_pending``\n"
+    "  paths were waiting\n"
+    "- ``overflows``: the notification queue overflows, each causing a\n"
+    "  rescan of the source\n"
+    "- ``lag``, ``max_lag``: the time between the first change of a\n"
+    "  batch and the end of its application, in seconds, for the last\n"
+    "  batch and at most\n"
+    ;
+
+static PyObject* Mirror_get_stats(PyObject *obj, void* arg) {
+    Mirror_Object *self = (Mirror_Object*)obj;
+    Watcher_Object *w = self->watcher;
+
+    return Py_BuildValue("{snsnsnsnsnsnsnsnsdsd}",
+                         "events", (Py_ssize_t)(w ? w->events : 0),
+                         "pending", (Py_ssize_t)(w ? w->dirty.count : 0),
+                         "batches", (Py_ssize_t)self->batches,
+                         "applied", (Py_ssize_t)self->applied,
+                         "skipped", (Py_ssize_t)self->skipped,
+                         "failed", (Py_ssize_t)self->failed,
+                         "throttled", (Py_ssize_t)(w ? w->throttled : 0),
+                         "overflows", (Py_ssize_t)(w ? w->overflows : 0),
+                         "lag", self->lag / 1000.0,
+                         "max_lag", self->max_lag / 1000.0);
+}
+
+static char __Mirror_errors_doc__[] =
+    "The first errors, as (path, errno, message) tuples\n"
+    ;
+
+static PyObject* Mirror_get_errors(PyObject *obj, void* arg) {
+    return err_list_to_list(&((Mirror_Object*)obj)->errors);
+}
+
+static PyGetSetDef Mirror_getsets[] = {
+    {"stats", Mirror_get_stats, NULL, __Mirror_stats_doc__},
+    {"errors", Mirror_get_errors, NULL, __Mirror_errors_doc__},
+    {NULL}
+};
+
+static PyMethodDef Mirror_methods[] = {
+    {"sync", Mirror_sync, METH_NOARGS, __Mirror_sync_doc__},
+    {"step", Mirror_step, METH_VARARGS, __Mirror_step_doc__},
+    {"run", Mirror_run, METH_NOARGS, __Mirror_run_doc__},
+    {"stop", Mirror_stop, METH_NOARGS, __Mirror_stop_doc__},
+    {"close", Mirror_close, METH_NOARGS, __Mirror_close_doc__},
+    {NULL, NULL, 0, NULL}
+};
+
+static char __Mirror_Type_doc__[] =
+    "Mirror of the ACL changes of a tree onto another one\n"
+    "\n"
+    "The source tree is watched as with :py:class:`Watcher`, and the\n"
+    "changed ACLs are copied, as raw extended attributes, to the same\n"
+    "paths below the target; only the final state of the paths changed\n"
+    "within ``delay`` seconds is written. Paths missing from the target\n"
+    "are counted as failures, and removals are ignored. When\n"
+    "``max_pending`` paths are waiting, the batch is applied without\n"
+    "waiting for the end of the window, which bounds the memory used\n"
+    "and lets the kernel queue absorb the rest of the burst.\n"
+    "\n"
+    "  >>> m = posix1e.Mirror(\"/srv/share\", \"/standby/share\")\n"
+    "  >>> m.sync()\n"
+    "  >>> m.run()\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param string source: the tree to watch\n"
+    ":param string target: the tree to update\n"
+    ":param string backend: the notification backend, as for\n"
+    "    :py:class:`Watcher`\n"
+    ":param float delay: the coalescing window, in seconds\n"
+    ":param int max_pending: the paths waiting that cause a batch to be\n"
+    "    applied early; 0 for no limit\n"
+    ;
+
+/* The definition of the Mirror Type */
+static PyTypeObject Mirror_Type = {
+#ifdef IS_PY3K
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL)
+    0,
+#endif
+    "posix1e.Mirror",
+    sizeof(Mirror_Object),
+    0,
+    Mirror_dealloc,     /* tp_dealloc */
+    0,                  /* tp_print */
+    0,                  /* tp_getattr */
+    0,                  /* tp_setattr */
+    0,                  /* tp_compare */
+    0,                  /* tp_repr */
+    0,                  /* tp_as_number */
+    0,                  /* tp_as_sequence */
+    0,                  /* tp_as_mapping */
+    0,                  /* tp_hash */
+    0,                  /* tp_call */
+    0,                  /* tp_str */
+    0,                  /* tp_getattro */
+    0,                  /* tp_setattro */
+    0,                  /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT, /* tp_flags */
+    __Mirror_Type_doc__, /* tp_doc */
+    0,                  /* tp_traverse */
+    0,                  /* tp_clear */
+    0,                  /* tp_richcompare */
+    0,                  /* tp_weaklistoffset */
+    0,                  /* tp_iter */
+    0,                  /* tp_iternext */
+    Mirror_methods,     /* tp_methods */
+    0,                  /* tp_members */
+    Mirror_getsets,     /* tp_getset */
+    0,                  /* tp_base */
+    0,                  /* tp_dict */
+    0,                  /* tp_descr_get */
+    0,                  /* tp_descr_set */
+    0,                  /* tp_dictoffset */
+    Mirror_init,        /* tp_init */
+    0,                  /* tp_alloc */
+    Mirror_new,         /* tp_new */
+};
+
+/***** Principal cache *****/
+
+typedef struct {
+    uint32_t uid;
+    uint32_t gid;
+    gid_t *groups;
+    int ngroups;          /* -1 for unknown users */
+    int64_t expires;      /* watch_now() time; 0 if preloaded */
+} pcache_entry;
+
+typedef struct {
+    PyObject_HEAD
+    kv_map uids;          /* uid to entry number */
+    pcache_entry *entries; /* in insertion order */
+    size_t count;
+    size_t resolved;      /* the entries that expire (not preloaded) */
+    size_t alloc;
+    size_t max_size;
+    int64_t ttl;          /* in milliseconds */
+    int nss;
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+} PrincipalCache_Object;
+
+static PyTypeObject PrincipalCache_Type
+  CPYCHECKER_TYPE_OBJECT_FOR_TYPEDEF("PrincipalCache_Object");
+
+/* Resolves a user's primary group and groups through NSS; returns 0,
+   1 if the user is unknown, or -1 with errno set */
+static int pcache_lookup(uint32_t uid, uint32_t *gid, gid_t **groups,
+                         int *ngroups) {
+    struct passwd pw, *pwp = NULL;
+    gid_t *g = NULL, *p;
+    long bufsize = sysconf(_SC_GETPW_R_SIZE_MAX);
+    char *buf;
+    int nerr, n = 32, m;
+
+    if(bufsize < 1024)
+        bufsize = 16384;
+    for(;;) {
+        if((buf = malloc(bufsize)) == NULL)
+            return -1;
+        nerr = getpwuid_r(uid, &pw, buf, bufsize, &pwp);
+        if(nerr != ERANGE)
+            break;
+        free(buf);
+        bufsize *= 2;
+    }
+    if(pwp == NULL) {
+        free(buf);
+        if(nerr == 0 || nerr == ENOENT || nerr == ESRCH)
+            return 1;
+        errno = nerr;
+        return -1;
+    }
+    *gid = pw.pw_gid;
+    for(;;) {
+        if((p = realloc(g, n * sizeof(*g))) == NULL) {
+            free(g);
+            free(buf);
+            errno = ENOMEM;
+            return -1;
+        }
+        g = p;
+        m = n;
+        if(getgrouplist(pw.pw_name, pw.pw_gid, g, &m) != -1) {
+            n = m;
+            break;
+        }
+        n = m > n ? m : n * 2;
+    }
+    free(buf);
+    *groups = g;
+    *ngroups = n;
+    return 0;
+}
+
+static int pcache_reindex(PrincipalCache_Object *self) {
+    size_t i;
+
+    kv_map_free(&self->uids);
+    for(i = 0; i < self->count; i++)
+        if(kv_map_put(&self->uids, (const char*)&self->entries[i].uid,
+                      sizeof(uint32_t), i) == -1)
+            return -1;
+    return 0;
+}
+
+/* Makes room for a new entry: drops the expired entries and, if the
+   cache is still full, the oldest resolved ones, down to three
+   quarters of the maximum size so that evictions are amortized.
+   Preloaded entries are kept. */
+static int pcache_evict(PrincipalCache_Object *self) {
+    int64_t now = watch_now();
+    size_t i, j, drop;
+    pcache_entry *e;
+
+    drop = self->resolved > self->max_size * 3 / 4 ?
+        self->resolved - self->max_size * 3 / 4 : 0;
+    for(i = 0, j = 0; i < self->count; i++) {
+        e = self->entries + i;
+        if(e->expires != 0 && (drop > 0 || e->expires <= now)) {
+            if(drop > 0)
+                drop--;
+            free(e->groups);
+            self->resolved--;
+            self->evictions++;
+            continue;
+        }
+        self->entries[j++] = *e;
+    }
+    self->count = j;
+    return pcache_reindex(self);
+}
+
+/* Sets the entry of a uid, taking ownership of groups */
+static int pcache_set(PrincipalCache_Object *self, uint32_t uid,
+                      uint32_t gid, gid_t *groups, int ngroups,
+                      int64_t expires) {
+    uint64_t idx;
+    pcache_entry *e;
+
+    if(kv_map_get(&self->uids, (const char*)&uid, sizeof(uid), &idx)) {
+        e = self->entries + idx;
+        free(e->groups);
+        if(e->expires != 0)
+            self->resolved--;
+    } else {
+        /* only the resolved entries count towards max_size */
+        if(expires != 0 && self->resolved >= self->max_size &&
+           pcache_evict(self) == -1)
+            goto fail;
+        if(self->count == self->alloc) {
+            size_t alloc = self->alloc ? self->alloc * 2 : 16;
+            if((e = realloc(self->entries, alloc * sizeof(*e))) == NULL) {
+                errno = ENOMEM;
+                goto fail;
+            }
+            self->entries = e;
+            self->alloc = alloc;
+        }
+        if(kv_map_put(&self->uids, (const char*)&uid, sizeof(uid),
+                      self->count) == -1)
+            goto fail;
+        e = self->entries + self->count++;
+    }
+    e->uid = uid;
+    e->gid = gid;
+    e->groups = groups;
+    e->ngroups = ngroups;
+    e->expires = expires;
+    if(expires != 0)
+        self->resolved++;
+    return 0;
+
+ fail:
+    free(groups);
+    return -1;
+}
+
+/* Returns the entry of a known user, resolving it if needed; NULL
+   with an exception set otherwise */
+static const pcache_entry* pcache_get(PrincipalCache_Object *self,
+                                      uint32_t uid) {
+    gid_t *groups = NULL;
+    uint32_t gid = 0;
+    uint64_t idx = 0;
+    int ngroups = -1, nret;
+    const pcache_entry *e = NULL;
+
+    if(kv_map_get(&self->uids, (const char*)&uid, sizeof(uid), &idx)) {
+        e = self->entries + idx;
+        if(e->expires == 0 || e->expires > watch_now()) {
+            self->hits++;
+            goto found;
+        }
+    }
+    self->misses++;
+    if(!self->nss)
+        goto unknown;
+    Py_BEGIN_ALLOW_THREADS
+    nret = pcache_lookup(uid, &gid, &groups, &ngroups);
+    Py_END_ALLOW_THREADS
+    if(nret == -1) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return NULL;
+    }
+    if(pcache_set(self, uid, gid, groups, ngroups,
+                  watch_now() + self->ttl) == -1) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return NULL;
+    }
+    kv_map_get(&self->uids, (const char*)&uid, sizeof(uid), &idx);
+    e = self->entries + idx;
+
+ found:
+    if(e->ngroups >= 0)
+        return e;
+ unknown:
+    PyErr_Format(PyExc_KeyError, "unknown user %lu", (unsigned long)uid);
+    return NULL;
+}
+
+/* Whether the primary group of an entry is among its groups */
+static int pcache_has_gid(const pcache_entry *e) {
+    int i;
+
+    for(i = 0; i < e->ngroups; i++)
+        if(e->groups[i] == e->gid)
+            return 1;
+    return 0;
+}
+
+static void pcache_clear(PrincipalCache_Object *self) {
+    size_t i;
+
+    for(i = 0; i < self->count; i++)
+        free(self->entries[i].groups);
+    free(self->entries);
+    self->entries = NULL;
+    self->count = self->resolved = self->alloc = 0;
+    kv_map_free(&self->uids);
+}
+
+/* Adds the ids of an iterable to a gid_t array */
+static int pcache_add_groups(PyObject *groups, membuf *out) {
+    PyObject *iter, *item;
+    unsigned long id;
+    gid_t gid;
+
+    if((iter = PyObject_GetIter(groups)) == NULL)
+        return -1;
+    while((item = PyIter_Next(iter)) != NULL) {
+        id = PyLong_AsUnsignedLong(item);
+        Py_DECREF(item);
+        if(PyErr_Occurred())
+            break;
+        if(id >= UINT32_MAX) {
+            PyErr_SetString(PyExc_OverflowError, "invalid id");
+            break;
+        }
+        gid = id;
+        if(membuf_append(out, &gid, sizeof(gid)) == -1) {
+            PyErr_NoMemory();
+            break;
+        }
+    }
+    Py_DECREF(iter);
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+static int pcache_preload(PrincipalCache_Object *self, PyObject *map) {
+    PyObject *items, *item, *value, *gids;
+    membuf groups = { NULL, 0, 0 };
+    unsigned long uid, gid;
+    Py_ssize_t i, n;
+    int ret = -1;
+
+    if((items = PyMapping_Items(map)) == NULL)
+        return -1;
+    n = PyList_Size(items);
+    for(i = 0; i < n; i++) {
+        item = PyList_GET_ITEM(items, i);
+        value = PyTuple_GET_ITEM(item, 1);
+        uid = PyLong_AsUnsignedLong(PyTuple_GET_ITEM(item, 0));
+        if(PyErr_Occurred())
+            goto out;
+        if(!PyTuple_Check(value) ||
+           !PyArg_ParseTuple(value, "kO", &gid, &gids)) {
+            PyErr_SetString(PyExc_TypeError,
+                            "preloaded entries must be (gid, groups) tuples");
+            goto out;
+        }
+        if(uid >= UINT32_MAX || gid >= UINT32_MAX) {
+            PyErr_SetString(PyExc_OverflowError, "invalid id");
+            goto out;
+        }
+        groups.len = 0;
+        if(pcache_add_groups(gids, &groups) == -1)
+            goto out;
+        if(pcache_set(self, uid, gid, (gid_t*)groups.data,
+                      groups.len / sizeof(gid_t), 0) == -1) {
+            groups.data = NULL;
+            PyErr_SetFromErrno(PyExc_IOError);
+            goto out;
+        }
+        /* the entry owns the array now */
+        groups.data = NULL;
+        groups.size = 0;
+    }
+    ret = 0;
+
+ out:
+    membuf_free(&groups);
+    Py_DECREF(items);
+    return ret;
+}
+
+static PyObject* PrincipalCache_new(PyTypeObject* type, PyObject* args,
+                                    PyObject *keywds) {
+    return type->tp_alloc(type, 0);
+}
+
+static int PrincipalCache_init(PyObject* obj, PyObject* args,
+                               PyObject *keywds) {
+    PrincipalCache_Object *self = (PrincipalCache_Object*)obj;
+    static char *kwlist[] = { "ttl", "max_size", "preload", "nss", NULL };
+    PyObject *preload = NULL, *nss = Py_True;
+    double ttl = 300.0;
+    Py_ssize_t max_size = 4096;
+
+    if(!PyArg_ParseTupleAndKeywords(args, keywds, "|dnOO", kwlist,
+                                    &ttl, &max_size, &preload, &nss))
+        return -1;
+    if(ttl < 0 || max_size < 1) {
+        PyErr_SetString(PyExc_ValueError, "invalid ttl or max_size");
+        return -1;
+    }
+    pcache_clear(self);
+    self->ttl = (int64_t)(ttl * 1000);
+    self->max_size = max_size;
+    if((self->nss = PyObject_IsTrue(nss)) == -1)
+        return -1;
+    self->hits = self->misses = self->evictions = 0;
+    if(preload != NULL && preload != Py_None &&
+       pcache_preload(self, preload) == -1)
+        return -1;
+    return 0;
+}
+
+static void PrincipalCache_dealloc(PyObject* obj) {
+    pcache_clear((PrincipalCache_Object*)obj);
+    PyObject_DEL(obj);
+}
+
+static Py_ssize_t PrincipalCache_length(PyObject *obj) {
+    return ((PrincipalCache_Object*)obj)->count;
+}
+
+static char __PrincipalCache_resolve_doc__[] =
+    "resolve(uid)\n"
+    "Return the groups of a user.\n"
+    "\n"
+    ":param int uid: the user's id\n"
+    ":return: a tuple (primary gid, list of gids); the list holds all\n"
+    "    the groups of the user, including the primary one\n"
+    ":rtype: tuple\n"
+    ":raises KeyError: if the user is unknown\n"
+    ;
+
+static PyObject* PrincipalCache_resolve(PyObject *obj, PyObject *args) {
+    PrincipalCache_Object *self = (PrincipalCache_Object*)obj;
+    const pcache_entry *e;
+    PyObject *groups, *gid;
+    unsigned long uid;
+    int i;
+
+    if(!PyArg_ParseTuple(args, "k", &uid))
+        return NULL;
+    if(uid >= UINT32_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "invalid id");
+        return NULL;
+    }
+    if((e = pcache_get(self, uid)) == NULL)
+        return NULL;
+    if((groups = PyList_New(e->ngroups)) == NULL)
+        return NULL;
+    for(i = 0; i < e->ngroups; i++) {
+        if((gid = PyLong_FromUnsignedLong(e->groups[i])) == NULL) {
+            Py_DECREF(groups);
+            return NULL;
+        }
+        PyList_SET_ITEM(groups, i, gid);
+    }
+    return Py_BuildValue("(kN)", (unsigned long)e->gid, groups);
+}
+
+static char __PrincipalCache_preload_doc__[] =
+    "preload(mapping)\n"
+    "Add entries that never expire.\n"
+    "\n"
+    "Preloaded entries are not counted in the maximum size and are\n"
+    "never evicted; they replace the entries of the same users.\n"
+    "\n"
+    ":param mapping: a mapping from uids to (primary gid, list of\n"
+    "    gids) tuples, as returned by :py:meth:`resolve`\n"
+    ;
+
+static PyObject* PrincipalCache_preload(PyObject *obj, PyObject *args) {
+    PyObject *map;
+
+    if(!PyArg_ParseTuple(args, "O", &map))
+        return NULL;
+    if(pcache_preload((PrincipalCache_Object*)obj, map) == -1)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static char __PrincipalCache_clear_doc__[] =
+    "Forget all the entries, preloaded ones included.\n"
+    ;
+
+static PyObject* PrincipalCache_clear(PyObject *obj, PyObject *args) {
+    pcache_clear((PrincipalCache_Object*)obj);
+    Py_RETURN_NONE;
+}
+
+static char __PrincipalCache_stats_doc__[] =
+    "The cache's counters, as a dictionary of ``hits``, ``misses``\n"
+    "(lookups needing a resolution) and ``evictions``\n"
+    ;
+
+static PyObject* PrincipalCache_get_stats(PyObject *obj, void* arg) {
+    PrincipalCache_Object *self = (PrincipalCache_Object*)obj;
+
+    return Py_BuildValue("{snsnsn}",
+                         "hits", (Py_ssize_t)self->hits,
+                         "misses", (Py_ssize_t)self->misses,
+                         "evictions", (Py_ssize_t)self->evictions);
+}
+
+static PyGetSetDef PrincipalCache_getsets[] = {
+    {"stats", PrincipalCache_get_stats, NULL, __PrincipalCache_stats_doc__},
+    {NULL}
+};
+
+static PyMethodDef PrincipalCache_methods[] = {
+    {"resolve", PrincipalCache_resolve, METH_VARARGS,
+     __PrincipalCache_resolve_doc__},
+    {"preload", PrincipalCache_preload, METH_VARARGS,
+     __PrincipalCache_preload_doc__},
+    {"clear", PrincipalCache_clear, METH_NOARGS,
+     __PrincipalCache_clear_doc__},
+    {NULL, NULL, 0, NULL}
+};
+
+static PySequenceMethods PrincipalCache_as_sequence = {
+    PrincipalCache_length, /* sq_length */
+    0,                  /* sq_concat */
+    0,                  /* sq_repeat */
+    0,                  /* sq_item */
+    0,                  /* sq_slice */
+    0,                  /* sq_ass_item */
+    0,                  /* sq_ass_slice */
+    0,                  /* sq_contains */
+};
+
+static char __PrincipalCache_Type_doc__[] =
+    "Cache of the groups of users\n"
+    "\n"
+    "Resolving the groups of a user goes through NSS (getpwuid(3) and\n"
+    "getgrouplist(3)), which can be slow, e.g. with a directory\n"
+    "service. The cache resolves each user once, keeps the result for\n"
+    "``ttl`` seconds (unknown users included) and holds at most\n"
+    "``max_size`` resolved users. It can be given to\n"
+    ":py:func:`check_access` and :py:meth:`AclIndex.query`. Without\n"
+    "``nss``, only the preloaded users are known, which makes the\n"
+    "evaluations independent from the host.\n"
+    "\n"
+    "  >>> cache = posix1e.PrincipalCache(preload={1000: (100, [100])},\n"
+    "  ...                                nss=False)\n"
+    "  >>> posix1e.check_access(paths, 1000, cache=cache)\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param float ttl: the lifetime of the resolved entries, in seconds\n"
+    ":param int max_size: the maximum number of resolved entries\n"
+    ":param preload: a mapping as taken by :py:meth:`preload`\n"
+    ":param bool nss: whether to resolve unknown users through NSS\n"
+    ;
+
+/* The definition of the PrincipalCache Type */
+static PyTypeObject PrincipalCache_Type = {
+#ifdef IS_PY3K
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL)
+    0,
+#endif
+    "posix1e.PrincipalCache",
+    sizeof(PrincipalCache_Object),
+    0,
+    PrincipalCache_dealloc, /* tp_dealloc */
+    0,                  /* tp_print */
+    0,                  /* tp_getattr */
+    0,                  /* tp_setattr */
+    0,                  /* tp_compare */
+    0,                  /* tp_repr */
+    0,                  /* tp_as_number */
+    &PrincipalCache_as_sequence, /* tp_as_sequence */
+    0,                  /* tp_as_mapping */
+    0,                  /* tp_hash */
+    0,                  /* tp_call */
+    0,                  /* tp_str */
+    0,                  /* tp_getattro */
+    0,                  /* tp_setattro */
+    0,                  /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT, /* tp_flags */
+    __PrincipalCache_Type_doc__, /* tp_doc */
+    0,                  /* tp_traverse */
+    0,                  /* tp_clear */
+    0,                  /* tp_richcompare */
+    0,                  /* tp_weaklistoffset */
+    0,                  /* tp_iter */
+    0,                  /* tp_iternext */
+    PrincipalCache_methods, /* tp_methods */
+    0,                  /* tp_members */
+    PrincipalCache_getsets, /* tp_getset */
+    0,                  /* tp_base */
+    0,                  /* tp_dict */
+    0,                  /* tp_descr_get */
+    0,                  /* tp_descr_set */
+    0,                  /* tp_dictoffset */
+    PrincipalCache_init, /* tp_init */
+    0,                  /* tp_alloc */
+    PrincipalCache_new, /* tp_new */
+};
+
+/***** Principal index *****/
+
+/* An index file answers "which files does this user or group get
+   access to" without walking the tree. Its layout (little endian,
+   8-byte aligned tables, used in place via mmap):
+
+   - the header (idx_header)
+   - the file table: one idx_file per object, in the walker's order,
+     so that each subtree is a contiguous range of file numbers
+   - the ACL table: one idx_acl per distinct access ACL, with the
+     set of files having it
+   - the key table: one idx_key per principal, sorted by kind and id;
+     for the named entries (IDX_USER, IDX_GROUP), the data is the
+     array of the ids of the ACLs naming the principal, and for the
+     owners (IDX_OWNER, IDX_OWNING_GROUP) the set of files they own
+   - the principal table: one idx_principal per user and group found
+     (as owner or in an entry), plus "other", sorted by kind and id
+   - the directory table: one idx_dir per directory, sorted by file
+     number, with the end of its subtree and its summary
+   - the data: path names (NUL terminated), ACL blobs, key data,
+     summaries
+
+   Sets of files are stored as run lists: varint pairs of (gap since
+   the end of the previous run, run length), which keeps the sets of
+   the files of a directory tiny. Files are thus grouped by ACL: a
+   user named in one ACL shared by a million files costs one ACL id
+   in its key, and the run list of that ACL.
+
+   The summary of a directory is the set of the grants found in its
+   subtree, each grant being a principal number (its position in the
+   principal table) and the effective permissions one object gives
+   it, as sorted, delta-encoded varints of (number << 3 | perms). A
+   search for some permissions skips the subtrees whose summary has
+   no grant that matches; the summaries are exact, so unlike Bloom
+   filters they can also prune searches excluding some principals.
+*/
+#define INDEX_MAGIC "PYACLIDX"
+#define INDEX_VERSION 2
+
+#define IDX_USER 0
+#define IDX_GROUP 1
+#define IDX_OWNER 2
+#define IDX_OWNING_GROUP 3
+
+/* principal kinds */
+#define IDX_P_USER 0
+#define IDX_P_GROUP 1
+#define IDX_P_OTHER 2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t n_files;
+    uint64_t n_acls;
+    uint64_t n_keys;
+    uint64_t file_off;
+    uint64_t acl_off;
+    uint64_t key_off;
+    uint64_t data_off;
+    uint64_t n_principals;
+    uint64_t principal_off;
+    uint64_t n_dirs;
+    uint64_t dir_off;
+} idx_header;
+
+typedef struct {
+    uint64_t name_off;
+    uint64_t ino;
+    int64_t ctime_sec;
+    uint32_t ctime_nsec;
+    uint32_t name_len;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t acl_id;
+    uint32_t mode;
+} idx_file;
+
+typedef struct {
+    uint64_t blob_off;
+    uint64_t files_off;
+    uint32_t blob_len;
+    uint32_t files_len;
+} idx_acl;
+
+typedef struct {
+    uint32_t kind;
+    uint32_t id;
+    uint64_t off;
+    uint64_t len;         /* in bytes */
+} idx_key;
+
+typedef struct {
+    uint32_t kind;
+    uint32_t id;
+} idx_principal;
+
+typedef struct {
+    uint32_t file;
+    uint32_t end;         /* the file number after its subtree */
+    uint64_t off;         /* the summary */
+    uint64_t len;
+} idx_dir;
+
+/* What an object's ACL grants to whom */
+typedef struct {
+    uint32_t kind;
+    uint32_t id;
+    uint32_t perm;
+} idx_grant;
+
+/* Compares relative paths in the walker's order: "." first, then
+   depth-first with the entries of each directory sorted by name,
+   which is byte order with '/' sorting before everything else */
+static int walk_order_cmp(const char *a, const char *b) {
+    int ca, cb;
+
+    if(strcmp(a, ".") == 0 || strcmp(b, ".") == 0)
+        return (strcmp(b, ".") == 0) - (strcmp(a, ".") == 0);
+    for(; *a == *b && *a != '\0'; a++, b++)
+        ;
+    ca = *a == '/' ? 1 : (unsigned char)*a;
+    cb = *b == '/' ? 1 : (unsigned char)*b;
+    return ca - cb;
+}
+
+/* Appends a sorted set of file numbers as a run list */
+static int runs_put(membuf *out, const uint32_t *files, size_t count) {
+    uint64_t next = 0;
+    size_t i = 0, j;
+
+    while(i < count) {
+        for(j = i + 1; j < count && files[j] == files[j - 1] + 1; j++)
+            ;
+        if(varint_put(out, files[i] - next) == -1 ||
+           varint_put(out, j - i) == -1)
+            return -1;
+        next = (uint64_t)files[j - 1] + 1;
+        i = j;
+    }
+    return 0;
+}
+
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    size_t pos;
+    uint64_t next;
+    uint64_t limit;       /* the number of files */
+} run_iter;
+
+/* Returns 1 and the next run, 0 at the end, or -1 if corrupt */
+static int run_next(run_iter *it, uint64_t *start, uint64_t *count) {
+    uint64_t gap;
+
+    if(it->pos == it->len)
+        return 0;
+    if(varint_get(it->data, it->len, &it->pos, &gap) == -1 ||
+       varint_get(it->data, it->len, &it->pos, count) == -1 ||
+       gap > it->limit - it->next || *count > it->limit - it->next - gap)
+        return -1;
+    *start = it->next + gap;
+    it->next = *start + *count;
+    return 1;
+}
+
+/***** AclIndex type *****/
+
+typedef struct {
+    PyObject_HEAD
+    char *map;
+    size_t size;
+    uint64_t n_files;
+    uint64_t n_acls;
+    uint64_t n_keys;
+    const idx_file *files;
+    const idx_acl *acls;
+    const idx_key *keys;
+    uint64_t n_principals;
+    uint64_t n_dirs;
+    const idx_principal *principals;
+    const idx_dir *dirs;
+    int busy;
+} AclIndex_Object;
+
+static PyTypeObject AclIndex_Type
+  CPYCHECKER_TYPE_OBJECT_FOR_TYPEDEF("AclIndex_Object");
+
+static int index_open(AclIndex_Object *self, const char *fname) {
+    idx_header hdr;
+    struct stat st;
+    char *map;
+    int fd;
+
+    if((fd = open(fname, O_RDONLY | O_CLOEXEC)) == -1)
+        return -1;
+    if(fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if(st.st_size < (off_t)sizeof(hdr)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return -1;
+    memcpy(&hdr, map, sizeof(hdr));
+    hdr.n_files = le64toh(hdr.n_files);
+    hdr.n_acls = le64toh(hdr.n_acls);
+    hdr.n_keys = le64toh(hdr.n_keys);
+    hdr.file_off = le64toh(hdr.file_off);
+    hdr.acl_off = le64toh(hdr.acl_off);
+    hdr.key_off = le64toh(hdr.key_off);
+    hdr.n_principals = le64toh(hdr.n_principals);
+    hdr.principal_off = le64toh(hdr.principal_off);
+    hdr.n_dirs = le64toh(hdr.n_dirs);
+    hdr.dir_off = le64toh(hdr.dir_off);
+    if(memcmp(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic)) != 0 ||
+       le32toh(hdr.version) != INDEX_VERSION ||
+       hdr.n_files > UINT32_MAX ||
+       !snap_range_ok(st.st_size, hdr.file_off, hdr.n_files,
+                      sizeof(idx_file)) ||
+       !snap_range_ok(st.st_size, hdr.acl_off, hdr.n_acls, sizeof(idx_acl)) ||
+       !snap_range_ok(st.st_size, hdr.key_off, hdr.n_keys, sizeof(idx_key)) ||
+       !snap_range_ok(st.st_size, hdr.principal_off, hdr.n_principals,
+                      sizeof(idx_principal)) ||
+       !snap_range_ok(st.st_size, hdr.dir_off, hdr.n_dirs, sizeof(idx_dir))) {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    self->map = map;
+    self->size = st.st_size;
+    self->n_files = hdr.n_files;
+    self->n_acls = hdr.n_acls;
+    self->n_keys = hdr.n_keys;
+    self->files = (const idx_file*)(map + hdr.file_off);
+    self->acls = (const idx_acl*)(map + hdr.acl_off);
+    self->keys = (const idx_key*)(map + hdr.key_off);
+    self->n_principals = hdr.n_principals;
+    self->n_dirs = hdr.n_dirs;
+    self->principals = (const idx_principal*)(map + hdr.principal_off);
+    self->dirs = (const idx_dir*)(map + hdr.dir_off);
+    return 0;
+}
+
+static void index_close(AclIndex_Object *self) {
+    if(self->map != NULL)
+        munmap(self->map, self->size);
+    self->map = NULL;
+    self->size = 0;
+    self->n_files = self->n_acls = self->n_keys = 0;
+    self->n_principals = self->n_dirs = 0;
+}
+
+/* Returns the data at off/len, or NULL if it is out of the file */
+static const char* index_data(const AclIndex_Object *self, uint64_t off,
+                              uint64_t len) {
+    if(off > self->size || len > self->size - off)
+        return NULL;
+    return self->map + off;
+}
+
+static const char* index_file_name(const AclIndex_Object *self,
+                                   uint64_t idx, uint32_t *len) {
+    uint32_t nlen = le32toh(self->files[idx].name_len);
+    const char *name = index_data(self, le64toh(self->files[idx].name_off),
+                                  (uint64_t)nlen + 1);
+
+    if(name == NULL || name[nlen] != '\0')
+        return NULL;
+    if(len != NULL)
+        *len = nlen;
+    return name;
+}
+
+static const char* index_acl_blob(const AclIndex_Object *self, uint32_t id,
+                                  uint32_t *len) {
+    if(id >= self->n_acls)
+        return NULL;
+    *len = le32toh(self->acls[id].blob_len);
+    return index_data(self, le64toh(self->acls[id].blob_off), *len);
+}
+
+static int index_acl_runs(const AclIndex_Object *self, uint32_t id,
+                          run_iter *it) {
+    memset(it, 0, sizeof(*it));
+    it->len = le32toh(self->acls[id].files_len);
+    it->limit = self->n_files;
+    it->data = (const unsigned char*)
+        index_data(self, le64toh(self->acls[id].files_off), it->len);
+    return it->data == NULL ? -1 : 0;
+}
+
+/* Binary search for a path; returns its file number or -1 */
+static int64_t index_find(const AclIndex_Object *self, const char *path) {
+    uint64_t lo = 0, hi = self->n_files, mid;
+    const char *name;
+    int c;
+
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if((name = index_file_name(self, mid, NULL)) == NULL)
+            return -1;
+        c = walk_order_cmp(name, path);
+        if(c == 0)
+            return mid;
+        if(c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -1;
+}
+
+/* Returns the key of a principal, or NULL */
+static const idx_key* index_find_key(const AclIndex_Object *self,
+                                     uint32_t kind, uint32_t id) {
+    uint64_t lo = 0, hi = self->n_keys, mid;
+    uint32_t k, i;
+
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        k = le32toh(self->keys[mid].kind);
+        i = le32toh(self->keys[mid].id);
+        if(k == kind && i == id)
+            return self->keys + mid;
+        if(k < kind || (k == kind && i < id))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+/* Computes the permissions an ACL grants to the principal of the
+   given kind (the owner's ones for IDX_OWNER, and so on) */
+static int index_acl_perm(const char *blob, size_t len, uint32_t kind,
+                          uint32_t id) {
+    entry_rec rec;
+    int count, i, perm = 0, mask = 7;
+
+    if((count = blob_count(blob, len)) == -1)
+        return -1;
+    for(i = 0; i < count; i++) {
+        blob_get(blob, i, &rec);
+        if(rec.tag == ACL_MASK)
+            mask = rec.perm;
+        else if((kind == IDX_OWNER && rec.tag == ACL_USER_OBJ) ||
+                (kind == IDX_OWNING_GROUP && rec.tag == ACL_GROUP_OBJ) ||
+                (kind == IDX_USER && rec.tag == ACL_USER && rec.id == id) ||
+                (kind == IDX_GROUP && rec.tag == ACL_GROUP && rec.id == id))
+            perm = rec.perm;
+    }
+    return kind == IDX_OWNER ? perm : perm & mask;
+}
+
+/* Lists the grants of an object's ACL into out; returns their
+   number, or -1 if the ACL is corrupt */
+static int index_grants(const char *blob, size_t len, uint32_t uid,
+                        uint32_t gid, membuf *out) {
+    entry_rec rec;
+    idx_grant g;
+    int count, i, mask = 7;
+
+    out->len = 0;
+    if((count = blob_count(blob, len)) == -1)
+        return -1;
+    for(i = 0; i < count; i++) {
+        blob_get(blob, i, &rec);
+        if(rec.tag == ACL_MASK)
+            mask = rec.perm;
+    }
+    for(i = 0; i < count; i++) {
+        blob_get(blob, i, &rec);
+        g.perm = rec.perm & mask;
+        switch(rec.tag) {
+        case ACL_USER_OBJ:
+            g.kind = IDX_P_USER;
+            g.id = uid;
+            g.perm = rec.perm;
+            break;
+        case ACL_USER:
+            g.kind = IDX_P_USER;
+            g.id = rec.id;
+            break;
+        case ACL_GROUP_OBJ:
+            g.kind = IDX_P_GROUP;
+            g.id = gid;
+            break;
+        case ACL_GROUP:
+            g.kind = IDX_P_GROUP;
+            g.id = rec.id;
+            break;
+        case ACL_OTHER:
+            g.kind = IDX_P_OTHER;
+            g.id = 0;
+            g.perm = rec.perm;
+            break;
+        default:
+            continue;
+        }
+        if(membuf_append(out, &g, sizeof(g)) == -1)
+            return -1;
+    }
+    return out->len / sizeof(g);
+}
+
+static int u64_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Returns the directory record of a file, or NULL */
+static const idx_dir* index_find_dir(const AclIndex_Object *self,
+                                     uint64_t f) {
+    uint64_t lo = 0, hi = self->n_dirs, mid, file;
+
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        file = le32toh(self->dirs[mid].file);
+        if(file == f)
+            return self->dirs + mid;
+        if(file < f)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+static int index_excluded(const uint64_t *excl, size_t nexcl,
+                          uint32_t kind, uint32_t id) {
+    uint64_t key = (uint64_t)kind << 32 | id;
+
+    return nexcl > 0 &&
+        bsearch(&key, excl, nexcl, sizeof(*excl), u64_cmp) != NULL;
+}
+
+/* Tells whether the summary of a directory has a grant of the wanted
+   permissions to a principal that is not excluded; -1 if corrupt */
+static int index_dir_matches(const AclIndex_Object *self,
+                             const idx_dir *dir, int want,
+                             const uint64_t *excl, size_t nexcl) {
+    const unsigned char *data;
+    uint64_t len = le64toh(dir->len), count, delta, tok = 0, i;
+    size_t pos = 0;
+
+    data = (const unsigned char*)index_data(self, le64toh(dir->off), len);
+    if(data == NULL || varint_get(data, len, &pos, &count) == -1)
+        return -1;
+    for(i = 0; i < count; i++) {
+        if(varint_get(data, len, &pos, &delta) == -1)
+            return -1;
+        tok += delta;
+        if((tok >> 3) >= self->n_principals)
+            return -1;
+        if((tok & want) == (uint64_t)want &&
+           !index_excluded(excl, nexcl,
+                           le32toh(self->principals[tok >> 3].kind),
+                           le32toh(self->principals[tok >> 3].id)))
+            return 1;
+    }
+    return 0;
+}
+
+typedef struct {
+    uint64_t file;
+    idx_grant grant;
+} idx_hit;
+
+/* Lists into hits the grants of the wanted permissions to principals
+   not excluded, for the files in [start, end); the subtrees whose
+   summary shows they have none are skipped */
+static int index_search(const AclIndex_Object *self, uint64_t start,
+                        uint64_t end, int want, const uint64_t *excl,
+                        size_t nexcl, membuf *hits) {
+    membuf grants = { NULL, 0, 0 };
+    const idx_dir *dir;
+    const idx_grant *g;
+    const char *blob;
+    uint64_t f = start, next;
+    uint32_t blen;
+    idx_hit hit;
+    int n, i, m;
+
+    while(f < end) {
+        if((dir = index_find_dir(self, f)) != NULL) {
+            if((m = index_dir_matches(self, dir, want, excl, nexcl)) == -1)
+                goto corrupt;
+            next = le32toh(dir->end);
+            if(next <= f || next > self->n_files)
+                goto corrupt;
+            if(m == 0) {
+                f = next;
+                continue;
+            }
+        }
+        blob = index_acl_blob(self, le32toh(self->files[f].acl_id), &blen);
+        if(blob == NULL)
+            goto corrupt;
+        n = index_grants(blob, blen, le32toh(self->files[f].uid),
+                         le32toh(self->files[f].gid), &grants);
+        if(n == -1)
+            goto corrupt;
+        for(i = 0, g = (const idx_grant*)grants.data; i < n; i++, g++) {
+            if(g->perm == 0 || (g->perm & want) != (uint32_t)want ||
+               index_excluded(excl, nexcl, g->kind, g->id))
+                continue;
+            hit.file = f;
+            hit.grant = *g;
+            if(membuf_append(hits, &hit, sizeof(hit)) == -1) {
+                membuf_free(&grants);
+                return -1;
+            }
+        }
+        f++;
+    }
+    membuf_free(&grants);
+    return 0;
+
+ corrupt:
+    membuf_free(&grants);
+    errno = EINVAL;
+    return -1;
+}
+
+#define IDX_COVERED 0x80
+#define IDX_WANTED 0x40     /* a single entry grants all the wanted perms */
+
+/* Fills perms (one byte per file) with IDX_COVERED | the permissions
+   for the files a principal gets access to through its kind of
+   entry, plus IDX_WANTED if the entry grants all of want; files
+   already covered are left alone unless merge is set, in which case
+   the entries are combined */
+static int index_collect(const AclIndex_Object *self, uint32_t kind,
+                         uint32_t id, unsigned char *perms, int merge,
+                         int want) {
+    const idx_key *key = index_find_key(self, kind, id);
+    const unsigned char *data;
+    const char *blob;
+    uint64_t i, start, count, f, nacls;
+    uint32_t acl_id, blen;
+    run_iter it;
+    int r, p;
+
+    if(key == NULL)
+        return 0;
+    data = (const unsigned char*)index_data(self, le64toh(key->off),
+                                            le64toh(key->len));
+    if(data == NULL)
+        goto corrupt;
+    if(kind == IDX_OWNER || kind == IDX_OWNING_GROUP) {
+        memset(&it, 0, sizeof(it));
+        it.data = data;
+        it.len = le64toh(key->len);
+        it.limit = self->n_files;
+        while((r = run_next(&it, &start, &count)) == 1)
+            for(f = start; f < start + count; f++) {
+                acl_id = le32toh(self->files[f].acl_id);
+                if((blob = index_acl_blob(self, acl_id, &blen)) == NULL ||
+                   (p = index_acl_perm(blob, blen, kind, id)) == -1)
+                    goto corrupt;
+                if(merge || !(perms[f] & IDX_COVERED))
+                    perms[f] |= IDX_COVERED | p |
+                        ((p & want) == want ? IDX_WANTED : 0);
+            }
+        return r == -1 ? -1 : 0;
+    }
+    nacls = le64toh(key->len) / sizeof(uint32_t);
+    for(i = 0; i < nacls; i++) {
+        memcpy(&acl_id, data + i * sizeof(uint32_t), sizeof(acl_id));
+        acl_id = le32toh(acl_id);
+        if((blob = index_acl_blob(self, acl_id, &blen)) == NULL ||
+           (p = index_acl_perm(blob, blen, kind, id)) == -1 ||
+           index_acl_runs(self, acl_id, &it) == -1)
+            goto corrupt;
+        while((r = run_next(&it, &start, &count)) == 1)
+            for(f = start; f < start + count; f++)
+                if(merge || !(perms[f] & IDX_COVERED))
+                    perms[f] |= IDX_COVERED | p |
+                        ((p & want) == want ? IDX_WANTED : 0);
+        if(r == -1)
+            goto corrupt;
+    }
+    return 0;
+
+ corrupt:
+    errno = EINVAL;
+    return -1;
+}
+
+static PyObject* AclIndex_new(PyTypeObject* type, PyObject* args,
+                              PyObject *keywds) {
+    PyObject* newindex;
+
+    newindex = type->tp_alloc(type, 0);
+    if(newindex != NULL) {
+        AclIndex_Object *self = (AclIndex_Object*)newindex;
+        self->map = NULL;
+        self->size = 0;
+        self->n_files = self->n_acls = self->n_keys = 0;
+        self->n_principals = self->n_dirs = 0;
+        self->busy = 0;
+    }
+    return newindex;
+}
+
+static int AclIndex_init(PyObject* obj, PyObject* args, PyObject *keywds) {
+    AclIndex_Object *self = (AclIndex_Object*)obj;
+    static char *kwlist[] = { "filename", NULL };
+    char *fname = NULL;
+    int nret;
+
+    if(!PyArg_ParseTupleAndKeywords(args, keywds, "et", kwlist,
+                                    Py_FileSystemDefaultEncoding, &fname))
+        return -1;
+    if(self->busy) {
+        PyErr_SetString(PyExc_ValueError, "index is in use");
+        PyMem_Free(fname);
+        return -1;
+    }
+    index_close(self);
+    nret = index_open(self, fname);
+    if(nret == -1)
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, fname);
+    PyMem_Free(fname);
+    return nret;
+}
+
+static void AclIndex_dealloc(PyObject* obj) {
+    index_close((AclIndex_Object*)obj);
+    PyObject_DEL(obj);
+}
+
+static Py_ssize_t AclIndex_length(PyObject *obj) {
+    return ((AclIndex_Object*)obj)->n_files;
+}
+
+static char __AclIndex_query_doc__[] =
+    "query([user=None, group=None, perms=0, cache=None])\n"
+    "Return the files a user or group gets access to.\n"
+    "\n"
+    "For a user, these are the files it owns (with the owner's\n"
+    "permissions) and the files whose ACL has a named entry for it;\n"
+    "for a group, the files it owns and the files whose ACL has a\n"
+    "named entry for it. Group memberships are only expanded with a\n"
+    "cache: the files a user doesn't get access to as owner or named\n"
+    "user then get the permissions of its groups, combined. The\n"
+    "permissions are the effective ones, i.e. masked by the mask entry\n"
+    "where it applies.\n"
+    "\n"
+    ":param int user: the uid to look for\n"
+    ":param int group: the gid to look for (exclusive with user)\n"
+    ":param int perms: only return the files where all these\n"
+    "    permissions (a combination of :py:data:`ACL_READ`,\n"
+    "    :py:data:`ACL_WRITE` and :py:data:`ACL_EXECUTE`) are granted\n"
+    "    by a single entry, as in the access check algorithm\n"
+    ":param cache: a :py:class:`PrincipalCache` giving the groups of\n"
+    "    the user\n"
+    ":return: a list of (path, permissions) tuples, in the tree's order\n"
+    ":rtype: list\n"
+    ":raises KeyError: if the cache doesn't know the user\n"
+    ;
+
+static PyObject* AclIndex_query(PyObject *obj, PyObject *args,
+                                PyObject *keywds) {
+    AclIndex_Object *self = (AclIndex_Object*)obj;
+    static char *kwlist[] = { "user", "group", "perms", "cache", NULL };
+    PyObject *user = Py_None, *group = Py_None, *cache = NULL;
+    PyObject *list = NULL, *item;
+    const pcache_entry *e;
+    unsigned char *perms, *gperms = NULL;
+    gid_t *groups = NULL;
+    int ngroups = 0, i;
+    const char *name;
+    unsigned long id;
+    uint32_t nlen;
+    uint64_t f;
+    int want = 0, nret;
+
+    if(!PyArg_ParseTupleAndKeywords(args, keywds, "|OOiO!", kwlist,
+                                    &user, &group, &want,
+                                    &PrincipalCache_Type, &cache))
+        return NULL;
+    if((user == Py_None) == (group == Py_None)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "exactly one of user and group must be given");
+        return NULL;
+    }
+    id = PyLong_AsUnsignedLong(user != Py_None ? user : group);
+    if(PyErr_Occurred())
+        return NULL;
+    if(id >= UINT32_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "invalid id");
+        return NULL;
+    }
+    if(cache != NULL && user != Py_None) {
+        if((e = pcache_get((PrincipalCache_Object*)cache, id)) == NULL)
+            return NULL;
+        /* the entry may change while the GIL is released */
+        ngroups = e->ngroups;
+        if((groups = malloc((ngroups + 1) * sizeof(*groups))) == NULL ||
+           (gperms = calloc(self->n_files + 1, 1)) == NULL) {
+            free(groups);
+            return PyErr_NoMemory();
+        }
+        if(ngroups > 0)
+            memcpy(groups, e->groups, ngroups * sizeof(*groups));
+        if(!pcache_has_gid(e))
+            groups[ngroups++] = e->gid;
+    }
+    if((perms = calloc(self->n_files + 1, 1)) == NULL) {
+        free(groups);
+        free(gperms);
+        return PyErr_NoMemory();
+    }
+    self->busy++;
+    Py_BEGIN_ALLOW_THREADS
+    if(user != Py_None) {
+        nret = index_collect(self, IDX_OWNER, id, perms, 0, want) == -1 ||
+            index_collect(self, IDX_USER, id, perms, 0, want) == -1 ? -1 : 0;
+        /* as in the access check algorithm, one of the group entries
+           must grant all the wanted permissions */
+        for(i = 0; i < ngroups && nret == 0; i++)
+            nret = index_collect(self, IDX_OWNING_GROUP, groups[i], gperms,
+                                 1, want) == -1 ||
+                index_collect(self, IDX_GROUP, groups[i], gperms,
+                              1, want) == -1 ? -1 : 0;
+        for(f = 0; gperms != NULL && f < self->n_files; f++)
+            if(!(perms[f] & IDX_COVERED))
+                perms[f] = gperms[f];
+    } else
+        nret = index_collect(self, IDX_OWNING_GROUP, id, perms, 1,
+                             want) == -1 ||
+            index_collect(self, IDX_GROUP, id, perms, 1, want) == -1 ? -1 : 0;
+    Py_END_ALLOW_THREADS
+    self->busy--;
+    if(nret == -1) {
+        if(errno == EINVAL)
+            PyErr_SetString(PyExc_ValueError, "corrupt index");
+        else
+            PyErr_SetFromErrno(PyExc_IOError);
+        goto out;
+    }
+    if((list = PyList_New(0)) == NULL)
+        goto out;
+    for(f = 0; f < self->n_files; f++) {
+        if(!(perms[f] & IDX_WANTED))
+            continue;
+        if((name = index_file_name(self, f, &nlen)) == NULL) {
+            PyErr_SetString(PyExc_ValueError, "corrupt index");
+            Py_CLEAR(list);
+            goto out;
+        }
+        item = Py_BuildValue("(Ni)", MyPath_FromStringAndSize(name, nlen),
+                             perms[f] & 7);
+        if(item == NULL || PyList_Append(list, item) == -1) {
+            Py_XDECREF(item);
+            Py_CLEAR(list);
+            goto out;
+        }
+        Py_DECREF(item);
+    }
+
+ out:
+    free(perms);
+    free(gperms);
+    free(groups);
+    return list;
+}
+
+/* Adds the keys of the ids of an iterable to excl */
+static int index_add_excluded(PyObject *ids, uint32_t kind, membuf *excl) {
+    PyObject *iter, *item;
+    unsigned long id;
+    uint64_t key;
+
+    if((iter = PyObject_GetIter(ids)) == NULL)
+        return -1;
+    while((item = PyIter_Next(iter)) != NULL) {
+        id = PyLong_AsUnsignedLong(item);
+        Py_DECREF(item);
+        if(PyErr_Occurred())
+            break;
+        if(id >= UINT32_MAX) {
+            PyErr_SetString(PyExc_OverflowError, "invalid id");
+            break;
+        }
+        key = (uint64_t)kind << 32 | id;
+        if(membuf_append(excl, &key, sizeof(key)) == -1) {
+            PyErr_NoMemory();
+            break;
+        }
+    }
+    Py_DECREF(iter);
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+static char __AclIndex_search_doc__[] =
+    "search(perms[, below='.', exclude_users=(), exclude_groups=()])\n"
+    "Return the grants of some permissions in a subtree.\n"
+    "\n"
+    "A grant is an entry of an object's ACL giving some permissions\n"
+    "to a user (the owner or a named user), a group (the owning group\n"
+    "or a named group) or to others. The permissions are the effective\n"
+    "ones; grants of no permissions are not listed. The directories\n"
+    "whose subtree has no matching grant are skipped without looking\n"
+    "at their contents, which makes searches for rare grants (e.g.\n"
+    "\"who else than the staff can write here\") cheap.\n"
+    "\n"
+    ":param int perms: only return the grants of all these permissions\n"
+    ":param string below: the path (relative to the indexed tree) of\n"
+    "    the subtree to search\n"
+    ":param exclude_users: the uids whose grants to ignore\n"
+    ":param exclude_groups: the gids whose grants to ignore\n"
+    ":return: a list of (path, kind, id, permissions) tuples, kind\n"
+    "    being ``'user'``, ``'group'`` or ``'other'`` (with an id of\n"
+    "    None), in the tree's order\n"
+    ":rtype: list\n"
+    ":raises KeyError: if the subtree is not in the index\n"
+    ;
+
+static PyObject* AclIndex_search(PyObject *obj, PyObject *args,
+                                 PyObject *keywds) {
+    AclIndex_Object *self = (AclIndex_Object*)obj;
+    static char *kwlist[] = { "perms", "below", "exclude_users",
+                              "exclude_groups", NULL };
+    static const char *kinds[] = { "user", "group", "other" };
+    PyObject *users = NULL, *groups = NULL, *list = NULL, *item, *id;
+    membuf excl = { NULL, 0, 0 }, hits = { NULL, 0, 0 };
+    const idx_dir *dir;
+    const idx_hit *hit;
+    const char *name;
+    char *below = NULL;
+    int64_t start;
+    uint64_t end;
+    size_t nexcl, i;
+    uint32_t nlen;
+    int want, nret;
+
+    if(!PyArg_ParseTupleAndKeywords(args, keywds, "i|etOO", kwlist, &want,
+                                    Py_FileSystemDefaultEncoding, &below,
+                                    &users, &groups))
+        return NULL;
+    name = below == NULL ? "." : snap_norm_path(below);
+    if((start = index_find(self, name)) == -1)
+        PyErr_SetString(PyExc_KeyError, name);
+    PyMem_Free(below);
+    if(start == -1)
+        return NULL;
+    dir = index_find_dir(self, start);
+    end = dir == NULL ? (uint64_t)start + 1 : le32toh(dir->end);
+    if(end > self->n_files) {
+        PyErr_SetString(PyExc_ValueError, "corrupt index");
+        return NULL;
+    }
+    if((users != NULL &&
+        index_add_excluded(users, IDX_P_USER, &excl) == -1) ||
+       (groups != NULL &&
+        index_add_excluded(groups, IDX_P_GROUP, &excl) == -1))
+        goto out;
+    nexcl = excl.len / sizeof(uint64_t);
+    if(nexcl > 0)
+        qsort(excl.data, nexcl, sizeof(uint64_t), u64_cmp);
+
+    self->busy++;
+    Py_BEGIN_ALLOW_THREADS
+    nret = index_search(self, start, end, want & 7,
+                        (const uint64_t*)excl.data, nexcl, &hits);
+    Py_END_ALLOW_THREADS
+    self->busy--;
+    if(nret == -1) {
+        if(errno == EINVAL)
+            PyErr_SetString(PyExc_ValueError, "corrupt index");
+        else
+            PyErr_SetFromErrno(PyExc_IOError);
+        goto out;
+    }
+    if((list = PyList_New(0)) == NULL)
+        goto out;
+    for(i = 0, hit = (const idx_hit*)hits.data;
+        i < hits.len / sizeof(*hit); i++, hit++) {
+        if((name = index_file_name(self, hit->file, &nlen)) == NULL) {
+            PyErr_SetString(PyExc_ValueError, "corrupt index");
+            Py_CLEAR(list);
+            goto out;
+        }
+        if(hit->grant.kind == IDX_P_OTHER) {
+            Py_INCREF(Py_None);
+            id = Py_None;
+        } else
+            id = PyLong_FromUnsignedLong(hit->grant.id);
+        item = Py_BuildValue("(NsNi)", MyPath_FromStringAndSize(name, nlen),
+                             kinds[hit->grant.kind], id, hit->grant.perm);
+        if(item == NULL || PyList_Append(list, item) == -1) {
+            Py_XDECREF(item);
+            Py_CLEAR(list);
+            goto out;
+        }
+        Py_DECREF(item);
+    }
+
+ out:
+    membuf_free(&excl);
+    membuf_free(&hits);
+    return list;
+}
+
+static char __AclIndex_principals_doc__[] =
+    "Return the principals present in the index.\n"
+    "\n"
+    ":return: a list of (kind, id) tuples, kind being ``'user'`` or\n"
+    "    ``'group'``, without duplicates\n"
+    ":rtype: list\n"
+    ;
+
+static PyObject* AclIndex_principals(PyObject *obj, PyObject *args) {
+    AclIndex_Object *self = (AclIndex_Object*)obj;
+    PyObject *set, *item, *list;
+    uint64_t i;
+    uint32_t kind;
+
+    if((set = PySet_New(NULL)) == NULL)
+        return NULL;
+    for(i = 0; i < self->n_keys; i++) {
+        kind = le32toh(self->keys[i].kind);
+        item = Py_BuildValue("(sk)", kind == IDX_USER || kind == IDX_OWNER ?
+                             "user" : "group",
+                             (unsigned long)le32toh(self->keys[i].id));
+        if(item == NULL || PySet_Add(set, item) == -1) {
+            Py_XDECREF(item);
+            Py_DECREF(set);
+            return NULL;
+        }
+        Py_DECREF(item);
+    }
+    list = PySequence_List(set);
+    Py_DECREF(set);
+    if(list != NULL && PyList_Sort(list) == -1)
+        Py_CLEAR(list);
+    return list;
+}
+
+static char __AclIndex_close_doc__[] =
+    "Unmap the index file.\n"
+    ;
+
+static PyObject* AclIndex_close(PyObject *obj, PyObject *args) {
+    if(((AclIndex_Object*)obj)->busy) {
+        PyErr_SetString(PyExc_ValueError, "index is in use");
+        return NULL;
+    }
+    index_close((AclIndex_Object*)obj);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef AclIndex_methods[] = {
+    {"query", (PyCFunction)AclIndex_query, METH_VARARGS | METH_KEYWORDS,
+     __AclIndex_query_doc__},
+    {"search", (PyCFunction)AclIndex_search, METH_VARARGS | METH_KEYWORDS,
+     __AclIndex_search_doc__},
+    {"principals", AclIndex_principals, METH_NOARGS,
+     __AclIndex_principals_doc__},
+    {"close", AclIndex_close, METH_NOARGS, __AclIndex_close_doc__},
+    {NULL, NULL, 0, NULL}
+};
+
+static PySequenceMethods AclIndex_as_sequence = {
+    AclIndex_length,    /* sq_length */
+    0,                  /* sq_concat */
+    0,                  /* sq_repeat */
+    0,                  /* sq_item */
+    0,                  /* sq_slice */
+    0,                  /* sq_ass_item */
+    0,                  /* sq_ass_slice */
+    0,                  /* sq_contains */
+};
+
+static char __AclIndex_Type_doc__[] =
+    "Principal index, as written by :py:func:`build_index`\n"
+    "\n"
+    "The index file is mapped in memory, and queries only touch the\n"
+    "parts of it they need. The length of the index is the number of\n"
+    "files in it.\n"
+    "\n"
+    "  >>> idx = posix1e.AclIndex(\"share.idx\")\n"
+    "  >>> writable = idx.query(user=1000, perms=posix1e.ACL_WRITE)\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param string filename: the index file\n"
+    ;
+
+/* The definition of the AclIndex Type */
+static PyTypeObject AclIndex_Type = {
+#ifdef IS_PY3K
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL)
+    0,
+#endif
+    "posix1e.AclIndex",
+    sizeof(AclIndex_Object),
+    0,
+    AclIndex_dealloc,   /* tp_dealloc */
+    0,                  /* tp_print */
+    0,                  /* tp_getattr */
+    0,                  /* tp_setattr */
+    0,                  /* tp_compare */
+    0,                  /* tp_repr */
+    0,                  /* tp_as_number */
+    &AclIndex_as_sequence, /* tp_as_sequence */
+    0,                  /* tp_as_mapping */
+    0,                  /* tp_hash */
+    0,                  /* tp_call */
+    0,                  /* tp_str */
+    0,                  /* tp_getattro */
+    0,                  /* tp_setattro */
+    0,                  /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT, /* tp_flags */
+    __AclIndex_Type_doc__, /* tp_doc */
+    0,                  /* tp_traverse */
+    0,                  /* tp_clear */
+    0,                  /* tp_richcompare */
+    0,                  /* tp_weaklistoffset */
+    0,                  /* tp_iter */
+    0,                  /* tp_iternext */
+    AclIndex_methods,   /* tp_methods */
+    0,                  /* tp_members */
+    0,                  /* tp_getset */
+    0,                  /* tp_base */
+    0,                  /* tp_dict */
+    0,                  /* tp_descr_get */
+    0,                  /* tp_descr_set */
+    0,                  /* tp_dictoffset */
+    AclIndex_init,      /* tp_init */
+    0,                  /* tp_alloc */
+    AclIndex_new,       /* tp_new */
+};
+
+/***** Index writer *****/
+
+typedef struct {
+    idx_file *files;      /* host order, name_off relative to names */
+    size_t count;
+    size_t alloc;
+    membuf names;
+    blob_table acls;
+    membuf scratch;
+    const AclIndex_Object *base;
+    size_t reused;
+    err_list *errors;
+} index_writer;
+
+/* (key, file or ACL number) pairs, sorted to build the key table */
+typedef struct {
+    uint64_t key;         /* kind << 32 | id */
+    uint32_t value;
+} idx_pair;
+
+static int idx_pair_cmp(const void *a, const void *b) {
+    const idx_pair *x = a, *y = b;
+
+    if(x->key != y->key)
+        return x->key < y->key ? -1 : 1;
+    return x->value < y->value ? -1 : x->value > y->value;
+}
+
+static int index_writer_visit(void *data, const walk_item *item, int post) {
+    index_writer *iw = data;
+    const struct stat *st = item->st;
+    const char *blob = NULL;
+    uint32_t blen = 0;
+    idx_file *f, *p;
+    int64_t id, b;
+    size_t alloc;
+
+    if(post || S_ISLNK(st->st_mode))
+        return 0;
+    if(iw->count == iw->alloc) {
+        alloc = iw->alloc ? iw->alloc * 2 : 256;
+        if((p = realloc(iw->files, alloc * sizeof(*p))) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        iw->files = p;
+        iw->alloc = alloc;
+    }
+    if(iw->base != NULL && (b = index_find(iw->base, item->rel)) != -1) {
+        const idx_file *old = iw->base->files + b;
+        if(le64toh(old->ino) == (uint64_t)st->st_ino &&
+           (int64_t)le64toh(old->ctime_sec) == (int64_t)st->st_ctim.tv_sec &&
+           le32toh(old->ctime_nsec) == (uint32_t)st->st_ctim.tv_nsec &&
+           (blob = index_acl_blob(iw->base, le32toh(old->acl_id),
+                                  &blen)) != NULL &&
+           blob_count(blob, blen) == -1)
+            blob = NULL;
+    }
+    if(blob != NULL) {
+        iw->reused++;
+    } else {
+        if(read_acl_blob(item->path, ACL_TYPE_ACCESS, st->st_mode,
+                         &iw->scratch) == -1)
+            return err_list_add(iw->errors, item->rel, errno);
+        blob = iw->scratch.data;
+        blen = iw->scratch.len;
+    }
+    if((id = blob_table_add(&iw->acls, blob, blen)) == -1)
+        return -1;
+    f = iw->files + iw->count;
+    f->name_off = iw->names.len;
+    f->name_len = strlen(item->rel);
+    if(membuf_append(&iw->names, item->rel, f->name_len + 1) == -1)
+        return -1;
+    f->ino = st->st_ino;
+    f->ctime_sec = st->st_ctim.tv_sec;
+    f->ctime_nsec = st->st_ctim.tv_nsec;
+    f->uid = st->st_uid;
+    f->gid = st->st_gid;
+    f->acl_id = id;
+    f->mode = st->st_mode;
+    iw->count++;
+    return 0;
+}
+
+/* Appends the data of the sorted pairs to data, as run lists or as
+   arrays of 32-bit values, and their keys to keys */
+static int index_write_keys(membuf *keys, membuf *data, uint64_t data_off,
+                            idx_pair *pairs, size_t count, int runs) {
+    uint32_t *values = NULL, v;
+    size_t i = 0, j, k;
+    idx_key key;
+    int ret = -1;
+
+    if(count > 0 && (values = malloc(count * sizeof(*values))) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    while(i < count) {
+        for(j = i; j < count && pairs[j].key == pairs[i].key; j++)
+            values[j - i] = pairs[j].value;
+        key.kind = htole32(pairs[i].key >> 32);
+        key.id = htole32(pairs[i].key & 0xffffffff);
+        key.off = data_off + data->len;
+        if(runs) {
+            if(runs_put(data, values, j - i) == -1)
+                goto out;
+        } else {
+            for(k = 0; k < j - i; k++) {
+                v = htole32(values[k]);
+                if(membuf_append(data, &v, sizeof(v)) == -1)
+                    goto out;
+            }
+        }
+        key.len = htole64(data_off + data->len - key.off);
+        key.off = htole64(key.off);
+        if(membuf_append(keys, &key, sizeof(key)) == -1)
+            goto out;
+        i = j;
+    }
+    ret = 0;
+
+ out:
+    free(values);
+    return ret;
+}
+
+static int u32_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int idx_dir_cmp(const void *a, const void *b) {
+    uint32_t x = le32toh(((const idx_dir*)a)->file);
+    uint32_t y = le32toh(((const idx_dir*)b)->file);
+
+    return x < y ? -1 : x > y;
+}
+
+/* A directory whose subtree is being summarized */
+typedef struct {
+    size_t file;
+    membuf tokens;        /* uint32_t grants, unsorted */
+} idx_open_dir;
+
+static int index_is_below(const char *dir, const char *name) {
+    size_t len = strlen(dir);
+
+    return strcmp(dir, ".") == 0 ||
+        (strncmp(name, dir, len) == 0 && name[len] == '/');
+}
+
+/* Closes the innermost open directory: writes its summary to data
+   and its record to dirs, and passes its grants on to its parent */
+static int index_close_dir(idx_open_dir *stack, int *depth, size_t end,
+                           membuf *data, uint64_t data_off, membuf *dirs) {
+    idx_open_dir *d = stack + *depth - 1;
+    uint32_t *tokens = (uint32_t*)d->tokens.data, prev = 0;
+    size_t n = d->tokens.len / sizeof(uint32_t), i, u = 0;
+    idx_dir rec;
+
+    if(n > 0)
+        qsort(tokens, n, sizeof(*tokens), u32_cmp);
+    for(i = 0; i < n; i++)
+        if(u == 0 || tokens[i] != tokens[u - 1])
+            tokens[u++] = tokens[i];
+    rec.file = htole32(d->file);
+    rec.end = htole32(end);
+    rec.off = data_off + data->len;
+    if(varint_put(data, u) == -1)
+        return -1;
+    for(i = 0; i < u; i++) {
+        if(varint_put(data, tokens[i] - prev) == -1)
+            return -1;
+        prev = tokens[i];
+    }
+    rec.len = htole64(data_off + data->len - rec.off);
+    rec.off = htole64(rec.off);
+    if(membuf_append(dirs, &rec, sizeof(rec)) == -1)
+        return -1;
+    if(*depth > 1 && membuf_append(&stack[*depth - 2].tokens, tokens,
+                                   u * sizeof(uint32_t)) == -1)
+        return -1;
+    d->tokens.len = 0;
+    (*depth)--;
+    return 0;
+}
+
+/* Computes the summaries of the directories, in one pass over the
+   files, as the subtree of a directory is the range of files that
+   follow it and are below it */
+static int index_summarize(index_writer *iw, const uint64_t *principals,
+                           size_t n_principals, membuf *data,
+                           uint64_t data_off, membuf *dirs) {
+    idx_open_dir *stack = NULL, *p;
+    membuf grants = { NULL, 0, 0 };
+    const idx_file *file;
+    const idx_grant *g;
+    const uint64_t *no;
+    uint64_t key;
+    uint32_t tok;
+    size_t f;
+    int depth = 0, alloc = 0, n, i, ret = -1;
+
+    if(n_principals >= (1U << 29)) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    for(f = 0; f < iw->count; f++) {
+        file = iw->files + f;
+        while(depth > 0 &&
+              !index_is_below(iw->names.data +
+                              iw->files[stack[depth - 1].file].name_off,
+                              iw->names.data + file->name_off))
+            if(index_close_dir(stack, &depth, f, data, data_off, dirs) == -1)
+                goto out;
+        if(S_ISDIR(file->mode)) {
+            if(depth == alloc) {
+                if((p = realloc(stack, (alloc + 16) * sizeof(*p))) == NULL) {
+                    errno = ENOMEM;
+                    goto out;
+                }
+                memset(p + alloc, 0, 16 * sizeof(*p));
+                stack = p;
+                alloc += 16;
+            }
+            stack[depth++].file = f;
+        }
+        if(depth == 0)
+            continue;
+        n = index_grants(iw->acls.blobs.data + iw->acls.offs[file->acl_id],
+                         iw->acls.lens[file->acl_id], file->uid, file->gid,
+                         &grants);
+        if(n == -1)
+            goto out;
+        for(i = 0, g = (const idx_grant*)grants.data; i < n; i++, g++) {
+            key = (uint64_t)g->kind << 32 | g->id;
+            if(g->perm == 0 ||
+               (no = bsearch(&key, principals, n_principals,
+                             sizeof(*principals), u64_cmp)) == NULL)
+                continue;
+            tok = (uint32_t)(no - principals) << 3 | g->perm;
+            if(membuf_append(&stack[depth - 1].tokens, &tok,
+                             sizeof(tok)) == -1)
+                goto out;
+        }
+    }
+    while(depth > 0)
+        if(index_close_dir(stack, &depth, iw->count, data, data_off,
+                           dirs) == -1)
+            goto out;
+    if(dirs->len > 0)
+        qsort(dirs->data, dirs->len / sizeof(idx_dir), sizeof(idx_dir),
+              idx_dir_cmp);
+    ret = 0;
+
+ out:
+    for(i = 0; i < alloc; i++)
+        membuf_free(&stack[i].tokens);
+    free(stack);
+    membuf_free(&grants);
+    return ret;
+}
+
+static int index_writer_save(index_writer *iw, const char *fname) {
+    idx_header hdr;
+    idx_pair *named = NULL, *owners = NULL;
+    uint32_t *by_acl = NULL;
+    uint64_t *principals = NULL, key_off;
+    size_t *acl_start = NULL, n_named = 0, n_principals = 0, i, j;
+    membuf out = { NULL, 0, 0 }, data = { NULL, 0, 0 };
+    membuf keys = { NULL, 0, 0 }, tmpname = { NULL, 0, 0 };
+    membuf dirs = { NULL, 0, 0 };
+    uint64_t data_off, blob_off, names_off;
+    entry_rec rec;
+    int fd = -1, ret = -1, saved, count;
+
+    /* the files of each ACL, via a counting sort */
+    if((acl_start = calloc(iw->acls.count + 1, sizeof(*acl_start))) == NULL ||
+       (iw->count > 0 &&
+        ((by_acl = malloc(iw->count * sizeof(*by_acl))) == NULL ||
+         (owners = malloc(2 * iw->count * sizeof(*owners))) == NULL)))
+        goto nomem;
+    for(i = 0; i < iw->count; i++)
+        acl_start[iw->files[i].acl_id + 1]++;
+    for(i = 0; i < iw->acls.count; i++)
+        acl_start[i + 1] += acl_start[i];
+    for(i = 0; i < iw->count; i++)
+        by_acl[acl_start[iw->files[i].acl_id]++] = i;
+    for(i = iw->acls.count; i > 0; i--)
+        acl_start[i] = acl_start[i - 1];
+    acl_start[0] = 0;
+
+    /* the named entries of each ACL */
+    for(i = 0; i < iw->acls.count; i++) {
+        const char *blob = iw->acls.blobs.data + iw->acls.offs[i];
+        count = blob_count(blob, iw->acls.lens[i]);
+        for(j = 0; j < (size_t)count; j++) {
+            blob_get(blob, j, &rec);
+            if(rec.tag != ACL_USER && rec.tag != ACL_GROUP)
+                continue;
+            if(n_named % 256 == 0) {
+                idx_pair *p = realloc(named, (n_named + 256) * sizeof(*p));
+                if(p == NULL)
+                    goto nomem;
+                named = p;
+            }
+            named[n_named].key = (uint64_t)(rec.tag == ACL_USER ?
+                                            IDX_USER : IDX_GROUP) << 32 |
+                rec.id;
+            named[n_named++].value = i;
+        }
+    }
+    if(n_named > 0)
+        qsort(named, n_named, sizeof(*named), idx_pair_cmp);
+    for(i = 0; i < iw->count; i++) {
+        owners[2 * i].key = (uint64_t)IDX_OWNER << 32 | iw->files[i].uid;
+        owners[2 * i].value = i;
+        owners[2 * i + 1].key = (uint64_t)IDX_OWNING_GROUP << 32 |
+            iw->files[i].gid;
+        owners[2 * i + 1].value = i;
+    }
+    if(iw->count > 0)
+        qsort(owners, 2 * iw->count, sizeof(*owners), idx_pair_cmp);
+
+    /* the principals: the owners, the named entries and "other" */
+    if((principals = malloc((2 * iw->count + n_named + 1) *
+                            sizeof(*principals))) == NULL)
+        goto nomem;
+    for(i = 0; i < iw->count; i++) {
+        principals[n_principals++] = (uint64_t)IDX_P_USER << 32 |
+            iw->files[i].uid;
+        principals[n_principals++] = (uint64_t)IDX_P_GROUP << 32 |
+            iw->files[i].gid;
+    }
+    for(i = 0; i < n_named; i++)
+        principals[n_principals++] = (uint64_t)
+            ((named[i].key >> 32) == IDX_USER ? IDX_P_USER : IDX_P_GROUP)
+            << 32 | (named[i].key & 0xffffffff);
+    principals[n_principals++] = (uint64_t)IDX_P_OTHER << 32;
+    qsort(principals, n_principals, sizeof(*principals), u64_cmp);
+    for(i = 0, j = 0; i < n_principals; i++)
+        if(j == 0 || principals[i] != principals[j - 1])
+            principals[j++] = principals[i];
+    n_principals = j;
+
+    /* the data area: names, blobs, the ACLs' run lists, the keys' data */
+    memset(&hdr, 0, sizeof(hdr));
+    data_off = sizeof(hdr) + iw->count * sizeof(idx_file) +
+        iw->acls.count * sizeof(idx_acl);
+    names_off = data_off;
+    blob_off = names_off + iw->names.len;
+    if(membuf_append(&data, iw->names.data, iw->names.len) == -1 ||
+       membuf_append(&data, iw->acls.blobs.data, iw->acls.blobs.len) == -1)
+        goto out;
+    if(membuf_append(&out, &hdr, sizeof(hdr)) == -1)
+        goto out;
+    for(i = 0; i < iw->count; i++) {
+        idx_file f = iw->files[i];
+        f.name_off = htole64(names_off + f.name_off);
+        f.ino = htole64(f.ino);
+        f.ctime_sec = htole64(f.ctime_sec);
+        f.ctime_nsec = htole32(f.ctime_nsec);
+        f.name_len = htole32(f.name_len);
+        f.uid = htole32(f.uid);
+        f.gid = htole32(f.gid);
+        f.acl_id = htole32(f.acl_id);
+        f.mode = htole32(f.mode);
+        if(membuf_append(&out, &f, sizeof(f)) == -1)
+            goto out;
+    }
+    for(i = 0; i < iw->acls.count; i++) {
+        idx_acl a;
+        a.blob_off = htole64(blob_off + iw->acls.offs[i]);
+        a.blob_len = htole32(iw->acls.lens[i]);
+        a.files_off = data_off + data.len;
+        if(runs_put(&data, by_acl + acl_start[i],
+                    acl_start[i + 1] - acl_start[i]) == -1)
+            goto out;
+        a.files_len = htole32(data_off + data.len - a.files_off);
+        a.files_off = htole64(a.files_off);
+        if(membuf_append(&out, &a, sizeof(a)) == -1)
+            goto out;
+    }
+    if(index_write_keys(&keys, &data, data_off, named, n_named, 0) == -1 ||
+       index_write_keys(&keys, &data, data_off, owners, 2 * iw->count,
+                        1) == -1 ||
+       index_summarize(iw, principals, n_principals, &data, data_off,
+                       &dirs) == -1)
+        goto out;
+    for(i = 0; i < n_principals; i++) {
+        idx_principal pr;
+        pr.kind = htole32(principals[i] >> 32);
+        pr.id = htole32(principals[i] & 0xffffffff);
+        if(membuf_append(&keys, &pr, sizeof(pr)) == -1)
+            goto out;
+    }
+
+    memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.version = htole32(INDEX_VERSION);
+    hdr.n_files = htole64(iw->count);
+    hdr.n_acls = htole64(iw->acls.count);
+    hdr.n_keys = htole64((keys.len - n_principals * sizeof(idx_principal)) /
+                         sizeof(idx_key));
+    hdr.file_off = htole64(sizeof(hdr));
+    hdr.acl_off = htole64(sizeof(hdr) + iw->count * sizeof(idx_file));
+    hdr.data_off = htole64(data_off);
+    /* the key, principal and directory tables go last, aligned */
+    key_off = SNAP_ALIGN(data_off + data.len);
+    hdr.key_off = htole64(key_off);
+    hdr.principal_off = htole64(key_off + keys.len -
+                                n_principals * sizeof(idx_principal));
+    hdr.dir_off = htole64(key_off + keys.len);
+    hdr.n_principals = htole64(n_principals);
+    hdr.n_dirs = htole64(dirs.len / sizeof(idx_dir));
+    memcpy(out.data, &hdr, sizeof(hdr));
+    while(data.len % 8 != 0)
+        if(membuf_append(&data, "", 1) == -1)
+            goto out;
+
+    if(membuf_append(&tmpname, fname, strlen(fname)) == -1 ||
+       membuf_append(&tmpname, ".XXXXXX", 8) == -1)
+        goto out;
+    if((fd = mkostemp(tmpname.data, O_CLOEXEC)) == -1)
+        goto out;
+    if(write_all(fd, out.data, out.len) == -1 ||
+       write_all(fd, data.data, data.len) == -1 ||
+       write_all(fd, keys.data, keys.len) == -1 ||
+       write_all(fd, dirs.data, dirs.len) == -1)
+        goto out;
+    ret = close(fd);
+    fd = -1;
+    if(ret == 0)
+        ret = rename(tmpname.data, fname);
+    goto out;
+
+ nomem:
+    errno = ENOMEM;
+ out:
+    saved = errno;
+    if(fd != -1)
+        close(fd);
+    if(ret == -1 && tmpname.len > 0)
+        unlink(tmpname.data);
+    free(named);
+    free(owners);
+    free(by_acl);
+    free(acl_start);
+    free(principals);
+    membuf_free(&dirs);
+    membuf_free(&out);
+    membuf_free(&data);
+    membuf_free(&keys);
+    membuf_free(&tmpname);
+    errno = saved;
+    return ret;
+}
+
+static void index_writer_free(index_writer *iw) {
+    free(iw->files);
+    membuf_free(&iw->names);
+    blob_table_free(&iw->acls);
+    membuf_free(&iw->scratch);
+}
+
+static char __build_index_doc__[] =
+    "build_index(root, filename[, base=None])\n"
+    "Build a principal index of a directory tree.\n"
+    "\n"
+    "The tree is walked without following symbolic links, and the\n"
+    "owner, group and access ACL of each object are recorded in an\n"
+    "index file answering, via :py:class:`AclIndex`, which files a\n"
+    "user or group gets access to. The file is replaced atomically.\n"
+    "Each directory also gets a summary of the grants made in its\n"
+    "subtree, which :py:meth:`AclIndex.search` uses to skip it.\n"
+    "\n"
+    "With a base (the previous index of the same tree), the update is\n"
+    "incremental: the objects whose inode number and ctime didn't\n"
+    "change keep their recorded ACL, which is not read again.\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param string root: the directory tree to index\n"
+    ":param string filename: the index file to write\n"
+    ":param base: the previous index, as an :py:class:`AclIndex` or a\n"
+    "    file name\n"
+    ":return: a dictionary with the number of ``paths`` and distinct\n"
+    "    ``acls`` indexed, the list of ``errors``, as (path, errno,\n"
+    "    message) tuples, and with a base the number of paths\n"
+    "    ``reused``\n"
+    ":rtype: dict\n"
+    ;
+
+static PyObject* aclmodule_build_index(PyObject* obj, PyObject* args,
+                                       PyObject *keywds) {
+    static char *kwlist[] = { "root", "filename", "base", NULL };
+    char *root = NULL, *fname = NULL;
+    PyObject *base = Py_None, *ret = NULL;
+    AclIndex_Object *bidx = NULL;
+    index_writer iw;
+    err_list errors;
+    int nret;
+
+    memset(&iw, 0, sizeof(iw));
+    memset(&errors, 0, sizeof(errors));
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "etet|O", kwlist,
+                                     Py_FileSystemDefaultEncoding, &root,
+                                     Py_FileSystemDefaultEncoding, &fname,
+                                     &base))
+        goto out;
+    if(PyObject_IsInstance(base, (PyObject*)&AclIndex_Type)) {
+        bidx = (AclIndex_Object*)base;
+        Py_INCREF(bidx);
+    } else if(base != Py_None) {
+        bidx = (AclIndex_Object*)
+            PyObject_CallFunctionObjArgs((PyObject*)&AclIndex_Type, base,
+                                         NULL);
+        if(bidx == NULL)
+            goto out;
+    }
+    iw.base = bidx;
+    iw.errors = &errors;
+    if(bidx != NULL)
+        bidx->busy++;
+    Py_BEGIN_ALLOW_THREADS
+    nret = walk_tree(root, index_writer_visit, &iw, &errors);
+    if(nret == 0)
+        nret = index_writer_save(&iw, fname);
+    Py_END_ALLOW_THREADS
+    if(bidx != NULL)
+        bidx->busy--;
+    if(nret == -1) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        goto out;
+    }
+    ret = tree_stats(&errors, "paths", iw.count, "acls", iw.acls.count);
+    if(ret != NULL && bidx != NULL &&
+       dict_set_size(ret, "reused", iw.reused) == -1) {
+        Py_DECREF(ret);
+        ret = NULL;
+    }
+
+ out:
+    Py_XDECREF(bidx);
+    index_writer_free(&iw);
+    err_list_free(&errors);
+    PyMem_Free(root);
+    PyMem_Free(fname);
+    return ret;
+}
+
+/***** Access evaluation *****/
+
+/* The state of an access evaluation, shared by a batch of paths */
+typedef struct {
+    uid_t uid;
+    const gid_t *groups;
+    size_t ngroups;
+    kv_map dirs;        /* search check results of directories */
+    membuf blob;
+    membuf path;        /* the part of the path walked */
+    membuf rest;        /* the part left */
+    membuf link;
+} access_ctx;
+
+static int access_in_groups(const access_ctx *ac, gid_t gid) {
+    size_t i;
+
+    for(i = 0; i < ac->ngroups; i++)
+        if(ac->groups[i] == gid)
+            return 1;
+    return 0;
+}
+
+/* Applies the ACL access check algorithm to the ACL in ac->blob;
+   returns 1 if all the wanted permissions are granted */
+static int access_granted(const access_ctx *ac, const struct stat *st,
+                          unsigned int want) {
+    const char *blob = ac->blob.data;
+    int count = blob_count(blob, ac->blob.len), i, mask = 7;
+    int group_match = 0, group_ok = 0, user = -1, other = 0;
+    entry_rec rec;
+
+    for(i = 0; i < count; i++) {
+        blob_get(blob, i, &rec);
+        switch(rec.tag) {
+        case ACL_USER_OBJ:
+            if(st->st_uid == ac->uid)
+                return (rec.perm & want) == want;
+            break;
+        case ACL_USER:
+            if(rec.id == ac->uid)
+                user = rec.perm;
+            break;
+        case ACL_MASK:
+            mask = rec.perm;
+            break;
+        case ACL_OTHER:
+            other = rec.perm;
+            break;
+        }
+    }
+    if(user != -1)
+        return (user & mask & want) == want;
+    for(i = 0; i < count; i++) {
+        blob_get(blob, i, &rec);
+        if((rec.tag == ACL_GROUP_OBJ && access_in_groups(ac, st->st_gid)) ||
+           (rec.tag == ACL_GROUP && access_in_groups(ac, rec.id))) {
+            group_match = 1;
+            if((rec.perm & mask & want) == want)
+                group_ok = 1;
+        }
+    }
+    if(group_match)
+        return group_ok;
+    return (other & want) == want;
+}
+
+/* Checks the wanted permissions on a path; returns 0, or an errno
+   (EACCES if they're not granted) */
+static int access_check(access_ctx *ac, const char *path, int want) {
+    struct stat st;
+
+    if(lstat(path, &st) == -1 ||
+       read_acl_blob(path, ACL_TYPE_ACCESS, st.st_mode, &ac->blob) == -1)
+        return errno;
+    return access_granted(ac, &st, want) ? 0 : EACCES;
+}
+
+#define ACCESS_MAX_LINKS 40     /* the symbolic links followed, as Linux */
+
+/* Sets ac->path to its first len bytes */
+static int access_set_len(access_ctx *ac, size_t len) {
+    ac->path.len = len;
+    if(membuf_reserve(&ac->path, 1) == -1)
+        return -1;
+    ac->path.data[len] = '\0';
+    return 0;
+}
+
+/* Checks search permission on the directory in ac->path; the results
+   are memoized */
+static int access_search(access_ctx *ac) {
+    uint64_t known;
+
+    if(!kv_map_get(&ac->dirs, ac->path.data, ac->path.len, &known)) {
+        known = access_check(ac, ac->path.data, ACL_EXECUTE);
+        if(kv_map_put(&ac->dirs, ac->path.data, ac->path.len, known) == -1)
+            return errno;
+    }
+    return known;
+}
+
+/* Evaluates the access to a path: it is walked as the kernel does,
+   one component at a time from the root or the current directory,
+   each directory looked up in having to grant search permission and
+   the symbolic links being expanded as they're met; the path reached
+   must grant the wanted permissions. Nothing is resolved before being
+   checked. Returns 0, or an errno with ac->path.data[0..*comp_len)
+   set to the first component that denied access or couldn't be
+   checked. */
+static int access_eval(access_ctx *ac, const char *path, int want,
+                       size_t *comp_len) {
+    const char *p, *name;
+    size_t name_len, pos, dir_len;
+    struct stat st;
+    membuf swap;
+    ssize_t n;
+    int links = 0, err;
+
+    *comp_len = 0;
+    if(path[0] == '\0')
+        return ENOENT;
+    ac->path.len = ac->rest.len = 0;
+    if(path[0] != '/') {
+        if(membuf_reserve(&ac->path, PATH_MAX) == -1 ||
+           getcwd(ac->path.data, ac->path.size) == NULL)
+            return errno;
+        ac->path.len = strlen(ac->path.data);
+    } else if(membuf_append(&ac->path, "/", 1) == -1 ||
+              access_set_len(ac, 1) == -1)
+        return errno;
+    if(membuf_append(&ac->rest, path, strlen(path) + 1) == -1)
+        return errno;
+    for(pos = 0;;) {
+        for(p = ac->rest.data + pos; *p == '/'; p++)
+            ;
+        if(*p == '\0')
+            break;
+        for(name = p; *p != '/' && *p != '\0'; p++)
+            ;
+        name_len = p - name;
+        pos = p - ac->rest.data;
+        *comp_len = ac->path.len;
+        if((err = access_search(ac)) != 0)
+            return err;
+        if(name_len == 1 && name[0] == '.')
+            continue;
+        dir_len = ac->path.len;
+        if(name_len == 2 && name[0] == '.' && name[1] == '.') {
+            /* the path has no links, so .. is its parent */
+            while(dir_len > 1 && ac->path.data[dir_len - 1] != '/')
+                dir_len--;
+            if(access_set_len(ac, dir_len > 1 ? dir_len - 1 : 1) == -1)
+                return errno;
+            continue;
+        }
+        if((dir_len > 1 && membuf_append(&ac->path, "/", 1) == -1) ||
+           membuf_append(&ac->path, name, name_len) == -1 ||
+           access_set_len(ac, ac->path.len) == -1)
+            return errno;
+        *comp_len = ac->path.len;
+        if(lstat(ac->path.data, &st) == -1)
+            return errno;
+        if(S_ISLNK(st.st_mode)) {
+            /* the rest of the path is walked from the link's target */
+            if(++links > ACCESS_MAX_LINKS)
+                return ELOOP;
+            ac->link.len = 0;
+            if(membuf_reserve(&ac->link, PATH_MAX) == -1)
+                return errno;
+            if((n = readlink(ac->path.data, ac->link.data, PATH_MAX)) == -1)
+                return errno;
+            if(n == 0 || n == PATH_MAX)
+                return n == 0 ? ENOENT : ENAMETOOLONG;
+            ac->link.len = n;
+            if(membuf_append(&ac->link, ac->rest.data + pos,
+                             ac->rest.len - pos) == -1 ||
+               access_set_len(ac, ac->link.data[0] == '/' ? 1 : dir_len) == -1)
+                return errno;
+            swap = ac->rest;
+            ac->rest = ac->link;
+            ac->link = swap;
+            pos = 0;
+            continue;
+        }
+        if(*p == '/' && !S_ISDIR(st.st_mode))
+            return ENOTDIR;
+    }
+    *comp_len = ac->path.len;
+    return access_check(ac, ac->path.data, want);
+}
+
+typedef struct {
+    int err;
+    size_t off;         /* offset of the component in the output */
+    size_t len;
+} access_result;
+
+/* Appends a path object, encoded and NUL-terminated, to out */
+static int access_add_path(PyObject *path, membuf *out) {
+    PyObject *bytes;
+    int ret;
+
+    if(PyUnicode_Check(path)) {
+        bytes = PyUnicode_AsEncodedString(path, Py_FileSystemDefaultEncoding,
+                                          "strict");
+        if(bytes == NULL)
+            return -1;
+    } else if(PyBytes_Check(path)) {
+        bytes = path;
+        Py_INCREF(bytes);
+    } else {
+        PyErr_SetString(PyExc_TypeError, "paths must be strings");
+        return -1;
+    }
+    ret = membuf_append(out, PyBytes_AS_STRING(bytes),
+                        PyBytes_GET_SIZE(bytes) + 1);
+    Py_DECREF(bytes);
+    if(ret == -1)
+        PyErr_NoMemory();
+    return ret;
+}
+
+static char __check_access_doc__[] =
+    "check_access(paths, uid[, groups=(), perms=ACL_READ, cache=None])\n"
+    "Check whether a user can access paths.\n"
+    "\n"
+    "Reaching a path needs search permission on each directory it goes\n"
+    "through, besides the wanted permissions on the path itself. Each\n"
+    "path is walked as the kernel does, one component at a time, the\n"
+    "symbolic links being expanded as they're met (up to 40 of them,\n"
+    "then ``ELOOP`` is reported), and the ACL access check algorithm\n"
+    "is applied to each directory looked up in and to the path: the\n"
+    "owner entry if the user owns the object, else a named user entry\n"
+    "for it, else the group entries matching its groups (if any\n"
+    "matches, one of them must grant the permissions), else the other\n"
+    "entry. The results of the ancestors are shared by all the paths\n"
+    "of a batch. Capabilities (e.g. those of the superuser) are not\n"
+    "taken into account.\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param paths: a path, or a list of paths\n"
+    ":param int uid: the user's id\n"
+    ":param groups: the user's groups, primary and supplementary;\n"
+    "    without them, they're taken from the cache if given (the\n"
+    "    primary group included)\n"
+    ":param int perms: the wanted permissions on the paths, a\n"
+    "    combination of :py:data:`ACL_READ`, :py:data:`ACL_WRITE` and\n"
+    "    :py:data:`ACL_EXECUTE`\n"
+    ":param cache: a :py:class:`PrincipalCache` giving the groups\n"
+    ":return: None if the access is granted, otherwise a tuple\n"
+    "    (component, errno) for the first component (a directory on\n"
+    "    the way, with the links expanded, or the path reached) that\n"
+    "    denies it (with ``EACCES``) or couldn't be checked; a list of\n"
+    "    these for a list of paths\n"
+    ":raises KeyError: if the cache doesn't know the user\n"
+    ;
+
+static PyObject* aclmodule_check_access(PyObject* obj, PyObject* args,
+                                        PyObject *keywds) {
+    static char *kwlist[] = { "paths", "uid", "groups", "perms", "cache",
+                              NULL };
+    PyObject *paths, *uidobj, *groups = NULL, *cache = NULL, *iter = NULL;
+    PyObject *item;
+    const pcache_entry *e;
+    PyObject *list = NULL, *ret = NULL;
+    membuf gids = { NULL, 0, 0 }, in = { NULL, 0, 0 }, out = { NULL, 0, 0 };
+    access_ctx ac;
+    access_result *results = NULL, *r;
+    unsigned long uid;
+    size_t count = 0, i, pos, comp_len;
+    gid_t primary;
+    int want = ACL_READ, single;
+
+    if(!PyArg_ParseTupleAndKeywords(args, keywds, "OO|OiO!", kwlist, &paths,
+                                    &uidobj, &groups, &want,
+                                    &PrincipalCache_Type, &cache))
+        return NULL;
+    uid = PyLong_AsUnsignedLong(uidobj);
+    if(PyErr_Occurred())
+        return NULL;
+    if(uid >= UINT32_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "invalid id");
+        return NULL;
+    }
+    if(groups != NULL) {
+        if(pcache_add_groups(groups, &gids) == -1)
+            goto out;
+    } else if(cache != NULL) {
+        if((e = pcache_get((PrincipalCache_Object*)cache, uid)) == NULL)
+            goto out;
+        primary = e->gid;
+        if((e->ngroups > 0 &&
+            membuf_append(&gids, e->groups,
+                          e->ngroups * sizeof(gid_t)) == -1) ||
+           (!pcache_has_gid(e) &&
+            membuf_append(&gids, &primary, sizeof(primary)) == -1)) {
+            PyErr_NoMemory();
+            goto out;
+        }
+    }
+    single = PyUnicode_Check(paths) || PyBytes_Check(paths);
+    if(single) {
+        if(access_add_path(paths, &in) == -1)
+            goto out;
+        count = 1;
+    } else {
+        if((iter = PyObject_GetIter(paths)) == NULL)
+            goto out;
+        while((item = PyIter_Next(iter)) != NULL) {
+            if(access_add_path(item, &in) == -1) {
+                Py_DECREF(item);
+                goto out;
+            }
+            Py_DECREF(item);
+            count++;
+        }
+        if(PyErr_Occurred())
+            goto out;
+    }
+    if((results = calloc(count + 1, sizeof(*results))) == NULL) {
+        PyErr_NoMemory();
+        goto out;
+    }
+
+    memset(&ac, 0, sizeof(ac));
+    ac.uid = uid;
+    ac.groups = (const gid_t*)gids.data;
+    ac.ngroups = gids.len / sizeof(gid_t);
+    Py_BEGIN_ALLOW_THREADS
+    for(i = 0, pos = 0; i < count; i++, pos += strlen(in.data + pos) + 1) {
+        r = results + i;
+        r->err = access_eval(&ac, in.data + pos, want & 7, &comp_len);
+        if(r->err == 0)
+            continue;
+        r->off = out.len;
+        r->len = comp_len;
+        if(membuf_append(&out, ac.path.data, comp_len) == -1) {
+            r->err = ENOMEM;
+            r->len = 0;
+        }
+    }
+    kv_map_free(&ac.dirs);
+    membuf_free(&ac.blob);
+    membuf_free(&ac.path);
+    membuf_free(&ac.rest);
+    membuf_free(&ac.link);
+    Py_END_ALLOW_THREADS
+
+    if((list = PyList_New(count)) == NULL)
+        goto out;
+    for(i = 0; i < count; i++) {
+        r = results + i;
+        if(r->err == 0) {
+            Py_INCREF(Py_None);
+            item = Py_None;
+        } else
+            item = Py_BuildValue("(Ni)", MyPath_FromStringAndSize(
+                                     out.data + r->off, r->len), r->err);
+        if(item == NULL) {
+            Py_CLEAR(list);
+            goto out;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    if(single) {
+        ret = PyList_GET_ITEM(list, 0);
+        Py_INCREF(ret);
+        Py_DECREF(list);
+    } else
+        ret = list;
+
+ out:
+    Py_XDECREF(iter);
+    free(results);
+    membuf_free(&gids);
+    membuf_free(&in);
+    membuf_free(&out);
+    return ret;
+}
+
+/***** Redundancy analysis *****/
+
+/* An entry is redundant when removing it doesn't change the access
+   any process gets, whatever its user and groups:
+
+   - a duplicate is a named entry for a qualifier that an earlier
+     entry already has (for groups, only if it grants nothing more,
+     as all the matching group entries count)
+   - a named user entry is masked or shadowed when the user would
+     get exactly the same effective permissions without it, i.e. when
+     all the group class entries (masked) and the other entry grant
+     them: the user then gets them through whichever entry applies
+   - a named group entry is masked or shadowed when it grants (once
+     masked) what the other entry grants, and a subset of what each
+     other group class entry grants, so that neither dropping to the
+     other entry nor the remaining group entries change the outcome
+   - the mask is unneeded when no named entry is left; dropping it
+     needs the owning group entry to be masked instead
+
+   Removing an entry only weakens the conditions for the others, so
+   all the redundant entries can be removed together.
+*/
+#define RED_DUPLICATE 1
+#define RED_MASKED 2
+#define RED_SHADOWED 3
+#define RED_UNNEEDED 4
+
+static const char *red_reasons[] = {
+    NULL, "duplicate", "masked", "shadowed", "unneeded"
+};
+
+/* Fills why (one per record) with the reasons the records are
+   redundant, or 0; returns the number of redundant records */
+static int recs_redundant(const entry_rec *recs, int count,
+                          unsigned char *why) {
+    unsigned int mask = 7, other = 0, p, q;
+    int i, j, found = 0, named = 0, ok;
+
+    memset(why, 0, count);
+    for(i = 0; i < count; i++) {
+        if(recs[i].tag == ACL_MASK)
+            mask = recs[i].perm;
+        else if(recs[i].tag == ACL_OTHER)
+            other = recs[i].perm;
+    }
+    for(i = 0; i < count; i++) {
+        if(recs[i].tag != ACL_USER && recs[i].tag != ACL_GROUP)
+            continue;
+        for(j = 0; j < i; j++)
+            if(recs[j].tag == recs[i].tag && recs[j].id == recs[i].id &&
+               !why[j] && (recs[i].tag == ACL_USER ||
+                           (recs[i].perm & mask & ~recs[j].perm) == 0)) {
+                why[i] = RED_DUPLICATE;
+                break;
+            }
+    }
+    for(i = 0; i < count; i++) {
+        if(why[i] || (recs[i].tag != ACL_USER && recs[i].tag != ACL_GROUP))
+            continue;
+        /* the first of duplicated qualifiers are kept */
+        for(j = 0, ok = 1; j < count && ok; j++)
+            if(j != i && recs[j].tag == recs[i].tag &&
+               recs[j].id == recs[i].id)
+                ok = 0;
+        p = recs[i].perm & mask;
+        ok = ok && p == other;
+        for(j = 0; j < count && ok; j++) {
+            if(j == i || why[j] || (recs[j].tag != ACL_GROUP_OBJ &&
+                                    recs[j].tag != ACL_GROUP))
+                continue;
+            q = recs[j].perm & mask;
+            ok = recs[i].tag == ACL_USER ? q == p : (p & ~q) == 0;
+        }
+        if(ok) {
+            why[i] = p == 0 ? RED_MASKED : RED_SHADOWED;
+            found++;
+        } else
+            named++;
+    }
+    for(i = 0; i < count; i++)
+        if(why[i] == RED_DUPLICATE)
+            found++;
+        else if(recs[i].tag == ACL_MASK && named == 0) {
+            why[i] = RED_UNNEEDED;
+            found++;
+        }
+    return found;
+}
+
+/* Removes the redundant records in place; returns the new count */
+static int recs_minimize(entry_rec *recs, int count,
+                         const unsigned char *why) {
+    unsigned int mask = 7;
+    int i, j;
+
+    for(i = 0; i < count; i++)
+        if(recs[i].tag == ACL_MASK && why[i] == RED_UNNEEDED)
+            mask = recs[i].perm;
+    for(i = 0, j = 0; i < count; i++) {
+        if(why[i])
+            continue;
+        recs[j] = recs[i];
+        if(recs[j].tag == ACL_GROUP_OBJ)
+            recs[j].perm &= mask;
+        j++;
+    }
+    return j;
+}
+
+static PyObject* red_item(const entry_rec *rec, int why) {
+    PyObject *qualifier;
+
+    if(rec->tag == ACL_USER || rec->tag == ACL_GROUP)
+        qualifier = PyLong_FromUnsignedLong(rec->id);
+    else {
+        Py_INCREF(Py_None);
+        qualifier = Py_None;
+    }
+    return Py_BuildValue("(iNis)", rec->tag, qualifier, rec->perm,
+                         red_reasons[why]);
+}
+
+/* Builds the list of the redundant records */
+static PyObject* red_list(const entry_rec *recs, int count,
+                          const unsigned char *why) {
+    PyObject *list, *item;
+    int i;
+
+    if((list = PyList_New(0)) == NULL)
+        return NULL;
+    for(i = 0; i < count; i++) {
+        if(!why[i])
+            continue;
+        item = red_item(recs + i, why[i]);
+        if(item == NULL || PyList_Append(list, item) == -1) {
+            Py_XDECREF(item);
+            Py_DECREF(list);
+            return NULL;
+        }
+        Py_DECREF(item);
+    }
+    return list;
+}
+
+static PyObject* ACL_redundant(PyObject *obj, PyObject *args) {
+    ACL_Object *self = (ACL_Object*)obj;
+    entry_rec *recs = NULL;
+    unsigned char *why;
+    PyObject *list;
+    int count;
+
+    if(ACL_ready(self) == -1)
+        return NULL;
+    if((count = acl_get_recs(self->acl, &recs)) == -1)
+        return PyErr_SetFromErrno(PyExc_IOError);
+    if((why = malloc(count + 1)) == NULL) {
+        free(recs);
+        return PyErr_NoMemory();
+    }
+    recs_redundant(recs, count, why);
+    list = red_list(recs, count, why);
+    free(why);
+    free(recs);
+    return list;
+}
+
+static PyObject* ACL_minimize(PyObject *obj, PyObject *args) {
+    ACL_Object *self = (ACL_Object*)obj;
+    entry_rec *recs = NULL;
+    unsigned char *why;
+    acl_t acl;
+    int count;
+
+    if(ACL_ready(self) == -1)
+        return NULL;
+    if((count = acl_get_recs(self->acl, &recs)) == -1)
+        return PyErr_SetFromErrno(PyExc_IOError);
+    if((why = malloc(count + 1)) == NULL) {
+        free(recs);
+        return PyErr_NoMemory();
+    }
+    recs_redundant(recs, count, why);
+    count = recs_minimize(recs, count, why);
+    acl = acl_from_recs(recs, count);
+    free(why);
+    free(recs);
+    if(acl == NULL)
+        return PyErr_SetFromErrno(PyExc_IOError);
+    return ACL_wrap(acl);
+}
+
+/* A tree-wide analysis; each distinct ACL is analysed once */
+typedef struct {
+    kv_map seen;          /* blob to result number + 1, 0 if none */
+    membuf results;       /* red_result */
+    membuf entries;       /* red_entry, for all the results */
+    membuf hits;          /* red_hit */
+    membuf names;
+    membuf blob;
+    entry_rec *recs;
+    unsigned char *why;
+    int alloc;
+    size_t paths;
+    size_t acls;
+    size_t redundant;
+    err_list *errors;
+} red_tree;
+
+typedef struct {
+    size_t first;         /* in entries */
+    int count;
+} red_result;
+
+typedef struct {
+    entry_rec rec;
+    int why;
+} red_entry;
+
+typedef struct {
+    size_t name_off;
+    acl_type_t type;
+    uint64_t result;
+} red_hit;
+
+/* Analyses an ACL blob unless it was already; sets *result to its
+   result number + 1, or 0 if it has no redundant entries */
+static int red_tree_acl(red_tree *rt, const char *blob, size_t len,
+                        uint64_t *result) {
+    int count = blob_count(blob, len), i, n;
+    red_result r;
+    red_entry e;
+    void *p;
+
+    if(kv_map_get(&rt->seen, blob, len, result))
+        return 0;
+    if(count > rt->alloc) {
+        if((p = realloc(rt->recs, count * sizeof(*rt->recs))) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        rt->recs = p;
+        if((p = realloc(rt->why, count)) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        rt->why = p;
+        rt->alloc = count;
+    }
+    for(i = 0; i < count; i++)
+        blob_get(blob, i, rt->recs + i);
+    rt->acls++;
+    *result = 0;
+    if((n = recs_redundant(rt->recs, count, rt->why)) > 0) {
+        r.first = rt->entries.len / sizeof(e);
+        r.count = n;
+        for(i = 0; i < count; i++) {
+            if(!rt->why[i])
+                continue;
+            e.rec = rt->recs[i];
+            e.why = rt->why[i];
+            if(membuf_append(&rt->entries, &e, sizeof(e)) == -1)
+                return -1;
+        }
+        if(membuf_append(&rt->results, &r, sizeof(r)) == -1)
+            return -1;
+        *result = rt->results.len / sizeof(r);
+    }
+    return kv_map_put(&rt->seen, blob, len, *result);
+}
+
+static int red_tree_visit(void *data, const walk_item *item, int post) {
+    red_tree *rt = data;
+    const red_result *r;
+    red_hit hit;
+    int k, nret;
+
+    if(post || S_ISLNK(item->st->st_mode))
+        return 0;
+    rt->paths++;
+    for(k = 0; k < 2; k++) {
+        hit.type = k == 0 ? ACL_TYPE_ACCESS : ACL_TYPE_DEFAULT;
+        if(k == 1 && !S_ISDIR(item->st->st_mode))
+            break;
+        nret = read_acl_blob(item->path, hit.type, item->st->st_mode,
+                             &rt->blob);
+        if(nret == -1)
+            return err_list_add(rt->errors, item->rel, errno);
+        if(nret == 0)
+            continue;
+        if(red_tree_acl(rt, rt->blob.data, rt->blob.len, &hit.result) == -1)
+            return -1;
+        if(hit.result == 0)
+            continue;
+        r = (const red_result*)rt->results.data + hit.result - 1;
+        rt->redundant += r->count;
+        hit.name_off = rt->names.len;
+        if(membuf_append(&rt->names, item->rel, strlen(item->rel) + 1) == -1 ||
+           membuf_append(&rt->hits, &hit, sizeof(hit)) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+static void red_tree_free(red_tree *rt) {
+    kv_map_free(&rt->seen);
+    membuf_free(&rt->results);
+    membuf_free(&rt->entries);
+    membuf_free(&rt->hits);
+    membuf_free(&rt->names);
+    membuf_free(&rt->blob);
+    free(rt->recs);
+    free(rt->why);
+}
+
+static char __find_redundant_doc__[] =
+    "find_redundant(root)\n"
+    "Find the ACL entries that have no effect in a directory tree.\n"
+    "\n"
+    "The tree is walked without following symbolic links, and the\n"
+    "access ACLs (and default ACLs of directories) are analysed as by\n"
+    ":py:meth:`ACL.redundant`, once per distinct ACL.\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param string root: the directory tree\n"
+    ":return: a dictionary with the number of ``paths`` and distinct\n"
+    "    ``acls`` examined, the number of ``redundant`` entries (for\n"
+    "    all the paths), their size in ``bytes`` in the extended\n"
+    "    attributes, the ``found`` list of (path, type, entries)\n"
+    "    tuples (type being :py:data:`ACL_TYPE_ACCESS` or\n"
+    "    :py:data:`ACL_TYPE_DEFAULT`, and entries as returned by\n"
+    "    :py:meth:`ACL.redundant`), in the tree's order, and the list\n"
+    "    of ``errors``, as (path, errno, message) tuples\n"
+    ":rtype: dict\n"
+    ;
+
+static PyObject* aclmodule_find_redundant(PyObject* obj, PyObject* args) {
+    char *root = NULL;
+    red_tree rt;
+    err_list errors;
+    const red_hit *hit;
+    const red_result *r;
+    const red_entry *e;
+    PyObject *ret = NULL, *found = NULL, *list, *item;
+    size_t i;
+    int j, nret;
+
+    if(!PyArg_ParseTuple(args, "et", Py_FileSystemDefaultEncoding, &root))
+        return NULL;
+    memset(&rt, 0, sizeof(rt));
+    memset(&errors, 0, sizeof(errors));
+    rt.errors = &errors;
+    Py_BEGIN_ALLOW_THREADS
+    nret = walk_tree(root, red_tree_visit, &rt, &errors);
+    Py_END_ALLOW_THREADS
+    if(nret == -1) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        goto out;
+    }
+    if((found = PyList_New(0)) == NULL)
+        goto out;
+    for(i = 0, hit = (const red_hit*)rt.hits.data;
+        i < rt.hits.len / sizeof(*hit); i++, hit++) {
+        r = (const red_result*)rt.results.data + hit->result - 1;
+        e = (const red_entry*)rt.entries.data + r->first;
+        if((list = PyList_New(r->count)) == NULL)
+            goto out;
+        for(j = 0; j < r->count; j++, e++) {
+            if((item = red_item(&e->rec, e->why)) == NULL) {
+                Py_DECREF(list);
+                goto out;
+            }
+            PyList_SET_ITEM(list, j, item);
+        }
+        item = Py_BuildValue("(NiN)", MyPath_FromStringAndSize(
+                                 rt.names.data + hit->name_off,
+                                 strlen(rt.names.data + hit->name_off)),
+                             hit->type, list);
+        if(item == NULL || PyList_Append(found, item) == -1) {
+            Py_XDECREF(item);
+            goto out;
+        }
+        Py_DECREF(item);
+    }
+    ret = tree_stats(&errors, "paths", rt.paths, "acls", rt.acls);
+    if(ret != NULL &&
+       (dict_set_size(ret, "redundant", rt.redundant) == -1 ||
+        dict_set_size(ret, "bytes", rt.redundant * ACL_EA_ENTRY) == -1 ||
+        PyDict_SetItemString(ret, "found", found) == -1))
+        Py_CLEAR(ret);
+
+ out:
+    Py_XDECREF(found);
+    red_tree_free(&rt);
+    err_list_free(&errors);
+    PyMem_Free(root);
+    return ret;
+}
+
+/***** ACL set algebra *****/
+
+/* The operators work on the effective permissions of each principal
+   (the owner, named users, owning group, named groups and others):
+   the entries of the group class are masked first, and the result
+   gets a mask that grants exactly the union of its group class (or
+   none, without named entries). An entry whose permissions are all
+   removed by a difference is kept, as dropping it could grant more
+   through the group or other entries. */
+#define ALG_UNION 0
+#define ALG_INTERSECTION 1
+#define ALG_DIFFERENCE 2
+
+/* Turns recs into one record per principal, sorted, with its
+   effective permissions and without the mask; returns the count */
+static int alg_effective(entry_rec *recs, int count) {
+    unsigned int mask = 7;
+    int i, j;
+
+    for(i = 0; i < count; i++)
+        if(recs[i].tag == ACL_MASK)
+            mask = recs[i].perm;
+    for(i = 0, j = 0; i < count; i++) {
+        if(recs[i].tag == ACL_MASK)
+            continue;
+        recs[j] = recs[i];
+        if(recs[j].tag == ACL_USER || recs[j].tag == ACL_GROUP ||
+           recs[j].tag == ACL_GROUP_OBJ)
+            recs[j].perm &= mask;
+        j++;
+    }
+    count = j;
+    qsort(recs, count, sizeof(entry_rec), entry_rec_cmp);
+    for(i = 1, j = count > 0 ? 1 : 0; i < count; i++)
+        if(entry_rec_cmp(recs + i, recs + j - 1) == 0)
+            recs[j - 1].perm |= recs[i].perm;
+        else
+            recs[j++] = recs[i];
+    return j;
+}
+
+/* Combines two sorted sets of records into out, which must have room
+   for na + nb + 1 records; returns the count */
+static int alg_combine(const entry_rec *a, int na, const entry_rec *b,
+                       int nb, int op, entry_rec *out) {
+    unsigned int mask = 0;
+    int i = 0, j = 0, n = 0, c, named = 0;
+
+    while(i < na || j < nb) {
+        c = i == na ? 1 : j == nb ? -1 : entry_rec_cmp(a + i, b + j);
+        if(c < 0) {
+            if(op != ALG_INTERSECTION)
+                out[n++] = a[i];
+            i++;
+        } else if(c > 0) {
+            if(op == ALG_UNION)
+                out[n++] = b[j];
+            j++;
+        } else {
+            out[n] = a[i];
+            out[n++].perm = op == ALG_UNION ? a[i].perm | b[j].perm :
+                op == ALG_INTERSECTION ? a[i].perm & b[j].perm :
+                a[i].perm & ~b[j].perm;
+            i++;
+            j++;
+        }
+    }
+    for(i = 0; i < n; i++) {
+        if(out[i].tag == ACL_USER || out[i].tag == ACL_GROUP)
+            named = 1;
+        if(out[i].tag == ACL_USER || out[i].tag == ACL_GROUP ||
+           out[i].tag == ACL_GROUP_OBJ)
+            mask |= out[i].perm;
+    }
+    if(named) {
+        out[n].tag = ACL_MASK;
+        out[n].perm = mask;
+        out[n++].id = ACL_EA_NOID;
+        qsort(out, n, sizeof(entry_rec), entry_rec_cmp);
+    }
+    return n;
+}
+
+static PyObject* ACL_algebra(PyObject *o1, PyObject *o2, int op) {
+    entry_rec *a = NULL, *b = NULL, *out = NULL;
+    int na, nb, n;
+    acl_t acl = NULL;
+
+    if(!PyObject_IsInstance(o1, (PyObject*)&ACL_Type) ||
+       !PyObject_IsInstance(o2, (PyObject*)&ACL_Type)) {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
+    }
+    if(ACL_ready((ACL_Object*)o1) == -1 || ACL_ready((ACL_Object*)o2) == -1)
+        return NULL;
+    if((na = acl_get_recs(((ACL_Object*)o1)->acl, &a)) == -1 ||
+       (nb = acl_get_recs(((ACL_Object*)o2)->acl, &b)) == -1)
+        goto out;
+    na = alg_effective(a, na);
+    nb = alg_effective(b, nb);
+    if((out = malloc((na + nb + 1) * sizeof(*out))) == NULL) {
+        errno = ENOMEM;
+        goto out;
+    }
+    n = alg_combine(a, na, b, nb, op, out);
+    acl = acl_from_recs(out, n);
+
+ out:
+    free(a);
+    free(b);
+    free(out);
+    if(acl == NULL)
+        return PyErr_SetFromErrno(PyExc_IOError);
+    return ACL_wrap(acl);
+}
+
+static PyObject* ACL_or(PyObject *o1, PyObject *o2) {
+    return ACL_algebra(o1, o2, ALG_UNION);
+}
+
+static PyObject* ACL_and(PyObject *o1, PyObject *o2) {
+    return ACL_algebra(o1, o2, ALG_INTERSECTION);
+}
+
+static PyObject* ACL_subtract(PyObject *o1, PyObject *o2) {
+    return ACL_algebra(o1, o2, ALG_DIFFERENCE);
+}
+
+static PyNumberMethods ACL_as_number = {
+    0,                  /* nb_add */
+    ACL_subtract,       /* nb_subtract */
+    0,                  /* nb_multiply */
+#ifndef IS_PY3K
+    0,                  /* nb_divide */
+#endif
+    0,                  /* nb_remainder */
+    0,                  /* nb_divmod */
+    0,                  /* nb_power */
+    0,                  /* nb_negative */
+    0,                  /* nb_positive */
+    0,                  /* nb_absolute */
+    0,                  /* nb_bool */
+    0,                  /* nb_invert */
+    0,                  /* nb_lshift */
+    0,                  /* nb_rshift */
+    ACL_and,            /* nb_and */
+    0,                  /* nb_xor */
+    ACL_or,             /* nb_or */
+};
+
+/***** Batched modification *****/
+
+/* A batch of operations, as for setfacl -m and -x: each one sets the
+   permissions of an entry (creating it) or, with perm MOD_REMOVE,
+   removes it. Operations on the same entry are applied in order, so
+   only the last one counts. The result must be a valid ACL, else
+   nothing is changed. */
+#define MOD_REMOVE ((unsigned int)-1)
+
+typedef struct {
+    entry_rec rec;
+    int seq;
+} mod_op;
+
+static int mod_op_cmp(const void *a, const void *b) {
+    const mod_op *x = a, *y = b;
+    int c = entry_rec_cmp(&x->rec, &y->rec);
+
+    return c ? c : (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+/* Parses one setfacl-style entry, "tag:qualifier:perms" to modify
+   or "tag:qualifier" to remove */
+static int mod_parse_entry(char *spec, kv_map *names, mod_op *op) {
+    char *qual, *perms, *tag = spec;
+    int i;
+
+    if((qual = strchr(tag, ':')) == NULL)
+        goto inval;
+    *qual++ = '\0';
+    if((perms = strchr(qual, ':')) != NULL)
+        *perms++ = '\0';
+    if(strcmp(tag, "user") == 0 || strcmp(tag, "u") == 0)
+        op->rec.tag = *qual ? ACL_USER : ACL_USER_OBJ;
+    else if(strcmp(tag, "group") == 0 || strcmp(tag, "g") == 0)
+        op->rec.tag = *qual ? ACL_GROUP : ACL_GROUP_OBJ;
+    else if(strcmp(tag, "mask") == 0 || strcmp(tag, "m") == 0)
+        op->rec.tag = ACL_MASK;
+    else if(strcmp(tag, "other") == 0 || strcmp(tag, "o") == 0)
+        op->rec.tag = ACL_OTHER;
+    else
+        goto inval;
+    op->rec.id = ACL_EA_NOID;
+    if(op->rec.tag == ACL_USER || op->rec.tag == ACL_GROUP) {
+        if(resolve_name(names, op->rec.tag, qual, &op->rec.id) == -1)
+            return -1;
+    } else if(*qual) {
+        goto inval;
+    }
+    if(perms == NULL) {
+        op->rec.perm = MOD_REMOVE;
+        return 0;
+    }
+    op->rec.perm = 0;
+    if(perms[0] >= '0' && perms[0] <= '7' && perms[1] == '\0') {
+        op->rec.perm = perms[0] - '0';
+        return 0;
+    }
+    for(i = 0; perms[i]; i++) {
+        switch(perms[i]) {
+        case 'r': op->rec.perm |= ACL_READ; break;
+        case 'w': op->rec.perm |= ACL_WRITE; break;
+        case 'x': op->rec.perm |= ACL_EXECUTE; break;
+        case '-': break;
+        default: goto inval;
+        }
+    }
+    return 0;
+
+ inval:
+    errno = EINVAL;
+    return -1;
+}
+
+/* Parses a list of entries separated by commas or white space,
+   appending the operations to out */
+static int mod_parse_text(const char *text, kv_map *names, membuf *out) {
+    char *copy, *spec, *save = NULL;
+    mod_op op;
+    int ret = 0;
+
+    if((copy = strdup(text)) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for(spec = strtok_r(copy, ", \t\r\n", &save); spec != NULL;
+        spec = strtok_r(NULL, ", \t\r\n", &save)) {
+        op.seq = out->len / sizeof(op);
+        if(mod_parse_entry(spec, names, &op) == -1 ||
+           membuf_append(out, &op, sizeof(op)) == -1) {
+            ret = -1;
+            break;
+        }
+    }
+    free(copy);
+    return ret;
+}
+
+/* Sorts the operations and keeps only the last one on each entry;
+   returns the new count */
+static int mod_prepare(mod_op *ops, int count) {
+    int i, j;
+
+    qsort(ops, count, sizeof(mod_op), mod_op_cmp);
+    for(i = 0, j = 0; i < count; i++) {
+        if(j > 0 && entry_rec_cmp(&ops[i].rec, &ops[j - 1].rec) == 0)
+            j--;
+        ops[j++] = ops[i];
+    }
+    return j;
+}
+
+/* Checks that sorted records form a valid ACL */
+static int mod_valid(const entry_rec *recs, int count) {
+    int i, base = 0, named = 0, mask = 0;
+
+    for(i = 0; i < count; i++) {
+        if(i > 0 && entry_rec_cmp(recs + i - 1, recs + i) == 0)
+            goto inval;
+        switch(recs[i].tag) {
+        case ACL_USER_OBJ: case ACL_GROUP_OBJ: case ACL_OTHER:
+            base++;
+            break;
+        case ACL_USER: case ACL_GROUP:
+            named = 1;
+            break;
+        case ACL_MASK:
+            mask = 1;
+            break;
+        default:
+            goto inval;
+        }
+    }
+    if(base == 3 && (mask || !named))
+        return 0;
+
+ inval:
+    errno = EINVAL;
+    return -1;
+}
+
+/* Applies prepared operations to sorted records, into out (room for
+   count + nops + 1 records), recomputing the mask unless calc_mask
+   is 0 or an operation is on the mask; returns the count of out, or
+   -1 with errno set to EINVAL if the result is not a valid ACL */
+static int mod_apply(const entry_rec *recs, int count, const mod_op *ops,
+                     int nops, int calc_mask, entry_rec *out) {
+    unsigned int perm = 0;
+    int i = 0, j = 0, n = 0, c, named = 0, mask = -1;
+
+    while(i < count || j < nops) {
+        c = i == count ? 1 : j == nops ? -1 :
+            entry_rec_cmp(recs + i, &ops[j].rec);
+        if(c < 0) {
+            out[n++] = recs[i++];
+            continue;
+        }
+        if(ops[j].rec.tag == ACL_MASK)
+            calc_mask = 0;
+        if(ops[j].rec.perm != MOD_REMOVE)
+            out[n++] = ops[j].rec;
+        if(c == 0)
+            i++;
+        j++;
+    }
+    if(calc_mask) {
+        for(i = 0; i < n; i++) {
+            if(out[i].tag == ACL_USER || out[i].tag == ACL_GROUP)
+                named = 1;
+            if(out[i].tag == ACL_MASK)
+                mask = i;
+            else if(out[i].tag == ACL_USER || out[i].tag == ACL_GROUP ||
+                    out[i].tag == ACL_GROUP_OBJ)
+                perm |= out[i].perm;
+        }
+        if(mask >= 0) {
+            out[mask].perm = perm;
+        } else if(named) {
+            out[n].tag = ACL_MASK;
+            out[n].perm = perm;
+            out[n++].id = ACL_EA_NOID;
+            qsort(out, n, sizeof(entry_rec), entry_rec_cmp);
+        }
+    }
+    return mod_valid(out, n) == -1 ? -1 : n;
+}
+
+/* Converts ops, a setfacl-style string or a sequence of (tag,
+   qualifier, perms) tuples, to prepared operations; returns their
+   count, or -1 with an exception set */
+static int mod_parse_ops(PyObject *ops, membuf *out) {
+    PyObject *seq, *item, *qualifier, *perms;
+    Py_ssize_t i, n;
+    const char *text;
+    kv_map names;
+    mod_op op;
+    long bits;
+    int tag, nret;
+    id_t id;
+
+    if(PyUnicode_Check(ops) || PyBytes_Check(ops)) {
+        if(!PyArg_Parse(ops, "s", &text))
+            return -1;
+        memset(&names, 0, sizeof(names));
+        nret = mod_parse_text(text, &names, out);
+        kv_map_free(&names);
+        if(nret == -1) {
+            if(errno == EINVAL)
+                PyErr_Format(PyExc_ValueError, "invalid ACL entries: %s",
+                             text);
+            else
+                PyErr_SetFromErrno(PyExc_IOError);
+            return -1;
+        }
+        return mod_prepare((mod_op*)out->data, out->len / sizeof(op));
+    }
+    if((seq = PySequence_Fast(ops, "ops must be a string or a sequence"))
+       == NULL)
+        return -1;
+    n = PySequence_Fast_GET_SIZE(seq);
+    for(i = 0; i < n; i++) {
+        item = PySequence_Fast_GET_ITEM(seq, i);
+        if(!PyTuple_Check(item)) {
+            PyErr_SetString(PyExc_TypeError,
+                            "operations must be (tag, qualifier, perms)"
+                            " tuples");
+            goto err;
+        }
+        if(!PyArg_ParseTuple(item, "iOO", &tag, &qualifier, &perms) ||
+           acl_parse_key(tag, qualifier, &id) == -1)
+            goto err;
+        op.rec.tag = tag;
+        op.rec.id = tag == ACL_USER || tag == ACL_GROUP ? id : ACL_EA_NOID;
+        op.rec.perm = MOD_REMOVE;
+        op.seq = i;
+        if(perms != Py_None) {
+            bits = PyInt_AsLong(perms);
+            if(bits == -1 && PyErr_Occurred())
+                goto err;
+            if(bits & ~(long)(ACL_READ | ACL_WRITE | ACL_EXECUTE)) {
+                PyErr_SetString(PyExc_ValueError, "invalid permissions");
+                goto err;
+            }
+            op.rec.perm = bits;
+        }
+        if(membuf_append(out, &op, sizeof(op)) == -1) {
+            PyErr_NoMemory();
+            goto err;
+        }
+    }
+    Py_DECREF(seq);
+    return mod_prepare((mod_op*)out->data, out->len / sizeof(op));
+
+ err:
+    Py_DECREF(seq);
+    return -1;
+}
+
+/* Tells whether making the sorted records cur into the sorted records
+   recs deletes entries */
+static int mod_deletes(const entry_rec *cur, int ncur,
+                       const entry_rec *recs, int count) {
+    int i = 0, j = 0, cmp;
+
+    while(i < ncur && j < count) {
+        if((cmp = entry_rec_cmp(cur + i, recs + j)) < 0)
+            return 1;
+        if(cmp == 0)
+            i++;
+        j++;
+    }
+    return i < ncur;
+}
+
+/* Makes the entries of acl match the sorted records, keeping the
+   entries that stay (so that their Entry objects remain usable). The
+   missing entries are created first, and removed again if that
+   fails; updating and deleting the others can't fail. */
+static int mod_update_acl(acl_t *acl, const entry_rec *recs, int count) {
+    acl_entry_t entry, *handles = NULL, *added = NULL;
+    entry_rec *cur = NULL, *hit;
+    int *target = NULL;
+    unsigned char *used = NULL;
+    int ncur, nadded = 0, i, eid, ret = -1;
+    id_t id;
+
+    if((ncur = acl_get_recs(*acl, &cur)) == -1)
+        return -1;
+    if((used = calloc(count + 1, 1)) == NULL ||
+       (target = malloc((ncur + 1) * sizeof(*target))) == NULL ||
+       (handles = malloc((ncur + 1) * sizeof(*handles))) == NULL ||
+       (added = malloc((count + 1) * sizeof(*added))) == NULL) {
+        errno = ENOMEM;
+        goto out;
+    }
+    for(i = 0, eid = ACL_FIRST_ENTRY; i < ncur; i++, eid = ACL_NEXT_ENTRY) {
+        if(acl_get_entry(*acl, eid, handles + i) != 1) {
+            errno = EINVAL;
+            goto out;
+        }
+        /* of duplicate entries, the first one stays */
+        hit = bsearch(cur + i, recs, count, sizeof(entry_rec),
+                      entry_rec_cmp);
+        target[i] = hit == NULL || used[hit - recs] ? -1 : hit - recs;
+        if(hit != NULL)
+            used[hit - recs] = 1;
+    }
+    for(i = 0; i < count; i++) {
+        if(used[i])
+            continue;
+        if(acl_create_entry(acl, &entry) == -1)
+            goto undo;
+        added[nadded++] = entry;
+        id = recs[i].id;
+        if(acl_set_tag_type(entry, recs[i].tag) == -1 ||
+           ((recs[i].tag == ACL_USER || recs[i].tag == ACL_GROUP) &&
+            acl_set_qualifier(entry, &id) == -1) ||
+           entry_set_perms(entry, recs[i].perm) == -1)
+            goto undo;
+    }
+    for(i = 0; i < ncur; i++)
+        if(target[i] == -1) {
+            if(acl_delete_entry(*acl, handles[i]) == -1)
+                goto out;
+        } else if(cur[i].perm != recs[target[i]].perm &&
+                  entry_set_perms(handles[i], recs[target[i]].perm) == -1) {
+            goto out;
+        }
+    ret = 0;
+    goto out;
+
+ undo:
+    for(i = 0; i < nadded; i++)
+        acl_delete_entry(*acl, added[i]);
+ out:
+    free(cur);
+    free(used);
+    free(target);
+    free(handles);
+    free(added);
+    return ret;
+}
+
+static PyObject* ACL_modify(PyObject *obj, PyObject *args, PyObject *keywds) {
+    ACL_Object *self = (ACL_Object*)obj;
+    static char *kwlist[] = { "ops", "calc_mask", NULL };
+    PyObject *ops;
+    membuf buf = { NULL, 0, 0 };
+    entry_rec *recs = NULL, *out = NULL;
+    int calc_mask = 1, nops, count, n;
+    PyObject *ret = NULL;
+
+    if(!PyArg_ParseTupleAndKeywords(args, keywds, "O|i", kwlist,
+                                    &ops, &calc_mask))
+        return NULL;
+    if((nops = mod_parse_ops(ops, &buf)) == -1 || ACL_ready(self) == -1)
+        goto out;
+    if((count = acl_get_recs(self->acl, &recs)) == -1) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        goto out;
+    }
+    qsort(recs, count, sizeof(entry_rec), entry_rec_cmp);
+    if((out = malloc((count + nops + 1) * sizeof(entry_rec))) == NULL) {
+        PyErr_NoMemory();
+        goto out;
+    }
+    if((n = mod_apply(recs, count, (mod_op*)buf.data, nops, calc_mask,
+                      out)) == -1) {
+        PyErr_SetString(PyExc_ValueError,
+                        "the modified ACL would not be valid");
+        goto out;
+    }
+#ifdef HAVE_LEVEL2
+    if(ACL_unshare(self) == -1 ||
+       (mod_deletes(recs, count, out, n) && ACL_detach_entries(self) == -1))
+        goto out;
+#endif
+    if(mod_update_acl(&self->acl, out, n) == -1) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        goto out;
+    }
+#ifdef HAVE_LEVEL2
+    ACL_drop_index(self);
+    if(ACL_mask_rescan(self) == -1)
+        goto out;
+#endif
+    Py_INCREF(Py_None);
+    ret = Py_None;
+
+ out:
+    free(out);
+    free(recs);
+    membuf_free(&buf);
+    return ret;
+}
+
+/* Applies the same operations to the ACLs of a whole tree */
+typedef struct {
+    const mod_op *ops;
+    int nops;
+    int calc_mask;
+    acl_type_t type;
+    membuf blob;
+    membuf scratch;
+    entry_rec *recs;
+    int alloc;
+    size_t paths;
+    size_t changed;
+    err_list *errors;
+} mod_tree;
+
+static int mod_tree_visit(void *data, const walk_item *item, int post) {
+    mod_tree *mt = data;
+    const char *name = mt->type == ACL_TYPE_DEFAULT ?
+        ACL_EA_DEFAULT : ACL_EA_ACCESS;
+    entry_rec *recs, *out, rec;
+    int nret, count, i, j, n;
+
+    if(post || S_ISLNK(item->st->st_mode) ||
+       (mt->type == ACL_TYPE_DEFAULT && !S_ISDIR(item->st->st_mode)))
+        return 0;
+    mt->paths++;
+    nret = read_acl_blob(item->path, mt->type, item->st->st_mode, &mt->blob);
+    if(nret == -1)
+        return err_list_add(mt->errors, item->rel, errno);
+    /* like setfacl, a new default ACL starts from the access ACL's
+       base entries */
+    if(nret == 0 && read_acl_blob(item->path, ACL_TYPE_ACCESS,
+                                  item->st->st_mode, &mt->blob) == -1)
+        return err_list_add(mt->errors, item->rel, errno);
+    count = blob_count(mt->blob.data, mt->blob.len);
+    if(count + mt->nops + 1 > mt->alloc) {
+        free(mt->recs);
+        mt->alloc = 2 * (count + mt->nops + 1);
+        if((mt->recs = malloc(2 * mt->alloc * sizeof(entry_rec))) == NULL) {
+            mt->alloc = 0;
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    recs = mt->recs;
+    out = mt->recs + mt->alloc;
+    for(i = 0, j = 0; i < count; i++) {
+        blob_get(mt->blob.data, i, &rec);
+        if(nret == 1 || rec.tag == ACL_USER_OBJ ||
+           rec.tag == ACL_GROUP_OBJ || rec.tag == ACL_OTHER)
+            recs[j++] = rec;
+    }
+    qsort(recs, j, sizeof(entry_rec), entry_rec_cmp);
+    if((n = mod_apply(recs, j, mt->ops, mt->nops, mt->calc_mask, out)) == -1)
+        return err_list_add(mt->errors, item->rel, errno);
+    mt->scratch.len = 0;
+    if(recs_to_blob(out, n, &mt->scratch) == -1)
+        return -1;
+    if(nret == 1 && mt->scratch.len == mt->blob.len &&
+       memcmp(mt->scratch.data, mt->blob.data, mt->blob.len) == 0)
+        return 0;
+    if(lsetxattr(item->path, name, mt->scratch.data, mt->scratch.len, 0)
+       == -1)
+        return err_list_add(mt->errors, item->rel, errno);
+    mt->changed++;
+    return 0;
+}
+
+static char __modify_tree_doc__[] =
+    "modify_tree(root, ops[, default=False, calc_mask=True])\n"
+    "Modify the ACLs of a whole directory tree.\n"
+    "\n"
+    "The operations are applied as by :py:meth:`ACL.modify` to the\n"
+    "access ACL of every object in the tree, or with default set, to\n"
+    "the default ACL of every directory (a missing default ACL starts\n"
+    "as the base entries of the access ACL, as with :command:`setfacl\n"
+    "-d -m`). Symbolic links are neither followed nor modified, and\n"
+    "unchanged ACLs aren't written back. The work is done with the\n"
+    "GIL released.\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param string root: the directory tree\n"
+    ":param ops: the operations, as for :py:meth:`ACL.modify`\n"
+    ":param bool default: whether to modify the default ACLs\n"
+    ":param bool calc_mask: whether to recompute the masks\n"
+    ":return: a dictionary with the number of ``paths`` examined and\n"
+    "    ``changed``, and the list of ``errors``, as (path, errno,\n"
+    "    message) tuples; paths whose ACL would become invalid fail\n"
+    "    with :py:data:`errno.EINVAL`, leaving it unchanged\n"
+    ":rtype: dict\n"
+    ;
+
+static PyObject* aclmodule_modify_tree(PyObject *obj, PyObject *args,
+                                       PyObject *keywds) {
+    static char *kwlist[] = { "root", "ops", "default", "calc_mask", NULL };
+    char *root = NULL;
+    PyObject *ops, *ret = NULL;
+    membuf buf = { NULL, 0, 0 };
+    err_list errors;
+    mod_tree mt;
+    int def = 0, nret;
+
+    memset(&mt, 0, sizeof(mt));
+    memset(&errors, 0, sizeof(errors));
+    mt.calc_mask = 1;
+    if(!PyArg_ParseTupleAndKeywords(args, keywds, "etO|ii", kwlist,
+                                    Py_FileSystemDefaultEncoding, &root,
+                                    &ops, &def, &mt.calc_mask))
+        return NULL;
+    if((mt.nops = mod_parse_ops(ops, &buf)) == -1)
+        goto out;
+    mt.ops = (const mod_op*)buf.data;
+    mt.type = def ? ACL_TYPE_DEFAULT : ACL_TYPE_ACCESS;
+    mt.errors = &errors;
+    Py_BEGIN_ALLOW_THREADS
+    nret = walk_tree(root, mod_tree_visit, &mt, &errors);
+    Py_END_ALLOW_THREADS
+    if(nret == -1) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        goto out;
+    }
+    ret = tree_stats(&errors, "paths", mt.paths, "changed", mt.changed);
+
+ out:
+    membuf_free(&mt.blob);
+    membuf_free(&mt.scratch);
+    free(mt.recs);
+    membuf_free(&buf);
+    err_list_free(&errors);
+    PyMem_Free(root);
+    return ret;
+}
+
+/***** In-place loading *****/
+
+/* Loading into an existing ACL object reads the xattr into a buffer
+   kept by the object and rewrites the entries of its acl_t in place:
+   once the object has held an ACL as large as the next one, a load
+   allocates nothing. If entries were handed out, though, the acl_t
+   is set aside (the Entry objects keep showing it, detached from the
+   ACL) and a new one is built. */
+
+/* Makes the entries of the (unshared) ACL those of a valid blob of
+   count entries; the current entries are gathered first, as libacl
+   may reorder them while they are rewritten. Returns -1 with errno
+   set on failure. */
+static int ACL_refill(ACL_Object *self, const char *blob, int count) {
+    acl_entry_t entry, *p;
+    entry_rec rec;
+    id_t id;
+    int ncur = 0, i, nerr, eid = ACL_FIRST_ENTRY;
+
+    while((nerr = acl_get_entry(self->acl, eid, &entry)) == 1) {
+        eid = ACL_NEXT_ENTRY;
+        if(ncur == self->load_alloc) {
+            i = self->load_alloc ? self->load_alloc * 2 : 16;
+            if((p = realloc(self->load_entries, i * sizeof(*p))) == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            self->load_entries = p;
+            self->load_alloc = i;
+        }
+        self->load_entries[ncur++] = entry;
+    }
+    if(nerr == -1)
+        return -1;
+    for(i = 0; i < count; i++) {
+        if(i < ncur)
+            entry = self->load_entries[i];
+        else if(acl_create_entry(&self->acl, &entry) == -1)
+            return -1;
+        blob_get(blob, i, &rec);
+        id = rec.id;
+        if(acl_set_tag_type(entry, rec.tag) == -1 ||
+           ((rec.tag == ACL_USER || rec.tag == ACL_GROUP) &&
+            acl_set_qualifier(entry, &id) == -1) ||
+           entry_set_perms(entry, rec.perm) == -1)
+            return -1;
+    }
+    for(; i < ncur; i++)
+        if(acl_delete_entry(self->acl, self->load_entries[i]) == -1)
+            return -1;
+    return 0;
+}
+
+/* Loads a blob into the ACL; returns -1 with an exception set */
+static int ACL_load_blob(ACL_Object *self, const char *blob, size_t len) {
+    int count;
+
+    if((count = blob_count(blob, len)) == -1) {
+        PyErr_SetString(PyExc_ValueError, "invalid ACL blob");
+        return -1;
+    }
+    ACL_drop_lazy(self);
+    /* a shared acl_t is left to the others */
+    if(self->cow_refs != NULL && *self->cow_refs > 1) {
+        ACL_release(self);
+    } else {
+        free(self->cow_refs);
+        self->cow_refs = NULL;
+    }
+    if(self->exposed && self->acl != NULL && ACL_retire(self) == -1) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if(self->acl == NULL && (self->acl = acl_init(count)) == NULL) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return -1;
+    }
+    if(ACL_refill(self, blob, count) == -1) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return -1;
+    }
+#ifdef HAVE_LEVEL2
+    ACL_drop_index(self);
+    return ACL_mask_rescan(self);
+#else
+    self->generation++;
+    return 0;
+#endif
+}
+
+/* Reads the ACL of path (or fd, if path is NULL) as a blob into the
+   load buffer, making one from the mode if the file has none, as
+   libacl does; returns its length, or -1 with errno set */
+static ssize_t ACL_read_blob(ACL_Object *self, const char *path, int fd,
+                             acl_type_t type) {
+    const char *name = type == ACL_TYPE_DEFAULT ?
+        ACL_EA_DEFAULT : ACL_EA_ACCESS;
+    membuf buf = { self->load_buf, 0, self->load_size };
+    entry_rec recs[3];
+    struct stat st;
+    ssize_t n = -1;
+
+    if(membuf_reserve(&buf, 256) == -1)
+        goto out;
+    for(;;) {
+        n = path != NULL ? getxattr(path, name, buf.data, buf.size) :
+            fgetxattr(fd, name, buf.data, buf.size);
+        if(n >= 0 || errno != ERANGE)
+            break;
+        n = path != NULL ? getxattr(path, name, NULL, 0) :
+            fgetxattr(fd, name, NULL, 0);
+        if(n == -1 || membuf_reserve(&buf, n) == -1) {
+            n = -1;
+            goto out;
+        }
+    }
+    if(n > 0 || (n == -1 && errno != ENODATA && errno != ENOTSUP))
+        goto out;
+    /* no ACL (or an empty default one) */
+    n = 0;
+    if(type == ACL_TYPE_ACCESS) {
+        if((path != NULL ? stat(path, &st) : fstat(fd, &st)) == -1) {
+            n = -1;
+            goto out;
+        }
+        n = recs_from_mode(st.st_mode, recs);
+    }
+    n = recs_to_blob(recs, n, &buf) == -1 ? -1 : (ssize_t)buf.len;
+
+ out:
+    self->load_buf = buf.data;
+    self->load_size = buf.size;
+    return n;
+}
+
+static PyObject* ACL_load(PyObject *obj, PyObject *args, PyObject *keywds) {
+    ACL_Object *self = (ACL_Object*)obj;
+    static char *kwlist[] = { "source", "type", NULL };
+    PyObject *source;
+    char *path = NULL;
+    acl_type_t type = ACL_TYPE_ACCESS;
+    ssize_t n;
+    int fd = -1;
+
+    if(!PyArg_ParseTupleAndKeywords(args, keywds, "O|I", kwlist,
+                                    &source, &type))
+        return NULL;
+    if(type != ACL_TYPE_ACCESS && type != ACL_TYPE_DEFAULT) {
+        PyErr_SetString(PyExc_ValueError, "invalid ACL type");
+        return NULL;
+    }
+    if(PyInt_Check(source)) {
+        if((fd = PyInt_AsLong(source)) == -1 && PyErr_Occurred())
+            return NULL;
+    } else if(!PyArg_Parse(source, "et", Py_FileSystemDefaultEncoding,
+                           &path)) {
+        return NULL;
+    }
+    if((n = ACL_read_blob(self, path, fd, type)) == -1) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+        PyMem_Free(path);
+        return NULL;
+    }
+    PyMem_Free(path);
+    if(ACL_load_blob(self, self->load_buf, n) == -1)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject* ACL_load_from_bytes(PyObject *obj, PyObject *args) {
+    Py_buffer data;
+    int nret;
+
+#ifdef IS_PY3K
+    if(!PyArg_ParseTuple(args, "y*", &data))
+#else
+    if(!PyArg_ParseTuple(args, "s*", &data))
+#endif
+        return NULL;
+    nret = ACL_load_blob((ACL_Object*)obj, data.buf, data.len);
+    PyBuffer_Release(&data);
+    if(nret == -1)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject* ACL_load_from_text(PyObject *obj, PyObject *args) {
+    ACL_Object *self = (ACL_Object*)obj;
+    membuf blob = { NULL, 0, 0 };
+    entry_rec *recs = NULL;
+    const char *text;
+    acl_t acl;
+    int count, nret;
+
+    if(!PyArg_ParseTuple(args, "s", &text))
+        return NULL;
+    if((acl = acl_from_text(text)) == NULL)
+        return PyErr_SetFromErrno(PyExc_IOError);
+    count = acl_get_recs(acl, &recs);
+    acl_free(acl);
+    if(count == -1)
+        return PyErr_SetFromErrno(PyExc_IOError);
+    nret = recs_to_blob(recs, count, &blob);
+    free(recs);
+    if(nret == -1) {
+        membuf_free(&blob);
+        return PyErr_NoMemory();
+    }
+    nret = ACL_load_blob(self, blob.data, blob.len);
+    membuf_free(&blob);
+    if(nret == -1)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+/* The storage kept by load(), as (buffer address, size, entries
+   address, count); only meant for the tests */
+static PyObject* ACL_get_load_buffers(PyObject *obj, void* arg) {
+    ACL_Object *self = (ACL_Object*)obj;
+
+    return Py_BuildValue("(KnKi)",
+                         (unsigned long long)(size_t)self->load_buf,
+                         (Py_ssize_t)self->load_size,
+                         (unsigned long long)(size_t)self->load_entries,
+                         self->load_alloc);
+}
+
+/***** Lazy ACLs *****/
+
+/* Reads a lazy ACL, through the load buffer (which is not kept, as
+   a lazy ACL is usually read once) */
+static int ACL_load_lazy(ACL_Object *self) {
+    char procpath[PATH_MAX], *path = self->lazy_name;
+    ssize_t n;
+    int nret;
+
+    /* the *xattr calls have no *at variants, so go through the
+       directory's entry in /proc */
+    if(self->lazy_dir_fd != AT_FDCWD && path[0] != '/') {
+        if(snprintf(procpath, sizeof(procpath), "/proc/self/fd/%d/%s",
+                    self->lazy_dir_fd, path) >= (int)sizeof(procpath)) {
+            errno = ENAMETOOLONG;
+            PyErr_SetFromErrnoWithFilename(PyExc_IOError, self->lazy_name);
+            return -1;
+        }
+        path = procpath;
+    }
+    if((n = ACL_read_blob(self, path, -1, self->lazy_type)) == -1) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, self->lazy_name);
+        return -1;
+    }
+    nret = ACL_load_blob(self, self->load_buf, n);
+    free(self->load_buf);
+    self->load_buf = NULL;
+    self->load_size = 0;
+    return nret;
+}
+
+static char __lazy_acl_doc__[] =
+    "lazy_acl(name[, dir_fd=None, type=ACL_TYPE_ACCESS])\n"
+    "Return an ACL object that reads the ACL of a file when first used.\n"
+    "\n"
+    "Creating the object makes no system call: the ACL is read on the\n"
+    "first access to its entries (iteration, conversion to text,\n"
+    "comparison, serialization, copying, modification), and errors\n"
+    "such as a missing file are raised then. Code that walks a tree and\n"
+    "filters on other metadata (e.g. with :py:func:`os.scandir`) thus\n"
+    "only pays for the ACLs it looks at. A missing access ACL is made\n"
+    "from the file mode, and a missing default ACL gives an empty one;\n"
+    "symbolic links are followed.\n"
+    "\n"
+    ".. note:: Only available on Linux.\n"
+    "\n"
+    ":param name: the path of the file, relative to dir_fd if given\n"
+    ":param int dir_fd: a descriptor of the directory name is relative\n"
+    "    to; it must stay open until the ACL is read\n"
+    ":param int type: :py:data:`ACL_TYPE_ACCESS` or\n"
+    "    :py:data:`ACL_TYPE_DEFAULT`\n"
+    ":rtype: ACL\n"
+    ;
+
+static PyObject* aclmodule_lazy_acl(PyObject *obj, PyObject *args,
+                                    PyObject *keywds) {
+    static char *kwlist[] = { "name", "dir_fd", "type", NULL };
+    char *name = NULL;
+    PyObject *dir_fd = Py_None, *ret;
+    acl_type_t type = ACL_TYPE_ACCESS;
+    ACL_Object *self;
+    int fd = AT_FDCWD;
+
+    if(!PyArg_ParseTupleAndKeywords(args, keywds, "et|OI", kwlist,
+                                    Py_FileSystemDefaultEncoding, &name,
+                                    &dir_fd, &type))
+        return NULL;
+    if(type != ACL_TYPE_ACCESS && type != ACL_TYPE_DEFAULT) {
+        PyErr_SetString(PyExc_ValueError, "invalid ACL type");
+        goto err;
+    }
+    if(dir_fd != Py_None &&
+       (fd = PyInt_AsLong(dir_fd)) == -1 && PyErr_Occurred())
+        goto err;
+    if((ret = ACL_new(&ACL_Type, NULL, NULL)) == NULL)
+        goto err;
+    self = (ACL_Object*)ret;
+    if((self->lazy_name = strdup(name)) == NULL) {
+        Py_DECREF(ret);
+        PyErr_NoMemory();
+        goto err;
+    }
+    self->lazy_dir_fd = fd;
+    self->lazy_type = type;
+    PyMem_Free(name);
+    return ret;
+
+ err:
+    PyMem_Free(name);
+    return NULL;
+}
+
+#endif
+
+/* Module methods */
+
+static char __deletedef_doc__[] =
+    "delete_default(path)\n"
+    "Delete the default ACL from a directory.\n"
+    "\n"
+    "This function deletes the default ACL associated with\n"
+    "a directory (the ACL which will be ANDed with the mode\n"
+    "parameter to the open, creat functions).\n"
+    "\n"
+    ":param string path: the directory whose default ACL should be deleted\n"
+    ;
+
+/* Deletes the default ACL from a directory */
+static PyObject* aclmodule_delete_default(PyObject* obj, PyObject* args) {
+    char *filename;
+
+    /* Parse the arguments */
+    if (!PyArg_ParseTuple(args, "et", NULL, &filename))
+        return NULL;
+
+    if(acl_delete_def_file(filename) == -1) {
+        return PyErr_SetFromErrno(PyExc_IOError);
+    }
+
+    /* Return the result */
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+#ifdef HAVE_LINUX
+static char __has_extended_doc__[] =
+    "has_extended(item)\n"
+    "Check if a file or file handle has an extended ACL.\n"
+    "\n"
+    ":param item: either a file name or a file-like object or an integer;\n"
+    "  it represents the file-system object on which to act\n"
+    ;
+
+/* Check for extended ACL a file or fd */
+static PyObject* aclmodule_has_extended(PyObject* obj, PyObject* args) {
+    PyObject *myarg;
+    int nret;
+    int fd;
+
+    if (!PyArg_ParseTuple(args, "O", &myarg))
+        return NULL;
+
+    if(PyBytes_Check(myarg)) {
+        const char *filename = PyBytes_AS_STRING(myarg);
+        nret = acl_extended_file(filename);
+    } else if (PyUnicode_Check(myarg)) {
+        PyObject *o =
+            PyUnicode_AsEncodedString(myarg,
+                                      Py_FileSystemDefaultEncoding, "strict");
+        if (o == NULL)
+            return NULL;
+        const char *filename = PyBytes_AS_STRING(o);
+        nret = acl_extended_file(filename);
+        Py_DECREF(o);
+    } else if((fd = PyObject_AsFileDescriptor(myarg)) != -1) {
+        nret = acl_extended_fd(fd);
+    } else {
+        PyErr_SetString(PyExc_TypeError, "argument 1 must be string, int,"
+                        " or file-like object");
+        return 0;
+    }
+    if(nret == -1) {
+        return PyErr_SetFromErrno(PyExc_IOError);
+    }
+
+    /* Return the result */
+    return PyBool_FromLong(nret);
+}
+#endif
+
+/* The module methods */
+static PyMethodDef aclmodule_methods[] = {
+    {"delete_default", aclmodule_delete_default, METH_VARARGS,
+     __deletedef_doc__},
+#ifdef HAVE_LINUX
+    {"has_extended", aclmodule_has_extended, METH_VARARGS,
+     __has_extended_doc__},
+#endif
+#ifdef HAVE_LINUX_KERNEL
+    {"snapshot", (PyCFunction)aclmodule_snapshot,
+     METH_VARARGS | METH_KEYWORDS, __snapshot_doc__},
+    {"merge_snapshots", aclmodule_merge_snapshots, METH_VARARGS,
+     __merge_snapshots_doc__},
+    {"tree_digest", aclmodule_tree_digest, METH_VARARGS,
+     __tree_digest_doc__},
+    {"diff_snapshots", aclmodule_diff_snapshots, METH_VARARGS,
+     __diff_snapshots_doc__},
+    {"restore", (PyCFunction)aclmodule_restore, METH_VARARGS | METH_KEYWORDS,
+     __restore_doc__},
+    {"dump", (PyCFunction)aclmodule_dump, METH_VARARGS | METH_KEYWORDS,
+     __dump_doc__},
+    {"export", (PyCFunction)aclmodule_export, METH_VARARGS | METH_KEYWORDS,
+     __export_doc__},
+    {"pax_encode", (PyCFunction)aclmodule_pax_encode,
+     METH_VARARGS | METH_KEYWORDS, __pax_encode_doc__},
+    {"pax_decode", (PyCFunction)aclmodule_pax_decode,
+     METH_VARARGS | METH_KEYWORDS, __pax_decode_doc__},
+    {"pax_encode_many", (PyCFunction)aclmodule_pax_encode_many,
+     METH_VARARGS | METH_KEYWORDS, __pax_encode_many_doc__},
+    {"pax_decode_many", (PyCFunction)aclmodule_pax_decode_many,
+     METH_VARARGS | METH_KEYWORDS, __pax_decode_many_doc__},
+    {"pack_acls", aclmodule_pack_acls, METH_VARARGS, __pack_acls_doc__},
+    {"build_index", (PyCFunction)aclmodule_build_index,
+     METH_VARARGS | METH_KEYWORDS, __build_index_doc__},
+    {"check_access", (PyCFunction)aclmodule_check_access,
+     METH_VARARGS | METH_KEYWORDS, __check_access_doc__},
+    {"find_redundant", aclmodule_find_redundant, METH_VARARGS,
+     __find_redundant_doc__},
+    {"modify_tree", (PyCFunction)aclmodule_modify_tree,
+     METH_VARARGS | METH_KEYWORDS, __modify_tree_doc__},
+    {"lazy_acl", (PyCFunction)aclmodule_lazy_acl,
+     METH_VARARGS | METH_KEYWORDS, __lazy_acl_doc__},
+#endif
+    {NULL, NULL, 0, NULL}
+};
+
+static char __posix1e_doc__[] =
+    "POSIX.1e ACLs manipulation\n"
+    "==========================\n"
+    "\n"
+    "This module provides support for manipulating POSIX.1e ACLS\n"
+    "\n"
+    "Depending on the operating system support for POSIX.1e, \n"
+    "the ACL type will have more or less capabilities:\n\n"
+    "  - level 1, only basic support, you can create\n"
+    "    ACLs from files and text descriptions;\n"
+    "    once created, the type is immutable\n"
+    "  - level 2, complete support, you can alter\n"
+    "    the ACL once it is created\n"
+    "\n"
+    "Also, in level 2, more types are available, corresponding\n"
+    "to acl_entry_t (the Entry type), acl_permset_t (the Permset type).\n"
+    "\n"
+    "The existence of level 2 support and other extensions can be\n"
+    "checked by the constants:\n\n"
+    "  - :py:data:`HAS_ACL_ENTRY` for level 2 and the Entry/Permset classes\n"
+    "  - :py:data:`HAS_ACL_FROM_MODE` for ``ACL(mode=...)`` usage\n"
+    "  - :py:data:`HAS_ACL_CHECK` for the :py:func:`ACL.check` function\n"
+    "  - :py:data:`HAS_EXTENDED_CHECK` for the module-level\n"
+    "    :py:func:`has_extended` function\n"
+    "  - :py:data:`HAS_EQUIV_MODE` for the :py:func:`ACL.equiv_mode` method\n"
+    "  - :py:data:`HAS_SNAPSHOT` for the :py:func:`snapshot` function and\n"
+    "    the :py:class:`Snapshot` class\n"
+    "\n"
+    "Example:\n"
+    "\n"
+    ">>> import posix1e\n"
+    ">>> acl1 = posix1e.ACL(file=\"file.txt\") \n"
+    ">>> print acl1\n"
     "user::rw-\n"
     "group::rw-\n"
     "other::r--\n"
@@ -1765,6 +13582,9 @@ static char __posix1e_doc__[] =
     ".. py:data:: HAS_EQUIV_MODE\n\n"
     "   denotes support for the equiv_mode function\n"
     "\n"
+    ".. py:data:: HAS_SNAPSHOT\n\n"
+    "   denotes support for the tree snapshot functions\n"
+    "\n"
     ;
 
 #ifdef IS_PY3K
@@ -1804,6 +13624,36 @@ void initposix1e(void)
         INITERROR;
 #endif
 
+#ifdef HAVE_LINUX_KERNEL
+    Py_TYPE(&Snapshot_Type) = &PyType_Type;
+    if(PyType_Ready(&Snapshot_Type) < 0)
+        INITERROR;
+
+    Py_TYPE(&DumpReader_Type) = &PyType_Type;
+    if(PyType_Ready(&DumpReader_Type) < 0)
+        INITERROR;
+
+    Py_TYPE(&PackedACLs_Type) = &PyType_Type;
+    if(PyType_Ready(&PackedACLs_Type) < 0)
+        INITERROR;
+
+    Py_TYPE(&Watcher_Type) = &PyType_Type;
+    if(PyType_Ready(&Watcher_Type) < 0)
+        INITERROR;
+
+    Py_TYPE(&Mirror_Type) = &PyType_Type;
+    if(PyType_Ready(&Mirror_Type) < 0)
+        INITERROR;
+
+    Py_TYPE(&AclIndex_Type) = &PyType_Type;
+    if(PyType_Ready(&AclIndex_Type) < 0)
+        INITERROR;
+
+    Py_TYPE(&PrincipalCache_Type) = &PyType_Type;
+    if(PyType_Ready(&PrincipalCache_Type) < 0)
+        INITERROR;
+#endif
+
 #ifdef IS_PY3K
     m = PyModule_Create(&posix1emodule);
 #else
@@ -1874,12 +13724,54 @@ void initposix1e(void)
 #define LINUX_EXT_VAL 1
 #else
 #define LINUX_EXT_VAL 0
+#endif
+
+#ifdef HAVE_LINUX_KERNEL
+    Py_INCREF(&Snapshot_Type);
+    if (PyDict_SetItemString(d, "Snapshot",
+                             (PyObject *) &Snapshot_Type) < 0)
+        INITERROR;
+
+    Py_INCREF(&DumpReader_Type);
+    if (PyDict_SetItemString(d, "DumpReader",
+                             (PyObject *) &DumpReader_Type) < 0)
+        INITERROR;
+
+    Py_INCREF(&PackedACLs_Type);
+    if (PyDict_SetItemString(d, "PackedACLs",
+                             (PyObject *) &PackedACLs_Type) < 0)
+        INITERROR;
+
+    Py_INCREF(&Watcher_Type);
+    if (PyDict_SetItemString(d, "Watcher",
+                             (PyObject *) &Watcher_Type) < 0)
+        INITERROR;
+
+    Py_INCREF(&Mirror_Type);
+    if (PyDict_SetItemString(d, "Mirror",
+                             (PyObject *) &Mirror_Type) < 0)
+        INITERROR;
+
+    Py_INCREF(&AclIndex_Type);
+    if (PyDict_SetItemString(d, "AclIndex",
+                             (PyObject *) &AclIndex_Type) < 0)
+        INITERROR;
+
+    Py_INCREF(&PrincipalCache_Type);
+    if (PyDict_SetItemString(d, "PrincipalCache",
+                             (PyObject *) &PrincipalCache_Type) < 0)
+        INITERROR;
+
+#define SNAPSHOT_VAL 1
+#else
+#define SNAPSHOT_VAL 0
 #endif
     /* declare the Linux extensions */
     PyModule_AddIntConstant(m, "HAS_ACL_FROM_MODE", LINUX_EXT_VAL);
     PyModule_AddIntConstant(m, "HAS_ACL_CHECK", LINUX_EXT_VAL);
     PyModule_AddIntConstant(m, "HAS_EXTENDED_CHECK", LINUX_EXT_VAL);
     PyModule_AddIntConstant(m, "HAS_EQUIV_MODE", LINUX_EXT_VAL);
+    PyModule_AddIntConstant(m, "HAS_SNAPSHOT", SNAPSHOT_VAL);
 
 #ifdef IS_PY3K
     return m;
@@ -10,7 +10,9 @@ libs = []
 if u_sysname == "Linux":
     macros.append(("HAVE_LINUX", None))
     macros.append(("HAVE_LEVEL2", None))
+    macros.append(("HAVE_LINUX_KERNEL", None))
     libs.append("acl")
+    libs.append("pthread")
 elif u_sysname == "GNU/kFreeBSD":
     macros.append(("HAVE_LINUX", None))
     macros.append(("HAVE_LEVEL2", None))
@@ -28,6 +28,10 @@ import sys
 import platform
 import re
 import errno
+import shutil
+import io
+import copy
+import time
 
 import posix1e
 from posix1e import *
@@ -45,6 +49,9 @@ M0755 = 493 # octal 755
 # Check if running under Python 3
 IS_PY_3K = sys.hexversion >= 0x03000000
 
+# Check if running on Linux, where the kernel specific parts are built
+HAS_LINUX = platform.system() == "Linux"
+
 def _skip_test(fn):
     """Wrapper to skip a test"""
     new_fn = lambda x: None
@@ -81,6 +88,7 @@ class aclTest:
         """set up function"""
         self.rmfiles = []
         self.rmdirs = []
+        self.rmtrees = []
 
     def tearDown(self):
         """tear down function"""
@@ -88,6 +96,8 @@ class aclTest:
             os.unlink(fname)
         for dname in self.rmdirs:
             os.rmdir(dname)
+        for dname in self.rmtrees:
+            shutil.rmtree(dname)
 
     def _getfile(self):
         """create a temp file"""
@@ -101,6 +111,15 @@ class aclTest:
         self.rmdirs.append(dname)
         return dname
 
+    def _gettree(self):
+        """create a small directory tree"""
+        dname = tempfile.mkdtemp(".test", "xattr-", TEST_DIR)
+        self.rmtrees.append(dname)
+        os.mkdir(os.path.join(dname, "sub"))
+        for name in "a", "b", os.path.join("sub", "c"):
+            open(os.path.join(dname, name), "w").close()
+        return dname
+
     def _getsymlink(self):
         """create a symlink"""
         fh, fname = self._getfile()
@@ -392,5 +411,1186 @@ class ModificationTests(aclTest, unittest.TestCase):
                     e.qualifier = qualifier
 
 
+class SnapshotTests(aclTest, unittest.TestCase):
+    """Tree snapshot tests"""
+
+    @has_ext(HAS_SNAPSHOT)
+    def testSnapshot(self):
+        """Test saving and looking up a tree snapshot"""
+        tree = self._gettree()
+        ext_acl = posix1e.ACL(text="u::rw,g::r,o::-,u:0:r,m::r")
+        ext_acl.applyto(os.path.join(tree, "a"))
+        def_acl = posix1e.ACL(text="u::rwx,g::rx,o::-,g:0:rx,m::rx")
+        def_acl.applyto(os.path.join(tree, "sub"), ACL_TYPE_DEFAULT)
+        _, fname = self._getfile()
+        stats = posix1e.snapshot(tree, fname)
+        self.assertEqual(stats["paths"], 5)
+        self.assertEqual(stats["errors"], [])
+        snap = posix1e.Snapshot(fname)
+        self.assertEqual(len(snap), 5)
+        for path in ".", "a", "b", "sub", "sub/c":
+            self.assertTrue(path in snap)
+            acl, default = snap.lookup(path)
+            self.assertEqual(acl, posix1e.ACL(file=os.path.join(tree, path)))
+        self.assertEqual(snap.lookup("a")[0], ext_acl)
+        self.assertEqual(snap.lookup("sub/")[1], def_acl)
+        self.assertEqual(snap.lookup("b")[1], None)
+        ino = os.stat(os.path.join(tree, "sub", "c")).st_ino
+        self.assertEqual(snap.lookup_inode(ino), ["sub/c"])
+        self.assertFalse("missing" in snap)
+        self.assertRaises(KeyError, snap.lookup, "missing")
+        key = b"sub/"
+        self.assertTrue(key in snap)
+        self.assertEqual(key, b"sub/")
+
+    @has_ext(HAS_SNAPSHOT)
+    def testSnapshotDedup(self):
+        """Test that identical ACLs are stored once"""
+        tree = self._gettree()
+        _, fname = self._getfile()
+        os.chmod(tree, M0755)
+        os.chmod(os.path.join(tree, "sub"), M0755)
+        for name in "a", "b", os.path.join("sub", "c"):
+            os.chmod(os.path.join(tree, name), M0644)
+        self.assertEqual(posix1e.snapshot(tree, fname)["acls"], 2)
+
+    @has_ext(HAS_SNAPSHOT)
+    def testSnapshotDelta(self):
+        """Test incremental snapshots and merging them"""
+        tree = self._gettree()
+        ext_acl = posix1e.ACL(text="u::rw,g::r,o::-,u:0:r,m::r")
+        _, full = self._getfile()
+        _, delta1 = self._getfile()
+        _, delta2 = self._getfile()
+        _, merged = self._getfile()
+        posix1e.snapshot(tree, full)
+        ext_acl.applyto(os.path.join(tree, "sub", "c"))
+        os.unlink(os.path.join(tree, "b"))
+        stats = posix1e.snapshot(tree, delta1, base=full)
+        # the root changed too, as an entry was removed from it, and sub
+        # is saved again because its digest changed
+        self.assertEqual((stats["paths"], stats["reused"], stats["deleted"]),
+                         (4, 2, 1))
+        snap = posix1e.Snapshot(delta1)
+        self.assertTrue(snap.delta)
+        self.assertEqual(snap.lookup("sub/c")[0], ext_acl)
+        self.assertFalse("b" in snap)
+        self.assertFalse("a" in snap)
+        # the deletion record of b isn't an entry
+        self.assertEqual(len(snap), 3)
+        self.assertEqual(posix1e.merge_snapshots(merged, [full, delta1]), 4)
+        snap = posix1e.Snapshot(merged)
+        self.assertFalse(snap.delta)
+        self.assertEqual(snap.lookup("sub/c")[0], ext_acl)
+        self.assertFalse("b" in snap)
+        # a chain of deltas, and a delta on top of a merged snapshot
+        open(os.path.join(tree, "sub", "d"), "w").close()
+        stats = posix1e.snapshot(tree, delta2, base=[full, delta1])
+        self.assertEqual(stats["deleted"], 0)
+        self.assertTrue("sub/d" in posix1e.Snapshot(delta2))
+        self.assertEqual(posix1e.merge_snapshots(merged, [merged, delta2]), 5)
+        self.assertRaises(ValueError, posix1e.snapshot, tree, delta2,
+                          base=[full, delta2])
+        stats = posix1e.snapshot(tree, full, base=merged, delta=False)
+        self.assertEqual((stats["paths"], stats["reused"]), (5, 5))
+
+    @has_ext(HAS_SNAPSHOT)
+    def testTreeDigest(self):
+        """Test tree digests"""
+        tree = self._gettree()
+        _, full = self._getfile()
+        _, delta = self._getfile()
+        _, merged = self._getfile()
+        digest = posix1e.tree_digest(tree)
+        self.assertEqual(posix1e.tree_digest(tree), digest)
+        posix1e.snapshot(tree, full)
+        self.assertEqual(posix1e.Snapshot(full).digest("."), digest)
+        ext_acl = posix1e.ACL(text="u::rw,g::r,o::-,u:0:r,m::r")
+        ext_acl.applyto(os.path.join(tree, "sub", "c"))
+        new_digest = posix1e.tree_digest(tree)
+        self.assertNotEqual(new_digest, digest)
+        snap = posix1e.Snapshot(full)
+        posix1e.snapshot(tree, delta, base=snap)
+        posix1e.merge_snapshots(merged, [snap, delta])
+        snap = posix1e.Snapshot(merged)
+        self.assertEqual(snap.digest("."), new_digest)
+        self.assertEqual(snap.digest("a"), posix1e.Snapshot(full).digest("a"))
+        self.assertRaises(KeyError, snap.digest, "missing")
+
+    @has_ext(HAS_SNAPSHOT)
+    def testDiffSnapshots(self):
+        """Test comparing snapshots"""
+        tree = self._gettree()
+        _, old = self._getfile()
+        _, new = self._getfile()
+        os.mkdir(os.path.join(tree, "sub2"))
+        open(os.path.join(tree, "sub2", "e"), "w").close()
+        posix1e.snapshot(tree, old)
+        self.assertEqual(posix1e.diff_snapshots(old, old), [])
+        posix1e.ACL(text="u::rw,g::r,o::-,u:0:r,m::r").applyto(
+            os.path.join(tree, "sub", "c"))
+        os.unlink(os.path.join(tree, "b"))
+        os.mkdir(os.path.join(tree, "sub", "d"))
+        posix1e.snapshot(tree, new)
+        self.assertEqual(posix1e.diff_snapshots(old, posix1e.Snapshot(new)),
+                         [("b", "removed"), ("sub/c", "changed"),
+                          ("sub/d", "added")])
+
+    @has_ext(HAS_SNAPSHOT)
+    def testSnapshotInvalid(self):
+        """Test opening an invalid snapshot"""
+        fd, fname = self._getfile()
+        os.write(fd, "not a snapshot".encode() * 10)
+        os.close(fd)
+        self.assertRaises(IOError, posix1e.Snapshot, fname)
+
+
+class RestoreTests(aclTest, unittest.TestCase):
+    """Tree restore tests"""
+
+    @has_ext(HAS_SNAPSHOT)
+    def testRestoreSnapshot(self):
+        """Test restoring ACLs from a snapshot"""
+        tree = self._gettree()
+        ext_acl = posix1e.ACL(text="u::rw,g::r,o::-,u:0:r,m::r")
+        def_acl = posix1e.ACL(text="u::rwx,g::rx,o::-,g:0:rx,m::rx")
+        ext_acl.applyto(os.path.join(tree, "sub", "c"))
+        def_acl.applyto(os.path.join(tree, "sub"), ACL_TYPE_DEFAULT)
+        _, fname = self._getfile()
+        posix1e.snapshot(tree, fname)
+        posix1e.ACL(text=BASIC_ACL_TEXT).applyto(os.path.join(tree, "sub",
+                                                              "c"))
+        posix1e.delete_default(os.path.join(tree, "sub"))
+        stats = posix1e.restore(fname, tree, threads=4)
+        self.assertEqual(stats, {"applied": 2, "skipped": 3, "errors": []})
+        self.assertEqual(posix1e.ACL(file=os.path.join(tree, "sub", "c")),
+                         ext_acl)
+        self.assertEqual(posix1e.ACL(filedef=os.path.join(tree, "sub")),
+                         def_acl)
+        stats = posix1e.restore(posix1e.Snapshot(fname), tree)
+        self.assertEqual(stats["skipped"], 5)
+
+    @has_ext(HAS_LINUX)
+    def testRestoreDump(self):
+        """Test restoring ACLs from a getfacl dump"""
+        tree = self._gettree()
+        fd, fname = self._getfile()
+        os.write(fd, "# file: sub\n# owner: root\ndefault:user::rwx\n"
+                 "default:group::r-x\ndefault:group:0:r-x\n"
+                 "default:mask::r-x\ndefault:other::---\n"
+                 "user::rwx\ngroup::r-x\nother::---\n\n"
+                 "# file: sub/c\nuser::rw-\nuser:0:r--\n"
+                 "group::r--\t#effective:r--\nmask::r--\nother::---\n\n"
+                 "# file: missing\nuser::rw-\ngroup::r--\nother::---\n"
+                 .encode())
+        os.close(fd)
+        stats = posix1e.restore(fname, tree, threads=1, skip_identical=False)
+        self.assertEqual(stats["applied"], 2)
+        self.assertEqual([e[:2] for e in stats["errors"]],
+                         [("missing", errno.ENOENT)])
+        self.assertEqual(posix1e.ACL(file=os.path.join(tree, "sub", "c")),
+                         posix1e.ACL(text="u::rw,u:0:r,g::r,m::r,o::-"))
+        self.assertEqual(posix1e.ACL(filedef=os.path.join(tree, "sub")),
+                         posix1e.ACL(text="u::rwx,g::rx,g:0:rx,m::rx,o::-"))
+
+    @has_ext(HAS_LINUX)
+    def testRestoreUnknownName(self):
+        """Test restoring a dump naming an unknown user"""
+        tree = self._gettree()
+        fd, fname = self._getfile()
+        os.write(fd, "# file: a\nuser::rw-\nuser:no-such-user-4242:r--\n"
+                 "group::r--\nmask::r--\nother::---\n\n"
+                 "# file: b\nuser::rw-\ngroup::r--\nother::r--\n"
+                 .encode())
+        os.close(fd)
+        stats = posix1e.restore(fname, tree, threads=1, skip_identical=False)
+        self.assertEqual(stats["applied"], 1)
+        self.assertEqual([e[:2] for e in stats["errors"]],
+                         [("a", errno.EINVAL)])
+        self.assertEqual(posix1e.ACL(file=os.path.join(tree, "b")),
+                         posix1e.ACL(text="u::rw,g::r,o::r"))
+
+    @has_ext(HAS_LINUX)
+    def testRestoreBadDump(self):
+        """Test restoring from an invalid dump"""
+        tree = self._getdir()
+        fd, fname = self._getfile()
+        os.write(fd, "# file: .\nuser::rw-\nbogus::r\n".encode())
+        os.close(fd)
+        self.assertRaises(ValueError, posix1e.restore, fname, tree)
+
+
+class DumpTests(aclTest, unittest.TestCase):
+    """getfacl text codec tests"""
+
+    @has_ext(HAS_SNAPSHOT)
+    def testDump(self):
+        """Test dumping a tree as text"""
+        tree = self._gettree()
+        ext_acl = posix1e.ACL(text="u::rw,g::r,o::-,u:0:r,m::r")
+        ext_acl.applyto(os.path.join(tree, "a"))
+        posix1e.ACL(text="u::rwx,g::rx,o::-").applyto(
+            os.path.join(tree, "sub"), ACL_TYPE_DEFAULT)
+        os.chmod(os.path.join(tree, "b"), M0644 | 0x200)
+        out = io.BytesIO()
+        stats = posix1e.dump(tree, out, numeric=True)
+        self.assertEqual(stats, {"paths": 5, "errors": []})
+        text = out.getvalue().decode()
+        self.assertTrue("# file: a\n# owner: %d\n# group: %d\nuser::rw-\n"
+                        "user:0:r--\ngroup::r--\nmask::r--\nother::---\n\n" %
+                        (os.getuid(), os.getgid()) in text)
+        self.assertTrue("# flags: --t\n" in text)
+        self.assertTrue("default:user::rwx\ndefault:group::r-x\n"
+                        "default:other::---\n" in text)
+        fd, fname = self._getfile()
+        posix1e.dump(tree, fd)
+        os.close(fd)
+        with open(fname) as f:
+            self.assertTrue("user:root:r--\n" in f.read())
+        _, sname = self._getfile()
+        posix1e.snapshot(tree, sname)
+        out = io.BytesIO()
+        posix1e.dump(posix1e.Snapshot(sname), out, numeric=True)
+        self.assertFalse("# owner:" in out.getvalue().decode())
+        self.assertRaises(TypeError, posix1e.dump, tree, None)
+
+    @has_ext(HAS_LINUX)
+    def testDumpReader(self):
+        """Test parsing a dump"""
+        tree = self._gettree()
+        ext_acl = posix1e.ACL(text="u::rw,g::r,o::-,u:0:r,m::r")
+        ext_acl.applyto(os.path.join(tree, "sub", "c"))
+        def_acl = posix1e.ACL(text="u::rwx,g::rx,o::-")
+        def_acl.applyto(os.path.join(tree, "sub"), ACL_TYPE_DEFAULT)
+        out = io.BytesIO()
+        posix1e.dump(tree, out)
+        out.seek(0)
+        records = list(posix1e.DumpReader(out))
+        self.assertEqual([r[0] for r in records],
+                         [".", "a", "b", "sub", "sub/c"])
+        for path, acl, default in records:
+            self.assertEqual(acl, posix1e.ACL(file=os.path.join(tree, path)))
+        self.assertEqual(records[3][2], def_acl)
+        self.assertEqual(records[4][1], ext_acl)
+        self.assertEqual(records[4][2], None)
+        bad = io.BytesIO("# file: x\nuser::rw-\nbogus::r\n".encode())
+        self.assertRaises(ValueError, list, posix1e.DumpReader(bad))
+        # the reads from a pipe let the writer thread run
+        import threading
+        rfd, wfd = os.pipe()
+        def writer():
+            for line in out.getvalue().splitlines(True):
+                os.write(wfd, line)
+            os.close(wfd)
+        thread = threading.Thread(target=writer)
+        thread.start()
+        try:
+            piped = list(posix1e.DumpReader(rfd))
+        finally:
+            thread.join()
+            os.close(rfd)
+        self.assertEqual(piped, records)
+
+
+class ExportTests(aclTest, unittest.TestCase):
+    """NDJSON and CSV export tests"""
+
+    @has_ext(HAS_LINUX)
+    def testExportNdjson(self):
+        """Test exporting a tree as NDJSON"""
+        import json
+        tree = self._gettree()
+        ext_acl = posix1e.ACL(text="u::rw,g::rw,o::-,u:0:rw,m::r")
+        ext_acl.applyto(os.path.join(tree, "a"))
+        out = io.BytesIO()
+        stats = posix1e.export(tree, out, names=True)
+        self.assertEqual(stats, {"paths": 5, "errors": []})
+        records = [json.loads(line) for line in
+                   out.getvalue().decode().splitlines()]
+        self.assertEqual(len(records), 5)
+        rec = [r for r in records if r["path"] == "a"][0]
+        self.assertEqual(rec["type"], "access")
+        self.assertEqual(rec["entries"][1],
+                         {"tag": "user", "qualifier": 0, "name": "root",
+                          "perms": "rw-", "effective": "r--"})
+        self.assertEqual(rec["entries"][2]["effective"], "r--")
+        self.assertEqual(rec["entries"][0]["effective"], "rw-")
+        self.assertRaises(ValueError, posix1e.export, tree, out,
+                          format="xml")
+
+    @has_ext(HAS_SNAPSHOT)
+    def testExportCsv(self):
+        """Test exporting a snapshot as CSV"""
+        tree = self._gettree()
+        posix1e.ACL(text="u::rwx,g::rx,o::-").applyto(
+            os.path.join(tree, "sub"), ACL_TYPE_DEFAULT)
+        os.rename(os.path.join(tree, "b"), os.path.join(tree, "b,\"c"))
+        _, sname = self._getfile()
+        posix1e.snapshot(tree, sname)
+        fd, fname = self._getfile()
+        posix1e.export(posix1e.Snapshot(sname), fd, format="csv")
+        os.close(fd)
+        with open(fname) as f:
+            lines = f.read().splitlines()
+        self.assertEqual(lines[0], "path,type,tag,qualifier,perms,effective")
+        self.assertEqual(len(lines), 1 + 6 * 3)
+        self.assertTrue('"b,""c",access,user_obj,,rw-,rw-' in lines)
+        self.assertTrue("sub,default,group_obj,,r-x,r-x" in lines)
+
+
+class WatcherTests(aclTest, unittest.TestCase):
+    """ACL change watcher tests"""
+
+    def _collect(self, watcher, paths, timeout=10):
+        """Reads batches until all the paths are reported, and no more
+        changes come.
+
+        The coalescing window may close early on a loaded system and
+        split the changes across batches, so these are merged: each
+        path maps to its first old fingerprint and its latest ACLs.
+        """
+        seen = {}
+        deadline = time.time() + timeout
+        while time.time() < deadline:
+            batch = watcher.read(0.1)
+            if not batch and set(paths) <= set(seen):
+                break
+            for path, old, acl, default in batch:
+                if path in seen:
+                    old = seen[path][0]
+                seen[path] = (old, acl, default)
+        return seen
+
+    @has_ext(HAS_LINUX)
+    def testWatcher(self):
+        """Test watching a tree for ACL changes"""
+        tree = self._gettree()
+        watcher = posix1e.Watcher(tree, delay=0.01)
+        self.assertEqual(watcher.backend, "inotify")
+        self.assertEqual(watcher.read(0), [])
+        ext_acl = posix1e.ACL(text="u::rw,g::r,o::-,u:0:r,m::r")
+        ext_acl.applyto(os.path.join(tree, "a"))
+        c = os.path.join(tree, "sub", "c")
+        os.chmod(c, M0755)
+        os.chmod(c, M0644)
+        seen = self._collect(watcher, ["a"])
+        self.assertNotEqual(seen["a"][0], None)
+        self.assertEqual(seen["a"][1:], (ext_acl, None))
+        # the changes of c cancel out, within a batch or across them
+        if "sub/c" in seen:
+            self.assertEqual(seen["sub/c"][1], posix1e.ACL(file=c))
+        os.mkdir(os.path.join(tree, "sub", "new"))
+        os.unlink(os.path.join(tree, "b"))
+        seen = self._collect(watcher, ["b", "sub/new"])
+        self.assertEqual(sorted((k, v[0] is None, v[1] is None)
+                                for k, v in seen.items()),
+                         [("b", False, True), ("sub/new", True, False)])
+        watcher.close()
+        self.assertRaises(ValueError, watcher.read)
+        self.assertRaises(ValueError, posix1e.Watcher, tree, "dnotify")
+
+
+class MirrorTests(aclTest, unittest.TestCase):
+    """ACL mirror tests"""
+
+    @has_ext(HAS_LINUX)
+    def testMirror(self):
+        """Test mirroring ACL changes to another tree"""
+        source = self._gettree()
+        target = self._gettree()
+        def_acl = posix1e.ACL(text="u::rwx,g::rx,o::-")
+        def_acl.applyto(os.path.join(source, "sub"), ACL_TYPE_DEFAULT)
+        mirror = posix1e.Mirror(source, target, delay=0.01)
+        self.assertEqual(mirror.sync(), 1)
+        self.assertEqual(posix1e.ACL(filedef=os.path.join(target, "sub")),
+                         def_acl)
+        ext_acl = posix1e.ACL(text="u::rw,g::r,o::-,u:0:r,m::r")
+        for mode in (M0755, M0644):
+            ext_acl.applyto(os.path.join(source, "a"))
+            os.chmod(os.path.join(source, "a"), mode)
+        posix1e.delete_default(os.path.join(source, "sub"))
+        self.assertEqual(mirror.step(5), 2)
+        self.assertEqual(posix1e.ACL(file=os.path.join(target, "a")),
+                         posix1e.ACL(file=os.path.join(source, "a")))
+        self.assertFalse(posix1e.has_extended(os.path.join(target, "sub")))
+        stats = mirror.stats
+        self.assertEqual((stats["batches"], stats["failed"]), (1, 0))
+        self.assertEqual(stats["pending"], 0)
+        self.assertTrue(stats["lag"] >= 0)
+        mirror.close()
+        self.assertRaises(ValueError, mirror.step, 0)
+
+    @has_ext(HAS_LINUX)
+    def testMirrorThrottle(self):
+        """Test the back-pressure of max_pending"""
+        source = self._gettree()
+        target = self._gettree()
+        os.unlink(os.path.join(target, "b"))
+        mirror = posix1e.Mirror(source, target, delay=60, max_pending=2)
+        self.assertEqual(mirror.sync(), 0)
+        stats = mirror.stats
+        self.assertEqual(stats["failed"], 1)
+        self.assertEqual([e[:2] for e in mirror.errors], [("b", errno.ENOENT)])
+        ext_acl = posix1e.ACL(text="u::rw,g::r,o::-,u:0:r,m::r")
+        for name in "a", "b", os.path.join("sub", "c"), "sub":
+            ext_acl.applyto(os.path.join(source, name))
+        # the window is long, but each batch stops at two paths, and
+        # the events left are kept for the next one
+        self.assertEqual(mirror.step(), 2)
+        self.assertEqual(mirror.stats["pending"], 0)
+        self.assertEqual(mirror.step(), 2)
+        stats = mirror.stats
+        self.assertEqual((stats["batches"], stats["throttled"]), (2, 2))
+        self.assertEqual((stats["applied"], stats["failed"]), (3, 2))
+        for name in "a", os.path.join("sub", "c"), "sub":
+            self.assertEqual(posix1e.ACL(file=os.path.join(target, name)),
+                             ext_acl)
+
+    @has_ext(HAS_LINUX)
+    def testMirrorRun(self):
+        """Test running a mirror in a thread"""
+        import threading
+        source = self._gettree()
+        target = self._gettree()
+        mirror = posix1e.Mirror(source, target, delay=0.01)
+        thread = threading.Thread(target=mirror.run)
+        thread.start()
+        try:
+            ext_acl = posix1e.ACL(text="u::rw,g::r,o::-,u:0:r,m::r")
+            ext_acl.applyto(os.path.join(source, "a"))
+            deadline = time.time() + 10
+            while (posix1e.ACL(file=os.path.join(target, "a")) != ext_acl
+                   and time.time() < deadline):
+                time.sleep(0.01)
+            self.assertEqual(posix1e.ACL(file=os.path.join(target, "a")),
+                             ext_acl)
+            self.assertRaises(ValueError, mirror.close)
+            self.assertRaises(ValueError, mirror.step, 0)
+        finally:
+            mirror.stop()
+            thread.join(10)
+        self.assertFalse(thread.is_alive())
+        self.assertEqual(mirror.stats["applied"], 1)
+        mirror.close()
+
+
+class IndexTests(aclTest, unittest.TestCase):
+    """Principal index tests"""
+
+    @has_ext(HAS_LINUX)
+    def testIndex(self):
+        """Test building and querying a principal index"""
+        tree = self._gettree()
+        acl1 = posix1e.ACL(text="u::rw,g::r,o::-,u:4242:rw,g:4243:rwx,m::r")
+        acl1.applyto(os.path.join(tree, "a"))
+        acl1.applyto(os.path.join(tree, "sub", "c"))
+        posix1e.ACL(text="u::rw,g::r,o::-,u:4242:rwx,m::rwx").applyto(
+            os.path.join(tree, "b"))
+        _, iname = self._getfile()
+        stats = posix1e.build_index(tree, iname)
+        self.assertEqual((stats["paths"], stats["acls"]), (5, 4))
+        idx = posix1e.AclIndex(iname)
+        self.assertEqual(len(idx), 5)
+        self.assertTrue(("group", 4243) in idx.principals())
+        self.assertEqual(idx.query(user=4242),
+                         [("a", 4), ("b", 7), ("sub/c", 4)])
+        self.assertEqual(idx.query(user=4242, perms=posix1e.ACL_WRITE),
+                         [("b", 7)])
+        self.assertEqual(idx.query(group=4243), [("a", 4), ("sub/c", 4)])
+        owned = idx.query(user=os.getuid())
+        self.assertEqual([path for (path, perms) in owned],
+                         [".", "a", "b", "sub", "sub/c"])
+        self.assertEqual(idx.query(user=4244), [])
+        self.assertRaises(ValueError, idx.query)
+
+    @has_ext(HAS_LINUX)
+    def testIndexIncremental(self):
+        """Test updating a principal index"""
+        tree = self._gettree()
+        _, iname = self._getfile()
+        posix1e.build_index(tree, iname)
+        acl1 = posix1e.ACL(text="u::rw,g::r,o::-,u:4242:rw,m::rw")
+        acl1.applyto(os.path.join(tree, "sub", "c"))
+        stats = posix1e.build_index(tree, iname, base=iname)
+        self.assertEqual((stats["paths"], stats["reused"]), (5, 4))
+        idx = posix1e.AclIndex(iname)
+        self.assertEqual(idx.query(user=4242), [("sub/c", 6)])
+
+    @has_ext(HAS_LINUX)
+    def testIndexSearch(self):
+        """Test searching a principal index for grants"""
+        tree = self._gettree()
+        for name in ".", "sub", "a", "b", "sub/c":
+            os.chmod(os.path.join(tree, name), 0o700)
+        acl1 = posix1e.ACL(text="u::rw,g::r,o::-,g:4243:rw,m::rw")
+        acl1.applyto(os.path.join(tree, "sub", "c"))
+        _, iname = self._getfile()
+        posix1e.build_index(tree, iname)
+        idx = posix1e.AclIndex(iname)
+        uid = os.getuid()
+        self.assertEqual(idx.search(posix1e.ACL_WRITE,
+                                    exclude_users=[uid]),
+                         [("sub/c", "group", 4243, 6)])
+        self.assertEqual(idx.search(posix1e.ACL_WRITE, below="a",
+                                    exclude_users=[uid]), [])
+        self.assertEqual(idx.search(posix1e.ACL_WRITE, below="sub/",
+                                    exclude_users=[uid],
+                                    exclude_groups=[4243]), [])
+        found = idx.search(posix1e.ACL_READ, below="sub")
+        self.assertEqual([(p, k, i) for (p, k, i, _) in found],
+                         [("sub", "user", uid), ("sub/c", "user", uid),
+                          ("sub/c", "group", os.getgid()),
+                          ("sub/c", "group", 4243)])
+        self.assertEqual(len(idx.search(0)), 7)
+        self.assertRaises(KeyError, idx.search, 0, "missing")
+
+
+class AccessTests(aclTest, unittest.TestCase):
+    """path-chain access evaluation tests"""
+
+    @has_ext(HAS_LINUX)
+    def testCheckAccess(self):
+        """Test evaluating the access of a user along paths"""
+        tree = os.path.realpath(self._gettree())
+        if posix1e.check_access(tree, 4242, perms=0) is not None:
+            self.skipTest("the test directory isn't searchable by others")
+        a, b = os.path.join(tree, "a"), os.path.join(tree, "b")
+        os.chmod(tree, 0o700)
+        os.chmod(a, 0o600)
+        os.chmod(b, 0o600)
+        self.assertEqual(posix1e.check_access(a, 4242),
+                         (tree, errno.EACCES))
+        posix1e.ACL(text="u::rwx,g::-,o::-,u:4242:x,m::x").applyto(tree)
+        self.assertEqual(posix1e.check_access(a, 4242), (a, errno.EACCES))
+        posix1e.ACL(text="u::rw,g::-,o::-,u:4242:r,m::r").applyto(a)
+        posix1e.ACL(text="u::rw,g::-,o::-,g:4243:rw,m::rw").applyto(b)
+        self.assertEqual(posix1e.check_access(a, 4242), None)
+        self.assertEqual(posix1e.check_access(a, 4242,
+                                              perms=posix1e.ACL_WRITE),
+                         (a, errno.EACCES))
+        self.assertEqual(posix1e.check_access(b, 4242, groups=[4243],
+                                              perms=posix1e.ACL_WRITE),
+                         None)
+        missing = os.path.join(tree, "missing", "x")
+        self.assertEqual(posix1e.check_access([a, b, missing], 4242),
+                         [None, (b, errno.EACCES),
+                          (os.path.join(tree, "missing"), errno.ENOENT)])
+        # the path is walked as given: .. and the links are looked up in
+        # the directories they're in, which must be searchable
+        sub = os.path.join(tree, "sub")
+        os.chmod(sub, 0o700)
+        os.symlink(os.path.join("sub", "..", "a"), os.path.join(tree, "l"))
+        os.symlink("l", os.path.join(tree, "l2"))
+        os.symlink("loop", os.path.join(tree, "loop"))
+        self.assertEqual(posix1e.check_access(os.path.join(sub, "..", "a"),
+                                              4242),
+                         (sub, errno.EACCES))
+        self.assertEqual(posix1e.check_access(os.path.join(tree, "l2"),
+                                              4242),
+                         (sub, errno.EACCES))
+        self.assertEqual(posix1e.check_access(os.path.join(tree, "loop"),
+                                              4242),
+                         (os.path.join(tree, "loop"), errno.ELOOP))
+        self.assertEqual(posix1e.check_access(os.path.join(a, "x"), 4242),
+                         (a, errno.ENOTDIR))
+        os.chmod(sub, 0o711)
+        self.assertEqual(posix1e.check_access(os.path.join(tree, "l2"),
+                                              4242),
+                         None)
+        posix1e.ACL(text="u::rw,g::-,o::-,u:4242:r,m::-").applyto(a)
+        self.assertEqual(posix1e.check_access([a], 4242),
+                         [(a, errno.EACCES)])
+
+
+class PrincipalCacheTests(aclTest, unittest.TestCase):
+    """principal cache tests"""
+
+    @has_ext(HAS_LINUX)
+    def testPreload(self):
+        """Test a hermetic principal cache"""
+        cache = posix1e.PrincipalCache(preload={4242: (4242, [4243])},
+                                       nss=False)
+        self.assertEqual(len(cache), 1)
+        self.assertEqual(cache.resolve(4242), (4242, [4243]))
+        self.assertRaises(KeyError, cache.resolve, 4244)
+        cache.preload({4244: (1, ())})
+        self.assertEqual(cache.resolve(4244), (1, []))
+        self.assertEqual(cache.stats["hits"], 2)
+        self.assertEqual(cache.stats["misses"], 1)
+        self.assertRaises(TypeError, cache.preload, {1: 2})
+        cache.clear()
+        self.assertEqual(len(cache), 0)
+
+    @has_ext(HAS_LINUX)
+    def testResolve(self):
+        """Test resolving users through NSS"""
+        cache = posix1e.PrincipalCache(max_size=1)
+        gid, groups = cache.resolve(os.getuid())
+        self.assertTrue(gid in groups)
+        self.assertEqual(cache.resolve(os.getuid()), (gid, groups))
+        self.assertEqual(cache.stats["misses"], 1)
+        cache.resolve(0)
+        self.assertEqual(len(cache), 1)
+        # preloaded entries don't count towards max_size
+        cache = posix1e.PrincipalCache(max_size=1,
+                                       preload={4242: (4242, [4243])})
+        cache.resolve(os.getuid())
+        self.assertEqual((len(cache), cache.stats["evictions"]), (2, 0))
+        self.assertRaises(KeyError, cache.resolve, 4299)
+        self.assertEqual((len(cache), cache.stats["evictions"]), (2, 1))
+        self.assertEqual(cache.resolve(4242), (4242, [4243]))
+
+    @has_ext(HAS_LINUX)
+    def testEvaluation(self):
+        """Test evaluating access with a principal cache"""
+        tree = os.path.realpath(self._gettree())
+        b = os.path.join(tree, "b")
+        posix1e.ACL(text="u::rwx,g::-,o::x").applyto(tree)
+        posix1e.ACL(text="u::rw,g::-,o::-,g:4243:rw,m::rw").applyto(b)
+        cache = posix1e.PrincipalCache(preload={4242: (4242, [4243])},
+                                       nss=False)
+        if posix1e.check_access(tree, 4242, perms=0) is None:
+            self.assertEqual(posix1e.check_access(b, 4242, cache=cache),
+                             None)
+            # the primary group is taken into account, even if the
+            # preloaded groups don't list it
+            cache.preload({4246: (4243, [])})
+            self.assertEqual(posix1e.check_access(b, 4246, cache=cache),
+                             None)
+        _, iname = self._getfile()
+        posix1e.build_index(tree, iname)
+        idx = posix1e.AclIndex(iname)
+        self.assertEqual(idx.query(user=4242), [])
+        self.assertEqual(idx.query(user=4242, cache=cache), [("b", 6)])
+        self.assertRaises(KeyError, idx.query, user=4244, cache=cache)
+        # a single group entry must grant all the wanted permissions
+        posix1e.ACL(text="u::rw,g::-,o::-,g:4243:r,g:4244:w,m::rw").applyto(
+            os.path.join(tree, "a"))
+        posix1e.build_index(tree, iname)
+        idx = posix1e.AclIndex(iname)
+        cache.preload({4245: (4245, [4243, 4244])})
+        self.assertEqual(idx.query(user=4245, cache=cache),
+                         [("a", 6), ("b", 6)])
+        self.assertEqual(idx.query(user=4245, cache=cache,
+                                   perms=posix1e.ACL_READ |
+                                   posix1e.ACL_WRITE),
+                         [("b", 6)])
+        self.assertEqual(idx.query(user=4245, cache=cache,
+                                   perms=posix1e.ACL_WRITE),
+                         [("a", 6), ("b", 6)])
+
+
+class RedundancyTests(aclTest, unittest.TestCase):
+    """redundant entries tests"""
+
+    @has_ext(HAS_LINUX)
+    def testRedundant(self):
+        """Test finding the entries that have no effect"""
+        acl = posix1e.ACL(text="u::rw,g::r,o::r,u:4242:r,g:4243:rw,m::r")
+        self.assertEqual(acl.redundant(),
+                         [(posix1e.ACL_USER, 4242, 4, "shadowed"),
+                          (posix1e.ACL_GROUP, 4243, 6, "shadowed"),
+                          (posix1e.ACL_MASK, None, 4, "unneeded")])
+        self.assertEqual(acl.minimize(),
+                         posix1e.ACL(text="u::rw,g::r,o::r"))
+        acl = posix1e.ACL(text="u::rw,g::-,o::-,u:4242:w,u:4244:r,m::r")
+        self.assertEqual(acl.redundant(),
+                         [(posix1e.ACL_USER, 4242, 2, "masked")])
+        self.assertEqual(acl.minimize(),
+                         posix1e.ACL(text="u::rw,g::-,o::-,u:4244:r,m::r"))
+        acl = posix1e.ACL(text="u::rw,g::r,o::-,u:4242:r,m::r")
+        self.assertEqual(acl.redundant(), [])
+        self.assertEqual(acl.minimize(), acl)
+
+    @has_ext(HAS_LINUX)
+    def testFindRedundant(self):
+        """Test finding redundant entries in a tree"""
+        tree = self._gettree()
+        acl = posix1e.ACL(text="u::rw,g::r,o::r,u:4242:r,m::r")
+        for name in "a", "b":
+            acl.applyto(os.path.join(tree, name))
+        stats = posix1e.find_redundant(tree)
+        self.assertEqual(stats["paths"], 5)
+        self.assertEqual(stats["redundant"], 4)
+        self.assertEqual(stats["bytes"], 32)
+        self.assertEqual([(p, t) for (p, t, _) in stats["found"]],
+                         [("a", posix1e.ACL_TYPE_ACCESS),
+                          ("b", posix1e.ACL_TYPE_ACCESS)])
+        self.assertEqual(stats["found"][0][2], acl.redundant())
+        self.assertEqual(stats["errors"], [])
+
+
+class AlgebraTests(unittest.TestCase):
+    """ACL set algebra tests"""
+
+    @has_ext(HAS_LINUX)
+    def testAlgebra(self):
+        """Test the union, intersection and difference of ACLs"""
+        a = posix1e.ACL(text="u::rw,g::r,o::-,u:4242:rwx,m::rw")
+        b = posix1e.ACL(text="u::r,g::rw,o::r,g:4243:r,m::rwx")
+        self.assertEqual(a | b, posix1e.ACL(
+            text="u::rw,g::rw,o::r,u:4242:rw,g:4243:r,m::rw"))
+        self.assertEqual(a & b, posix1e.ACL(text="u::r,g::r,o::-"))
+        self.assertEqual(a - b, posix1e.ACL(
+            text="u::w,g::-,o::-,u:4242:rw,m::rw"))
+        self.assertEqual(b - b, posix1e.ACL(
+            text="u::-,g::-,o::-,g:4243:-,m::-"))
+        self.assertTrue((a | b).valid())
+        self.assertRaises(TypeError, lambda: a | 1)
+
+
+class LookupTests(unittest.TestCase):
+    """Keyed entry lookup tests"""
+
+    @has_ext(HAS_ACL_ENTRY)
+    def testFind(self):
+        """Test finding entries by tag and qualifier"""
+        acl = posix1e.ACL(text="u::rw,g::r,o::-,u:4242:rwx,g:4243:r,m::rwx")
+        e = acl.find(posix1e.ACL_USER, 4242)
+        self.assertEqual((e.tag_type, e.qualifier),
+                         (posix1e.ACL_USER, 4242))
+        self.assertTrue(e.permset.execute)
+        self.assertEqual(acl.find(posix1e.ACL_OTHER).tag_type,
+                         posix1e.ACL_OTHER)
+        self.assertEqual(acl.find(posix1e.ACL_GROUP, 4242), None)
+        self.assertRaises(ValueError, acl.find, posix1e.ACL_USER)
+        self.assertRaises(ValueError, acl.find, posix1e.ACL_MASK, 1)
+        e.qualifier = 4244
+        self.assertEqual(acl.find(posix1e.ACL_USER, 4242), None)
+        self.assertEqual(acl.find(posix1e.ACL_USER, 4244).qualifier, 4244)
+        acl.delete_entry(acl.find(posix1e.ACL_GROUP, 4243))
+        self.assertEqual(acl.find(posix1e.ACL_GROUP, 4243), None)
+
+    @has_ext(HAS_ACL_ENTRY)
+    def testSetPerms(self):
+        """Test creating, updating and deleting entries by key"""
+        acl = posix1e.ACL(text="u::rw,g::r,o::-")
+        acl.set_perms(posix1e.ACL_USER, 4242, posix1e.ACL_READ)
+        acl.set_perms(posix1e.ACL_OTHER, None,
+                      posix1e.ACL_READ | posix1e.ACL_EXECUTE)
+        acl.set_perms(posix1e.ACL_MASK, None, posix1e.ACL_READ)
+        self.assertEqual(acl, posix1e.ACL(
+            text="u::rw,g::r,o::rx,u:4242:r,m::r"))
+        self.assertTrue(acl.valid())
+        acl.set_perms(posix1e.ACL_USER, 4242, None)
+        acl.set_perms(posix1e.ACL_USER, 4243, None)
+        self.assertEqual(acl.find(posix1e.ACL_USER, 4242), None)
+        self.assertEqual(acl, posix1e.ACL(text="u::rw,g::r,o::rx,m::r"))
+        self.assertRaises(ValueError, acl.set_perms,
+                          posix1e.ACL_OTHER, None, 8)
+
+    @has_ext(HAS_ACL_ENTRY)
+    def testSetPermsStale(self):
+        """Test deleting entries handed out before"""
+        acl = posix1e.ACL(text="u::rw,g::r,o::-,u:4242:rwx,m::rwx")
+        e = acl.find(posix1e.ACL_USER, 4242)
+        other = acl.find(posix1e.ACL_OTHER)
+        acl.set_perms(posix1e.ACL_USER, 4242, None)
+        self.assertEqual((e.tag_type, e.qualifier), (posix1e.ACL_USER, 4242))
+        self.assertTrue(e.permset.execute)
+        e.permset.clear()
+        other.permset.read = True
+        self.assertEqual(acl, posix1e.ACL(text="u::rw,g::r,o::-,m::rwx"))
+        self.assertEqual(len(acl), 4)
+
+
+class BatchModifyTests(aclTest, unittest.TestCase):
+    """Batched modification tests"""
+
+    @has_ext(HAS_LINUX and HAS_ACL_ENTRY)
+    def testModify(self):
+        """Test applying a batch of operations to an ACL"""
+        acl = posix1e.ACL(text="u::rw,g::r,o::-,u:4242:r,m::r")
+        owner = list(acl)[0]
+        acl.modify("u:4243:rwx, g:4244:5,u:4242")
+        self.assertEqual(acl, posix1e.ACL(
+            text="u::rw,g::r,o::-,u:4243:rwx,g:4244:rx,m::rwx"))
+        self.assertEqual(owner.tag_type, posix1e.ACL_USER_OBJ)
+        acl.modify([(posix1e.ACL_OTHER, None, posix1e.ACL_READ),
+                    (posix1e.ACL_MASK, None, posix1e.ACL_READ),
+                    (posix1e.ACL_USER, 4243, None)])
+        self.assertEqual(acl, posix1e.ACL(
+            text="u::rw,g::r,o::r,g:4244:rx,m::r"))
+        acl.modify("g:4245:w", calc_mask=False)
+        self.assertEqual(acl.find(posix1e.ACL_MASK).permset.write, False)
+        self.assertRaises(ValueError, acl.modify, "m:")
+        self.assertRaises(ValueError, acl.modify, "u:4242:rwx,o::,g:")
+        self.assertRaises(ValueError, acl.modify, "u:4242:rwz")
+        self.assertEqual(acl, posix1e.ACL(
+            text="u::rw,g::r,o::r,g:4244:rx,g:4245:w,m::r"))
+
+    @has_ext(HAS_LINUX and HAS_ACL_ENTRY)
+    def testModifyStale(self):
+        """Test deleting entries handed out before"""
+        acl = posix1e.ACL(text="u::rw,g::r,o::-,u:4242:r,m::r")
+        named = acl.find(posix1e.ACL_USER, 4242)
+        acl.modify("u:4242,u:4243:w")
+        self.assertEqual((named.tag_type, named.qualifier),
+                         (posix1e.ACL_USER, 4242))
+        named.permset.add(posix1e.ACL_WRITE)
+        self.assertEqual(acl, posix1e.ACL(
+            text="u::rw,g::r,o::-,u:4243:w,m::rw"))
+        # without deletions, the entries stay attached
+        mask = acl.find(posix1e.ACL_MASK)
+        acl.modify("o::r")
+        mask.permset.add(posix1e.ACL_EXECUTE)
+        self.assertTrue(acl.find(posix1e.ACL_MASK).permset.execute)
+
+    @has_ext(HAS_LINUX and HAS_ACL_ENTRY)
+    def testModifyTree(self):
+        """Test applying a batch of operations to a tree"""
+        tree = self._gettree()
+        stats = posix1e.modify_tree(tree, "u:4242:rwx,o::-")
+        self.assertEqual((stats["paths"], stats["changed"]), (5, 5))
+        acl = posix1e.ACL(file=os.path.join(tree, "sub", "c"))
+        self.assertEqual(acl.find(posix1e.ACL_USER, 4242).permset.execute,
+                         True)
+        self.assertEqual(posix1e.modify_tree(tree, "o::-")["changed"], 0)
+        stats = posix1e.modify_tree(tree, "g:4243:rx", default=True)
+        self.assertEqual((stats["paths"], stats["changed"]), (2, 2))
+        self.assertNotEqual(posix1e.ACL(filedef=os.path.join(tree, "sub"))
+                            .find(posix1e.ACL_GROUP, 4243), None)
+        stats = posix1e.modify_tree(tree, "o:")
+        self.assertEqual([e[:2] for e in stats["errors"]],
+                         [(p, errno.EINVAL) for p in
+                          (".", "a", "b", "sub", os.path.join("sub", "c"))])
+        self.assertEqual(stats["changed"], 0)
+
+
+class AutoMaskTests(unittest.TestCase):
+    """Automatic mask tests"""
+
+    @has_ext(HAS_ACL_ENTRY)
+    def testAutoMask(self):
+        """Test keeping the mask up to date on each change"""
+        acl = posix1e.ACL(text="u::rw,g::r,o::-")
+        self.assertFalse(acl.auto_mask)
+        acl.auto_mask = True
+        self.assertEqual(acl.find(posix1e.ACL_MASK), None)
+        acl.set_perms(posix1e.ACL_USER, 4242, posix1e.ACL_WRITE)
+        mask = acl.find(posix1e.ACL_MASK)
+        self.assertEqual(str(mask.permset), "rw-")
+        entry = acl.append()
+        entry.tag_type = posix1e.ACL_GROUP
+        entry.qualifier = 4243
+        entry.permset.add(posix1e.ACL_EXECUTE)
+        self.assertEqual(str(mask.permset), "rwx")
+        acl.find(posix1e.ACL_GROUP_OBJ).permset.clear()
+        acl.delete_entry(entry)
+        self.assertEqual(str(mask.permset), "-w-")
+        self.assertTrue(acl.valid())
+        acl.auto_mask = False
+        acl.set_perms(posix1e.ACL_USER, 4242, posix1e.ACL_READ)
+        self.assertEqual(str(mask.permset), "-w-")
+        acl = posix1e.ACL(text="u::rw,g::r,o::-,u:4242:rwx,m::r")
+        acl.auto_mask = True
+        self.assertEqual(acl, posix1e.ACL(
+            text="u::rw,g::r,o::-,u:4242:rwx,m::rwx"))
+
+
+class MemoTests(unittest.TestCase):
+    """Memoized results tests"""
+
+    @has_ext(HAS_LINUX and HAS_ACL_ENTRY)
+    def testMemo(self):
+        """Test that derived results follow the changes to the ACL"""
+        acl = posix1e.ACL(text="u::rw,g::r,o::-,u:4242:rwx,m::rwx")
+        text = str(acl)
+        self.assertTrue(str(acl) is text)
+        self.assertTrue(acl.valid())
+        data = posix1e.pax_encode(acl, numeric=True)
+        acl.find(posix1e.ACL_USER, 4242).permset.write = False
+        self.assertNotEqual(str(acl), text)
+        self.assertNotEqual(posix1e.pax_encode(acl, numeric=True), data)
+        acl.delete_entry(acl.find(posix1e.ACL_MASK))
+        self.assertFalse(acl.valid())
+        self.assertEqual(acl.check(), (posix1e.ACL_MISS_ERROR, 3))
+        acl.set_perms(posix1e.ACL_USER, 4242, None)
+        self.assertTrue(acl.valid())
+        self.assertFalse(acl.check())
+        self.assertEqual(acl.equiv_mode(), 0o640)
+        acl.find(posix1e.ACL_OTHER).permset.add(posix1e.ACL_READ)
+        self.assertEqual(acl.equiv_mode(), 0o644)
+
+
+class CopyTests(unittest.TestCase):
+    """Copy-on-write tests"""
+
+    @has_ext(HAS_ACL_ENTRY)
+    def testCopy(self):
+        """Test that copies are independent"""
+        acl = posix1e.ACL(text="u::rw,g::r,o::-,u:4242:rwx,m::rwx")
+        copies = [copy.copy(acl), copy.deepcopy(acl), posix1e.ACL(acl=acl)]
+        for other in copies:
+            self.assertEqual(other, acl)
+        copies[0].set_perms(posix1e.ACL_USER, 4243, posix1e.ACL_READ)
+        for entry in copies[1]:
+            entry.permset.clear()
+        copies[2].modify("u:4242")
+        self.assertEqual(acl, posix1e.ACL(
+            text="u::rw,g::r,o::-,u:4242:rwx,m::rwx"))
+        self.assertEqual(copies[0].find(posix1e.ACL_USER, 4243)
+                         .permset.read, True)
+        self.assertEqual(str(copies[1]).count("---"), 5)
+        self.assertEqual(copies[2].find(posix1e.ACL_USER, 4242), None)
+        entry = acl.find(posix1e.ACL_USER, 4242)
+        other = copy.copy(acl)
+        entry.permset.clear()
+        self.assertEqual(other.find(posix1e.ACL_USER, 4242)
+                         .permset.read, True)
+
+
+class ReloadTests(aclTest, unittest.TestCase):
+    """In-place loading tests"""
+
+    @has_ext(HAS_LINUX and HAS_ACL_ENTRY)
+    def testLoad(self):
+        """Test reloading an ACL object from files and data"""
+        fh, fname = self._getfile()
+        os.fchmod(fh, 0o640)
+        full = posix1e.ACL(text="u::rw,u:4242:r,g::r,g:4243:x,m::rwx,o::-")
+        full.applyto(fname)
+        dname = self._getdir()
+        acl = posix1e.ACL()
+        acl.load(fname)
+        self.assertEqual(acl, full)
+        acl.load(dname)
+        self.assertEqual(acl, posix1e.ACL(file=dname))
+        acl.load(fh)
+        self.assertEqual(acl, full)
+        acl.load(dname, posix1e.ACL_TYPE_DEFAULT)
+        self.assertEqual(len(list(acl)), 0)
+        other = posix1e.ACL(acl=full)
+        other.load_from_text("u::r,g::r,o::r")
+        self.assertEqual(other, posix1e.ACL(mode=0o444))
+        self.assertEqual(full, posix1e.ACL(file=fname))
+        other.load_from_bytes(b"\x02\x00\x00\x00")
+        self.assertEqual(len(list(other)), 0)
+        self.assertRaises(ValueError, other.load_from_bytes, b"junk")
+        blob = posix1e.pax_decode(posix1e.pax_encode(full), raw=True)[0]
+        other.load_from_bytes(bytearray(blob))
+        self.assertEqual(other, full)
+        if IS_PY_3K:
+            self.assertRaises(TypeError, other.load_from_bytes, "junk")
+        self.assertRaises(IOError, acl.load, os.path.join(dname, "x"))
+        os.close(fh)
+
+    @has_ext(HAS_LINUX)
+    def testLoadReuse(self):
+        """Test that reloading an ACL of the same size reuses its storage"""
+        _, fname = self._getfile()
+        _, other = self._getfile()
+        posix1e.ACL(text="u::rw,u:4242:r,g::r,m::r,o::-").applyto(fname)
+        posix1e.ACL(text="u::rw,u:4243:rw,g::r,m::rw,o::-").applyto(other)
+        acl = posix1e.ACL()
+        acl.load(fname)
+        acl.load(other)
+        buffers = acl._load_buffers
+        self.assertTrue(buffers[1] > 0 and buffers[3] >= 5)
+        for i in range(10):
+            acl.load(fname if i % 2 else other)
+            self.assertEqual(acl._load_buffers, buffers)
+        self.assertEqual(acl, posix1e.ACL(file=fname))
+
+    @has_ext(HAS_LINUX and HAS_ACL_ENTRY)
+    def testLoadExposed(self):
+        """Test reloading an ACL whose entries were handed out"""
+        _, fname = self._getfile()
+        posix1e.ACL(text="u::rw,u:4242:r,g::r,m::r,o::-").applyto(fname)
+        acl = posix1e.ACL(text="u::rwx,g::rx,o::r")
+        entries = list(acl)
+        acl.load(fname)
+        self.assertEqual(acl, posix1e.ACL(file=fname))
+        # the entries are detached, with their previous contents
+        self.assertEqual([str(e.permset) for e in entries],
+                         ["rwx", "r-x", "r--"])
+        entries[0].permset.clear()
+        self.assertEqual(acl, posix1e.ACL(file=fname))
+        acl.load_from_text("u::r,g::r,o::r")
+        self.assertEqual(acl, posix1e.ACL(mode=0o444))
+
+
+class LazyTests(aclTest, unittest.TestCase):
+    """Lazy ACL tests"""
+
+    @has_ext(HAS_LINUX and HAS_ACL_ENTRY)
+    def testLazy(self):
+        """Test that lazy ACLs are read on first use"""
+        dname = self._gettree()
+        acl = posix1e.ACL(text="u::rw,u:4242:r,g::r,m::r,o::-")
+        acl.applyto(os.path.join(dname, "a"))
+        fd = os.open(dname, os.O_RDONLY)
+        try:
+            lazy = posix1e.lazy_acl("a", dir_fd=fd)
+            missing = posix1e.lazy_acl("missing", fd)
+            self.assertEqual(lazy, acl)
+            self.assertEqual(str(posix1e.lazy_acl("b", fd)),
+                             str(posix1e.ACL(file=os.path.join(dname, "b"))))
+            self.assertRaises(IOError, str, missing)
+            self.assertRaises(IOError, list, missing)
+        finally:
+            os.close(fd)
+        lazy = posix1e.lazy_acl(os.path.join(dname, "a"))
+        self.assertEqual(copy.copy(lazy), acl)
+        lazy = posix1e.lazy_acl(dname, type=posix1e.ACL_TYPE_DEFAULT)
+        self.assertEqual(len(list(lazy)), 0)
+        lazy = posix1e.lazy_acl("missing")
+        lazy.load_from_text("u::r,g::r,o::r")
+        self.assertEqual(lazy, posix1e.ACL(mode=0o444))
+
+
+class SequenceTests(unittest.TestCase):
+    """Sequence protocol tests"""
+
+    @has_ext(HAS_ACL_ENTRY)
+    def testSequence(self):
+        """Test len(), indexing, slicing and membership"""
+        acl = posix1e.ACL(text="u::rw,u:4242:r,g::r,g:4243:x,m::rwx,o::-")
+        self.assertEqual(len(acl), 6)
+        self.assertEqual(len(posix1e.ACL()), 0)
+        self.assertEqual([e.tag_type for e in acl[:]],
+                         [e.tag_type for e in acl])
+        self.assertEqual(acl[0].tag_type, posix1e.ACL_USER_OBJ)
+        self.assertEqual(acl[-1].tag_type, posix1e.ACL_OTHER)
+        self.assertEqual([e.qualifier for e in acl[1:4:2]], [4242, 4243])
+        self.assertRaises(IndexError, acl.__getitem__, 6)
+        self.assertRaises(TypeError, acl.__getitem__, "x")
+        self.assertTrue((posix1e.ACL_USER, 4242) in acl)
+        self.assertFalse((posix1e.ACL_GROUP, 4242) in acl)
+        self.assertTrue((posix1e.ACL_MASK,) in acl)
+        self.assertRaises(TypeError, acl.__contains__, 4242)
+        acl.set_perms(posix1e.ACL_USER, 4244, posix1e.ACL_READ)
+        self.assertEqual(len(acl), 7)
+        acl.delete_entry(acl[1])
+        self.assertEqual(len(acl), 6)
+        self.assertFalse((posix1e.ACL_USER, 4242) in acl)
+        other = copy.copy(acl)
+        other[0].permset.clear()
+        self.assertTrue(acl[0].permset.read)
+
+    @has_ext(HAS_ACL_ENTRY)
+    def testIterLookups(self):
+        """Test len(), membership and find() during an iteration"""
+        acl = posix1e.ACL(text="u::rw,u:4242:r,u:4244:w,g::r,g:4243:x,"
+                          "m::rwx,o::-")
+        seen = []
+        for entry in acl:
+            seen.append(entry.tag_type)
+            self.assertEqual(len(acl), 7)
+            self.assertTrue((posix1e.ACL_USER, 4242) in acl)
+            self.assertEqual(acl.find(posix1e.ACL_GROUP, 4243).qualifier,
+                             4243)
+        self.assertEqual(seen, [e.tag_type for e in acl[:]])
+
+
+class PermsetIntTests(unittest.TestCase):
+    """Integer permset tests"""
+
+    @has_ext(HAS_ACL_ENTRY)
+    def testPermsetInt(self):
+        """Test the integer view of permsets"""
+        acl = posix1e.ACL(text="u::rw,g::r,o::-")
+        owner, group = acl[0].permset, acl[1].permset
+        self.assertEqual(owner.perms, posix1e.ACL_READ | posix1e.ACL_WRITE)
+        self.assertEqual(int(owner), owner.perms)
+        self.assertEqual(owner, posix1e.ACL_READ | posix1e.ACL_WRITE)
+        self.assertNotEqual(owner, group)
+        self.assertEqual(owner & group, posix1e.ACL_READ)
+        self.assertEqual(posix1e.ACL_EXECUTE | owner, 7)
+        self.assertTrue(group < owner)
+        self.assertFalse(owner == "rw-")
+        owner.perms = posix1e.ACL_READ | posix1e.ACL_EXECUTE
+        self.assertEqual(str(owner), "r-x")
+        self.assertEqual(acl, posix1e.ACL(text="u::rx,g::r,o::-"))
+        self.assertRaises(ValueError, setattr, owner, "perms", 8)
+        self.assertRaises(TypeError, lambda: owner | "x")
+        # compared by (mutable) value, hence unhashable
+        self.assertRaises(TypeError, hash, owner)
+
+    @has_ext(HAS_ACL_ENTRY)
+    def testEntryPerms(self):
+        """Test creating entries with their tag and permissions"""
+        acl = posix1e.ACL(text="u::rw,g::r,o::-")
+        entry = posix1e.Entry(acl, posix1e.ACL_USER, 4242, posix1e.ACL_READ)
+        self.assertEqual(entry.qualifier, 4242)
+        self.assertEqual(entry.permset, posix1e.ACL_READ)
+        posix1e.Entry(acl, tag_type=posix1e.ACL_MASK, perms=7)
+        self.assertEqual(acl, posix1e.ACL(
+            text="u::rw,g::r,o::-,u:4242:r,m::rwx"))
+        self.assertRaises(ValueError, posix1e.Entry, acl, posix1e.ACL_USER)
+        self.assertRaises(ValueError, posix1e.Entry, acl, qualifier=1)
+        self.assertRaises(ValueError, posix1e.Entry, acl,
+                          posix1e.ACL_OTHER, None, 8)
+        self.assertEqual(len(acl), 5)
+
+
+class PaxTests(unittest.TestCase):
+    """pax record tests"""
+
+    @has_ext(HAS_LINUX)
+    def testPaxEncode(self):
+        """Test encoding and decoding pax records"""
+        acl = posix1e.ACL(text="u::rw,u:0:r,g::r,m::r,o::-")
+        default = posix1e.ACL(text="u::rwx,g::rx,o::-")
+        text = "SCHILY.acl.access=user::rw-,user:0:r--:0,group::r--," \
+            "mask::r--,other::---\n"
+        data = posix1e.pax_encode(acl, numeric=True)
+        self.assertEqual(data, ("%d %s" % (len(text) + 3, text)).encode())
+        data = posix1e.pax_encode(acl, default)
+        self.assertTrue(b"user:root:r--:0," in data)
+        self.assertEqual(posix1e.pax_decode(data), (acl, default))
+        raw, raw_default = posix1e.pax_decode(data, raw=True)
+        self.assertEqual(posix1e.pax_encode(raw, raw_default), data)
+        other = "path=x\n"
+        data = ("%d %s" % (len(other) + 3, other)).encode() + data
+        self.assertEqual(posix1e.pax_decode(data)[0], acl)
+        self.assertEqual(posix1e.pax_decode(b""), (None, None))
+        self.assertEqual(posix1e.pax_encode(), b"")
+        self.assertRaises(ValueError, posix1e.pax_decode, b"99 bogus=\n")
+        self.assertRaises(ValueError, posix1e.pax_encode, b"junk")
+
+    @has_ext(HAS_LINUX)
+    def testPaxMany(self):
+        """Test the batched pax functions"""
+        acls = [posix1e.ACL(text="u::rw,u:%d:r,g::r,m::r,o::-" % i)
+                for i in range(10)]
+        headers = posix1e.pax_encode_many([(a, None) for a in acls])
+        self.assertEqual(len(headers), 10)
+        self.assertEqual(posix1e.pax_decode_many(headers),
+                         [(a, None) for a in acls])
+        self.assertRaises(TypeError, posix1e.pax_encode_many, [1])
+
+
+class PackTests(unittest.TestCase):
+    """Packed ACL batch tests"""
+
+    @has_ext(HAS_LINUX)
+    def testPack(self):
+        """Test packing and unpacking ACLs"""
+        acls = [posix1e.ACL(text="u::rw,u:%d:r,g::r,m::r,o::-" % (i % 3))
+                for i in range(9)]
+        items = acls + [None, posix1e.pax_decode(
+            posix1e.pax_encode(acls[0]), raw=True)[0]]
+        data = posix1e.pack_acls(items)
+        packed = posix1e.PackedACLs(data)
+        self.assertEqual(len(packed), 11)
+        self.assertEqual(packed.unique, 3)
+        self.assertEqual(list(packed), acls + [None, acls[0]])
+        self.assertEqual(packed[-1], acls[0])
+        self.assertRaises(IndexError, packed.__getitem__, 11)
+        # packing into a buffer, and unpacking from a memoryview
+        buf = bytearray(len(data) + 10)
+        self.assertEqual(posix1e.pack_acls(items, buf), len(data))
+        packed = posix1e.PackedACLs(memoryview(buf)[:len(data)])
+        self.assertEqual(packed[4], acls[4])
+        # the buffer is writable, so its records are checked on access
+        buf[:len(data)] = b"\xff" * len(data)
+        self.assertRaises(ValueError, packed.__getitem__, 4)
+        self.assertRaises(ValueError, posix1e.pack_acls, items,
+                          bytearray(10))
+        self.assertRaises(ValueError, posix1e.PackedACLs, data[:-1])
+        self.assertRaises(ValueError, posix1e.PackedACLs, b"junk")
+
+
 if __name__ == "__main__":
     unittest.main()